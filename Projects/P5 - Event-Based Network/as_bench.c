@@ -0,0 +1,859 @@
+#include "as_bench.h"
+
+#include <sys/resource.h>
+
+
+static int _hist_bucket(uint64_t value) {
+    if (value < (1 << HIST_SUB_BITS)) {
+        return value;
+    }
+    int exp = 63 - __builtin_clzll(value);
+    int sub = (value >> (exp - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+    return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+
+static uint64_t _hist_bucket_top(int bucket) {
+    if (bucket < (1 << HIST_SUB_BITS)) {
+        return bucket;
+    }
+    int exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+    uint64_t bottom = ((1ULL << HIST_SUB_BITS) + sub) << (exp - HIST_SUB_BITS);
+    return bottom + (1ULL << (exp - HIST_SUB_BITS)) - 1;
+}
+
+
+void hist_record(Histogram *hist, uint64_t value) {
+    hist->counts[_hist_bucket(value)]++;
+    hist->total++;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+
+void hist_merge(Histogram *into, const Histogram *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+
+uint64_t hist_percentile(const Histogram *hist, double percent) {
+    if (hist->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percent / 100 * hist->total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            return MIN(_hist_bucket_top(i), hist->max);
+        }
+    }
+    return hist->max;
+}
+
+
+/*
+** Feed bytes of a LIST response to the connection's parser.
+**
+** return the number of bytes up to the end of the LIST (all of them if it has
+** not ended), and set *done once it has
+*/
+static size_t _scan_list(BenchConn *conn, const uint8_t *buf, size_t len, int *done) {
+    *done = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = buf[i];
+        if (conn->list_line == 0) {
+            conn->list_last = c == '0';
+        } else if (conn->list_line == 1) {
+            conn->list_last = conn->list_last && c == ':';
+        }
+        conn->list_line++;
+
+        if (c == '\n' && conn->list_cr) {
+            if (conn->list_last) {
+                *done = 1;
+                return i + 1;
+            }
+            conn->list_line = 0;
+        }
+        conn->list_cr = c == '\r';
+    }
+    return len;
+}
+
+
+int bench_list_files(BenchOptions *options) {
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        perror("bench_list_files: socket");
+        return -1;
+    }
+    if (connect(sockfd, (struct sockaddr *)&options->addr, sizeof(options->addr)) == -1) {
+        perror("bench_list_files: connect");
+        close(sockfd);
+        return -1;
+    }
+    const char *request = REQUEST_LIST END_OF_MESSAGE_TOKEN;
+    if (write_precisely(sockfd, request, strlen(request)) != strlen(request)) {
+        close(sockfd);
+        return -1;
+    }
+
+    // the whole response, then its lines
+    BenchConn parser = {0};
+    char *list = NULL;
+    size_t len = 0;
+    size_t capacity = 0;
+    int done = 0;
+    while (!done) {
+        if (capacity - len < RESPONSE_BUFFER_SIZE) {
+            capacity = capacity > 0 ? capacity * 2 : 64 * 1024;
+            char *grown = (char *)realloc(list, capacity + 1);
+            if (grown == NULL) {
+                perror("bench_list_files: realloc");
+                free(list);
+                close(sockfd);
+                return -1;
+            }
+            list = grown;
+        }
+        ssize_t got = read(sockfd, list + len, capacity - len);
+        if (got <= 0) {
+            ERR_PRINT("The server closed the connection during LIST (is the library empty?)\n");
+            free(list);
+            close(sockfd);
+            return -1;
+        }
+        len += _scan_list(&parser, (uint8_t *)list + len, got, &done);
+    }
+    close(sockfd);
+    list[len] = '\0';
+
+    options->files = (uint32_t *)malloc(len * sizeof(uint32_t)); // more than the lines
+    if (options->files == NULL) {
+        perror("bench_list_files: malloc");
+        free(list);
+        return -1;
+    }
+    options->num_files = 0;
+    for (char *line = strtok(list, "\r\n"); line != NULL; line = strtok(NULL, "\r\n")) {
+        char *colon = strchr(line, ':');
+        if (colon != NULL && colon[1] != '\0') {
+            options->files[options->num_files++] = strtoul(line, NULL, 10);
+        }
+    }
+    free(list);
+
+    if (options->num_files == 0) {
+        ERR_PRINT("The library has no files\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Watch the connection's socket for events, if that is not what it is watched
+** for already.
+**
+** return 0 on success, -1 on error
+*/
+static int _watch(BenchWorker *worker, BenchConn *conn, uint32_t events) {
+    if (events == conn->events) {
+        return 0;
+    }
+    struct epoll_event event = {.events = events, .data.ptr = conn};
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == -1) {
+        perror("as_bench: epoll_ctl");
+        return -1;
+    }
+    conn->events = events;
+    return 0;
+}
+
+
+/*
+** Wait on the connection's timer until when, then go on in resume.
+*/
+static void _wait(BenchWorker *worker, BenchConn *conn, uint64_t when, BenchState resume) {
+    conn->state = BENCH_WAITING;
+    conn->resume = resume;
+    wheel_add(&worker->wheel, &conn->timer, conn, when);
+}
+
+
+/*
+** Start a non-blocking connect for the connection.
+**
+** return 0 if it is under way (or failed and a retry is on the timer), -1 on
+** error
+*/
+static int _connect(BenchWorker *worker, BenchConn *conn) {
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0) {
+        perror("as_bench: socket");
+        return -1;
+    }
+    if (connect(conn->fd, (struct sockaddr *)&worker->options->addr, sizeof(worker->options->addr)) == -1 &&
+        errno != EINPROGRESS) {
+        worker->stats.connect_fails++;
+        close(conn->fd);
+        conn->fd = -1;
+        _wait(worker, conn, monotonic_ns() + BENCH_RECONNECT_DELAY_MS * NS_PER_MS, BENCH_CONNECTING);
+        return 0;
+    }
+
+    conn->state = BENCH_CONNECTING;
+    conn->events = EPOLLOUT;
+    struct epoll_event event = {.events = EPOLLOUT, .data.ptr = conn};
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+        perror("as_bench: epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Give up on the connection's request, and reconnect after a while.
+*/
+static void _fail(BenchWorker *worker, BenchConn *conn, int connecting) {
+    if (connecting) {
+        worker->stats.connect_fails++;
+    } else {
+        worker->stats.errors++;
+    }
+    close(conn->fd); // also takes it out of epoll
+    conn->fd = -1;
+    _wait(worker, conn, monotonic_ns() + BENCH_RECONNECT_DELAY_MS * NS_PER_MS, BENCH_CONNECTING);
+}
+
+
+/*
+** Pick the connection's next request, and send it.
+*/
+static void _start_request(BenchWorker *worker, BenchConn *conn) {
+    const BenchOptions *options = worker->options;
+    unsigned int total = options->mix[KIND_LIST] + options->mix[KIND_STREAM] + options->mix[KIND_RANGE];
+    unsigned int pick = rand_r(&worker->seed) % total;
+    conn->kind = pick < options->mix[KIND_LIST] ? KIND_LIST
+                 : pick < options->mix[KIND_LIST] + options->mix[KIND_STREAM] ? KIND_STREAM
+                 : KIND_RANGE;
+    conn->file = rand_r(&worker->seed) % options->num_files;
+
+    const char *line = conn->kind == KIND_LIST ? REQUEST_LIST END_OF_MESSAGE_TOKEN
+                       : conn->kind == KIND_STREAM ? REQUEST_STREAM END_OF_MESSAGE_TOKEN
+                       : REQUEST_STREAM_RANGE END_OF_MESSAGE_TOKEN;
+    size_t len = strlen(line);
+    memcpy(conn->request, line, len);
+    if (conn->kind != KIND_LIST) {
+        uint32_t network_index = htonl(options->files[conn->file]);
+        memcpy(conn->request + len, &network_index, sizeof(uint32_t));
+        len += sizeof(uint32_t);
+    }
+    if (conn->kind == KIND_RANGE) {
+        uint64_t size = worker->file_sizes[conn->file];
+        uint64_t offset = 0;
+        if (size > options->range_bytes) {
+            offset = ((uint64_t)rand_r(&worker->seed) << 31 | rand_r(&worker->seed)) % (size - options->range_bytes);
+        }
+        convert_uint64_to_uint8(offset, conn->request + len);
+        convert_uint64_to_uint8(options->range_bytes, conn->request + len + sizeof(uint64_t));
+        len += 2 * sizeof(uint64_t);
+    }
+    conn->request_len = len;
+    conn->request_sent = 0;
+
+    conn->header_len = conn->kind == KIND_STREAM ? sizeof(uint32_t)
+                       : conn->kind == KIND_RANGE ? STREAM_RANGE_HEADER_SIZE
+                       : 0;
+    conn->header_got = 0;
+    conn->body_left = 0;
+    conn->received = 0;
+    conn->list_line = 0;
+    conn->list_last = 0;
+    conn->list_cr = 0;
+    conn->first_byte_at = 0;
+    conn->sent_at = monotonic_ns();
+    conn->state = BENCH_SENDING;
+}
+
+
+/*
+** The connection's response is complete: count it (if it was within the run),
+** and think before the next request.
+*/
+static void _finish_request(BenchWorker *worker, BenchConn *conn, uint64_t now) {
+    if (now <= worker->deadline) {
+        BenchStats *stats = &worker->stats;
+        stats->requests[conn->kind]++;
+        stats->bytes[conn->kind] += conn->received;
+        hist_record(&stats->ttfb[conn->kind], (conn->first_byte_at - conn->sent_at) / 1000);
+        hist_record(&stats->completion[conn->kind], (now - conn->sent_at) / 1000);
+    }
+
+    if (worker->options->think_ms > 0) {
+        _wait(worker, conn, now + worker->options->think_ms * NS_PER_MS, BENCH_SENDING);
+    } else {
+        _start_request(worker, conn);
+    }
+}
+
+
+/*
+** Note the time of the response's first byte.
+*/
+static void _got_bytes(BenchConn *conn, size_t bytes) {
+    if (conn->first_byte_at == 0) {
+        conn->first_byte_at = monotonic_ns();
+    }
+    conn->received += bytes;
+    bucket_take(&conn->rate, bytes);
+}
+
+
+/*
+** The bytes the connection may read now (its read rate's tokens), waiting on
+** its timer until it has some if it has none.
+**
+** return the bytes, 0 if it is waiting
+*/
+static uint64_t _read_allowance(BenchWorker *worker, BenchConn *conn, uint64_t wanted) {
+    uint64_t now = monotonic_ns();
+    uint64_t allowance = bucket_available(&conn->rate, now);
+    if (allowance >= MIN(wanted, BENCH_SPLICE_SIZE)) {
+        return MIN(allowance, wanted);
+    }
+    _wait(worker, conn, now + bucket_delay(&conn->rate, MIN(wanted, BENCH_SPLICE_SIZE)), conn->state);
+    return 0;
+}
+
+
+/*
+** Move as much of the response's data from the socket to /dev/null as has
+** arrived (and the read rate allows).
+**
+** return 1 once it is all in, 0 to wait for more, -1 if the connection failed
+*/
+static int _discard_body(BenchWorker *worker, BenchConn *conn) {
+    while (conn->body_left > 0) {
+        uint64_t allowance = _read_allowance(worker, conn, conn->body_left);
+        if (allowance == 0) {
+            return 0;
+        }
+        ssize_t in = splice(conn->fd, NULL, worker->pipe_fds[1], NULL, MIN(allowance, BENCH_SPLICE_SIZE),
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (in == -1 && errno == EINTR) {
+            continue;
+        }
+        if (in == -1 && errno == EAGAIN) {
+            return 0;
+        }
+        if (in <= 0) {
+            return -1;
+        }
+        _got_bytes(conn, in);
+        conn->body_left -= in;
+
+        while (in > 0) {
+            ssize_t out = splice(worker->pipe_fds[0], NULL, worker->null_fd, NULL, in, SPLICE_F_MOVE);
+            if (out == -1 && errno == EINTR) {
+                continue;
+            }
+            if (out <= 0) {
+                perror("as_bench: splice");
+                exit(1); // the shared pipe would no longer be empty
+            }
+            in -= out;
+        }
+    }
+    return 1;
+}
+
+
+/*
+** Read what has arrived of the response's header (or LIST).
+**
+** return 1 once it is all in, 0 to wait for more, -1 if the connection failed
+*/
+static int _read_header(BenchWorker *worker, BenchConn *conn) {
+    while (conn->header_got < conn->header_len) {
+        ssize_t got = recv(conn->fd, conn->header + conn->header_got, conn->header_len - conn->header_got, 0);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got == -1 && errno == EAGAIN) {
+            return 0;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        _got_bytes(conn, got);
+        conn->header_got += got;
+    }
+
+    if (conn->kind == KIND_STREAM) {
+        uint32_t size;
+        memcpy(&size, conn->header, sizeof(uint32_t));
+        conn->body_left = ntohl(size);
+        worker->file_sizes[conn->file] = conn->body_left;
+    } else {
+        worker->file_sizes[conn->file] = convert_uint8_to_uint64(conn->header);
+        conn->body_left = convert_uint8_to_uint64(conn->header + sizeof(uint64_t));
+    }
+    return 1;
+}
+
+
+/*
+** Read what has arrived of a LIST response, scanning it for its end.
+**
+** return 1 once it is all in, 0 to wait for more, -1 if the connection failed
+*/
+static int _read_list(BenchWorker *worker, BenchConn *conn) {
+    uint8_t buf[BENCH_SPLICE_SIZE];
+    while (1) {
+        uint64_t allowance = _read_allowance(worker, conn, sizeof(buf));
+        if (allowance == 0) {
+            return 0;
+        }
+        // nothing follows the LIST: the next request is not sent until it is all in
+        ssize_t got = recv(conn->fd, buf, allowance, 0);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got == -1 && errno == EAGAIN) {
+            return 0;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        int done;
+        _scan_list(conn, buf, got, &done);
+        _got_bytes(conn, got);
+        if (done) {
+            return 1;
+        }
+    }
+}
+
+
+/*
+** Advance the connection's state machine as far as it goes without waiting.
+**
+** return 0 on success, -1 on error
+*/
+static int _advance(BenchWorker *worker, BenchConn *conn) {
+    while (1) {
+        int result = 1;
+        switch (conn->state) {
+            case BENCH_CONNECTING: {
+                int error = 0;
+                socklen_t len = sizeof(error);
+                if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+                    _fail(worker, conn, 1);
+                    return 0;
+                }
+                _start_request(worker, conn);
+                continue;
+            }
+
+            case BENCH_SENDING: {
+                ssize_t sent = send(conn->fd, conn->request + conn->request_sent,
+                                    conn->request_len - conn->request_sent, MSG_NOSIGNAL);
+                if (sent == -1 && (errno == EAGAIN || errno == EINTR)) {
+                    return _watch(worker, conn, EPOLLOUT);
+                }
+                if (sent <= 0) {
+                    _fail(worker, conn, 0);
+                    return 0;
+                }
+                conn->request_sent += sent;
+                if (conn->request_sent == conn->request_len) {
+                    conn->state = conn->kind == KIND_LIST ? BENCH_LIST : BENCH_HEADER;
+                }
+                continue;
+            }
+
+            case BENCH_HEADER:
+                result = _read_header(worker, conn);
+                if (result == 1) {
+                    conn->state = BENCH_BODY;
+                    continue;
+                }
+                break;
+
+            case BENCH_BODY:
+                result = _discard_body(worker, conn);
+                if (result == 1) {
+                    _finish_request(worker, conn, monotonic_ns());
+                    continue;
+                }
+                break;
+
+            case BENCH_LIST:
+                result = _read_list(worker, conn);
+                if (result == 1) {
+                    _finish_request(worker, conn, monotonic_ns());
+                    continue;
+                }
+                break;
+
+            case BENCH_WAITING:
+                return conn->fd >= 0 ? _watch(worker, conn, 0) : 0;
+        }
+
+        if (result < 0) {
+            _fail(worker, conn, 0);
+            return 0;
+        }
+        if (conn->state == BENCH_WAITING) {
+            return _watch(worker, conn, 0);
+        }
+        return _watch(worker, conn, EPOLLIN);
+    }
+}
+
+
+/*
+** The connection's timer expired: go on where it left off.
+**
+** return 0 on success, -1 on error
+*/
+static int _resume(BenchWorker *worker, BenchConn *conn) {
+    if (conn->resume == BENCH_CONNECTING) {
+        return _connect(worker, conn);
+    }
+    if (conn->resume == BENCH_SENDING) {
+        _start_request(worker, conn);
+    } else {
+        conn->state = conn->resume;
+    }
+    return _advance(worker, conn);
+}
+
+
+void *bench_run_worker(void *arg) {
+    BenchWorker *worker = (BenchWorker *)arg;
+    wheel_init(&worker->wheel, monotonic_ns());
+
+    for (int i = 0; i < worker->num_conns; i++) {
+        BenchConn *conn = &worker->conns[i];
+        bucket_init(&conn->rate, worker->options->read_rate, BENCH_SPLICE_SIZE, monotonic_ns());
+        if (_connect(worker, conn) < 0) {
+            exit(1);
+        }
+    }
+
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    uint64_t now;
+    while ((now = monotonic_ns()) < worker->deadline) {
+        int timeout_ms = wheel_timeout_ms(&worker->wheel, now, BENCH_EPOLL_TIMEOUT_MS);
+        int ready = epoll_wait(worker->epoll_fd, events, BENCH_MAX_EVENTS, timeout_ms);
+        if (ready == -1 && errno != EINTR) {
+            perror("as_bench: epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < ready; i++) {
+            BenchConn *conn = (BenchConn *)events[i].data.ptr;
+            if (conn->state == BENCH_WAITING) {
+                // hung up on while it waited (epoll reports that, watched for or not)
+                wheel_remove(&worker->wheel, &conn->timer);
+                _fail(worker, conn, 0);
+            } else if (_advance(worker, conn) < 0) {
+                exit(1);
+            }
+        }
+
+        Timer *expired = wheel_expire(&worker->wheel, monotonic_ns());
+        while (expired != NULL) {
+            Timer *next = expired->next;
+            if (_resume(worker, (BenchConn *)expired->owner) < 0) {
+                exit(1);
+            }
+            expired = next;
+        }
+    }
+
+    for (int i = 0; i < worker->num_conns; i++) {
+        if (worker->conns[i].fd >= 0) {
+            close(worker->conns[i].fd);
+        }
+    }
+    return NULL;
+}
+
+
+static void _print_row(const char *name, uint64_t requests, uint64_t bytes,
+                       const Histogram *ttfb, const Histogram *completion, double duration) {
+    printf("%-8s %10lu %9.1f %9.2f %9.2f %9.2f %11.2f %9.2f %9.2f\n", name, (unsigned long)requests,
+           requests / duration, bytes / duration / 1e6,
+           hist_percentile(ttfb, 50) / 1000.0, hist_percentile(ttfb, 99) / 1000.0,
+           hist_percentile(completion, 50) / 1000.0, hist_percentile(completion, 99) / 1000.0,
+           completion->max / 1000.0);
+}
+
+
+void bench_report(const BenchOptions *options, const BenchStats *stats, double duration) {
+    static const char *names[NUM_KINDS] = {"LIST", "STREAM", "RANGE"};
+
+    printf("\n%s%s%d connections (%d threads) to %s:%d for %.1f s, mix %u:%u:%u",
+           options->label != NULL ? options->label : "", options->label != NULL ? ": " : "",
+           options->connections, options->threads, options->hostname, options->port, duration,
+           options->mix[KIND_LIST], options->mix[KIND_STREAM], options->mix[KIND_RANGE]);
+    if (options->think_ms > 0) {
+        printf(", think %d ms", options->think_ms);
+    }
+    if (options->read_rate > 0) {
+        printf(", reading %lu KiB/s", (unsigned long)(options->read_rate / 1024));
+    }
+    printf("\n\n%-8s %10s %9s %9s %9s %9s %11s %9s %9s\n", "request", "done", "req/s", "MB/s",
+           "ttfb p50", "p99 ms", "done p50", "p99", "max ms");
+
+    uint64_t requests = 0;
+    uint64_t bytes = 0;
+    Histogram ttfb = {0};
+    Histogram completion = {0};
+    for (int kind = 0; kind < NUM_KINDS; kind++) {
+        if (stats->requests[kind] > 0) {
+            _print_row(names[kind], stats->requests[kind], stats->bytes[kind],
+                       &stats->ttfb[kind], &stats->completion[kind], duration);
+        }
+        requests += stats->requests[kind];
+        bytes += stats->bytes[kind];
+        hist_merge(&ttfb, &stats->ttfb[kind]);
+        hist_merge(&completion, &stats->completion[kind]);
+    }
+    _print_row("all", requests, bytes, &ttfb, &completion, duration);
+
+    printf("\n%-15s %9s %9s %9s %9s %9s\n", "ms", "p50", "p90", "p99", "p99.9", "max");
+    printf("%-15s %9.2f %9.2f %9.2f %9.2f %9.2f\n", "time to first", hist_percentile(&ttfb, 50) / 1000.0,
+           hist_percentile(&ttfb, 90) / 1000.0, hist_percentile(&ttfb, 99) / 1000.0,
+           hist_percentile(&ttfb, 99.9) / 1000.0, ttfb.max / 1000.0);
+    printf("%-15s %9.2f %9.2f %9.2f %9.2f %9.2f\n", "completion", hist_percentile(&completion, 50) / 1000.0,
+           hist_percentile(&completion, 90) / 1000.0, hist_percentile(&completion, 99) / 1000.0,
+           hist_percentile(&completion, 99.9) / 1000.0, completion.max / 1000.0);
+
+    printf("\n%.2f MB/s, %.1f requests/s, %lu errors, %lu failed connects\n",
+           bytes / duration / 1e6, requests / duration,
+           (unsigned long)stats->errors, (unsigned long)stats->connect_fails);
+}
+
+
+/*
+** Parse a mix of request weights, "LIST:STREAM:RANGE" (e.g. "1:4:4").
+**
+** return 0 on success, -1 if it is not one
+*/
+static int _parse_mix(const char *arg, unsigned int mix[NUM_KINDS]) {
+    char extra;
+    if (sscanf(arg, "%u:%u:%u%c", &mix[KIND_LIST], &mix[KIND_STREAM], &mix[KIND_RANGE], &extra) != 3) {
+        return -1;
+    }
+    return mix[KIND_LIST] + mix[KIND_STREAM] + mix[KIND_RANGE] > 0 ? 0 : -1;
+}
+
+
+/*
+** Raise the limit on open files as far as it goes: each connection is one.
+*/
+static void _raise_file_limit(int wanted) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)wanted + 64) {
+        printf("Warning: only %lu files may be open, some connections will fail\n",
+               (unsigned long)limit.rlim_cur);
+    }
+}
+
+
+static void print_usage() {
+    printf("Usage: as_bench [-h] [-a address] [-p port] [-c connections] [-j threads] [-d seconds]\n"
+           "                [-m mix] [-R bytes] [-t ms] [-b KiB/s] [-L label]\n");
+    printf("  -h  Print this message\n");
+    printf("  -a  Address of the server (default: localhost)\n");
+    printf("  -p  Port of the server (default: " XSTR(DEFAULT_PORT) ")\n");
+    printf("  -c  Connections to keep busy at once (default: " XSTR(DEFAULT_CONNECTIONS) ")\n");
+    printf("  -j  Threads to share the connections (default: 1)\n");
+    printf("  -d  Length of the run in seconds (default: " XSTR(DEFAULT_DURATION_SEC) ")\n");
+    printf("  -m  Weights of LIST:STREAM:STREAM_RANGE requests (default: " DEFAULT_MIX ")\n");
+    printf("  -R  Bytes a STREAM_RANGE asks for, from a random offset (default: 1 MiB)\n");
+    printf("  -t  Milliseconds a connection waits between requests (default: 0)\n");
+    printf("  -b  KiB/s each connection reads at most, like a player, 0 for no limit (default: 0)\n");
+    printf("  -L  Label for the results (e.g. the server's engine)\n");
+}
+
+
+int main(int argc, char * const *argv) {
+    int opt;
+    BenchOptions options = {
+        .hostname = "localhost",
+        .port = DEFAULT_PORT,
+        .connections = DEFAULT_CONNECTIONS,
+        .threads = 1,
+        .duration_sec = DEFAULT_DURATION_SEC,
+        .range_bytes = DEFAULT_RANGE_BYTES,
+    };
+    _parse_mix(DEFAULT_MIX, options.mix);
+
+    while ((opt = getopt(argc, argv, "ha:p:c:j:d:m:R:t:b:L:")) != -1) {
+        switch (opt) {
+            case 'h':
+                print_usage();
+                return 0;
+            case 'a':
+                options.hostname = optarg;
+                break;
+            case 'p':
+                options.port = atoi(optarg);
+                break;
+            case 'c':
+                options.connections = atoi(optarg);
+                if (options.connections <= 0) {
+                    ERR_PRINT("Invalid number of connections %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'j':
+                options.threads = atoi(optarg);
+                if (options.threads <= 0) {
+                    ERR_PRINT("Invalid number of threads %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'd':
+                options.duration_sec = atoi(optarg);
+                if (options.duration_sec <= 0) {
+                    ERR_PRINT("Invalid duration %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                if (_parse_mix(optarg, options.mix) < 0) {
+                    ERR_PRINT("Invalid mix %s (expected LIST:STREAM:RANGE weights, e.g. " DEFAULT_MIX ")\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'R':
+                options.range_bytes = strtoull(optarg, NULL, 10);
+                if (options.range_bytes == 0) {
+                    ERR_PRINT("Invalid range length %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                options.think_ms = atoi(optarg);
+                if (options.think_ms < 0) {
+                    ERR_PRINT("Invalid think time %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'b':
+                if (atoi(optarg) < 0) {
+                    ERR_PRINT("Invalid read rate %s\n", optarg);
+                    return 1;
+                }
+                options.read_rate = (uint64_t)atoi(optarg) * 1024;
+                break;
+            case 'L':
+                options.label = optarg;
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+    if (options.threads > options.connections) {
+        options.threads = options.connections;
+    }
+
+    struct hostent *hp = gethostbyname(options.hostname);
+    if (hp == NULL) {
+        ERR_PRINT("Unknown host: %s\n", options.hostname);
+        return 1;
+    }
+    options.addr.sin_family = AF_INET;
+    options.addr.sin_port = htons(options.port);
+    options.addr.sin_addr = *((struct in_addr *)hp->h_addr);
+
+    if (bench_list_files(&options) < 0) {
+        return 1;
+    }
+    _raise_file_limit(options.connections);
+    printf("Library has %u files; running %d connections for %d s\n",
+           options.num_files, options.connections, options.duration_sec);
+
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    BenchWorker *workers = (BenchWorker *)calloc(options.threads, sizeof(BenchWorker));
+    BenchConn *conns = (BenchConn *)calloc(options.connections, sizeof(BenchConn));
+    if (null_fd < 0 || workers == NULL || conns == NULL) {
+        perror("as_bench");
+        return 1;
+    }
+
+    uint64_t start = monotonic_ns();
+    uint64_t deadline = start + options.duration_sec * NS_PER_SEC;
+    int assigned = 0;
+    for (int i = 0; i < options.threads; i++) {
+        BenchWorker *worker = &workers[i];
+        worker->options = &options;
+        worker->null_fd = null_fd;
+        worker->seed = start ^ (i * 2654435761u);
+        worker->deadline = deadline;
+        worker->conns = conns + assigned;
+        worker->num_conns = options.connections / options.threads + (i < options.connections % options.threads);
+        assigned += worker->num_conns;
+        worker->file_sizes = (uint64_t *)calloc(options.num_files, sizeof(uint64_t));
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (worker->file_sizes == NULL || worker->epoll_fd < 0 || pipe2(worker->pipe_fds, O_CLOEXEC) == -1) {
+            perror("as_bench");
+            return 1;
+        }
+        int error = pthread_create(&worker->thread, NULL, bench_run_worker, worker);
+        if (error != 0) {
+            ERR_PRINT("as_bench: pthread_create: %s\n", strerror(error));
+            return 1;
+        }
+    }
+
+    BenchStats stats = {0};
+    for (int i = 0; i < options.threads; i++) {
+        BenchWorker *worker = &workers[i];
+        pthread_join(worker->thread, NULL);
+        for (int kind = 0; kind < NUM_KINDS; kind++) {
+            stats.requests[kind] += worker->stats.requests[kind];
+            stats.bytes[kind] += worker->stats.bytes[kind];
+            hist_merge(&stats.ttfb[kind], &worker->stats.ttfb[kind]);
+            hist_merge(&stats.completion[kind], &worker->stats.completion[kind]);
+        }
+        stats.errors += worker->stats.errors;
+        stats.connect_fails += worker->stats.connect_fails;
+
+        close(worker->epoll_fd);
+        close(worker->pipe_fds[0]);
+        close(worker->pipe_fds[1]);
+        free(worker->file_sizes);
+    }
+
+    bench_report(&options, &stats, (double)options.duration_sec);
+
+    close(null_fd);
+    free(conns);
+    free(workers);
+    free(options.files);
+    return 0;
+}
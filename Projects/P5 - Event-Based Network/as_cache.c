@@ -0,0 +1,173 @@
+#include "as_cache.h"
+
+
+void cache_init(FileCache *cache, size_t budget) {
+    memset(cache, 0, sizeof(*cache));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->budget = budget;
+}
+
+
+static size_t _bucket_of(dev_t device, ino_t inode) {
+    uint64_t key = (uint64_t)inode * 0x9E3779B97F4A7C15ULL ^ (uint64_t)device;
+    return (key >> 32) & (FILE_CACHE_BUCKETS - 1);
+}
+
+
+static int _is_same_file(const CachedFile *file, const struct stat *file_info) {
+    return file->inode == file_info->st_ino && file->device == file_info->st_dev &&
+           file->size == file_info->st_size &&
+           file->mtime.tv_sec == file_info->st_mtim.tv_sec &&
+           file->mtime.tv_nsec == file_info->st_mtim.tv_nsec;
+}
+
+
+static CachedFile *_lookup(FileCache *cache, const struct stat *file_info) {
+    CachedFile *file = cache->buckets[_bucket_of(file_info->st_dev, file_info->st_ino)];
+    while (file != NULL && !_is_same_file(file, file_info)) {
+        file = file->hash_next;
+    }
+    return file;
+}
+
+
+static void _lru_unlink(FileCache *cache, CachedFile *file) {
+    if (file->lru_prev != NULL) {
+        file->lru_prev->lru_next = file->lru_next;
+    } else {
+        cache->lru_head = file->lru_next;
+    }
+    if (file->lru_next != NULL) {
+        file->lru_next->lru_prev = file->lru_prev;
+    } else {
+        cache->lru_tail = file->lru_prev;
+    }
+    file->lru_prev = file->lru_next = NULL;
+}
+
+
+static void _lru_push_front(FileCache *cache, CachedFile *file) {
+    file->lru_prev = NULL;
+    file->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL) {
+        cache->lru_head->lru_prev = file;
+    } else {
+        cache->lru_tail = file;
+    }
+    cache->lru_head = file;
+}
+
+
+/*
+** Take a file out of the cache, dropping the cache's reference to it.
+*/
+static void _remove(FileCache *cache, CachedFile *file) {
+    CachedFile **link = &cache->buckets[_bucket_of(file->device, file->inode)];
+    while (*link != file) {
+        link = &(*link)->hash_next;
+    }
+    *link = file->hash_next;
+    _lru_unlink(cache, file);
+
+    cache->bytes -= file->size;
+    cache->num_files--;
+    cache_release(file);
+}
+
+
+CachedFile *cache_get(FileCache *cache, int fd, const struct stat *file_info, int *hit) {
+    pthread_mutex_lock(&cache->lock);
+    CachedFile *file = _lookup(cache, file_info);
+    *hit = file != NULL;
+    if (file != NULL) {
+        cache->hits++;
+        atomic_fetch_add_explicit(&file->refs, 1, memory_order_relaxed);
+        _lru_unlink(cache, file);
+        _lru_push_front(cache, file);
+        pthread_mutex_unlock(&cache->lock);
+        return file;
+    }
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (file_info->st_size == 0 || (size_t)file_info->st_size > cache->budget) {
+        return NULL;
+    }
+
+    // Map the file outside the lock; the pages are read in the background
+    uint8_t *data = mmap(NULL, file_info->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("cache_get: mmap");
+        return NULL;
+    }
+    madvise(data, file_info->st_size, MADV_WILLNEED);
+
+    file = (CachedFile *)calloc(1, sizeof(CachedFile));
+    if (file == NULL) {
+        perror("cache_get: calloc");
+        munmap(data, file_info->st_size);
+        return NULL;
+    }
+    file->device = file_info->st_dev;
+    file->inode = file_info->st_ino;
+    file->size = file_info->st_size;
+    file->mtime = file_info->st_mtim;
+    file->data = data;
+    atomic_init(&file->refs, 2); // the cache's and the caller's
+
+    pthread_mutex_lock(&cache->lock);
+    CachedFile *raced = _lookup(cache, file_info);
+    if (raced != NULL) {
+        // another worker cached it first: use theirs
+        atomic_fetch_add_explicit(&raced->refs, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&cache->lock);
+        munmap(data, file->size);
+        free(file);
+        return raced;
+    }
+
+    size_t bucket = _bucket_of(file->device, file->inode);
+    file->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = file;
+    _lru_push_front(cache, file);
+    cache->bytes += file->size;
+    cache->num_files++;
+
+    while (cache->bytes > cache->budget) {
+        cache->evictions++;
+        _remove(cache, cache->lru_tail);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return file;
+}
+
+
+void cache_release(CachedFile *file) {
+    if (atomic_fetch_sub_explicit(&file->refs, 1, memory_order_acq_rel) == 1) {
+        munmap(file->data, file->size);
+        free(file);
+    }
+}
+
+
+void cache_report(FileCache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    uint64_t requests = cache->hits + cache->misses;
+    printf("File cache: %d files, %.1f of %.1f MiB; %lu hits, %lu misses (%.1f%% hit rate), %lu evictions\n",
+           cache->num_files, cache->bytes / 1048576.0, cache->budget / 1048576.0,
+           (unsigned long)cache->hits, (unsigned long)cache->misses,
+           requests > 0 ? 100.0 * cache->hits / requests : 0.0,
+           (unsigned long)cache->evictions);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+void cache_free(FileCache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    while (cache->lru_tail != NULL) {
+        _remove(cache, cache->lru_tail);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_destroy(&cache->lock);
+}
@@ -23,6 +23,7 @@ static int connect_to_server(int port, const char *hostname) {
     struct hostent *hp = gethostbyname(hostname);
     if (hp == NULL) {
         ERR_PRINT("Unknown host: %s\n", hostname);
+        close(sockfd);
         return -1;
     }
 
@@ -31,6 +32,7 @@ static int connect_to_server(int port, const char *hostname) {
     // Request connection to server.
     if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
         perror("connect");
+        close(sockfd);
         return -1;
     }
 
@@ -44,6 +46,7 @@ static int connect_to_server(int port, const char *hostname) {
 ** This is processed as a list response for a single library file,
 ** of the form:
 **                   <index>:<filename>\r\n
+** where the filename is empty if the file was removed from the library.
 **
 ** returns index on success, -1 on error
 ** filename is a heap allocated string pointing to the parsed filename
@@ -53,23 +56,34 @@ static int get_next_filename(int sockfd, char **filename) {
     static char buf[RESPONSE_BUFFER_SIZE];
 
     while((*filename = find_network_newline(buf, &bytes_in_buffer)) == NULL) {
-        int num = read(sockfd, buf + bytes_in_buffer,
-                       RESPONSE_BUFFER_SIZE - bytes_in_buffer);
-        if (num < 0) {
-            perror("list_request");
-            return -1;
-        }
-        bytes_in_buffer += num;
+        // a full buffer is only a problem if there is no line in it
         if (bytes_in_buffer == RESPONSE_BUFFER_SIZE) {
             ERR_PRINT("Response buffer filled without finding file\n");
             ERR_PRINT("Bleeding data, this shouldn't happen, but not giving up\n");
             memmove(buf, buf + BUFFER_BLEED_OFF, RESPONSE_BUFFER_SIZE - BUFFER_BLEED_OFF);
+            bytes_in_buffer -= BUFFER_BLEED_OFF;
+        }
+        int num = read(sockfd, buf + bytes_in_buffer,
+                       RESPONSE_BUFFER_SIZE - bytes_in_buffer);
+        if (num <= 0) {
+            if (num == 0) {
+                ERR_PRINT("list_request: server closed the connection\n");
+            } else {
+                perror("list_request");
+            }
+            return -1;
         }
+        bytes_in_buffer += num;
     }
 
-    char *parse_ptr = strtok(*filename, ":");
-    int index = strtol(parse_ptr, NULL, 10);
-    parse_ptr = strtok(NULL, ":");
+    char *parse_ptr = strchr(*filename, ':');
+    if (parse_ptr == NULL) {
+        ERR_PRINT("Malformed list entry: %s\n", *filename);
+        free(*filename);
+        return -1;
+    }
+    int index = strtol(*filename, NULL, 10);
+    parse_ptr++;
     // moves the filename to the start of the string (overwriting the index)
     memmove(*filename, parse_ptr, strlen(parse_ptr) + 1);
 
@@ -107,7 +121,13 @@ int populate_filenames(int sockfd, char ***filenames_ptr)
     return len;
 }
 
-int list_request(int sockfd, Library *library) {
+/*
+** Helper for: list_request, sync_request
+** Sends a LIST request and replaces the library's files with the list.
+**
+** returns the number of files on success, -1 on error
+*/
+static int fetch_library(int sockfd, Library *library) {
     //send the list request:
     const char *message = "LIST\r\n";
 
@@ -126,11 +146,19 @@ int list_request(int sockfd, Library *library) {
 
     library->files = filenames;
     library->num_files = (uint32_t) len;
+    return len;
+}
+
+int list_request(int sockfd, Library *library) {
+    int len = fetch_library(sockfd, library);
+    if (len == -1){return len;}
 
-    //print files in list.
+    //print files in list, skipping the ones removed from the server's library.
     for (int i = 0; i < len; i++)
     {
-        printf("%d: %s\n", i, library->files[i]);
+        if (library->files[i][0] != '\0') {
+            printf("%d: %s\n", i, library->files[i]);
+        }
     }
 
     return 0;
@@ -246,6 +274,98 @@ free_tokville:
 }
 
 
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+/*
+** Helper for: sync_request
+** Creates the directories within the library dir that the files at
+** file_indexes are written to, like create_missing_directories, but each one
+** once: the files' directories are sorted, so a directory's parents that the
+** one before it shares are not made again.
+**
+** returns the number of directories made on success, -1 on error
+*/
+static int create_library_directories(const Library *library, const uint32_t *file_indexes, int num_files) {
+    mode_t permissions;
+    if (get_library_dir_permission(library->path, &permissions) == -1) {
+        return -1;
+    }
+
+    char **dirs = malloc((num_files + 1) * sizeof(char *));
+    if (dirs == NULL) {
+        perror("create_library_directories");
+        return -1;
+    }
+    int num_dirs = 0;
+    int result = 0;
+    for (int i = 0; i < num_files; i++) {
+        const char *name = library->files[file_indexes[i]];
+        const char *before_filename = strrchr(name, '/');
+        if (before_filename == NULL) {
+            continue;
+        }
+        dirs[num_dirs] = strndup(name, before_filename - name);
+        if (dirs[num_dirs] == NULL) {
+            perror("create_library_directories");
+            result = -1;
+            goto free_dirs;
+        }
+        num_dirs++;
+    }
+    qsort(dirs, num_dirs, sizeof(char *), compare_paths);
+
+    const char *made = ""; // the last directory made, with its parents
+    for (int i = 0; i < num_dirs; i++) {
+        const char *dir = dirs[i];
+        if (strcmp(dir, made) == 0) {
+            continue;
+        }
+        size_t shared = 0;
+        while (made[shared] != '\0' && made[shared] == dir[shared]) {
+            shared++;
+        }
+
+        char *path = _join_path(library->path, dir);
+        if (path == NULL) {
+            result = -1;
+            goto free_dirs;
+        }
+        char *dir_in_path = path + strlen(path) - strlen(dir);
+        for (size_t end = 1; end <= strlen(dir); end++) {
+            if (dir[end] != '/' && dir[end] != '\0') {
+                continue;
+            }
+            // a directory the last one has too already exists
+            if (end <= shared && (made[end] == '/' || made[end] == '\0')) {
+                continue;
+            }
+            dir_in_path[end] = '\0';
+            if (mkdir(path, permissions) == 0) {
+                result++;
+            } else if (errno != EEXIST) {
+                perror("create_library_directories");
+                free(path);
+                result = -1;
+                goto free_dirs;
+            }
+            dir_in_path[end] = dir[end];
+        }
+        free(path);
+        made = dir;
+    }
+
+free_dirs:
+    for (int i = 0; i < num_dirs; i++) {
+        free(dirs[i]);
+    }
+    free(dirs);
+    return result;
+}
+
+
 /*
 ** Helper for: get_file_request
 */
@@ -271,25 +391,876 @@ static int file_index_to_fd(uint32_t file_index, const Library * library){
 }
 
 
-int get_file_request(int sockfd, uint32_t file_index, const Library * library){
+/*
+** Helper for: process_stream_request, get_file_request, get_files_request
+** Makes a pipe to splice data from the socket through, and tries to make it
+** STREAM_PIPE_SIZE bytes long.
+**
+** returns the pipe's size on success, -1 on error
+*/
+static int make_splice_pipe(int pipe_fds[2]) {
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        perror("make_splice_pipe: pipe2");
+        return -1;
+    }
+    // a smaller pipe (e.g. pipe-max-size is lower) only means more splice calls
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+    int size = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+    if (size == -1) {
+        perror("make_splice_pipe: fcntl");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    return size;
+}
+
+
+/*
+** Helper for: get_rest_of_file, get_files_request, run_segment
+** Moves exactly length bytes from the socket to the file dest_fd, spliced
+** through the (empty) pipe of pipe_size bytes, so they are never copied
+** through the client: a pipe's worth at a time, in from the socket and out to
+** the file. They are written at the file's position, or at *offset (which is
+** advanced, as by pwrite) if offset is not NULL.
+**
+** returns 1 once they are all in the file, 0 if the connection was lost first,
+** -1 on error
+*/
+static int splice_to_file(int sockfd, const int pipe_fds[2], int pipe_size, int dest_fd, uint64_t length,
+                          loff_t *offset) {
+    while (length > 0) {
+        ssize_t in = splice(sockfd, NULL, pipe_fds[1], NULL, MIN(length, pipe_size), SPLICE_F_MOVE);
+        if (in == -1 && errno == EINTR) {
+            continue;
+        }
+        if (in <= 0) {
+            return 0;
+        }
+        length -= in;
+
+        while (in > 0) {
+            ssize_t out = splice(pipe_fds[0], NULL, dest_fd, offset, in, SPLICE_F_MOVE);
+            if (out == -1 && errno == EINTR) {
+                continue;
+            }
+            if (out <= 0) {
+                perror("splice_to_file: splice");
+                return -1;
+            }
+            in -= out;
+        }
+    }
+    return 1;
+}
+
+
+/*
+** Helper for: get_rest_of_file, get_segmented, run_segment
+** Asks for length bytes of the file at file_index from offset with a
+** STREAM_RANGE request, and reads the response's header: the file's size and
+** the length of the data that follows.
+**
+** returns 1 on success, 0 if the connection was lost
+*/
+static int request_range(int sockfd, uint32_t file_index, uint64_t offset, uint64_t length,
+                         uint64_t *file_size, uint64_t *data_length) {
+    const char *request_line = REQUEST_STREAM_RANGE END_OF_MESSAGE_TOKEN;
+    size_t line_len = strlen(request_line);
+    uint8_t request[line_len + STREAM_RANGE_FIELDS_SIZE];
+
+    uint32_t network_index = htonl(file_index);
+    memcpy(request, request_line, line_len);
+    memcpy(request + line_len, &network_index, sizeof(uint32_t));
+    convert_uint64_to_uint8(offset, request + line_len + sizeof(uint32_t));
+    convert_uint64_to_uint8(length, request + line_len + sizeof(uint32_t) + sizeof(uint64_t));
+
+    // MSG_NOSIGNAL: a connection the server has closed is resumed, not a SIGPIPE
+    if (send(sockfd, request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)) {
+        return 0;
+    }
+
+    uint8_t header[STREAM_RANGE_HEADER_SIZE];
+    if (read_precisely(sockfd, header, sizeof(header)) != sizeof(header)) {
+        return 0;
+    }
+    *file_size = convert_uint8_to_uint64(header);
+    *data_length = convert_uint8_to_uint64(header + sizeof(uint64_t));
+    return 1;
+}
+
+
+/*
+** Helper for: get_file_request
+** Asks for the file from offset (the bytes dest_fd already has) to its end, and
+** appends what arrives to dest_fd.
+**
+** returns 1 once the file is complete, 0 if the connection was lost first,
+** -1 on error
+*/
+static int get_rest_of_file(int sockfd, uint32_t file_index, int dest_fd, uint64_t offset,
+                            const int pipe_fds[2], int pipe_size) {
+    uint64_t file_size, length;
+    if (!request_range(sockfd, file_index, offset, UINT64_MAX, &file_size, &length)) {
+        return 0;
+    }
+
+    if (offset > file_size) {
+        printf("Partial file is longer than the server's, starting over\n");
+        if (ftruncate(dest_fd, 0) == -1 || lseek(dest_fd, 0, SEEK_SET) == -1) {
+            perror("get_rest_of_file: ftruncate");
+            return -1;
+        }
+        return get_rest_of_file(sockfd, file_index, dest_fd, 0, pipe_fds, pipe_size);
+    }
+
+    return splice_to_file(sockfd, pipe_fds, pipe_size, dest_fd, length, NULL);
+}
+
+
+/*
+** Helper for: get_segmented
+** A segment's thread: gets the segment on a connection of its own, writing it
+** at its offset. The segment's offset is where it got to.
+**
+** returns NULL
+*/
+static void *run_segment(void *arg) {
+    GetSegment *segment = (GetSegment *)arg;
+    int sockfd = connect_to_server(segment->server->port, segment->server->hostname);
+    if (sockfd == -1) {
+        return NULL;
+    }
+    int pipe_fds[2];
+    int pipe_size = make_splice_pipe(pipe_fds);
+    if (pipe_size == -1) {
+        close(sockfd);
+        return NULL;
+    }
+
+    uint64_t wanted = segment->end - segment->offset;
+    uint64_t file_size, length;
+    if (request_range(sockfd, segment->file_index, segment->offset, wanted, &file_size, &length)) {
+        segment->file_size = file_size;
+        // a file that changed since the first segment is not split up further
+        if (length == wanted) {
+            splice_to_file(sockfd, pipe_fds, pipe_size, segment->fd, length, &segment->offset);
+        }
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    close(sockfd);
+    return NULL;
+}
+
+
+// Seconds on a clock that only goes forward
+static double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+/*
+** Helper for: get_file_request
+** Gets the file at file_index into the empty file dest_fd: its first
+** GET_SEGMENT_MIN_SIZE bytes on the client's connection and, if there is more,
+** the rest in segments on up to server->connections - 1 connections of their
+** own, at once (see get_file_request).
+**
+** If a segment's connection is lost, the rest of the file from the first byte
+** that is not in is got on the client's connection.
+**
+** returns 1 once the file is complete, 0 if the client's connection was lost
+** first (with the file cut back to the bytes that are in from its start, and
+** dest_fd at its end), -1 on error
+*/
+static int get_segmented(ServerConnection *server, uint32_t file_index, const char *name, int dest_fd,
+                         const int pipe_fds[2], int pipe_size) {
+    double started = now_seconds();
+    uint64_t file_size, length;
+    if (!request_range(server->sockfd, file_index, 0, GET_SEGMENT_MIN_SIZE, &file_size, &length)) {
+        return 0;
+    }
+    if (length == file_size) {
+        return splice_to_file(server->sockfd, pipe_fds, pipe_size, dest_fd, length, NULL);
+    }
+
+    // the rest in equal segments, each at least GET_SEGMENT_MIN_SIZE bytes
+    uint64_t rest = file_size - length;
+    int num_segments = MIN((uint64_t)server->connections - 1,
+                           (rest + GET_SEGMENT_MIN_SIZE - 1) / GET_SEGMENT_MIN_SIZE);
+    uint64_t segment_size = (rest + num_segments - 1) / num_segments;
+    GetSegment segments[num_segments];
+    if (ftruncate(dest_fd, file_size) == -1) {
+        perror("get_segmented: ftruncate");
+        return -1;
+    }
+
+    int num_started = 0;
+    for (int i = 0; i < num_segments; i++) {
+        GetSegment *segment = &segments[i];
+        segment->server = server;
+        segment->file_index = file_index;
+        segment->fd = dest_fd;
+        segment->offset = length + i * segment_size;
+        segment->end = MIN(segment->offset + segment_size, file_size);
+        segment->file_size = file_size;
+        int error = pthread_create(&segment->thread, NULL, run_segment, segment);
+        if (error != 0) {
+            ERR_PRINT("get_segmented: pthread_create: %s\n", strerror(error));
+            break; // the segments not started are left for the resume
+        }
+        num_started++;
+    }
+    printf("Getting %s on %d connections\n", name, num_started + 1);
+
+    loff_t first_offset = 0;
+    int first = splice_to_file(server->sockfd, pipe_fds, pipe_size, dest_fd, length, &first_offset);
+    for (int i = 0; i < num_started; i++) {
+        pthread_join(segments[i].thread, NULL);
+    }
+    if (first == -1) {
+        return -1;
+    }
+
+    // what is in from the start: up to the first segment that is not complete
+    uint64_t complete = first_offset;
+    int all_in = first == 1;
+    for (int i = 0; all_in && i < num_started; i++) {
+        if (segments[i].file_size != file_size) {
+            complete = 0; // the file changed while it was being got
+            all_in = 0;
+            break;
+        }
+        complete = segments[i].offset;
+        all_in = segments[i].offset == segments[i].end;
+    }
+    if (!all_in || num_started < num_segments) {
+        if (ftruncate(dest_fd, complete) == -1 || lseek(dest_fd, 0, SEEK_END) == -1) {
+            perror("get_segmented: ftruncate");
+            return -1;
+        }
+        if (first != 1) {
+            return 0;
+        }
+        printf("Lost a connection getting %s, resuming from byte %lu\n", name, (unsigned long)complete);
+        return get_rest_of_file(server->sockfd, file_index, dest_fd, complete, pipe_fds, pipe_size);
+    }
+
+    struct stat file_info;
+    if (fstat(dest_fd, &file_info) == -1 || file_info.st_size != file_size) {
+        ERR_PRINT("Got %s, but it is not the server's size\n", name);
+        return -1;
+    }
+    double took = now_seconds() - started;
+    printf("Got %s: %.1f MiB in %.2f s (%.1f MiB/s on %d connections)\n", name, file_size / 1048576.0,
+           took, took > 0 ? file_size / 1048576.0 / took : 0.0, num_started + 1);
+    return 1;
+}
+
+
+/*
+** Helper for: get_file_request, get_files_request
+** Opens the partial file a get writes the file at file_index to, at its end
+** (so a partial file from an earlier get is kept and resumed), creating it and
+** (only if it cannot be created without) its directories. It is not opened with O_APPEND, which splice(2)
+** does not write to. The paths of the file and the partial file are
+** returned (heap-allocated) in filepath and partial_path.
+**
+** returns the partial file's fd on success, -1 on error
+*/
+static int open_partial_file(uint32_t file_index, const Library *library,
+                             char **filepath, char **partial_path) {
+    char *path = _join_path(library->path, library->files[file_index]);
+    if (path == NULL) {
+        return -1;
+    }
+    char *partial = malloc(strlen(path) + strlen(PARTIAL_FILE_SUFFIX) + 1);
+    if (partial == NULL) {
+        perror("open_partial_file");
+        free(path);
+        return -1;
+    }
+    strcpy(partial, path);
+    strcat(partial, PARTIAL_FILE_SUFFIX);
+
+    int fd = open(partial, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    if (fd == -1 && errno == ENOENT) {
+        create_missing_directories(library->files[file_index], library->path);
+        fd = open(partial, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    }
+    if (fd != -1 && lseek(fd, 0, SEEK_END) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1) {
+        perror("open_partial_file");
+        free(partial);
+        free(path);
+        return -1;
+    }
+    *filepath = path;
+    *partial_path = partial;
+    return fd;
+}
+
+
+int get_file_request(ServerConnection *server, uint32_t file_index, const Library * library){
     #ifdef DEBUG
     printf("Getting file %s\n", library->files[file_index]);
     #endif
 
-    int file_dest_fd = file_index_to_fd(file_index, library);
+    char *filepath;
+    char *partial_path;
+    int file_dest_fd = open_partial_file(file_index, library, &filepath, &partial_path);
     if (file_dest_fd == -1) {
         return -1;
     }
+    int pipe_fds[2];
+    int pipe_size = make_splice_pipe(pipe_fds);
+
+    int result = pipe_size == -1 ? -1 : 0;
+    for (int attempt = 0; result == 0; attempt++) {
+        struct stat file_info;
+        if (fstat(file_dest_fd, &file_info) == -1) {
+            perror("get_file_request");
+            result = -1;
+            break;
+        }
+        if (file_info.st_size > 0) {
+            printf("Resuming %s from byte %lu\n", library->files[file_index], (unsigned long)file_info.st_size);
+        }
 
-    int result = send_and_process_stream_request(sockfd, file_index, -1, file_dest_fd);
-    if (result == -1) {
+        if (server->sockfd != -1 && attempt == 0 && file_info.st_size == 0 && server->connections > 1) {
+            result = get_segmented(server, file_index, library->files[file_index], file_dest_fd,
+                                   pipe_fds, pipe_size);
+        } else if (server->sockfd != -1) {
+            result = get_rest_of_file(server->sockfd, file_index, file_dest_fd, file_info.st_size,
+                                      pipe_fds, pipe_size);
+        }
+        if (result != 0) {
+            break;
+        }
+
+        if (attempt == GET_RESUME_ATTEMPTS) {
+            ERR_PRINT("Lost the connection to the server too many times, giving up\n");
+            result = -1;
+            break;
+        }
+        printf("Lost the connection to the server, reconnecting\n");
+        sleep(GET_RESUME_DELAY_SEC);
+        if (server->sockfd != -1) {
+            close(server->sockfd);
+        }
+        server->sockfd = connect_to_server(server->port, server->hostname);
+    }
+
+    if (pipe_size != -1) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    close(file_dest_fd);
+    if (result == 1 && rename(partial_path, filepath) == -1) {
+        perror("get_file_request: rename");
+        result = -1;
+    }
+    free(partial_path);
+    free(filepath);
+    return result == 1 ? 0 : -1;
+}
+
+
+/*
+** Helper for: skip_up_to_date_files
+** Opens the local library's complete copy of the file at file_index.
+**
+** returns its fd, -1 if there is none
+*/
+static int open_local_copy(uint32_t file_index, const Library *library) {
+    char *filepath = _join_path(library->path, library->files[file_index]);
+    if (filepath == NULL) {
+        return -1;
+    }
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    free(filepath);
+    return fd;
+}
+
+
+int skip_up_to_date_files(ServerConnection *server, uint32_t *file_indexes, int num_files,
+                          const Library *library) {
+    if (server->sockfd == -1) {
+        return num_files;
+    }
+
+    int local_fds[num_files];
+    const char *request_line = REQUEST_HASH END_OF_MESSAGE_TOKEN;
+    size_t line_len = strlen(request_line);
+    uint8_t requests[num_files * (line_len + sizeof(uint32_t))];
+    size_t requests_len = 0;
+    for (int i = 0; i < num_files; i++) {
+        local_fds[i] = open_local_copy(file_indexes[i], library);
+        if (local_fds[i] == -1) {
+            continue;
+        }
+        uint32_t network_index = htonl(file_indexes[i]);
+        memcpy(requests + requests_len, request_line, line_len);
+        memcpy(requests + requests_len + line_len, &network_index, sizeof(uint32_t));
+        requests_len += line_len + sizeof(uint32_t);
+    }
+
+    int connected = requests_len == 0 ||
+                    send(server->sockfd, requests, requests_len, MSG_NOSIGNAL) == requests_len;
+    int num_left = 0;
+    for (int i = 0; i < num_files; i++) {
+        int up_to_date = 0;
+        if (local_fds[i] != -1 && connected) {
+            uint8_t response[HASH_RESPONSE_SIZE] = {0};
+            connected = read_precisely(server->sockfd, response, sizeof(response)) == sizeof(response);
+            uint8_t status = response[0];
+            uint64_t size = convert_uint8_to_uint64(response + sizeof(uint8_t));
+            uint64_t hash = convert_uint8_to_uint64(response + sizeof(uint8_t) + sizeof(uint64_t));
+
+            struct stat local_info;
+            uint64_t local_hash;
+            const char *name = library->files[file_indexes[i]];
+            if (!connected || status == HASH_MISSING) {
+                // get reports it
+            } else if (fstat(local_fds[i], &local_info) == -1 || local_info.st_size != size) {
+                printf("%s differs from the server's, getting it again\n", name);
+            } else if (status == HASH_PENDING) {
+                printf("%s cannot be checked yet (the server is still hashing it), getting it again\n", name);
+            } else if (xxh64_file(local_fds[i], &local_hash) == 0 && local_hash == hash) {
+                printf("%s is up to date\n", name);
+                up_to_date = 1;
+            } else {
+                printf("%s differs from the server's, getting it again\n", name);
+            }
+        }
+        if (local_fds[i] != -1) {
+            close(local_fds[i]);
+        }
+        if (!up_to_date) {
+            file_indexes[num_left++] = file_indexes[i];
+        }
+    }
+
+    if (!connected) {
+        close(server->sockfd);
+        server->sockfd = -1;
+    }
+    return num_left;
+}
+
+
+int stats_request(int sockfd) {
+    const char *request_line = REQUEST_STATS END_OF_MESSAGE_TOKEN;
+    if (write_precisely(sockfd, request_line, strlen(request_line)) != strlen(request_line)) {
+        perror("stats_request: write");
         return -1;
     }
 
+    uint8_t length_buf[sizeof(uint64_t)];
+    if (read_precisely(sockfd, length_buf, sizeof(length_buf)) != sizeof(length_buf)) {
+        ERR_PRINT("Connection lost while getting stats\n");
+        return -1;
+    }
+    uint64_t length = convert_uint8_to_uint64(length_buf);
+    char *text = (char *)malloc(length + 1);
+    if (text == NULL) {
+        perror("stats_request: malloc");
+        return -1;
+    }
+    if (read_precisely(sockfd, text, length) != length) {
+        ERR_PRINT("Connection lost while getting stats\n");
+        free(text);
+        return -1;
+    }
+
+    //print it without the network newlines.
+    text[length] = '\0';
+    for (char *line = strtok(text, "\r\n"); line != NULL; line = strtok(NULL, "\r\n")) {
+        printf("%s\n", line);
+    }
+    free(text);
     return 0;
 }
 
 
+/*
+** Helper for: list_query_request
+** Records the name of the file at index in the library, growing it with empty
+** (unknown) entries as needed.
+**
+** returns 0 on success, -1 on error
+*/
+static int remember_file(Library *library, uint32_t index, const char *name, size_t name_len) {
+    if (index >= library->num_files) {
+        char **files = realloc(library->files, (index + 1) * sizeof(char *));
+        if (files == NULL) {
+            perror("list_query_request: realloc");
+            return -1;
+        }
+        library->files = files;
+        for (; library->num_files <= index; library->num_files++) {
+            library->files[library->num_files] = NULL;
+        }
+    }
+
+    char *copy = strndup(name, name_len);
+    if (copy == NULL) {
+        perror("list_query_request: strndup");
+        return -1;
+    }
+    free(library->files[index]);
+    library->files[index] = copy;
+    return 0;
+}
+
+
+int list_query_request(int sockfd, Library *library, QueryMode mode, const char *pattern, uint32_t page) {
+    size_t pattern_len = strlen(pattern);
+    if (pattern_len > QUERY_PATTERN_MAX) {
+        printf("Patterns are at most %d characters\n", QUERY_PATTERN_MAX);
+        return 0;
+    }
+
+    uint8_t request[sizeof(REQUEST_LIST_QUERY END_OF_MESSAGE_TOKEN) + QUERY_FIELDS_SIZE + QUERY_PATTERN_MAX];
+    size_t len = strlen(REQUEST_LIST_QUERY END_OF_MESSAGE_TOKEN);
+    memcpy(request, REQUEST_LIST_QUERY END_OF_MESSAGE_TOKEN, len);
+    uint32_t offset = htonl((page - 1) * QUERY_PAGE_SIZE);
+    uint32_t limit = htonl(QUERY_PAGE_SIZE);
+    request[len++] = mode;
+    memcpy(request + len, &offset, sizeof(offset));
+    len += sizeof(offset);
+    memcpy(request + len, &limit, sizeof(limit));
+    len += sizeof(limit);
+    request[len++] = pattern_len;
+    memcpy(request + len, pattern, pattern_len);
+    len += pattern_len;
+    if (write_precisely(sockfd, request, len) != len) {
+        perror("list_query_request: write");
+        return -1;
+    }
+
+    uint8_t header[QUERY_RESPONSE_HEADER_SIZE];
+    if (read_precisely(sockfd, header, sizeof(header)) != sizeof(header)) {
+        ERR_PRINT("Connection lost while querying the library\n");
+        return -1;
+    }
+    uint32_t matched, listed;
+    memcpy(&matched, header, sizeof(uint32_t));
+    memcpy(&listed, header + sizeof(uint32_t), sizeof(uint32_t));
+    matched = ntohl(matched);
+    listed = ntohl(listed);
+    uint64_t list_len = convert_uint8_to_uint64(header + 2 * sizeof(uint32_t));
+    char *list = (char *)malloc(list_len + 1);
+    if (list == NULL) {
+        perror("list_query_request: malloc");
+        return -1;
+    }
+    if (read_precisely(sockfd, list, list_len) != list_len) {
+        ERR_PRINT("Connection lost while querying the library\n");
+        free(list);
+        return -1;
+    }
+    list[list_len] = '\0';
+
+    //each line is "<index>:<name>", as in a LIST response.
+    int result = 0;
+    for (char *line = strtok(list, "\r\n"); line != NULL; line = strtok(NULL, "\r\n")) {
+        char *name = strchr(line, ':');
+        if (name == NULL) {
+            ERR_PRINT("Malformed list entry: %s\n", line);
+            result = -1;
+            break;
+        }
+        uint32_t index = strtoul(line, NULL, 10);
+        name++;
+        if (remember_file(library, index, name, strlen(name)) < 0) {
+            result = -1;
+            break;
+        }
+        printf("%u: %s\n", index, name);
+    }
+    free(list);
+
+    // the entries of files not listed yet are empty, as for removed files
+    for (uint32_t i = 0; result == 0 && i < library->num_files; i++) {
+        if (library->files[i] == NULL && remember_file(library, i, "", 0) < 0) {
+            result = -1;
+        }
+    }
+
+    uint32_t first = (page - 1) * QUERY_PAGE_SIZE;
+    if (listed > 0) {
+        printf("Files %u-%u of %u matching \"%s\"\n", first + 1, first + listed, matched, pattern);
+    } else {
+        printf("No files on page %u of %u matching \"%s\"\n", page, matched, pattern);
+    }
+    return result;
+}
+
+
+/*
+** Helper for: get_files_request
+** Opens a connection of its own to the server and switches it to the framed
+** protocol. The server's initial window and most open streams are returned in
+** window and max_streams.
+**
+** returns the socket on success, -2 if the server does not serve the framed
+** protocol, -1 on error
+*/
+static int connect_framed(ServerConnection *server, uint32_t *window, uint32_t *max_streams) {
+    int sockfd = connect_to_server(server->port, server->hostname);
+    if (sockfd == -1) {
+        return -1;
+    }
+
+    const char *request_line = REQUEST_FRAMED END_OF_MESSAGE_TOKEN;
+    uint8_t header[FRAME_HEADER_SIZE];
+    uint8_t hello[2 * sizeof(uint32_t)];
+    uint32_t length, stream_id;
+    uint8_t type;
+    if (write_precisely(sockfd, request_line, strlen(request_line)) != strlen(request_line) ||
+        read_precisely(sockfd, header, sizeof(header)) != sizeof(header)) {
+        close(sockfd);
+        return -1;
+    }
+    frame_unpack_header(header, &length, &stream_id, &type);
+    if (type == FRAME_ERROR && length == 0) {
+        close(sockfd);
+        return -2;
+    }
+    if (type != FRAME_HELLO || length != sizeof(hello) ||
+        read_precisely(sockfd, hello, sizeof(hello)) != sizeof(hello)) {
+        ERR_PRINT("Unexpected answer to %s\n", REQUEST_FRAMED);
+        close(sockfd);
+        return -1;
+    }
+    memcpy(window, hello, sizeof(uint32_t));
+    memcpy(max_streams, hello + sizeof(uint32_t), sizeof(uint32_t));
+    *window = ntohl(*window);
+    *max_streams = ntohl(*max_streams);
+    return sockfd;
+}
+
+
+/*
+** Helper for: get_files_request
+** Asks for the rest of a file (from the bytes its partial file already has) on
+** a new stream.
+**
+** returns 0 on success, -1 on error
+*/
+static int request_framed_get(int sockfd, FramedGet *get, uint32_t stream_id) {
+    struct stat file_info;
+    if (fstat(get->fd, &file_info) == -1) {
+        perror("request_framed_get");
+        return -1;
+    }
+    get->offset = file_info.st_size;
+    get->stream_id = stream_id;
+
+    uint8_t frame[FRAME_HEADER_SIZE + STREAM_RANGE_FIELDS_SIZE];
+    uint32_t network_index = htonl(get->file_index);
+    frame_pack_header(frame, STREAM_RANGE_FIELDS_SIZE, stream_id, FRAME_STREAM);
+    memcpy(frame + FRAME_HEADER_SIZE, &network_index, sizeof(uint32_t));
+    convert_uint64_to_uint8(get->offset, frame + FRAME_HEADER_SIZE + sizeof(uint32_t));
+    convert_uint64_to_uint8(UINT64_MAX, frame + FRAME_HEADER_SIZE + sizeof(uint32_t) + sizeof(uint64_t));
+    return write_precisely(sockfd, frame, sizeof(frame)) == sizeof(frame) ? 0 : -1;
+}
+
+
+/*
+** Helper for: get_files_request
+** Handles one frame from the server for the get it belongs to.
+**
+** returns 1 once the get is over (complete, or the server could not send the
+** file), 0 if more is to come, -1 on error
+*/
+static int process_framed_get(int sockfd, FramedGet *get, uint8_t type, const uint8_t *payload,
+                              uint32_t length, uint32_t window, uint32_t *next_stream_id,
+                              const int pipe_fds[2], int pipe_size) {
+    if (type == FRAME_HEADERS && length == STREAM_RANGE_HEADER_SIZE) {
+        uint64_t file_size = convert_uint8_to_uint64(payload);
+        if (get->offset > file_size) {
+            printf("Partial file is longer than the server's, starting over\n");
+            if (ftruncate(get->fd, 0) == -1 || lseek(get->fd, 0, SEEK_SET) == -1) {
+                perror("process_framed_get: ftruncate");
+                return -1;
+            }
+            return request_framed_get(sockfd, get, (*next_stream_id)++);
+        }
+        if (get->offset > 0) {
+            printf("Resuming %s from byte %lu\n", get->name, (unsigned long)get->offset);
+        }
+        get->length = convert_uint8_to_uint64(payload + sizeof(uint64_t));
+        get->receiving = 1;
+
+    } else if (type == FRAME_DATA && get->receiving) {
+        // the payload is still in the socket: straight from there to the file
+        int spliced = splice_to_file(sockfd, pipe_fds, pipe_size, get->fd, length, NULL);
+        if (spliced != 1) {
+            if (spliced == 0) {
+                ERR_PRINT("Lost the connection to the server\n");
+            }
+            return -1;
+        }
+        get->received += length;
+        get->unacked += length;
+        // the window is given back in halves, so it never runs dry while the data is on its way
+        if (get->received < get->length && get->unacked >= window / 2) {
+            uint8_t frame[FRAME_HEADER_SIZE + sizeof(uint32_t)];
+            uint32_t increment = htonl(get->unacked);
+            frame_pack_header(frame, sizeof(uint32_t), get->stream_id, FRAME_WINDOW);
+            memcpy(frame + FRAME_HEADER_SIZE, &increment, sizeof(uint32_t));
+            if (write_precisely(sockfd, frame, sizeof(frame)) != sizeof(frame)) {
+                return -1;
+            }
+            get->unacked = 0;
+        }
+
+    } else if (type == FRAME_ERROR) {
+        printf("Could not get %s: %.*s\n", get->name, (int)length, payload);
+        get->failed = 1;
+        return 1;
+
+    } else {
+        ERR_PRINT("Unexpected frame of type %u for %s\n", type, get->name);
+        return -1;
+    }
+
+    return get->receiving && get->received == get->length;
+}
+
+
+int get_files_request(ServerConnection *server, const uint32_t *file_indexes, int num_files,
+                      const Library *library) {
+    uint32_t window, max_streams;
+    int sockfd = connect_framed(server, &window, &max_streams);
+    if (sockfd == -2) {
+        // one at a time on the connection we have
+        printf("Server does not serve several files at once, getting them one by one\n");
+        for (int i = 0; i < num_files; i++) {
+            if (get_file_request(server, file_indexes[i], library) == -1) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    if (sockfd == -1) {
+        return -1;
+    }
+
+    int pipe_fds[2];
+    int pipe_size = make_splice_pipe(pipe_fds);
+    if (pipe_size == -1) {
+        close(sockfd);
+        return -1;
+    }
+    FramedGet *gets = calloc(num_files, sizeof(FramedGet));
+    uint8_t *payload = malloc(FRAME_DATA_MAX);
+    if (gets == NULL || payload == NULL) {
+        perror("get_files_request");
+        free(gets);
+        free(payload);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        close(sockfd);
+        return -1;
+    }
+    for (int i = 0; i < num_files; i++) {
+        gets[i].file_index = file_indexes[i];
+        gets[i].name = library->files[file_indexes[i]];
+        gets[i].fd = -1;
+    }
+
+    int result = 0;
+    int num_requested = 0;
+    int num_open = 0;
+    int num_over = 0;
+    uint32_t next_stream_id = 1;
+    while (result == 0 && num_over < num_files) {
+        // the server answers up to max_streams at once, interleaving their data
+        while (num_open < max_streams && num_requested < num_files) {
+            FramedGet *get = &gets[num_requested++];
+            get->fd = open_partial_file(get->file_index, library, &get->filepath, &get->partial_path);
+            if (get->fd == -1 || request_framed_get(sockfd, get, next_stream_id++) == -1) {
+                result = -1;
+                break;
+            }
+            num_open++;
+        }
+        if (result == -1) {
+            break;
+        }
+
+        uint8_t header[FRAME_HEADER_SIZE];
+        uint32_t length, stream_id;
+        uint8_t type;
+        if (read_precisely(sockfd, header, sizeof(header)) != sizeof(header)) {
+            ERR_PRINT("Lost the connection to the server\n");
+            result = -1;
+            break;
+        }
+        frame_unpack_header(header, &length, &stream_id, &type);
+
+        FramedGet *get = NULL;
+        for (int i = 0; i < num_requested && get == NULL; i++) {
+            if (gets[i].stream_id == stream_id && gets[i].fd != -1) {
+                get = &gets[i];
+            }
+        }
+        // a DATA frame's payload is spliced to its file, the others' are read
+        if (type != FRAME_DATA || get == NULL) {
+            if (length > FRAME_DATA_MAX ||
+                (length > 0 && read_precisely(sockfd, payload, length) != length)) {
+                ERR_PRINT("Lost the connection to the server\n");
+                result = -1;
+                break;
+            }
+            if (get == NULL) {
+                continue; // a stream that is already over
+            }
+        }
+
+        int over = process_framed_get(sockfd, get, type, payload, length, window, &next_stream_id,
+                                      pipe_fds, pipe_size);
+        if (over == -1) {
+            result = -1;
+        } else if (over == 1) {
+            close(get->fd);
+            get->fd = -1;
+            if (!get->failed && rename(get->partial_path, get->filepath) == -1) {
+                perror("get_files_request: rename");
+                result = -1;
+            }
+            num_open--;
+            num_over++;
+        }
+    }
+
+    // what did not make it stays partial, for the next get to resume
+    for (int i = 0; i < num_requested; i++) {
+        if (gets[i].fd != -1) {
+            close(gets[i].fd);
+        }
+        free(gets[i].filepath);
+        free(gets[i].partial_path);
+    }
+    free(gets);
+    free(payload);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    close(sockfd);
+    return result;
+}
+
+
 int start_audio_player_process(int *audio_out_fd) {
      char *args[] = AUDIO_PLAYER_ARGS;
     int pipefd[2];
@@ -387,6 +1358,61 @@ int stream_and_get_request(int sockfd, uint32_t file_index, const Library * libr
     return 0;
 }
 
+int radio_request(ServerConnection *server, uint32_t file_index) {
+    uint8_t request[sizeof(REQUEST_RADIO END_OF_MESSAGE_TOKEN) - 1 + sizeof(uint32_t)];
+    size_t line_len = strlen(REQUEST_RADIO END_OF_MESSAGE_TOKEN);
+    uint32_t network_index = htonl(file_index);
+    memcpy(request, REQUEST_RADIO END_OF_MESSAGE_TOKEN, line_len);
+    memcpy(request + line_len, &network_index, sizeof(uint32_t));
+    if (write_precisely(server->sockfd, request, sizeof(request)) != sizeof(request)) {
+        perror("radio_request: write");
+        return -1;
+    }
+
+    uint8_t header[2 * sizeof(uint64_t)];
+    if (read_precisely(server->sockfd, header, sizeof(header)) != sizeof(header)) {
+        ERR_PRINT("The server could not tune in to file %u\n", file_index);
+        return -1;
+    }
+    printf("Tuned in to file %u at %lu bytes/s\n", file_index,
+           (unsigned long)convert_uint8_to_uint64(header + sizeof(uint64_t)));
+
+    int audio_out_fd;
+    int audio_player_pid = start_audio_player_process(&audio_out_fd);
+    if (audio_player_pid == -1) {
+        return -1;
+    }
+
+    // the player quitting is how the broadcast ends: an error writing to it, not a SIGPIPE
+    struct sigaction ignore = {.sa_handler = SIG_IGN};
+    struct sigaction old_action;
+    sigaction(SIGPIPE, &ignore, &old_action);
+
+    uint8_t buffer[RESPONSE_BUFFER_SIZE];
+    while (1) {
+        ssize_t got = read(server->sockfd, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            ERR_PRINT("Lost the connection to the server\n");
+            break;
+        }
+        if (write_precisely(audio_out_fd, buffer, got) != got) {
+            break;
+        }
+    }
+
+    close(audio_out_fd);
+    _wait_on_audio_player(audio_player_pid);
+    sigaction(SIGPIPE, &old_action, NULL);
+
+    close(server->sockfd);
+    server->sockfd = connect_to_server(server->port, server->hostname);
+    return server->sockfd == -1 ? -1 : 0;
+}
+
+
 int create_and_send_streamreq(int sockfd, uint32_t file_index)
 {
     //chatgpt wrote this helper to create and send the stream request.
@@ -440,75 +1466,6 @@ uint32_t read_file_size(int sockfd)
     return network_index;
 }
 
- //   buf_to_buf(read_buf, write_buf, write_buf_cap, bytes_read);
-
-void buf_to_buf(uint8_t *out_buf, uint8_t *in_buf, ssize_t in_start, ssize_t num)
-{
-    //this assumes that the output buffer has enough space for num more bytes to be appended.
-    for (int i = 0; i < num; i++)
-    {
-        in_buf[in_start + i] = out_buf[i];
-    }
-}
-int write_one(int *pos, uint8_t **write_buf, int write_buf_cap)
-{
-    int curr_pos = *pos;
-    if (curr_pos != 0)
-    {
-        *pos = 0;
-        return curr_pos;
-    }
-
-    return 0;
-}
-
-int write_both(int *file_pos, int *audio_pos, uint8_t **write_buf, int write_buf_cap)
-{
-    int curr_file_pos = *file_pos;
-    int curr_audio_pos = *audio_pos;
-    int num_written = 0;
-    if (curr_file_pos - curr_audio_pos > 0)
-    {
-        *file_pos -= curr_audio_pos;
-        *audio_pos = 0;
-        num_written = curr_audio_pos;
-    }
-    else
-    {
-        *audio_pos -= curr_file_pos;
-        *file_pos = 0;
-        num_written = curr_file_pos;
-    }
-
-    return num_written;
-}
-//adjust_readwrite_pos(&file_pos, &audio_pos, &write_buf, write_buf_cap, out_no);
-int adjust_readwrite_pos(int *file_pos, int *audio_pos, uint8_t **write_buf, int write_buf_cap, int out_no)
-{
-    int ret = 0; //this will be number of bytes removed from write buffer.
-    int curr_file_pos = *file_pos;
-    int curr_audio_pos = *audio_pos;
-    if (out_no == 0)
-    {
-        if (curr_file_pos != 0 && curr_audio_pos != 0)
-        {
-            ret = write_both(file_pos, audio_pos, write_buf, write_buf_cap);
-        }
-    }
-
-    if (out_no == 1)
-    {
-        ret = write_one(audio_pos, write_buf, write_buf_cap);
-    }
-
-    if (out_no == 2)
-    {
-        ret = write_one(file_pos, write_buf, write_buf_cap);
-    }
-
-    return ret;
-}
-
 int get_max(int i, int j, int k)
 {
     int max;
@@ -520,101 +1477,109 @@ int get_max(int i, int j, int k)
 
 int process_stream_request(uint32_t file_size, int out_no, int audio_out_fd, int file_dest_fd, int sockfd)
 {
-    uint8_t read_buf[NETWORK_PRE_DYNAMIC_BUFF_SIZE];
-    uint8_t *write_buf = malloc(sizeof(uint8_t));
+    int pipe_fds[2];
+    int pipe_size = make_splice_pipe(pipe_fds);
+    if (pipe_size == -1) {return -1;}
 
+    uint32_t total_bytes_in = 0;
     uint32_t total_bytes_out = 0;
-    int write_buf_cap = 0;
-    int file_pos = 0;
-    int audio_pos = 0;
+    size_t in_pipe = 0; //bytes spliced in from the socket and not yet out to every destination.
+    size_t teed = 0;    //bytes at the front of the pipe the player already has a copy of (out_no 0).
+    int out_fd = out_no == 2 ? file_dest_fd : audio_out_fd;
     int max = get_max(audio_out_fd, file_dest_fd, sockfd);
+    int result = 0;
 
-    fd_set readfds_reset;
-    fd_set writefds_reset;
-    struct timeval timeout;
-    timeout.tv_sec = SELECT_TIMEOUT_SEC;
-    timeout.tv_usec = SELECT_TIMEOUT_USEC;
-
-    FD_ZERO(&readfds_reset);
-    FD_ZERO(&writefds_reset);
-
-    //Set the write/reads fd sets.
-    FD_SET(sockfd, &readfds_reset);
-    if (out_no == 0)
-    {
-        FD_SET(audio_out_fd, &writefds_reset);
-        FD_SET(file_dest_fd, &writefds_reset);
-    }
-    if (out_no == 1)
-    {
-        FD_SET(audio_out_fd, &writefds_reset);
-    }
-    if (out_no == 2)
-    {
-        FD_SET(file_dest_fd, &writefds_reset);
-    }
-
-    // Create file descriptor sets, and set them to zero.
     while (total_bytes_out != file_size)
     {
-        fd_set readfds = readfds_reset;
-        fd_set writefds = writefds_reset;
-
-        //SET TO SELECT TO MAXIMUM
+        //only read as much as the pipe holds: a player or disk that falls behind holds up the socket.
+        fd_set readfds;
+        fd_set writefds;
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        if (total_bytes_in != file_size && in_pipe < pipe_size) {FD_SET(sockfd, &readfds);}
+        if (in_pipe > 0 && teed == 0) {FD_SET(out_fd, &writefds);}
+
+        struct timeval timeout;
+        timeout.tv_sec = SELECT_TIMEOUT_SEC;
+        timeout.tv_usec = SELECT_TIMEOUT_USEC;
         int activity = select(max + 1, &readfds, &writefds, NULL, &timeout);
         if (activity == -1)
         {
+            if (errno == EINTR) {continue;}
             perror("select");
-            exit(EXIT_FAILURE);
+            result = -1;
+            break;
         } else if (activity == 0) {
             continue;
         }
 
         if (FD_ISSET(sockfd, &readfds))
         {
-            int bytes_read = read(sockfd, read_buf, NETWORK_PRE_DYNAMIC_BUFF_SIZE);
-            write_buf = realloc(write_buf, (write_buf_cap + bytes_read) * sizeof(uint8_t));
-            if (write_buf == NULL)
+            ssize_t bytes_in = splice(sockfd, NULL, pipe_fds[1], NULL, MIN(file_size - total_bytes_in, pipe_size - in_pipe),
+                                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (bytes_in == 0)
+            {
+                ERR_PRINT("Server closed the connection mid-stream\n");
+                result = -1;
+                break;
+            }
+            if (bytes_in > 0)
+            {
+                total_bytes_in += bytes_in;
+                in_pipe += bytes_in;
+            }
+            else if (errno != EAGAIN && errno != EINTR)
             {
-                perror("realloc");
-                exit(EXIT_FAILURE);
+                perror("process_stream_request: splice");
+                result = -1;
+                break;
             }
-            //move bytes from read_buf to end of write_buf
-            buf_to_buf(read_buf, write_buf, write_buf_cap, bytes_read);
-            write_buf_cap += bytes_read;
         }
 
-        if (out_no != 2 && FD_ISSET(audio_out_fd, &writefds) && audio_pos != write_buf_cap)
+        ssize_t bytes_out = 0;
+        if (FD_ISSET(out_fd, &writefds) && out_no == 0)
         {
-            int bytes_played = write(audio_out_fd, write_buf + audio_pos, write_buf_cap - audio_pos);
-            audio_pos += bytes_played;
+            //the player gets a copy of the pipe's data, which stays in the pipe for the file.
+            bytes_out = tee(pipe_fds[0], audio_out_fd, in_pipe, SPLICE_F_NONBLOCK);
+            if (bytes_out > 0) {teed = bytes_out;}
         }
-
-        if (out_no != 1 && FD_ISSET(file_dest_fd, &writefds) && file_pos != write_buf_cap)
+        else if (FD_ISSET(out_fd, &writefds))
         {
-            int bytes_written = write(file_dest_fd, write_buf + file_pos, write_buf_cap - file_pos);
-            file_pos += bytes_written;
+            bytes_out = splice(pipe_fds[0], NULL, out_fd, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (bytes_out > 0)
+            {
+                in_pipe -= bytes_out;
+                total_bytes_out += bytes_out;
+            }
+        }
+        if (bytes_out == -1 && errno != EAGAIN && errno != EINTR)
+        {
+            perror("process_stream_request: splice");
+            result = -1;
+            break;
         }
 
-        int bytes_out = adjust_readwrite_pos(&file_pos, &audio_pos, &write_buf, write_buf_cap, out_no);
-
-        if (bytes_out != 0)
+        //the copy the player has can leave the pipe now, into the file (which is always writable).
+        while (teed > 0)
         {
-            memmove(write_buf, write_buf + bytes_out, write_buf_cap - bytes_out);
-            write_buf_cap -= bytes_out;
-            write_buf = realloc(write_buf, write_buf_cap * sizeof(uint8_t));
-            if (write_buf_cap != 0 && write_buf == NULL)
+            bytes_out = splice(pipe_fds[0], NULL, file_dest_fd, NULL, teed, SPLICE_F_MOVE);
+            if (bytes_out == -1 && errno == EINTR) {continue;}
+            if (bytes_out <= 0)
             {
-                perror("realloc");
-                exit(EXIT_FAILURE);
+                perror("process_stream_request: splice");
+                result = -1;
+                break;
             }
+            teed -= bytes_out;
+            in_pipe -= bytes_out;
+            total_bytes_out += bytes_out;
         }
-
-        total_bytes_out += bytes_out;
+        if (result == -1) {break;}
     }
 
-    free(write_buf);
-    return total_bytes_out;
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return result == -1 ? -1 : total_bytes_out;
 }
 
 int send_and_process_stream_request(int sockfd, uint32_t file_index,
@@ -644,13 +1609,63 @@ int send_and_process_stream_request(int sockfd, uint32_t file_index,
 }
 
 
+int sync_request(ServerConnection *server, Library *library, const char *prefix) {
+    if (fetch_library(server->sockfd, library) == -1) {
+        return -1;
+    }
+
+    uint32_t *file_indexes = malloc((library->num_files + 1) * sizeof(uint32_t));
+    if (file_indexes == NULL) {
+        perror("sync_request");
+        return -1;
+    }
+    size_t prefix_len = strlen(prefix);
+    int num_files = 0;
+    for (uint32_t i = 0; i < library->num_files; i++) {
+        if (library->files[i][0] != '\0' && strncmp(library->files[i], prefix, prefix_len) == 0) {
+            file_indexes[num_files++] = i;
+        }
+    }
+
+    double started = now_seconds();
+    int num_dirs = create_library_directories(library, file_indexes, num_files);
+    int result = num_dirs == -1 ? -1 : 0;
+    int num_got = 0;
+    for (int start = 0; result == 0 && start < num_files; start += SYNC_BATCH_SIZE) {
+        uint32_t *batch = file_indexes + start;
+        int num_left = skip_up_to_date_files(server, batch, MIN(SYNC_BATCH_SIZE, num_files - start), library);
+        if (num_left > 0) {
+            result = num_left == 1 ? get_file_request(server, batch[0], library)
+                                   : get_files_request(server, batch, num_left, library);
+            num_got += num_left;
+        }
+    }
+    free(file_indexes);
+    if (result == -1) {
+        return -1;
+    }
+
+    printf("Synced %d files in %.2f s: got %d, %d up to date (made %d directories)\n", num_files,
+           now_seconds() - started, num_got, num_files - num_got, num_dirs);
+    return 0;
+}
+
+
 static void _print_shell_help(){
     printf("Commands:\n");
     printf("  list: List the files in the library\n");
-    printf("  get <file_index>: Get a file from the library\n");
+    printf("  get <file_index> [<file_index> ...]: Get files from the library\n");
+    printf("                                       (skipping those already up to date)\n");
     printf("  stream <file_index>: Stream a file from the library (without saving it)\n");
     printf("  stream+ <file_index>: Stream a file from the library\n");
     printf("                        and save it to the local library\n");
+    printf("  radio <file_index>: Tune in to a file's station, listening along with\n");
+    printf("                      everyone else tuned in to it\n");
+    printf("  find <text> [<page>]: List the files whose path contains text\n");
+    printf("  browse <prefix> [<page>]: List the files whose path starts with prefix\n");
+    printf("  sync [<prefix>]: Get every file in the library (or whose path starts with\n");
+    printf("                   prefix) that is not up to date\n");
+    printf("  stats: Display the server's metrics\n");
     printf("  help: Display this help message\n");
     printf("  quit: Quit the client\n");
 }
@@ -663,13 +1678,21 @@ static void _print_shell_help(){
 ** user for a command and then calls the appropriate function to handle the
 ** command. The user can enter the following commands:
 ** - "list" to list the files in the library
-** - "get <file_index>" to get a file from the library
+** - "get <file_index> [<file_index> ...]" to get files from the library (several
+**   are got at once)
 ** - "stream <file_index>" to stream a file from the library (without saving it)
 ** - "stream+ <file_index>" to stream a file from the library and save it to the local library
+** - "radio <file_index>" to tune in to a file's station
+** - "find <text> [<page>]" to list a page of the files whose path contains text
+** - "browse <prefix> [<page>]" to list a page of the files whose path starts
+**   with prefix (e.g. a directory's files)
+** - "sync [<prefix>]" to mirror the library (or the files whose path starts
+**   with prefix) into the local library
+** - "stats" to display the server's metrics
 ** - "help" to display the help message
 ** - "quit" to quit the client
 */
-static int client_shell(int sockfd, const char *library_directory) {
+static int client_shell(ServerConnection *server, const char *library_directory) {
     char buffer[REQUEST_BUFFER_SIZE];
     char *command;
     int file_index;
@@ -694,25 +1717,40 @@ static int client_shell(int sockfd, const char *library_directory) {
 
         // List Request -- list the files in the library
         if (strcmp(command, CMD_LIST) == 0) {
-            if (list_request(sockfd, &library) == -1) {
+            if (list_request(server->sockfd, &library) == -1) {
                 goto error;
             }
 
 
         // Get Request -- get a file from the library
         } else if (strcmp(command, CMD_GET) == 0) {
-            char *file_index_str = strtok(NULL, " \n");
-            if (file_index_str == NULL) {
-                printf("Usage: get <file_index>\n");
+            uint32_t file_indexes[REQUEST_BUFFER_SIZE / 2];
+            int num_files = 0;
+            int valid = 1;
+            char *file_index_str;
+            while (valid && (file_index_str = strtok(NULL, " \n")) != NULL) {
+                file_index = strtol(file_index_str, NULL, 10);
+                valid = file_index >= 0 && file_index < library.num_files &&
+                        library.files[file_index][0] != '\0';
+                file_indexes[num_files++] = file_index;
+            }
+            if (num_files == 0) {
+                printf("Usage: get <file_index> [<file_index> ...]\n");
                 continue;
             }
-            file_index = strtol(file_index_str, NULL, 10);
-            if (file_index < 0 || file_index >= library.num_files) {
+            if (!valid) {
                 printf("Invalid file index\n");
                 continue;
             }
 
-            if (get_file_request(sockfd, file_index, &library) == -1) {
+            num_files = skip_up_to_date_files(server, file_indexes, num_files, &library);
+            if (num_files == 0) {
+                continue;
+            }
+
+            int result = num_files == 1 ? get_file_request(server, file_indexes[0], &library)
+                                        : get_files_request(server, file_indexes, num_files, &library);
+            if (result == -1) {
                 goto error;
             }
 
@@ -724,12 +1762,13 @@ static int client_shell(int sockfd, const char *library_directory) {
                 continue;
             }
             file_index = strtol(file_index_str, NULL, 10);
-            if (file_index < 0 || file_index >= library.num_files) {
+            if (file_index < 0 || file_index >= library.num_files ||
+                library.files[file_index][0] == '\0') {
                 printf("Invalid file index\n");
                 continue;
             }
 
-            if (stream_request(sockfd, file_index) == -1) {
+            if (stream_request(server->sockfd, file_index) == -1) {
                 goto error;
             }
 
@@ -741,12 +1780,62 @@ static int client_shell(int sockfd, const char *library_directory) {
                 continue;
             }
             file_index = strtol(file_index_str, NULL, 10);
-            if (file_index < 0 || file_index >= library.num_files) {
+            if (file_index < 0 || file_index >= library.num_files ||
+                library.files[file_index][0] == '\0') {
                 printf("Invalid file index\n");
                 continue;
             }
 
-            if (stream_and_get_request(sockfd, file_index, &library) == -1) {
+            if (stream_and_get_request(server->sockfd, file_index, &library) == -1) {
+                goto error;
+            }
+
+        // Radio Request -- listen to a file's station along with everyone tuned in to it
+        } else if (strcmp(command, CMD_RADIO) == 0) {
+            char *file_index_str = strtok(NULL, " \n");
+            if (file_index_str == NULL) {
+                printf("Usage: radio <file_index>\n");
+                continue;
+            }
+            file_index = strtol(file_index_str, NULL, 10);
+            if (file_index < 0 || file_index >= library.num_files ||
+                library.files[file_index][0] == '\0') {
+                printf("Invalid file index\n");
+                continue;
+            }
+
+            if (radio_request(server, file_index) == -1) {
+                goto error;
+            }
+
+        // Find and Browse -- list a page of the files that match, without the whole library
+        } else if (strcmp(command, CMD_FIND) == 0 || strcmp(command, CMD_BROWSE) == 0) {
+            QueryMode mode = strcmp(command, CMD_FIND) == 0 ? QUERY_SUBSTRING : QUERY_PREFIX;
+            char *pattern = strtok(NULL, " \n");
+            char *page_str = strtok(NULL, " \n");
+            if (pattern == NULL) {
+                printf("Usage: %s <%s> [<page>]\n", command, mode == QUERY_SUBSTRING ? "text" : "prefix");
+                continue;
+            }
+            long page = page_str != NULL ? strtol(page_str, NULL, 10) : 1;
+            if (page < 1) {
+                printf("Invalid page\n");
+                continue;
+            }
+
+            if (list_query_request(server->sockfd, &library, mode, pattern, page) == -1) {
+                goto error;
+            }
+
+        // Sync -- get every file (or every file under a prefix) not up to date, pipelined
+        } else if (strcmp(command, CMD_SYNC) == 0) {
+            char *prefix = strtok(NULL, " \n");
+            if (sync_request(server, &library, prefix != NULL ? prefix : "") == -1) {
+                goto error;
+            }
+
+        } else if (strcmp(command, CMD_STATS) == 0) {
+            if (stats_request(server->sockfd) == -1) {
                 goto error;
             }
 
@@ -771,11 +1860,13 @@ error:
 
 
 static void print_usage() {
-    printf("Usage: as_client [-h] [-a NETWORK_ADDRESS] [-p PORT] [-l LIBRARY_DIRECTORY]\n");
+    printf("Usage: as_client [-h] [-a NETWORK_ADDRESS] [-p PORT] [-l LIBRARY_DIRECTORY] [-n CONNECTIONS]\n");
     printf("  -h: Print this help message\n");
     printf("  -a NETWORK_ADDRESS: Connect to server at NETWORK_ADDRESS (default 'localhost')\n");
     printf("  -p  Port to listen on (default: " XSTR(DEFAULT_PORT) ")\n");
     printf("  -l LIBRARY_DIRECTORY: Use LIBRARY_DIRECTORY as the library directory (default 'as-library')\n");
+    printf("  -n CONNECTIONS: Get a large file on up to CONNECTIONS connections at once (default: "
+           XSTR(DEFAULT_GET_CONNECTIONS) ")\n");
 }
 
 
@@ -784,8 +1875,9 @@ int main(int argc, char * const *argv) {
     int port = DEFAULT_PORT;
     const char *hostname = "localhost";
     const char *library_directory = "saved";
+    int connections = DEFAULT_GET_CONNECTIONS;
 
-    while ((opt = getopt(argc, argv, "ha:p:l:")) != -1) {
+    while ((opt = getopt(argc, argv, "ha:p:l:n:")) != -1) {
         switch (opt) {
             case 'h':
                 print_usage();
@@ -803,6 +1895,13 @@ int main(int argc, char * const *argv) {
             case 'l':
                 library_directory = optarg;
                 break;
+            case 'n':
+                connections = strtol(optarg, NULL, 10);
+                if (connections < 1) {
+                    ERR_PRINT("Invalid number of connections %d\n", connections);
+                    return 1;
+                }
+                break;
             default:
                 print_usage();
                 return 1;
@@ -812,17 +1911,19 @@ int main(int argc, char * const *argv) {
     printf("Connecting to server at %s:%d, using library in %s\n",
            hostname, port, library_directory);
 
-    int sockfd = connect_to_server(port, hostname);
-    if (sockfd == -1) {
+    ServerConnection server = {hostname, port, -1, connections};
+    server.sockfd = connect_to_server(port, hostname);
+    if (server.sockfd == -1) {
         return -1;
     }
 
-    int result = client_shell(sockfd, library_directory);
+    int result = client_shell(&server, library_directory);
+    if (server.sockfd != -1) {
+        close(server.sockfd);
+    }
     if (result == -1) {
-        close(sockfd);
         return -1;
     }
 
-    close(sockfd);
     return 0;
 }
@@ -0,0 +1,429 @@
+#include "as_frame.h"
+#include "as_stats.h"
+
+
+static uint32_t _read_uint32(const uint8_t *buf) {
+    uint32_t value;
+    memcpy(&value, buf, sizeof(uint32_t));
+    return ntohl(value);
+}
+
+
+/*
+** Queue a control frame. The caller makes sure there is room: the control
+** buffer always has FRAME_CONTROL_RESERVE bytes free when a frame is handled.
+*/
+static void _queue_control(FrameSession *session, uint32_t stream_id, uint8_t type,
+                           const void *payload, uint32_t length) {
+    if (session->control_sent > 0) {
+        // what was sent makes room at the front
+        session->control_len -= session->control_sent;
+        memmove(session->control, session->control + session->control_sent, session->control_len);
+        session->control_sent = 0;
+    }
+
+    frame_pack_header(session->control + session->control_len, length, stream_id, type);
+    memcpy(session->control + session->control_len + FRAME_HEADER_SIZE, payload, length);
+    session->control_len += FRAME_HEADER_SIZE + length;
+}
+
+
+static void _queue_error(FrameSession *session, uint32_t stream_id, const char *message) {
+    _queue_control(session, stream_id, FRAME_ERROR, message, MIN(strlen(message), FRAME_ERROR_MAX));
+}
+
+
+// Answer a request that cannot be served with an ERROR
+static void _refuse(FrameSession *session, uint32_t stream_id, const char *message) {
+    stats_add(&session->stats->errors, 1);
+    _queue_error(session, stream_id, message);
+}
+
+
+static void _queue_headers(FrameSession *session, uint32_t stream_id, uint64_t file_size, uint64_t length) {
+    uint8_t payload[STREAM_RANGE_HEADER_SIZE];
+    convert_uint64_to_uint8(file_size, payload);
+    convert_uint64_to_uint8(length, payload + sizeof(uint64_t));
+    _queue_control(session, stream_id, FRAME_HEADERS, payload, sizeof(payload));
+}
+
+
+int frame_start(Connection *conn) {
+    if (!conn->framing) {
+        // an empty ERROR on stream 0, and the line protocol carries on
+        static uint8_t refusal[FRAME_HEADER_SIZE] = {[2 * sizeof(uint32_t)] = FRAME_ERROR};
+        conn->out_buf = refusal;
+        conn->out_len = sizeof(refusal);
+        conn->out_sent = 0;
+        conn->state = CONN_SENDING;
+        return 0;
+    }
+
+    FrameSession *session = (FrameSession *)calloc(1, sizeof(FrameSession));
+    if (session == NULL) {
+        perror("frame_start: calloc");
+        return -1;
+    }
+    for (int i = 0; i < FRAME_MAX_STREAMS; i++) {
+        transfer_init(&session->streams[i].transfer);
+    }
+    session->current = -1;
+    session->stats = conn->stats;
+
+    uint8_t hello[2 * sizeof(uint32_t)];
+    uint32_t window = htonl(FRAME_INITIAL_WINDOW);
+    uint32_t max_streams = htonl(FRAME_MAX_STREAMS);
+    memcpy(hello, &window, sizeof(uint32_t));
+    memcpy(hello + sizeof(uint32_t), &max_streams, sizeof(uint32_t));
+    _queue_control(session, 0, FRAME_HELLO, hello, sizeof(hello));
+
+    // framed responses are flow controlled by the client rather than paced
+    bucket_init(&conn->pace, 0, 0, 0);
+    conn->frames = session;
+    conn->state = CONN_FRAMED;
+    #ifdef DEBUG
+    printf("Client switched to the framed protocol\n");
+    #endif
+    return 0;
+}
+
+
+static FrameStream *_find_stream(FrameSession *session, uint32_t stream_id) {
+    for (int i = 0; i < FRAME_MAX_STREAMS; i++) {
+        if (session->streams[i].id == stream_id) {
+            return &session->streams[i];
+        }
+    }
+    return NULL;
+}
+
+
+static void _close_stream(FrameSession *session, FrameStream *stream) {
+    if (stream->payload != NULL) {
+        _release_list_payload(stream->payload);
+        stream->payload = NULL;
+    }
+    transfer_close(&stream->transfer);
+    stream->id = 0;
+    stream->remaining = 0;
+    session->num_open--;
+}
+
+
+/*
+** Open a stream for a LIST or STREAM request, and queue its HEADERS, or an
+** ERROR if it cannot be answered.
+**
+** return 0 on success, -1 on a protocol error
+*/
+static int _open_stream(FrameSession *session, LibrarySnapshot *snapshot, FileCache *cache,
+                        uint32_t stream_id, uint8_t type, const uint8_t *fields) {
+    if (stream_id == 0 || _find_stream(session, stream_id) != NULL) {
+        ERR_PRINT("Request on stream %u, which is already open\n", stream_id);
+        return -1;
+    }
+
+    stats_add(&session->stats->requests[type == FRAME_LIST ? STAT_LIST : STAT_RANGE], 1);
+    FrameStream *stream = _find_stream(session, 0);
+    if (stream == NULL) {
+        _refuse(session, stream_id, "too many streams");
+        return 0;
+    }
+
+    if (type == FRAME_LIST) {
+        if (snapshot->library.num_files == 0) {
+            _refuse(session, stream_id, "no files in library");
+            return 0;
+        }
+        atomic_fetch_add_explicit(&snapshot->list->refs, 1, memory_order_relaxed);
+        stream->payload = snapshot->list;
+        stream->remaining = snapshot->list->len;
+        _queue_headers(session, stream_id, stream->remaining, stream->remaining);
+
+    } else {
+        uint32_t file_index = _read_uint32(fields);
+        uint64_t offset = convert_uint8_to_uint64(fields + sizeof(uint32_t));
+        uint64_t length = convert_uint8_to_uint64(fields + sizeof(uint32_t) + sizeof(uint64_t));
+
+        char *file_path = get_filepath_from_index(&snapshot->library, file_index);
+        if (file_path == NULL) {
+            _refuse(session, stream_id, "no such file");
+            return 0;
+        }
+        uint64_t file_size;
+        int opened = transfer_open(&stream->transfer, file_path, cache, &file_size, NULL);
+        free(file_path);
+        if (opened < 0) {
+            _refuse(session, stream_id, "cannot open file");
+            return 0;
+        }
+        if (cache != NULL) {
+            stats_add(opened == 1 ? &session->stats->cache_hits : &session->stats->cache_misses, 1);
+        }
+        stream->remaining = transfer_set_range(&stream->transfer, offset, length);
+        _queue_headers(session, stream_id, file_size, stream->remaining);
+        #ifdef DEBUG
+        printf("Streaming %lu bytes of file %u from byte %lu on stream %u\n",
+               (unsigned long)stream->remaining, file_index,
+               (unsigned long)stream->transfer.offset, stream_id);
+        #endif
+    }
+
+    stream->id = stream_id;
+    stream->window = FRAME_INITIAL_WINDOW;
+    stream->started = monotonic_ns();
+    session->num_open++;
+    if (stream->remaining == 0) {
+        stats_request_done(session->stats, type == FRAME_LIST ? STAT_LIST : STAT_RANGE, stream->started);
+        _close_stream(session, stream); // the HEADERS say it all
+    }
+    return 0;
+}
+
+
+/*
+** Handle one complete frame from the client.
+**
+** return 0 on success, -1 on a protocol error
+*/
+static int _handle_frame(FrameSession *session, LibrarySnapshot *snapshot, FileCache *cache,
+                         uint8_t type, uint32_t stream_id, const uint8_t *payload, uint32_t length) {
+    FrameStream *stream;
+    switch (type) {
+        case FRAME_LIST:
+        case FRAME_STREAM:
+            if (length != (type == FRAME_LIST ? 0 : STREAM_RANGE_FIELDS_SIZE)) {
+                break;
+            }
+            return _open_stream(session, snapshot, cache, stream_id, type, payload);
+
+        case FRAME_WINDOW:
+            if (length != sizeof(uint32_t)) {
+                break;
+            }
+            // a stream that is done has nothing left to grow
+            stream = stream_id != 0 ? _find_stream(session, stream_id) : NULL;
+            if (stream != NULL) {
+                stream->window += _read_uint32(payload);
+                if (stream->window > FRAME_MAX_WINDOW) {
+                    ERR_PRINT("Window of stream %u grew too large\n", stream_id);
+                    return -1;
+                }
+            }
+            return 0;
+
+        case FRAME_CANCEL:
+            if (length != 0) {
+                break;
+            }
+            stream = stream_id != 0 ? _find_stream(session, stream_id) : NULL;
+            if (stream != NULL) {
+                _queue_error(session, stream_id, "cancelled");
+                if (session->current >= 0 && stream == &session->streams[session->current]) {
+                    stream->remaining = 0; // closed once its DATA frame is done
+                } else {
+                    _close_stream(session, stream);
+                }
+            }
+            return 0;
+    }
+
+    ERR_PRINT("Bad frame of type %u and length %u\n", type, length);
+    return -1;
+}
+
+
+int frame_handle_requests(Connection *conn, LibrarySnapshot *snapshot, FileCache *cache) {
+    FrameSession *session = conn->frames;
+    while (conn->bytes_in_buf >= FRAME_HEADER_SIZE) {
+        uint32_t length;
+        uint32_t stream_id;
+        uint8_t type;
+        frame_unpack_header(conn->request_buffer, &length, &stream_id, &type);
+        if (length > FRAME_REQUEST_MAX) {
+            ERR_PRINT("Frame too long (%u bytes)\n", length);
+            return -1;
+        }
+        if (conn->bytes_in_buf < FRAME_HEADER_SIZE + length) {
+            return 0;
+        }
+        if (FRAME_CONTROL_SIZE - (session->control_len - session->control_sent) < FRAME_CONTROL_RESERVE) {
+            return 0; // waits for the control frames to go out
+        }
+
+        #ifdef DEBUG
+        printf("Frame from client: type %u, stream %u\n", type, stream_id);
+        #endif
+        int result = _handle_frame(session, snapshot, cache, type, stream_id,
+                                   conn->request_buffer + FRAME_HEADER_SIZE, length);
+        conn->bytes_in_buf -= FRAME_HEADER_SIZE + length;
+        memmove(conn->request_buffer, conn->request_buffer + FRAME_HEADER_SIZE + length, conn->bytes_in_buf);
+        if (result < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+** Start a DATA frame of the next stream that has data and window left, of at
+** most max_bytes.
+**
+** return 1 if one was started, 0 if no stream can send
+*/
+static int _start_data_frame(FrameSession *session, uint64_t max_bytes) {
+    for (int n = 0; n < FRAME_MAX_STREAMS; n++) {
+        int i = (session->next + n) % FRAME_MAX_STREAMS;
+        FrameStream *stream = &session->streams[i];
+        if (stream->id == 0 || stream->remaining == 0 || stream->window <= 0) {
+            continue;
+        }
+
+        uint64_t len = MIN(MIN(stream->remaining, (uint64_t)stream->window), MIN(max_bytes, FRAME_DATA_MAX));
+        frame_pack_header(session->data_header, len, stream->id, FRAME_DATA);
+        session->header_sent = 0;
+        session->data_left = len;
+        session->current = i;
+        session->next = (i + 1) % FRAME_MAX_STREAMS;
+        stream->remaining -= len;
+        stream->window -= len;
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+** Send the rest of the current DATA frame.
+**
+** return 1 once it is sent, 0 if the socket is full, -1 on error
+*/
+static int _send_data_frame(Connection *conn, FrameSession *session) {
+    FrameStream *stream = &session->streams[session->current];
+    int socket = conn->client.socket;
+
+    size_t header_sent = session->header_sent;
+    int ret = _send_nonblocking(socket, session->data_header, FRAME_HEADER_SIZE, &session->header_sent, MSG_MORE);
+    stats_add(&session->stats->bytes_sent, session->header_sent - header_sent);
+    if (ret != 1) {return ret;}
+
+    while (session->data_left > 0) {
+        uint64_t sent;
+        if (stream->payload != NULL) {
+            const uint8_t *data = (const uint8_t *)stream->payload->data + stream->payload->len
+                                  - stream->remaining - session->data_left;
+            size_t done = 0;
+            ret = _send_nonblocking(socket, data, session->data_left, &done, 0);
+            sent = done;
+        } else {
+            uint64_t before = stream->transfer.remaining;
+            ret = transfer_send(&stream->transfer, socket, session->data_left);
+            sent = before - stream->transfer.remaining;
+        }
+        frame_data_sent(session, sent); // the stream is closed once it is done
+        if (ret == 0 || ret < 0) {
+            return ret;
+        }
+    }
+    return 1;
+}
+
+
+int frame_send(Connection *conn, uint64_t max_bytes) {
+    FrameSession *session = conn->frames;
+    while (1) {
+        if (session->current < 0) {
+            // control frames go out between DATA frames
+            size_t control_sent = session->control_sent;
+            int ret = _send_nonblocking(conn->client.socket, session->control, session->control_len,
+                                        &session->control_sent, 0);
+            stats_add(&session->stats->bytes_sent, session->control_sent - control_sent);
+            if (ret != 1) {return ret;}
+            session->control_len = session->control_sent = 0;
+
+            if (max_bytes == 0) {
+                return frame_data_ready(session) > 0 ? 2 : 1;
+            }
+            if (!_start_data_frame(session, max_bytes)) {
+                return 1;
+            }
+            max_bytes -= session->data_left;
+        }
+
+        int ret = _send_data_frame(conn, session);
+        if (ret != 1) {return ret;}
+    }
+}
+
+
+int frame_next_data(FrameSession *session, uint64_t max_bytes) {
+    if (session->current >= 0) {
+        return 1;
+    }
+    return max_bytes > 0 && _start_data_frame(session, max_bytes);
+}
+
+
+void frame_control_sent(FrameSession *session, size_t bytes) {
+    session->control_sent += bytes;
+    stats_add(&session->stats->bytes_sent, bytes);
+    if (session->control_sent == session->control_len) {
+        session->control_len = session->control_sent = 0;
+    }
+}
+
+
+void frame_header_sent(FrameSession *session, size_t bytes) {
+    session->header_sent += bytes;
+    stats_add(&session->stats->bytes_sent, bytes);
+}
+
+
+void frame_data_sent(FrameSession *session, uint64_t bytes) {
+    FrameStream *stream = &session->streams[session->current];
+    session->data_left -= bytes;
+    session->data_sent += bytes;
+    stats_add(&session->stats->bytes_sent, bytes);
+    if (session->data_left > 0) {
+        return;
+    }
+
+    session->current = -1;
+    if (stream->remaining == 0) {
+        stats_request_done(session->stats, stream->payload != NULL ? STAT_LIST : STAT_RANGE, stream->started);
+        _close_stream(session, stream);
+    }
+}
+
+
+uint64_t frame_data_ready(const FrameSession *session) {
+    uint64_t ready = session->current >= 0 ? session->data_left : 0;
+    for (int i = 0; i < FRAME_MAX_STREAMS; i++) {
+        const FrameStream *stream = &session->streams[i];
+        if (stream->id != 0 && stream->window > 0) {
+            ready += MIN(stream->remaining, (uint64_t)stream->window);
+        }
+    }
+    return ready;
+}
+
+
+int frame_has_output(const FrameSession *session) {
+    return session->control_sent < session->control_len || frame_data_ready(session) > 0;
+}
+
+
+void frame_end(Connection *conn) {
+    FrameSession *session = conn->frames;
+    if (session == NULL) {
+        return;
+    }
+    for (int i = 0; i < FRAME_MAX_STREAMS; i++) {
+        if (session->streams[i].id != 0) {
+            _close_stream(session, &session->streams[i]);
+        }
+    }
+    free(session);
+    conn->frames = NULL;
+}
@@ -0,0 +1,424 @@
+#include "as_hash.h"
+
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+
+static int64_t _mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * NS_PER_SEC + st->st_mtim.tv_nsec;
+}
+
+
+static int _compare_saved(const void *a, const void *b) {
+    return strcmp(((const SavedHash *)a)->path, ((const SavedHash *)b)->path);
+}
+
+
+/*
+** Read the hashes saved by the last run into index->saved. A missing file is
+** no hashes; lines that cannot be parsed are skipped.
+*/
+static void _load_hashes(ContentIndex *index) {
+    FILE *file = fopen(index->save_path, "r");
+    if (file == NULL) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Cannot read content hashes from %s: %s\n", index->save_path, strerror(errno));
+        }
+        return;
+    }
+
+    size_t capacity = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_size, file)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        SavedHash saved = {.used = 0};
+        int path_at = 0;
+        if (sscanf(line, "%" SCNx64 " %" SCNu64 " %" SCNd64 " %n",
+                   &saved.hash, &saved.size, &saved.mtime, &path_at) != 3 || path_at == 0 ||
+            line[path_at] == '\0') {
+            continue;
+        }
+
+        if (index->num_saved == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 256;
+            SavedHash *grown = (SavedHash *)realloc(index->saved, capacity * sizeof(SavedHash));
+            if (grown == NULL) {
+                perror("_load_hashes: realloc");
+                break;
+            }
+            index->saved = grown;
+        }
+        saved.path = strdup(line + path_at);
+        if (saved.path == NULL) {
+            perror("_load_hashes: strdup");
+            break;
+        }
+        index->saved[index->num_saved++] = saved;
+    }
+    free(line);
+    fclose(file);
+
+    qsort(index->saved, index->num_saved, sizeof(SavedHash), _compare_saved);
+    printf("Loaded %zu content hashes\n", index->num_saved);
+}
+
+
+static void _free_saved(ContentIndex *index) {
+    for (size_t i = 0; i < index->num_saved; i++) {
+        free(index->saved[i].path);
+    }
+    free(index->saved);
+    index->saved = NULL;
+    index->num_saved = 0;
+}
+
+
+/*
+** Write the known hashes of the library's files to the index file: to a
+** temporary file first, renamed over it, so a crash never leaves half of one.
+*/
+static void _save_hashes(ContentIndex *index, const Library *library) {
+    size_t tmp_len = strlen(index->save_path) + sizeof(".tmp");
+    char *tmp_path = (char *)malloc(tmp_len);
+    if (tmp_path == NULL) {
+        perror("_save_hashes: malloc");
+        return;
+    }
+    snprintf(tmp_path, tmp_len, "%s.tmp", index->save_path);
+
+    FILE *file = fopen(tmp_path, "w");
+    int failed = file == NULL;
+    uint32_t num_hashes = MIN(index->num_hashes, library->num_files);
+    for (uint32_t i = 0; !failed && i < num_hashes; i++) {
+        const ContentHash *entry = &index->hashes[i];
+        if (entry->known && library->files[i] != NULL) {
+            failed = fprintf(file, "%016" PRIx64 " %" PRIu64 " %" PRId64 " %s\n",
+                             entry->hash, entry->size, entry->mtime, library->files[i]) < 0;
+        }
+    }
+    // the last run's hashes of files the first pass has not got to yet
+    for (size_t i = 0; !failed && i < index->num_saved; i++) {
+        const SavedHash *saved = &index->saved[i];
+        if (!saved->used) {
+            failed = fprintf(file, "%016" PRIx64 " %" PRIu64 " %" PRId64 " %s\n",
+                             saved->hash, saved->size, saved->mtime, saved->path) < 0;
+        }
+    }
+    if (file != NULL && fclose(file) != 0) {
+        failed = 1;
+    }
+    if (!failed && rename(tmp_path, index->save_path) < 0) {
+        failed = 1;
+    }
+
+    if (failed) {
+        if (!index->save_failed) {
+            fprintf(stderr, "Cannot save content hashes to %s: %s (keeping them in memory)\n",
+                    index->save_path, strerror(errno));
+            index->save_failed = 1;
+        }
+        unlink(tmp_path);
+    } else {
+        index->save_failed = 0;
+    }
+    free(tmp_path);
+}
+
+
+/*
+** Hash the file open on fd, a chunk at a time.
+**
+** return 0 on success, -1 on error, 1 if the server is quitting
+*/
+static int _hash_file(ContentIndex *index, int fd, uint8_t *buf, uint64_t *hash) {
+    Xxh64State state;
+    xxh64_init(&state);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    off_t offset = 0;
+    ssize_t len;
+    while ((len = pread(fd, buf, HASH_CHUNK_SIZE, offset)) != 0) {
+        if (atomic_load_explicit(&index->quit, memory_order_relaxed)) {
+            return 1;
+        }
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        xxh64_update(&state, buf, len);
+        offset += len;
+    }
+
+    // the library being hashed should not push what clients are playing out of the page cache
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    *hash = xxh64_digest(&state);
+    return 0;
+}
+
+
+/*
+** The hash saved by the last run for a file, if it still has the size and
+** modification time it was saved with. The saved entry is marked used either
+** way: the file's hash is the index's to save from now on.
+**
+** return 1 if *hash was set, 0 otherwise
+*/
+static int _find_saved(ContentIndex *index, const char *path, const struct stat *st, uint64_t *hash) {
+    if (index->num_saved == 0) {
+        return 0;
+    }
+    SavedHash key = {.path = (char *)path};
+    SavedHash *saved = (SavedHash *)bsearch(&key, index->saved, index->num_saved,
+                                            sizeof(SavedHash), _compare_saved);
+    if (saved == NULL) {
+        return 0;
+    }
+    saved->used = 1;
+    if (saved->size != (uint64_t)st->st_size || saved->mtime != _mtime_ns(st)) {
+        return 0;
+    }
+    *hash = saved->hash;
+    return 1;
+}
+
+
+/*
+** Make room for num_files hashes. Called with the lock held.
+**
+** return 0 on success, -1 on error
+*/
+static int _grow_hashes(ContentIndex *index, uint32_t num_files) {
+    if (num_files <= index->num_hashes) {
+        return 0;
+    }
+    ContentHash *hashes = (ContentHash *)realloc(index->hashes, num_files * sizeof(ContentHash));
+    if (hashes == NULL) {
+        perror("_grow_hashes: realloc");
+        return -1;
+    }
+    memset(hashes + index->num_hashes, 0, (num_files - index->num_hashes) * sizeof(ContentHash));
+    index->hashes = hashes;
+    index->num_hashes = num_files;
+    return 0;
+}
+
+
+/*
+** One pass through the library: hash every file whose size or modification
+** time is not the one it was hashed at (or take its hash from the last run's).
+**
+** return the number of files hashed
+*/
+static uint32_t _hash_library(ContentIndex *index, const Library *library, uint8_t *buf) {
+    pthread_mutex_lock(&index->lock);
+    int grown = _grow_hashes(index, library->num_files);
+    pthread_mutex_unlock(&index->lock);
+    if (grown < 0) {
+        return 0;
+    }
+
+    uint32_t changed = 0;
+    for (uint32_t i = 0; i < library->num_files; i++) {
+        if (atomic_load_explicit(&index->quit, memory_order_relaxed)) {
+            break;
+        }
+        if (library->files[i] == NULL) {
+            continue;
+        }
+
+        int fd = openat(index->library_fd, library->files[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            continue;
+        }
+        const ContentHash *entry = &index->hashes[i];
+        if (entry->known && entry->size == (uint64_t)st.st_size && entry->mtime == _mtime_ns(&st)) {
+            close(fd);
+            continue;
+        }
+
+        uint64_t hash;
+        int saved = _find_saved(index, library->files[i], &st, &hash);
+        int result = saved ? 0 : _hash_file(index, fd, buf, &hash);
+        struct stat after;
+        if (result == 0 && !saved && (fstat(fd, &after) < 0 || after.st_size != st.st_size ||
+                            _mtime_ns(&after) != _mtime_ns(&st))) {
+            result = -1; // written to while it was hashed: hashed again on the next pass
+        }
+        close(fd);
+        if (result != 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&index->lock);
+        index->hashes[i] = (ContentHash){
+            .size = st.st_size,
+            .mtime = _mtime_ns(&st),
+            .hash = hash,
+            .known = 1,
+        };
+        pthread_mutex_unlock(&index->lock);
+        if (!saved) {
+            changed++;
+            #ifdef DEBUG
+            printf("Hashed file %u: %016" PRIx64 "\n", i, hash);
+            #endif
+        }
+    }
+    return changed;
+}
+
+
+/*
+** The hasher thread: go through the library whenever it is woken, until the
+** server quits.
+*/
+static void *_run_hasher(void *arg) {
+    ContentIndex *index = (ContentIndex *)arg;
+
+    // nice 19 and the idle I/O class, for this thread only: clients come first
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, 3 << 13 /* IOPRIO_CLASS_IDLE */);
+
+    uint8_t *buf = (uint8_t *)malloc(HASH_CHUNK_SIZE);
+    if (buf == NULL) {
+        perror("_run_hasher: malloc");
+        return NULL;
+    }
+
+    int first_pass = 1;
+    pthread_mutex_lock(&index->lock);
+    while (!atomic_load(&index->quit)) {
+        if (!first_pass && !index->stale &&
+            atomic_load_explicit(&index->shared->generation, memory_order_acquire) == index->generation) {
+            pthread_cond_wait(&index->wake, &index->lock);
+            continue;
+        }
+        index->stale = 0;
+        pthread_mutex_unlock(&index->lock);
+
+        unsigned int generation;
+        LibrarySnapshot *snapshot = _acquire_snapshot(index->shared, &generation);
+        uint32_t changed = _hash_library(index, &snapshot->library, buf);
+        // a new snapshot may have renamed or removed files, as well
+        if (changed > 0 || generation != index->generation) {
+            _save_hashes(index, &snapshot->library);
+        }
+        if (first_pass && !atomic_load(&index->quit)) {
+            _free_saved(index); // every file that had one is hashed
+            first_pass = 0;
+        }
+        #ifdef DEBUG
+        printf("Content index: hashed %u files\n", changed);
+        #endif
+        _release_snapshot(snapshot);
+
+        pthread_mutex_lock(&index->lock);
+        index->generation = generation;
+    }
+    pthread_mutex_unlock(&index->lock);
+
+    free(buf);
+    return NULL;
+}
+
+
+int content_index_init(ContentIndex *index, SharedLibrary *shared, const char *library_path) {
+    memset(index, 0, sizeof(*index));
+    pthread_mutex_init(&index->lock, NULL);
+    pthread_cond_init(&index->wake, NULL);
+    atomic_init(&index->quit, 0);
+    index->shared = shared;
+
+    index->library_fd = open(library_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (index->library_fd < 0) {
+        perror("content_index_init: open");
+        return -1;
+    }
+    index->save_path = _join_path(library_path, HASH_INDEX_FILENAME);
+    if (index->save_path == NULL) {
+        close(index->library_fd);
+        return -1;
+    }
+
+    _load_hashes(index);
+    return 0;
+}
+
+
+int content_index_start(ContentIndex *index) {
+    int error = pthread_create(&index->thread, NULL, _run_hasher, index);
+    if (error != 0) {
+        ERR_PRINT("content_index_start: pthread_create: %s\n", strerror(error));
+        return -1;
+    }
+    index->running = 1;
+    return 0;
+}
+
+
+void content_index_wake(ContentIndex *index) {
+    pthread_mutex_lock(&index->lock);
+    pthread_cond_signal(&index->wake);
+    pthread_mutex_unlock(&index->lock);
+}
+
+
+HashStatus content_lookup(ContentIndex *index, const Library *library, uint32_t file_index,
+                          uint64_t *size, uint64_t *hash) {
+    *size = 0;
+    *hash = 0;
+    if (file_index >= library->num_files || library->files[file_index] == NULL) {
+        return HASH_MISSING;
+    }
+    struct stat st;
+    if (fstatat(index->library_fd, library->files[file_index], &st, 0) < 0) {
+        return HASH_MISSING;
+    }
+    *size = st.st_size;
+
+    HashStatus status = HASH_PENDING;
+    pthread_mutex_lock(&index->lock);
+    const ContentHash *entry = file_index < index->num_hashes ? &index->hashes[file_index] : NULL;
+    if (entry != NULL && entry->known && entry->size == (uint64_t)st.st_size &&
+        entry->mtime == _mtime_ns(&st)) {
+        *hash = entry->hash;
+        status = HASH_KNOWN;
+    } else {
+        // not hashed yet, or changed in place (which publishes no new snapshot)
+        index->stale = 1;
+        pthread_cond_signal(&index->wake);
+    }
+    pthread_mutex_unlock(&index->lock);
+    return status;
+}
+
+
+void content_index_free(ContentIndex *index) {
+    if (index->running) {
+        pthread_mutex_lock(&index->lock);
+        atomic_store(&index->quit, 1);
+        pthread_cond_signal(&index->wake);
+        pthread_mutex_unlock(&index->lock);
+        pthread_join(index->thread, NULL);
+        index->running = 0;
+    }
+
+    _free_saved(index);
+    free(index->hashes);
+    free(index->save_path);
+    close(index->library_fd);
+    pthread_cond_destroy(&index->wake);
+    pthread_mutex_destroy(&index->lock);
+}
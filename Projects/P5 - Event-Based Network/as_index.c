@@ -0,0 +1,1065 @@
+#include "as_index.h"
+
+#include <sys/mman.h>
+
+
+// FNV-1a
+static uint64_t _hash_path(const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *path != '\0'; path++) {
+        hash = (hash ^ (uint8_t)*path) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+static uint64_t _hash_inode(ino_t inode) {
+    uint64_t hash = (uint64_t)inode * 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 32);
+}
+
+
+static uint64_t _hash_of(const LibraryIndex *index, const SlotMap *map, uint32_t slot) {
+    if (map == &index->path_map) {
+        return _hash_path(index->library.files[slot]);
+    }
+    return _hash_inode(index->inodes[slot]);
+}
+
+
+static int _map_insert(LibraryIndex *index, SlotMap *map, uint32_t slot);
+
+
+/*
+** Double the map's buckets (it starts with 1024), keeping it at most half full.
+**
+** return 0 on success, -1 on error
+*/
+static int _map_grow(LibraryIndex *index, SlotMap *map) {
+    uint32_t *old_buckets = map->buckets;
+    size_t old_capacity = map->capacity;
+
+    map->capacity = old_capacity > 0 ? old_capacity * 2 : 1024;
+    map->buckets = (uint32_t *)calloc(map->capacity, sizeof(uint32_t));
+    if (map->buckets == NULL) {
+        perror("_map_grow: calloc");
+        map->buckets = old_buckets;
+        map->capacity = old_capacity;
+        return -1;
+    }
+    map->count = 0;
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_buckets[i] != 0) {
+            _map_insert(index, map, old_buckets[i] - 1);
+        }
+    }
+    free(old_buckets);
+    return 0;
+}
+
+
+static int _map_insert(LibraryIndex *index, SlotMap *map, uint32_t slot) {
+    if ((map->count + 1) * 2 > map->capacity && _map_grow(index, map) < 0) {
+        return -1;
+    }
+
+    size_t mask = map->capacity - 1;
+    size_t i = _hash_of(index, map, slot) & mask;
+    while (map->buckets[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    map->buckets[i] = slot + 1;
+    map->count++;
+    return 0;
+}
+
+
+/*
+** Take slot out of the map (if it is there), shifting back the entries after
+** it that would otherwise no longer be found. Must be called before the key
+** the slot was inserted with changes.
+*/
+static void _map_remove(LibraryIndex *index, SlotMap *map, uint32_t slot) {
+    if (map->capacity == 0) {
+        return;
+    }
+
+    size_t mask = map->capacity - 1;
+    size_t i = _hash_of(index, map, slot) & mask;
+    while (map->buckets[i] != slot + 1) {
+        if (map->buckets[i] == 0) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (map->buckets[j] == 0) {
+            break;
+        }
+        size_t home = _hash_of(index, map, map->buckets[j] - 1) & mask;
+        // move j into the hole at i unless its home lies cyclically in (i, j]
+        int home_between = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+        if (!home_between) {
+            map->buckets[i] = map->buckets[j];
+            i = j;
+        }
+    }
+    map->buckets[i] = 0;
+    map->count--;
+}
+
+
+// Index of the file at path, or -1
+static long _find_path(const LibraryIndex *index, const char *path) {
+    const SlotMap *map = &index->path_map;
+    if (map->capacity == 0) {
+        return -1;
+    }
+    size_t mask = map->capacity - 1;
+    for (size_t i = _hash_path(path) & mask; map->buckets[i] != 0; i = (i + 1) & mask) {
+        uint32_t slot = map->buckets[i] - 1;
+        if (strcmp(index->library.files[slot], path) == 0) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+
+// Index of a file with this inode, or -1
+static long _find_inode(const LibraryIndex *index, ino_t inode) {
+    const SlotMap *map = &index->inode_map;
+    if (map->capacity == 0) {
+        return -1;
+    }
+    size_t mask = map->capacity - 1;
+    for (size_t i = _hash_inode(inode) & mask; map->buckets[i] != 0; i = (i + 1) & mask) {
+        uint32_t slot = map->buckets[i] - 1;
+        if (index->inodes[slot] == inode) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+
+// Free a path the index owns, unless it is in the first scan's arena or was loaded
+static void _free_path(LibraryIndex *index, char *path) {
+    int loaded = index->saved != NULL && path >= index->saved && path < index->saved + index->saved_size;
+    if (!loaded && !arena_owns(&index->paths, path)) {
+        free(path);
+    }
+}
+
+
+// The watch wd, NULL if the index has no such watch
+static IndexWatch *_watch(LibraryIndex *index, int wd) {
+    return wd >= 0 && wd < index->num_watches && index->watches[wd].dir != NULL ? &index->watches[wd] : NULL;
+}
+
+
+// Take the file at slot out of its watch's list
+static void _unlink_file(LibraryIndex *index, uint32_t slot) {
+    IndexLink *link = &index->links[slot];
+    if (link->watch < 0) {
+        return;
+    }
+    if (link->prev != 0) {
+        index->links[link->prev - 1].next = link->next;
+    } else {
+        index->watches[link->watch].first_file = link->next;
+    }
+    if (link->next != 0) {
+        index->links[link->next - 1].prev = link->prev;
+    }
+    link->watch = -1;
+    link->next = link->prev = 0;
+}
+
+
+// Put the file at slot in the list of the watch wd (in none if there is no such watch)
+static void _link_file(LibraryIndex *index, uint32_t slot, int wd) {
+    if (index->links[slot].watch == wd) {
+        return;
+    }
+    _unlink_file(index, slot);
+    IndexWatch *watch = _watch(index, wd);
+    if (watch == NULL) {
+        return;
+    }
+    IndexLink *link = &index->links[slot];
+    link->watch = wd;
+    link->next = watch->first_file;
+    if (watch->first_file != 0) {
+        index->links[watch->first_file - 1].prev = slot + 1;
+    }
+    watch->first_file = slot + 1;
+}
+
+
+// Take the watch wd out of its parent's list of subdirectories
+static void _unlink_watch(LibraryIndex *index, int wd) {
+    IndexWatch *watch = &index->watches[wd];
+    if (watch->prev_sibling >= 0) {
+        index->watches[watch->prev_sibling].next_sibling = watch->next_sibling;
+    } else if (watch->parent >= 0) {
+        index->watches[watch->parent].first_child = watch->next_sibling;
+    }
+    if (watch->next_sibling >= 0) {
+        index->watches[watch->next_sibling].prev_sibling = watch->prev_sibling;
+    }
+    watch->parent = watch->next_sibling = watch->prev_sibling = -1;
+}
+
+
+// Make the watch wd a subdirectory of the watch parent (of none if there is no such watch)
+static void _link_watch(LibraryIndex *index, int wd, int parent) {
+    _unlink_watch(index, wd);
+    IndexWatch *dir = _watch(index, parent);
+    if (dir == NULL || parent == wd) {
+        return;
+    }
+    IndexWatch *watch = &index->watches[wd];
+    watch->parent = parent;
+    watch->next_sibling = dir->first_child;
+    if (dir->first_child >= 0) {
+        index->watches[dir->first_child].prev_sibling = wd;
+    }
+    dir->first_child = wd;
+}
+
+
+// Forget the watch wd, leaving its files and subdirectories' watches in no list
+static void _drop_watch(LibraryIndex *index, int wd) {
+    IndexWatch *watch = &index->watches[wd];
+    while (watch->first_file != 0) {
+        _unlink_file(index, watch->first_file - 1);
+    }
+    while (watch->first_child >= 0) {
+        _unlink_watch(index, watch->first_child);
+    }
+    _unlink_watch(index, wd);
+    free(watch->dir);
+    watch->dir = NULL;
+}
+
+
+// The watch of the subdirectory dir of the watch parent, or -1
+static int _find_child(LibraryIndex *index, int parent, const char *dir) {
+    IndexWatch *watch = _watch(index, parent);
+    for (int child = watch != NULL ? watch->first_child : -1; child >= 0;
+         child = index->watches[child].next_sibling) {
+        if (strcmp(index->watches[child].dir, dir) == 0) {
+            return child;
+        }
+    }
+    return -1;
+}
+
+
+/*
+** Give a new file the next index, in the directory of the watch wd. If
+** interned, path is in the index's arena and is used as is; otherwise it is
+** copied.
+**
+** return 0 on success, -1 on error
+*/
+static int _add_file(LibraryIndex *index, const char *path, ino_t inode, int interned, int wd) {
+    if (index->library.num_files == index->capacity) {
+        uint32_t capacity = index->capacity > 0 ? index->capacity * 2 : 64;
+        char **files = (char **)realloc(index->library.files, capacity * sizeof(char *));
+        if (files == NULL) {
+            perror("_add_file: realloc");
+            return -1;
+        }
+        index->library.files = files;
+        ino_t *inodes = (ino_t *)realloc(index->inodes, capacity * sizeof(ino_t));
+        if (inodes == NULL) {
+            perror("_add_file: realloc");
+            return -1;
+        }
+        index->inodes = inodes;
+        IndexLink *links = (IndexLink *)realloc(index->links, capacity * sizeof(IndexLink));
+        if (links == NULL) {
+            perror("_add_file: realloc");
+            return -1;
+        }
+        index->links = links;
+        index->capacity = capacity;
+    }
+
+    char *copy = interned ? (char *)path : strdup(path);
+    if (copy == NULL) {
+        perror("_add_file: strdup");
+        return -1;
+    }
+
+    uint32_t slot = index->library.num_files++;
+    index->library.files[slot] = copy;
+    index->inodes[slot] = inode;
+    index->links[slot] = (IndexLink){.watch = -1};
+    _link_file(index, slot, wd);
+    if (_map_insert(index, &index->path_map, slot) < 0) {
+        return -1;
+    }
+    // hard links share an inode; the first one found is the one renames are matched to
+    if (_find_inode(index, inode) < 0 && _map_insert(index, &index->inode_map, slot) < 0) {
+        return -1;
+    }
+
+    #ifdef DEBUG
+    printf("Library index: %u is %s\n", slot, path);
+    #endif
+    index->changed = 1;
+    return 0;
+}
+
+
+static void _remove_file(LibraryIndex *index, uint32_t slot) {
+    #ifdef DEBUG
+    printf("Library index: %u (%s) removed\n", slot, index->library.files[slot]);
+    #endif
+    _map_remove(index, &index->path_map, slot);
+    _map_remove(index, &index->inode_map, slot);
+    _unlink_file(index, slot);
+    _free_path(index, index->library.files[slot]);
+    index->library.files[slot] = NULL;
+    index->changed = 1;
+}
+
+
+/*
+** Give the file at slot a new path, replacing any other file at that path.
+**
+** return 0 on success, -1 on error
+*/
+static int _rename_file(LibraryIndex *index, uint32_t slot, const char *path) {
+    long existing = _find_path(index, path);
+    if (existing == slot) {
+        return 0;
+    }
+    if (existing >= 0) {
+        _remove_file(index, existing);
+    }
+
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        perror("_rename_file: strdup");
+        return -1;
+    }
+    _map_remove(index, &index->path_map, slot);
+    _free_path(index, index->library.files[slot]);
+    index->library.files[slot] = copy;
+
+    #ifdef DEBUG
+    printf("Library index: %u renamed to %s\n", slot, path);
+    #endif
+    index->changed = 1;
+    return _map_insert(index, &index->path_map, slot);
+}
+
+
+/*
+** A supported file was found at path, in the directory of the watch wd, by a
+** scan. It keeps its index if it is at the same path, or has the inode of a
+** file the scan has not found yet (it was renamed); otherwise it is new.
+**
+** seen: files found so far by a rescan, by index (NULL for a first scan), for
+**       the num_seen files the index had when it began.
+** interned: the path is in the index's arena (see _add_file).
+**
+** return 0 on success, -1 on error
+*/
+static int _found_file(LibraryIndex *index, const char *path, ino_t inode, int wd,
+                       uint8_t *seen, uint32_t num_seen, int interned) {
+    long slot = _find_path(index, path);
+    if (slot >= 0) {
+        if (index->inodes[slot] != inode) {
+            // replaced by a different file with the same name
+            _map_remove(index, &index->inode_map, slot);
+            index->inodes[slot] = inode;
+            if (_find_inode(index, inode) < 0 && _map_insert(index, &index->inode_map, slot) < 0) {
+                return -1;
+            }
+        }
+    } else {
+        slot = _find_inode(index, inode);
+        if (slot >= 0 && seen != NULL && slot < num_seen && !seen[slot]) {
+            if (_rename_file(index, slot, path) < 0) {
+                return -1;
+            }
+        } else {
+            return _add_file(index, path, inode, interned, wd);
+        }
+    }
+    _link_file(index, slot, wd);
+
+    if (seen != NULL && slot < num_seen) {
+        seen[slot] = 1;
+    }
+    return 0;
+}
+
+
+static void _stop_watching(LibraryIndex *index) {
+    if (index->inotify_fd >= 0) {
+        close(index->inotify_fd);
+        index->inotify_fd = -1;
+    }
+    for (int i = 0; i < index->num_watches; i++) {
+        free(index->watches[i].dir);
+    }
+    free(index->watches);
+    index->watches = NULL;
+    index->num_watches = 0;
+    for (uint32_t slot = 0; index->links != NULL && slot < index->library.num_files; slot++) {
+        index->links[slot] = (IndexLink){.watch = -1};
+    }
+}
+
+
+/*
+** Record that the watch wd is on the directory dir (relative to the library),
+** a subdirectory of the watch parent (-1 for the library's root).
+**
+** return 0 on success, -1 on error
+*/
+static int _add_watch(LibraryIndex *index, int wd, const char *dir, int parent) {
+    if (wd >= index->num_watches) {
+        int num_watches = index->num_watches > 0 ? index->num_watches * 2 : 64;
+        while (num_watches <= wd) {
+            num_watches *= 2;
+        }
+        IndexWatch *watches = (IndexWatch *)realloc(index->watches, num_watches * sizeof(IndexWatch));
+        if (watches == NULL) {
+            perror("_add_watch: realloc");
+            return -1;
+        }
+        for (int i = index->num_watches; i < num_watches; i++) {
+            watches[i] = (IndexWatch){.parent = -1, .first_child = -1, .next_sibling = -1, .prev_sibling = -1};
+        }
+        index->watches = watches;
+        index->num_watches = num_watches;
+    }
+
+    char *copy = strdup(dir);
+    if (copy == NULL) {
+        perror("_add_watch: strdup");
+        return -1;
+    }
+    // watching the same directory again keeps its lists
+    free(index->watches[wd].dir);
+    index->watches[wd].dir = copy;
+    _link_watch(index, wd, parent);
+    return 0;
+}
+
+
+/*
+** Apply a scanned directory (a subdirectory of the watch parent) to the index,
+** depth first, so its files are found in readdir order.
+**
+** return 0 on success, -1 on error
+*/
+static int _apply_scan(LibraryIndex *index, const ScanDir *dir, int parent, uint8_t *seen, uint32_t num_seen,
+                       int interned) {
+    if (dir->wd >= 0 && index->inotify_fd >= 0 && _add_watch(index, dir->wd, dir->path, parent) < 0) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < dir->num_entries; i++) {
+        const ScanEntry *entry = &dir->entries[i];
+        int result;
+        if (entry->dir == NULL) {
+            result = _found_file(index, entry->path, entry->inode, dir->wd, seen, num_seen, interned);
+        } else {
+            #ifdef DEBUG
+            printf("Library scan descending into directory: %s\n", entry->path);
+            #endif
+            result = _apply_scan(index, entry->dir, dir->wd, seen, num_seen, interned);
+        }
+        if (result < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+** Scan the directory dir (relative to the library, "" for its root; in the
+** directory of the watch parent) and everything below it (see scan_tree),
+** watching each directory, and apply it to the index. The first scan of the library keeps the scan's paths, in the
+** index's arena; later scans copy the paths of the files they add.
+**
+** A directory that is gone by the time it is scanned is not an error, except
+** for the first scan.
+**
+** return 0 on success, -1 on error
+*/
+static int _walk(LibraryIndex *index, const char *dir, int parent, uint8_t *seen, uint32_t num_seen,
+                 int first_scan) {
+    ScanTree tree;
+    if (scan_tree(&tree, index->library.path, dir, index->inotify_fd, INDEX_WATCH_MASK, SCAN_THREADS) < 0) {
+        if (!first_scan && (errno == ENOENT || errno == ENOTDIR)) {
+            return 0;
+        }
+        perror("scan_library");
+        return -1;
+    }
+
+    if (first_scan) {
+        arena_append(&index->paths, &tree.arena);
+    }
+    int result = _apply_scan(index, tree.root, parent, seen, num_seen, first_scan);
+
+    if (tree.watch_limit_reached && index->inotify_fd >= 0) {
+        fprintf(stderr, "Too many directories to watch the library with inotify "
+                        "(see /proc/sys/fs/inotify/max_user_watches); rescanning it periodically instead\n");
+        _stop_watching(index);
+    }
+    scan_tree_free(&tree);
+    return result;
+}
+
+
+/*
+** Set up an empty index of the library at path.
+**
+** return 0 on success, -1 on error
+*/
+static int _init_index(LibraryIndex *index, const char *path, int watch) {
+    memset(index, 0, sizeof(*index));
+    index->library.path = path;
+    index->inotify_fd = -1;
+
+    index->save_path = _join_path(path, INDEX_SAVE_FILENAME);
+    if (index->save_path == NULL) {
+        return -1;
+    }
+
+    if (watch) {
+        index->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (index->inotify_fd < 0) {
+            perror("index_init: inotify_init1");
+        }
+    }
+    return 0;
+}
+
+
+int index_init(LibraryIndex *index, const char *path, int watch) {
+    if (_init_index(index, path, watch) < 0 || _walk(index, "", -1, NULL, 0, 1) < 0) {
+        index_free(index);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Map the saved index file and check that it is whole: the header, the sizes
+** and the checksum.
+**
+** return the header (at the start of the mapping, of *size bytes), NULL if
+** there is no usable saved index
+*/
+static const SavedIndexHeader *_map_saved(const char *save_path, size_t *size) {
+    int fd = open(save_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Cannot read library index from %s: %s\n", save_path, strerror(errno));
+        }
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(SavedIndexHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    *size = info.st_size;
+    void *mapping = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("index_load: mmap");
+        return NULL;
+    }
+
+    const SavedIndexHeader *header = (const SavedIndexHeader *)mapping;
+    uint64_t files_size = (uint64_t)header->num_files * sizeof(SavedFile);
+    const char *paths = (const char *)mapping + sizeof(SavedIndexHeader) + files_size;
+    int valid = memcmp(header->magic, INDEX_SAVE_MAGIC, sizeof(header->magic)) == 0 &&
+                header->version == INDEX_SAVE_VERSION &&
+                sizeof(SavedIndexHeader) + files_size + header->paths_size == *size &&
+                // so every path is terminated
+                (header->paths_size == 0 || paths[header->paths_size - 1] == '\0');
+    if (valid) {
+        Xxh64State state;
+        xxh64_init(&state);
+        xxh64_update(&state, (const char *)mapping + sizeof(SavedIndexHeader), *size - sizeof(SavedIndexHeader));
+        valid = xxh64_digest(&state) == header->checksum;
+    }
+    if (!valid) {
+        fprintf(stderr, "Library index %s is damaged or out of date, scanning the library\n", save_path);
+        munmap(mapping, *size);
+        return NULL;
+    }
+    return header;
+}
+
+
+int index_load(LibraryIndex *index, const char *path, int watch) {
+    if (_init_index(index, path, watch) < 0) {
+        index_free(index);
+        return -1;
+    }
+    const SavedIndexHeader *header = _map_saved(index->save_path, &index->saved_size);
+    if (header == NULL) {
+        index_free(index);
+        return -1;
+    }
+    index->saved = (const char *)header;
+
+    const SavedFile *files = (const SavedFile *)(index->saved + sizeof(SavedIndexHeader));
+    const char *paths = (const char *)(files + header->num_files);
+    uint32_t num_files = header->num_files;
+    index->capacity = num_files > 0 ? num_files : 64;
+    index->library.files = (char **)malloc(index->capacity * sizeof(char *));
+    index->inodes = (ino_t *)malloc(index->capacity * sizeof(ino_t));
+    index->links = (IndexLink *)malloc(index->capacity * sizeof(IndexLink));
+    if (index->library.files == NULL || index->inodes == NULL || index->links == NULL) {
+        perror("index_load: malloc");
+        index_free(index);
+        return -1;
+    }
+
+    for (uint32_t slot = 0; slot < num_files; slot++) {
+        index->links[slot] = (IndexLink){.watch = -1}; // until the rescan finds it
+        const char *file_path = files[slot].path < header->paths_size ? paths + files[slot].path : NULL;
+        // a hole, or a path it has already (which a saved index never has)
+        if (file_path == NULL || *file_path == '\0' || _find_path(index, file_path) >= 0) {
+            index->library.files[slot] = NULL;
+            index->inodes[slot] = 0;
+            index->library.num_files++;
+            continue;
+        }
+
+        index->library.files[slot] = (char *)file_path;
+        index->inodes[slot] = files[slot].inode;
+        index->library.num_files++;
+        if (_map_insert(index, &index->path_map, slot) < 0 ||
+            (_find_inode(index, files[slot].inode) < 0 && _map_insert(index, &index->inode_map, slot) < 0)) {
+            index_free(index);
+            return -1;
+        }
+    }
+
+    printf("Loaded library index of %u files from %s\n", num_files, index->save_path);
+    return 0;
+}
+
+
+void index_save(LibraryIndex *index) {
+    size_t tmp_len = strlen(index->save_path) + sizeof(".tmp");
+    char *tmp_path = (char *)malloc(tmp_len);
+    if (tmp_path == NULL) {
+        perror("index_save: malloc");
+        return;
+    }
+    snprintf(tmp_path, tmp_len, "%s.tmp", index->save_path);
+
+    SavedIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_SAVE_MAGIC, sizeof(header.magic));
+    header.version = INDEX_SAVE_VERSION;
+    header.num_files = index->library.num_files;
+
+    Xxh64State state;
+    xxh64_init(&state);
+    FILE *file = fopen(tmp_path, "w");
+    // the header is written again once the checksum is known
+    int failed = file == NULL || fwrite(&header, sizeof(header), 1, file) != 1;
+    for (uint32_t slot = 0; !failed && slot < index->library.num_files; slot++) {
+        const char *path = index->library.files[slot];
+        SavedFile saved = {.inode = path != NULL ? index->inodes[slot] : 0,
+                           .path = path != NULL ? header.paths_size : INDEX_SAVED_HOLE};
+        header.paths_size += path != NULL ? strlen(path) + 1 : 0;
+        xxh64_update(&state, &saved, sizeof(saved));
+        failed = fwrite(&saved, sizeof(saved), 1, file) != 1;
+    }
+    for (uint32_t slot = 0; !failed && slot < index->library.num_files; slot++) {
+        const char *path = index->library.files[slot];
+        if (path != NULL) {
+            size_t len = strlen(path) + 1;
+            xxh64_update(&state, path, len);
+            failed = fwrite(path, len, 1, file) != 1;
+        }
+    }
+    if (!failed) {
+        header.checksum = xxh64_digest(&state);
+        failed = fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1;
+    }
+    if (file != NULL && fclose(file) != 0) {
+        failed = 1;
+    }
+    // the loaded index stays mapped: its file lives on until it is unmapped
+    if (!failed && rename(tmp_path, index->save_path) < 0) {
+        failed = 1;
+    }
+
+    if (failed) {
+        if (!index->save_failed) {
+            fprintf(stderr, "Cannot save library index to %s: %s (the next run will scan the library)\n",
+                    index->save_path, strerror(errno));
+            index->save_failed = 1;
+        }
+        unlink(tmp_path);
+    } else {
+        index->save_failed = 0;
+    }
+    free(tmp_path);
+}
+
+
+int index_rescan(LibraryIndex *index) {
+    uint32_t num_seen = index->library.num_files;
+    uint8_t *seen = (uint8_t *)calloc(num_seen > 0 ? num_seen : 1, sizeof(uint8_t));
+    if (seen == NULL) {
+        perror("index_rescan: calloc");
+        return -1;
+    }
+
+    int result = _walk(index, "", -1, seen, num_seen, 0);
+    if (result == 0) {
+        for (uint32_t slot = 0; slot < num_seen; slot++) {
+            if (index->library.files[slot] != NULL && !seen[slot]) {
+                _remove_file(index, slot);
+            }
+        }
+    }
+
+    free(seen);
+    return result;
+}
+
+
+/*
+** Replace the from prefix of *path with to.
+**
+** return 0 on success, -1 on error
+*/
+static int _replace_prefix(char **path, const char *from, const char *to) {
+    const char *rest = *path + strlen(from);
+    char *moved = (char *)malloc(strlen(to) + strlen(rest) + 1);
+    if (moved == NULL) {
+        perror("_replace_prefix: malloc");
+        return -1;
+    }
+    strcpy(moved, to);
+    strcat(moved, rest);
+    free(*path);
+    *path = moved;
+    return 0;
+}
+
+
+// A file appeared at path, in the directory of the watch wd: add it if it is a supported regular file and new
+static int _add_file_at(LibraryIndex *index, const char *path, int wd) {
+    if (!_is_file_extension_supported(path) || _find_path(index, path) >= 0) {
+        return 0;
+    }
+
+    char *full_path = _join_path(index->library.path, path);
+    if (full_path == NULL) {
+        return -1;
+    }
+    struct stat file_info;
+    int found = lstat(full_path, &file_info) == 0 && S_ISREG(file_info.st_mode);
+    free(full_path);
+
+    return found ? _add_file(index, path, file_info.st_ino, 0, wd) : 0;
+}
+
+
+// The file at from moved to to, in the directory of the watch wd
+static int _move_file(LibraryIndex *index, const char *from, const char *to, int wd) {
+    long slot = _find_path(index, from);
+    if (slot < 0) {
+        return _add_file_at(index, to, wd); // e.g. renamed to a supported extension
+    }
+    if (!_is_file_extension_supported(to)) {
+        _remove_file(index, slot);
+        return 0;
+    }
+    if (_rename_file(index, slot, to) < 0) {
+        return -1;
+    }
+    _link_file(index, slot, wd);
+    return 0;
+}
+
+
+/*
+** The directory of the watch wd moved from from to to: rename the files in it
+** and below it, through the watches' lists, and the watches themselves (they
+** stay on the same directories).
+**
+** return 0 on success, -1 on error
+*/
+static int _rename_watch(LibraryIndex *index, int wd, const char *from, const char *to) {
+    if (_replace_prefix(&index->watches[wd].dir, from, to) < 0) {
+        return -1;
+    }
+    for (uint32_t next = index->watches[wd].first_file; next != 0;) {
+        uint32_t slot = next - 1;
+        next = index->links[slot].next;
+        char *path = strdup(index->library.files[slot]);
+        if (path == NULL || _replace_prefix(&path, from, to) < 0 || _rename_file(index, slot, path) < 0) {
+            free(path);
+            return -1;
+        }
+        free(path);
+    }
+    for (int child = index->watches[wd].first_child; child >= 0; child = index->watches[child].next_sibling) {
+        if (_rename_watch(index, child, from, to) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// The directory from (in the directory of the watch from_wd) moved to to (in that of to_wd)
+static int _move_directory(LibraryIndex *index, int from_wd, const char *from, int to_wd, const char *to) {
+    int wd = _find_child(index, from_wd, from);
+    if (wd < 0) {
+        return _walk(index, to, to_wd, NULL, 0, 0); // never watched, so nothing in it is indexed
+    }
+    _link_watch(index, wd, to_wd);
+    return _rename_watch(index, wd, from, to);
+}
+
+
+// Remove the files in and below the directory of the watch wd, and stop watching them
+static void _remove_watch(LibraryIndex *index, int wd) {
+    IndexWatch *watch = &index->watches[wd];
+    while (watch->first_file != 0) {
+        _remove_file(index, watch->first_file - 1);
+    }
+    while (watch->first_child >= 0) {
+        _remove_watch(index, watch->first_child);
+    }
+    inotify_rm_watch(index->inotify_fd, wd);
+    _drop_watch(index, wd);
+}
+
+
+/*
+** The pending move was not followed by its other half: what was moved left the
+** library, so remove it.
+*/
+static void _finish_pending_move(LibraryIndex *index) {
+    if (index->pending_move == NULL) {
+        return;
+    }
+
+    const char *from = index->pending_move;
+    if (!index->pending_is_dir) {
+        long slot = _find_path(index, from);
+        if (slot >= 0) {
+            _remove_file(index, slot);
+        }
+    } else {
+        int wd = _find_child(index, index->pending_wd, from);
+        if (wd >= 0) {
+            _remove_watch(index, wd);
+        }
+    }
+
+    free(index->pending_move);
+    index->pending_move = NULL;
+}
+
+
+/*
+** Apply one inotify event to the index.
+**
+** return 0 on success, -1 on error
+*/
+static int _handle_event(LibraryIndex *index, const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        _finish_pending_move(index);
+        printf("Library index: inotify queue overflowed, rescanning the library\n");
+        return index_rescan(index);
+    }
+    if (_watch(index, event->wd) == NULL) {
+        return 0; // a directory no longer in the library
+    }
+    if (event->mask & IN_IGNORED) {
+        _drop_watch(index, event->wd);
+        return 0;
+    }
+    if (event->len == 0) {
+        return 0;
+    }
+
+    // the two halves of a move are queued together
+    int completes_move = (event->mask & IN_MOVED_TO) && index->pending_move != NULL &&
+                         event->cookie == index->move_cookie;
+    if (!completes_move) {
+        _finish_pending_move(index);
+    }
+
+    char *path = _join_path(index->watches[event->wd].dir, event->name);
+    if (path == NULL) {
+        return -1;
+    }
+
+    int is_dir = (event->mask & IN_ISDIR) != 0;
+    int result = 0;
+    if (event->mask & IN_MOVED_FROM) {
+        index->pending_move = path;
+        index->pending_is_dir = is_dir;
+        index->pending_wd = event->wd;
+        index->move_cookie = event->cookie;
+        return 0;
+
+    } else if (event->mask & IN_MOVED_TO) {
+        if (completes_move) {
+            result = is_dir ? _move_directory(index, index->pending_wd, index->pending_move, event->wd, path)
+                            : _move_file(index, index->pending_move, path, event->wd);
+            free(index->pending_move);
+            index->pending_move = NULL;
+        } else {
+            result = is_dir ? _walk(index, path, event->wd, NULL, 0, 0) : _add_file_at(index, path, event->wd);
+        }
+
+    } else if (event->mask & IN_CREATE) {
+        // files are added once they have been written (IN_CLOSE_WRITE)
+        if (is_dir) {
+            result = _walk(index, path, event->wd, NULL, 0, 0);
+        }
+
+    } else if (event->mask & IN_CLOSE_WRITE) {
+        result = _add_file_at(index, path, event->wd);
+
+    } else if ((event->mask & IN_DELETE) && !is_dir) {
+        long slot = _find_path(index, path);
+        if (slot >= 0) {
+            _remove_file(index, slot);
+        }
+    }
+
+    free(path);
+    return result;
+}
+
+
+int index_process_events(LibraryIndex *index) {
+    char buf[INOTIFY_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (index->inotify_fd >= 0) {
+        ssize_t len = read(index->inotify_fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("index_process_events: read");
+            return -1;
+        }
+
+        for (char *ptr = buf; ptr < buf + len;) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            if (_handle_event(index, event) < 0) {
+                return -1;
+            }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    // nothing more is queued, so a move still pending went out of the library
+    _finish_pending_move(index);
+    return 0;
+}
+
+
+int index_copy_library(const LibraryIndex *index, Library *library, char **paths) {
+    library->path = index->library.path;
+    library->num_files = 0;
+    library->files = NULL;
+    *paths = NULL;
+    if (index->library.num_files == 0) {
+        return 0;
+    }
+
+    size_t bytes = 0;
+    for (uint32_t slot = 0; slot < index->library.num_files; slot++) {
+        if (index->library.files[slot] != NULL) {
+            bytes += strlen(index->library.files[slot]) + 1;
+        }
+    }
+
+    library->files = (char **)calloc(index->library.num_files, sizeof(char *));
+    *paths = (char *)malloc(bytes > 0 ? bytes : 1);
+    if (library->files == NULL || *paths == NULL) {
+        perror("index_copy_library: malloc");
+        free(library->files);
+        free(*paths);
+        library->files = NULL;
+        *paths = NULL;
+        return -1;
+    }
+    library->num_files = index->library.num_files;
+
+    char *out = *paths;
+    for (uint32_t slot = 0; slot < index->library.num_files; slot++) {
+        if (index->library.files[slot] != NULL) {
+            size_t len = strlen(index->library.files[slot]) + 1;
+            memcpy(out, index->library.files[slot], len);
+            library->files[slot] = out;
+            out += len;
+        }
+    }
+    return 0;
+}
+
+
+void index_free(LibraryIndex *index) {
+    _stop_watching(index);
+    for (uint32_t slot = 0; slot < index->library.num_files; slot++) {
+        if (index->library.files[slot] != NULL) {
+            _free_path(index, index->library.files[slot]);
+        }
+    }
+    free(index->library.files);
+    index->library.files = NULL;
+    index->library.num_files = 0;
+    arena_free(&index->paths);
+
+    free(index->inodes);
+    free(index->links);
+    free(index->path_map.buckets);
+    free(index->inode_map.buckets);
+    free(index->pending_move);
+    index->inodes = NULL;
+    index->links = NULL;
+    index->path_map.buckets = index->inode_map.buckets = NULL;
+    index->path_map.capacity = index->inode_map.capacity = 0;
+    index->pending_move = NULL;
+    index->capacity = 0;
+
+    if (index->saved != NULL) {
+        munmap((void *)index->saved, index->saved_size);
+        index->saved = NULL;
+    }
+    free(index->save_path);
+    index->save_path = NULL;
+}
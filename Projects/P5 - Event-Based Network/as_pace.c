@@ -0,0 +1,338 @@
+#include "as_pace.h"
+
+// Bytes of a file's header read to find its bitrate
+#define PROBE_SIZE 4096
+// Frames that must follow what looks like an MP3's first, for it to be one
+#define MP3_FRAMES_CHECKED 2
+
+
+uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+
+void bucket_init(TokenBucket *bucket, uint64_t rate, uint64_t burst, uint64_t now) {
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->tokens = burst;
+    bucket->updated = now;
+}
+
+
+uint64_t bucket_available(TokenBucket *bucket, uint64_t now) {
+    if (bucket->rate == 0) {
+        return UINT64_MAX;
+    }
+
+    if (now > bucket->updated) {
+        bucket->tokens += (double)(now - bucket->updated) * bucket->rate / NS_PER_SEC;
+        if (bucket->tokens > bucket->burst) {
+            bucket->tokens = bucket->burst;
+        }
+        bucket->updated = now;
+    }
+    return bucket->tokens > 0 ? (uint64_t)bucket->tokens : 0;
+}
+
+
+void bucket_take(TokenBucket *bucket, uint64_t bytes) {
+    if (bucket->rate != 0) {
+        bucket->tokens -= bytes;
+    }
+}
+
+
+uint64_t bucket_delay(const TokenBucket *bucket, uint64_t bytes) {
+    if (bucket->rate == 0 || bucket->tokens >= bytes) {
+        return 0;
+    }
+    // a bucket never holds more than burst, so waiting for more than that is waiting for all of it
+    double wanted = MIN((double)bytes, (double)bucket->burst);
+    return (uint64_t)((wanted - bucket->tokens) * NS_PER_SEC / bucket->rate) + 1;
+}
+
+
+static uint64_t _tick_of(uint64_t ns) {
+    return ns / (WHEEL_TICK_MS * NS_PER_MS);
+}
+
+
+void wheel_init(TimerWheel *wheel, uint64_t now) {
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+        wheel->slots[i].prev = wheel->slots[i].next = &wheel->slots[i];
+    }
+    wheel->tick = _tick_of(now);
+    wheel->num_armed = 0;
+}
+
+
+void wheel_add(TimerWheel *wheel, Timer *timer, void *owner, uint64_t expires) {
+    wheel_remove(wheel, timer);
+
+    // rounded up, so a timer never fires early
+    uint64_t tick = _tick_of(expires + WHEEL_TICK_MS * NS_PER_MS - 1);
+    if (tick < wheel->tick) {
+        tick = wheel->tick;
+    }
+
+    Timer *slot = &wheel->slots[tick % WHEEL_SLOTS];
+    timer->expires = tick;
+    timer->owner = owner;
+    timer->prev = slot->prev;
+    timer->next = slot;
+    slot->prev->next = timer;
+    slot->prev = timer;
+    timer->armed = 1;
+    wheel->num_armed++;
+}
+
+
+void wheel_remove(TimerWheel *wheel, Timer *timer) {
+    if (!timer->armed) {
+        return;
+    }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+    timer->armed = 0;
+    wheel->num_armed--;
+}
+
+
+Timer *wheel_expire(TimerWheel *wheel, uint64_t now) {
+    uint64_t now_tick = _tick_of(now);
+    Timer *expired = NULL;
+    Timer **tail = &expired;
+
+    // after a whole turn every slot has been looked at, however long it has been
+    for (uint64_t tick = wheel->tick, turns = 0;
+         tick <= now_tick && turns < WHEEL_SLOTS && wheel->num_armed > 0; tick++, turns++) {
+        Timer *slot = &wheel->slots[tick % WHEEL_SLOTS];
+        Timer *timer = slot->next;
+        while (timer != slot) {
+            Timer *next = timer->next;
+            if (timer->expires <= now_tick) {
+                wheel_remove(wheel, timer);
+                *tail = timer;
+                tail = &timer->next;
+            }
+            timer = next;
+        }
+    }
+    *tail = NULL;
+
+    if (now_tick >= wheel->tick) {
+        wheel->tick = now_tick + 1;
+    }
+    return expired;
+}
+
+
+int wheel_timeout_ms(const TimerWheel *wheel, uint64_t now, int max_ms) {
+    if (wheel->num_armed == 0) {
+        return max_ms;
+    }
+
+    // the first slot ahead with a timer due on this turn of the wheel
+    uint64_t next_tick = wheel->tick + WHEEL_SLOTS;
+    for (uint64_t tick = wheel->tick; tick < wheel->tick + WHEEL_SLOTS; tick++) {
+        const Timer *slot = &wheel->slots[tick % WHEEL_SLOTS];
+        const Timer *timer;
+        for (timer = slot->next; timer != slot && timer->expires != tick; timer = timer->next) {
+        }
+        if (timer != slot) {
+            next_tick = tick;
+            break;
+        }
+    }
+
+    uint64_t due = next_tick * WHEEL_TICK_MS * NS_PER_MS;
+    if (due <= now) {
+        return 0;
+    }
+    uint64_t ms = (due - now + NS_PER_MS - 1) / NS_PER_MS;
+    return ms < (uint64_t)max_ms ? (int)ms : max_ms;
+}
+
+
+/*
+** Read up to len bytes of the file from offset.
+**
+** return the bytes read, 0 on error
+*/
+static size_t _read_at(int fd, uint64_t file_size, uint64_t offset, uint8_t *buf, size_t len) {
+    if (offset >= file_size) {
+        return 0;
+    }
+    len = MIN(len, file_size - offset);
+    ssize_t got = pread(fd, buf, len, offset);
+    return got > 0 ? (size_t)got : 0;
+}
+
+
+static uint32_t _le32(const uint8_t *p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+static uint32_t _be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+
+/*
+** A WAV's byte rate, from its "fmt " chunk.
+*/
+static uint64_t _wav_bitrate(const uint8_t *buf, size_t len) {
+    size_t offset = 12; // past "RIFF", the RIFF size and "WAVE"
+    while (offset + 8 <= len) {
+        uint32_t chunk_size = _le32(buf + offset + 4);
+        if (memcmp(buf + offset, "fmt ", 4) == 0) {
+            // format, channels and sample rate come before the byte rate
+            return chunk_size >= 16 && offset + 16 <= len ? _le32(buf + offset + 16) : 0;
+        }
+        offset += 8 + (uint64_t)chunk_size + (chunk_size & 1);
+    }
+    return 0;
+}
+
+
+/*
+** A FLAC's length over its duration, from its STREAMINFO block.
+*/
+static uint64_t _flac_bitrate(const uint8_t *buf, size_t len, uint64_t audio_size) {
+    // "fLaC", then STREAMINFO is the first metadata block, after its 4-byte header
+    if (len < 8 + 18 || (buf[4] & 0x7f) != 0) {
+        return 0;
+    }
+    const uint8_t *info = buf + 8;
+    uint32_t sample_rate = (uint32_t)info[10] << 12 | (uint32_t)info[11] << 4 | info[12] >> 4;
+    uint64_t total_samples = (uint64_t)(info[13] & 0x0f) << 32 | _be32(info + 14);
+    if (sample_rate == 0 || total_samples == 0) {
+        return 0;
+    }
+    return (uint64_t)((double)audio_size * sample_rate / total_samples);
+}
+
+
+/*
+** An MP3 frame header's fields, -1 in bitrate if it is not a valid header.
+*/
+typedef struct mp3_frame {
+    int bitrate; // kbit/s
+    int sample_rate;
+    int samples;
+    int length;
+    int side_info;
+} Mp3Frame;
+
+static Mp3Frame _mp3_frame(const uint8_t *h) {
+    static const short bitrates[2][3][15] = {
+        { // MPEG 1: layers I, II, III
+            {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+            {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+            {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+        },
+        { // MPEG 2 and 2.5
+            {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+            {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+            {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+        },
+    };
+    static const int sample_rates[3] = {44100, 48000, 32000};
+
+    Mp3Frame frame = {.bitrate = -1};
+    int version = (h[1] >> 3) & 3; // 3: MPEG 1, 2: MPEG 2, 0: MPEG 2.5
+    int layer = 3 - ((h[1] >> 1) & 3); // 0: layer I, 1: II, 2: III
+    int bitrate_index = h[2] >> 4;
+    int rate_index = (h[2] >> 2) & 3;
+    if (h[0] != 0xff || (h[1] & 0xe0) != 0xe0 || version == 1 || layer == 3 ||
+        bitrate_index == 0 || bitrate_index == 15 || rate_index == 3) {
+        return frame;
+    }
+
+    int mpeg1 = version == 3;
+    int mono = (h[3] >> 6) == 3;
+    int padding = (h[2] >> 1) & 1;
+    frame.bitrate = bitrates[!mpeg1][layer][bitrate_index];
+    frame.sample_rate = sample_rates[rate_index] >> (mpeg1 ? 0 : version == 2 ? 1 : 2);
+    frame.samples = layer == 0 ? 384 : (layer == 2 && !mpeg1) ? 576 : 1152;
+    if (layer == 0) {
+        frame.length = (12 * frame.bitrate * 1000 / frame.sample_rate + padding) * 4;
+    } else {
+        frame.length = frame.samples / 8 * frame.bitrate * 1000 / frame.sample_rate + padding;
+    }
+    frame.side_info = mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+    return frame;
+}
+
+
+/*
+** Whether the frame at offset is followed by MP3_FRAMES_CHECKED more of the
+** same version, layer and sample rate, as a real frame is: any two bytes can
+** look like the start of a frame.
+*/
+static int _mp3_frames_follow(const uint8_t *buf, size_t len, size_t offset, Mp3Frame frame) {
+    const uint8_t *first = buf + offset;
+    for (int i = 0; i < MP3_FRAMES_CHECKED; i++) {
+        offset += frame.length;
+        if (offset + 4 > len) {
+            return 0;
+        }
+        const uint8_t *h = buf + offset;
+        frame = _mp3_frame(h);
+        if (frame.bitrate < 0 || (h[1] & 0xfe) != (first[1] & 0xfe) || (h[2] & 0x0c) != (first[2] & 0x0c)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+** An MP3's bitrate, from its first frame, or its Xing header's frame count.
+*/
+static uint64_t _mp3_bitrate(const uint8_t *buf, size_t len, uint64_t audio_size) {
+    for (size_t offset = 0; offset + 4 <= len; offset++) {
+        Mp3Frame frame = _mp3_frame(buf + offset);
+        if (frame.bitrate < 0 || !_mp3_frames_follow(buf, len, offset, frame)) {
+            continue;
+        }
+
+        const uint8_t *xing = buf + offset + 4 + frame.side_info;
+        if (xing + 12 <= buf + len && (memcmp(xing, "Xing", 4) == 0 || memcmp(xing, "Info", 4) == 0) &&
+            (_be32(xing + 4) & 1) && _be32(xing + 8) > 0) {
+            double seconds = (double)_be32(xing + 8) * frame.samples / frame.sample_rate;
+            return (uint64_t)(audio_size / seconds);
+        }
+        return (uint64_t)frame.bitrate * 1000 / 8;
+    }
+    return 0;
+}
+
+
+uint64_t pace_probe_bitrate(int fd, uint64_t file_size) {
+    uint8_t buf[PROBE_SIZE];
+    uint64_t start = 0;
+    size_t len = _read_at(fd, file_size, 0, buf, sizeof(buf));
+
+    // an ID3v2 tag (cover art and all) may come before the audio
+    if (len >= 10 && memcmp(buf, "ID3", 3) == 0) {
+        uint32_t tag_size = (buf[6] & 0x7f) << 21 | (buf[7] & 0x7f) << 14 | (buf[8] & 0x7f) << 7 | (buf[9] & 0x7f);
+        start = 10 + (uint64_t)tag_size + ((buf[5] & 0x10) ? 10 : 0); // plus a footer, if it has one
+        len = _read_at(fd, file_size, start, buf, sizeof(buf));
+    }
+
+    if (len >= 12 && memcmp(buf, "RIFF", 4) == 0 && memcmp(buf + 8, "WAVE", 4) == 0) {
+        return _wav_bitrate(buf, len);
+    }
+    if (len >= 4 && memcmp(buf, "fLaC", 4) == 0) {
+        return _flac_bitrate(buf, len, file_size - start);
+    }
+    if ((len >= 4 && memcmp(buf, "OggS", 4) == 0) || (len >= 8 && memcmp(buf + 4, "ftyp", 4) == 0)) {
+        return 0; // Ogg and MP4 (.m4a) do not give a bitrate up front
+    }
+    return _mp3_bitrate(buf, len, file_size - start);
+}
@@ -0,0 +1,133 @@
+#include "as_query.h"
+
+
+static uint8_t _fold(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : (uint8_t)c;
+}
+
+
+// The bucket of the trigram at text
+static uint32_t _bucket(const char *text) {
+    uint32_t trigram = (uint32_t)_fold(text[0]) << 16 | (uint32_t)_fold(text[1]) << 8 | _fold(text[2]);
+    return (trigram * 0x9E3779B1u) >> (32 - QUERY_TRIGRAM_BITS);
+}
+
+
+int query_index_build(QueryIndex *index, const Library *library) {
+    index->starts = (uint32_t *)calloc(QUERY_BUCKETS + 1, sizeof(uint32_t));
+    // the last file counted in each bucket (plus 1), then where the bucket is being filled
+    uint32_t *next = (uint32_t *)calloc(QUERY_BUCKETS, sizeof(uint32_t));
+    index->postings = NULL;
+    if (index->starts == NULL || next == NULL) {
+        perror("query_index_build: calloc");
+        free(next);
+        query_index_free(index);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < library->num_files; i++) {
+        const char *path = library->files[i];
+        size_t len = path != NULL ? strlen(path) : 0;
+        for (size_t j = 0; j + 3 <= len; j++) {
+            uint32_t bucket = _bucket(path + j);
+            if (next[bucket] != i + 1) {
+                next[bucket] = i + 1;
+                index->starts[bucket + 1]++;
+            }
+        }
+    }
+    for (uint32_t bucket = 0; bucket < QUERY_BUCKETS; bucket++) {
+        index->starts[bucket + 1] += index->starts[bucket];
+    }
+
+    uint32_t num_postings = index->starts[QUERY_BUCKETS];
+    index->postings = (uint32_t *)malloc((num_postings > 0 ? num_postings : 1) * sizeof(uint32_t));
+    if (index->postings == NULL) {
+        perror("query_index_build: malloc");
+        free(next);
+        query_index_free(index);
+        return -1;
+    }
+    memcpy(next, index->starts, QUERY_BUCKETS * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < library->num_files; i++) {
+        const char *path = library->files[i];
+        size_t len = path != NULL ? strlen(path) : 0;
+        for (size_t j = 0; j + 3 <= len; j++) {
+            uint32_t bucket = _bucket(path + j);
+            // files are filled in in order, so a repeated trigram is the last one in
+            if (next[bucket] == index->starts[bucket] || index->postings[next[bucket] - 1] != i) {
+                index->postings[next[bucket]++] = i;
+            }
+        }
+    }
+
+    free(next);
+    return 0;
+}
+
+
+// Whether text starts with the pattern, ignoring ASCII case
+static int _starts_with(const char *text, const char *pattern, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '\0' || _fold(text[i]) != _fold(pattern[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+static int _matches(const char *path, QueryMode mode, const char *pattern, size_t len) {
+    if (mode == QUERY_PREFIX) {
+        return _starts_with(path, pattern, len);
+    }
+    if (len == 0) {
+        return 1;
+    }
+    uint8_t first = _fold(pattern[0]);
+    for (; *path != '\0'; path++) {
+        if (_fold(*path) == first && _starts_with(path + 1, pattern + 1, len - 1)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+uint32_t query_run(const QueryIndex *index, const Library *library, QueryMode mode,
+                   const char *pattern, size_t len, uint32_t offset, uint32_t limit, uint32_t *page) {
+    // the candidates: the shortest list of a trigram of the pattern, or every file
+    const uint32_t *candidates = NULL;
+    uint32_t num_candidates = library->num_files;
+    for (size_t j = 0; j + 3 <= len; j++) {
+        uint32_t bucket = _bucket(pattern + j);
+        uint32_t count = index->starts[bucket + 1] - index->starts[bucket];
+        if (candidates == NULL || count < num_candidates) {
+            candidates = index->postings + index->starts[bucket];
+            num_candidates = count;
+        }
+    }
+
+    uint32_t matched = 0;
+    for (uint32_t c = 0; c < num_candidates; c++) {
+        uint32_t i = candidates != NULL ? candidates[c] : c;
+        const char *path = library->files[i];
+        if (path == NULL || !_matches(path, mode, pattern, len)) {
+            continue;
+        }
+        if (matched >= offset && matched - offset < limit) {
+            page[matched - offset] = i;
+        }
+        matched++;
+    }
+    return matched;
+}
+
+
+void query_index_free(QueryIndex *index) {
+    free(index->starts);
+    free(index->postings);
+    index->starts = NULL;
+    index->postings = NULL;
+}
@@ -0,0 +1,297 @@
+#include "as_radio.h"
+#include "as_stats.h"
+
+
+void radio_init(RadioStations *stations) {
+    pthread_mutex_init(&stations->lock, NULL);
+    stations->stations = NULL;
+}
+
+
+// value * to / from, without overflowing for a station on air for days
+static uint64_t _scale(uint64_t value, uint64_t from, uint64_t to) {
+    return value / from * to + value % from * to / from;
+}
+
+
+/*
+** Read a chunk of the broadcast, at pos (a multiple of RADIO_CHUNK_SIZE), into
+** its slot in the ring. The file is played in a loop, so a chunk may wrap
+** around its end.
+**
+** return 0 on success, -1 on error
+*/
+static int _read_chunk(RadioStation *station, uint64_t pos) {
+    uint8_t *slot = station->ring + pos % RADIO_RING_SIZE;
+    size_t filled = 0;
+    while (filled < RADIO_CHUNK_SIZE) {
+        uint64_t offset = (pos + filled) % station->file_size;
+        size_t len = MIN(RADIO_CHUNK_SIZE - filled, station->file_size - offset);
+        ssize_t got = pread(station->fd, slot + filled, len, offset);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("radio: pread");
+            return -1;
+        }
+        if (got == 0) {
+            ERR_PRINT("radio: file %u shrank while on air\n", station->file_index);
+            return -1;
+        }
+        filled += got;
+    }
+    return 0;
+}
+
+
+/*
+** Read in the chunks that have gone on air by now. If another listener is
+** already reading them, carry on with what is in the ring.
+*/
+static void _produce(RadioStation *station, uint64_t now) {
+    uint64_t elapsed = now > station->started ? now - station->started : 0;
+    uint64_t on_air = station->lead + _scale(elapsed, NS_PER_SEC, station->bitrate);
+    uint64_t target = (on_air + RADIO_CHUNK_SIZE - 1) / RADIO_CHUNK_SIZE * RADIO_CHUNK_SIZE;
+    if (atomic_load_explicit(&station->head, memory_order_acquire) >= target ||
+        pthread_mutex_trylock(&station->produce_lock) != 0) {
+        return;
+    }
+
+    uint64_t pos = atomic_load_explicit(&station->head, memory_order_relaxed);
+    if (target - MIN(pos, target) > RADIO_RING_SIZE - RADIO_CHUNK_SIZE) {
+        // nobody was sent the chunks in between (the server stalled): skip them
+        pos = target - (RADIO_RING_SIZE - RADIO_CHUNK_SIZE);
+    }
+    for (; pos < target; pos += RADIO_CHUNK_SIZE) {
+        // the head before this chunk is seen before any of its bytes are (see radio_sent)
+        atomic_thread_fence(memory_order_release);
+        if (_read_chunk(station, pos) < 0) {
+            atomic_store_explicit(&station->failed, 1, memory_order_relaxed);
+            break;
+        }
+        // a chunk at a time, so a listener sent the chunk the next one
+        // overwrites finds out (see radio_sent)
+        atomic_store_explicit(&station->head, pos + RADIO_CHUNK_SIZE, memory_order_release);
+    }
+    pthread_mutex_unlock(&station->produce_lock);
+}
+
+
+// Where a listener starts: the station's lead behind its head
+static uint64_t _join_point(const RadioStation *station, uint64_t head) {
+    return head - MIN(station->lead, head);
+}
+
+
+// The oldest byte listeners are sent from: the oldest chunk is overwritten next
+static uint64_t _oldest(uint64_t head) {
+    return head - MIN(head, RADIO_RING_SIZE - RADIO_CHUNK_SIZE);
+}
+
+
+/*
+** Start a station playing the file at path.
+**
+** return the station, NULL on error
+*/
+static RadioStation *_start_station(RadioStations *stations, const char *path, uint32_t file_index) {
+    RadioStation *station = (RadioStation *)malloc(sizeof(RadioStation));
+    if (station == NULL) {
+        perror("radio: malloc");
+        return NULL;
+    }
+
+    station->fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (station->fd < 0 || fstat(station->fd, &info) < 0) {
+        perror("radio: open");
+        if (station->fd >= 0) {
+            close(station->fd);
+        }
+        free(station);
+        return NULL;
+    }
+    if (info.st_size == 0) {
+        ERR_PRINT("radio: file %u is empty\n", file_index);
+        close(station->fd);
+        free(station);
+        return NULL;
+    }
+
+    station->file_index = file_index;
+    station->file_size = info.st_size;
+    station->bitrate = pace_probe_bitrate(station->fd, station->file_size);
+    if (station->bitrate == 0) {
+        station->bitrate = RADIO_DEFAULT_BITRATE;
+    }
+    uint64_t lead = MIN(station->bitrate * PACE_BURST_SECONDS, RADIO_RING_SIZE / 2) / RADIO_CHUNK_SIZE;
+    station->lead = (lead > 0 ? lead : 1) * RADIO_CHUNK_SIZE;
+    station->started = monotonic_ns();
+
+    pthread_mutex_init(&station->produce_lock, NULL);
+    atomic_init(&station->head, 0);
+    atomic_init(&station->failed, 0);
+    station->listeners = 0;
+    station->owner = stations;
+    station->next = stations->stations;
+    stations->stations = station;
+
+    #ifdef DEBUG
+    printf("Station for file %u on air at %lu bytes/s\n", file_index, (unsigned long)station->bitrate);
+    #endif
+    return station;
+}
+
+
+int radio_tune(Connection *conn, RadioStations *stations, const Library *library, uint32_t file_index) {
+    char *file_path = get_filepath_from_index(library, file_index);
+    if (file_path == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&stations->lock);
+    RadioStation *station = stations->stations;
+    while (station != NULL && station->file_index != file_index) {
+        station = station->next;
+    }
+    if (station == NULL) {
+        station = _start_station(stations, file_path, file_index);
+    }
+    if (station != NULL) {
+        station->listeners++;
+    }
+    pthread_mutex_unlock(&stations->lock);
+    free(file_path);
+    if (station == NULL) {
+        return -1;
+    }
+
+    _produce(station, monotonic_ns());
+    conn->station = station;
+    conn->radio_cursor = _join_point(station, atomic_load_explicit(&station->head, memory_order_acquire));
+
+    convert_uint64_to_uint8(station->file_size, conn->prefix);
+    convert_uint64_to_uint8(station->bitrate, conn->prefix + sizeof(uint64_t));
+    conn->out_buf = conn->prefix;
+    conn->out_len = 2 * sizeof(uint64_t);
+    conn->out_sent = 0;
+    conn->state = CONN_RADIO;
+    return 0;
+}
+
+
+int64_t radio_peek(Connection *conn, const uint8_t **data) {
+    RadioStation *station = conn->station;
+    _produce(station, monotonic_ns());
+    if (atomic_load_explicit(&station->failed, memory_order_relaxed)) {
+        return -1;
+    }
+
+    uint64_t head = atomic_load_explicit(&station->head, memory_order_acquire);
+    if (conn->radio_cursor < _oldest(head)) {
+        #ifdef DEBUG
+        printf("Listener of station %u fell behind by %lu bytes, skipping ahead\n",
+               station->file_index, (unsigned long)(head - conn->radio_cursor));
+        #endif
+        conn->radio_cursor = _join_point(station, head);
+    }
+
+    uint64_t at = conn->radio_cursor % RADIO_RING_SIZE;
+    *data = station->ring + at;
+    return MIN(MIN(head - conn->radio_cursor, RADIO_RING_SIZE - at), RADIO_MAX_SEND);
+}
+
+
+int radio_send(Connection *conn, uint64_t *bytes) {
+    if (conn->out_sent == 0) {
+        // a listener that falls behind does so in the ring, not in its socket
+        int size = RADIO_SOCKET_BUFFER;
+        if (setsockopt(conn->client.socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0) {
+            perror("radio_send: setsockopt");
+        }
+    }
+
+    *bytes = 0;
+    size_t out_sent = conn->out_sent;
+    int ret = _send_nonblocking(conn->client.socket, conn->out_buf, conn->out_len, &conn->out_sent, MSG_MORE);
+    *bytes += conn->out_sent - out_sent;
+
+    while (ret == 1) {
+        const uint8_t *data;
+        int64_t len = radio_peek(conn, &data);
+        if (len <= 0) {
+            ret = len < 0 ? -1 : 1;
+            break;
+        }
+
+        size_t sent = 0;
+        ret = _send_nonblocking(conn->client.socket, data, len, &sent, 0);
+        radio_sent(conn, sent);
+        *bytes += sent;
+    }
+
+    stats_add(&conn->stats->bytes_sent, *bytes);
+    return ret;
+}
+
+
+void radio_sent(Connection *conn, size_t sent) {
+    RadioStation *station = conn->station;
+    // the bytes were read out of the ring before the head is
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t head = atomic_load_explicit(&station->head, memory_order_relaxed);
+    if (conn->radio_cursor < _oldest(head)) {
+        // the producer got to them while they were being sent
+        #ifdef DEBUG
+        printf("Listener of station %u was sent overwritten bytes, skipping ahead\n", station->file_index);
+        #endif
+        conn->radio_cursor = _join_point(station, head);
+        return;
+    }
+    conn->radio_cursor += sent;
+}
+
+
+uint64_t radio_next_due(const RadioStation *station) {
+    uint64_t head = atomic_load_explicit((_Atomic uint64_t *)&station->head, memory_order_relaxed);
+    if (head < station->lead) {
+        return station->started;
+    }
+    // its first byte goes on air once the one before it has
+    return station->started + _scale(head - station->lead + 1, station->bitrate, NS_PER_SEC);
+}
+
+
+void radio_leave(Connection *conn) {
+    RadioStation *station = conn->station;
+    if (station == NULL) {
+        return;
+    }
+    conn->station = NULL;
+
+    RadioStations *stations = station->owner;
+    pthread_mutex_lock(&stations->lock);
+    if (--station->listeners > 0) {
+        pthread_mutex_unlock(&stations->lock);
+        return;
+    }
+    RadioStation **link = &stations->stations;
+    while (*link != station) {
+        link = &(*link)->next;
+    }
+    *link = station->next;
+    pthread_mutex_unlock(&stations->lock);
+
+    #ifdef DEBUG
+    printf("Station for file %u off air\n", station->file_index);
+    #endif
+    close(station->fd);
+    pthread_mutex_destroy(&station->produce_lock);
+    free(station);
+}
+
+
+void radio_free(RadioStations *stations) {
+    pthread_mutex_destroy(&stations->lock);
+}
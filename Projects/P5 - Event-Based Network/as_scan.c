@@ -0,0 +1,384 @@
+#include "as_scan.h"
+
+
+uint8_t _is_file_extension_supported(const char *filename){
+    static const char *supported_file_exts[] = SUPPORTED_FILE_EXTS;
+
+    for (int i = 0; i < sizeof(supported_file_exts)/sizeof(char *); i++) {
+        char *files_ext = strrchr(filename, '.');
+        if (files_ext != NULL && strcmp(files_ext, supported_file_exts[i]) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+void *arena_alloc(PathArena *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+
+    ArenaChunk *chunk = arena->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = arena->next_size > 0 ? arena->next_size : ARENA_CHUNK_MIN;
+        while (chunk_size < size) {
+            chunk_size *= 2;
+        }
+
+        chunk = (ArenaChunk *)malloc(sizeof(ArenaChunk) + chunk_size);
+        if (chunk == NULL) {
+            perror("arena_alloc: malloc");
+            return NULL;
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->next_size = chunk_size * 2 < ARENA_CHUNK_MAX ? chunk_size * 2 : ARENA_CHUNK_MAX;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+
+int arena_owns(const PathArena *arena, const void *ptr) {
+    for (const ArenaChunk *chunk = arena->chunks; chunk != NULL; chunk = chunk->next) {
+        if ((const char *)ptr >= chunk->data && (const char *)ptr < chunk->data + chunk->used) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+void arena_append(PathArena *to, PathArena *from) {
+    if (from->chunks == NULL) {
+        return;
+    }
+    ArenaChunk *last = from->chunks;
+    while (last->next != NULL) {
+        last = last->next;
+    }
+    // from's chunks go in front: its newest may still have room
+    last->next = to->chunks;
+    to->chunks = from->chunks;
+    if (from->next_size > to->next_size) {
+        to->next_size = from->next_size;
+    }
+    from->chunks = NULL;
+    from->next_size = 0;
+}
+
+
+void arena_free(PathArena *arena) {
+    while (arena->chunks != NULL) {
+        ArenaChunk *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+    arena->next_size = 0;
+}
+
+
+// Same as _join_path, in the arena
+static char *_arena_join(PathArena *arena, const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    int slash = dir_len > 0 && dir[dir_len - 1] != '/';
+
+    char *joined = (char *)arena_alloc(arena, dir_len + slash + name_len + 1);
+    if (joined == NULL) {
+        return NULL;
+    }
+    memcpy(joined, dir, dir_len);
+    if (slash) {
+        joined[dir_len] = '/';
+    }
+    memcpy(joined + dir_len + slash, name, name_len + 1);
+    return joined;
+}
+
+
+static ScanDir *_new_dir(PathArena *arena, const char *path) {
+    ScanDir *dir = (ScanDir *)arena_alloc(arena, sizeof(ScanDir));
+    if (dir == NULL) {
+        return NULL;
+    }
+    memset(dir, 0, sizeof(*dir));
+    dir->path = path;
+    dir->wd = -1;
+    return dir;
+}
+
+
+static ScanEntry *_add_entry(ScanDir *dir) {
+    if (dir->num_entries == dir->capacity) {
+        uint32_t capacity = dir->capacity > 0 ? dir->capacity * 2 : 16;
+        ScanEntry *entries = (ScanEntry *)realloc(dir->entries, capacity * sizeof(ScanEntry));
+        if (entries == NULL) {
+            perror("scan_tree: realloc");
+            return NULL;
+        }
+        dir->entries = entries;
+        dir->capacity = capacity;
+    }
+    return &dir->entries[dir->num_entries++];
+}
+
+
+/*
+** The queue of directories waiting to be read, shared by a scan's threads.
+**
+** busy:    directories being read; the scan is over once none are, and
+**          none are queued.
+** failed:  a directory could not be listed for lack of memory.
+*/
+typedef struct scan_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    ScanDir **queue;
+    size_t num_queued;
+    size_t capacity;
+    int busy;
+    int failed;
+
+    int root_fd;
+    const char *library_path;
+    int inotify_fd;
+    uint32_t watch_mask;
+    atomic_int watch_limit_reached;
+} ScanPool;
+
+typedef struct scan_worker {
+    pthread_t thread;
+    ScanPool *pool;
+    PathArena arena;
+} ScanWorker;
+
+
+/*
+** Open and list one directory, adding its supported files and subdirectories
+** to its entries.
+**
+** return 0 on success, -1 if it cannot be opened, -2 on running out of memory
+*/
+static int _read_dir(ScanPool *pool, PathArena *arena, ScanDir *dir) {
+    if (pool->inotify_fd >= 0 && !atomic_load_explicit(&pool->watch_limit_reached, memory_order_relaxed)) {
+        char full_path[PATH_MAX];
+        int len = snprintf(full_path, sizeof(full_path), "%s/%s", pool->library_path, dir->path);
+        if (len > 0 && len < sizeof(full_path)) {
+            dir->wd = inotify_add_watch(pool->inotify_fd, full_path, pool->watch_mask);
+            if (dir->wd < 0 && (errno == ENOSPC || errno == ENOMEM)) {
+                atomic_store_explicit(&pool->watch_limit_reached, 1, memory_order_relaxed);
+            }
+        }
+    }
+
+    int fd = openat(pool->root_fd, dir->path[0] != '\0' ? dir->path : ".",
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    char buf[SCAN_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct dirent64))));
+    ssize_t len;
+    while ((len = getdents64(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t offset = 0; offset < len;) {
+            struct dirent64 *entry = (struct dirent64 *)(buf + offset);
+            offset += entry->d_reclen;
+
+            int is_dir;
+            if (entry->d_type == DT_REG && _is_file_extension_supported(entry->d_name)) {
+                is_dir = 0;
+            } else if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 &&
+                       strcmp(entry->d_name, "..") != 0) {
+                is_dir = 1;
+            } else {
+                continue;
+            }
+
+            ScanEntry *added = _add_entry(dir);
+            if (added == NULL) {
+                close(fd);
+                return -2;
+            }
+            added->dir = NULL;
+            added->inode = entry->d_ino;
+            added->path = _arena_join(arena, dir->path, entry->d_name);
+            if (added->path == NULL ||
+                (is_dir && (added->dir = _new_dir(arena, added->path)) == NULL)) {
+                close(fd);
+                return -2;
+            }
+        }
+    }
+    if (len < 0) {
+        perror("scan_tree: getdents64");
+    }
+
+    close(fd);
+    return 0;
+}
+
+
+/*
+** Queue the subdirectories of a directory that has been read. Called with the
+** pool's lock held.
+**
+** return 0 on success, -1 on error
+*/
+static int _queue_subdirs(ScanPool *pool, const ScanDir *dir) {
+    // queued last to first, so the first is read next
+    for (uint32_t i = dir->num_entries; i-- > 0;) {
+        if (dir->entries[i].dir == NULL) {
+            continue;
+        }
+        if (pool->num_queued == pool->capacity) {
+            size_t capacity = pool->capacity > 0 ? pool->capacity * 2 : 64;
+            ScanDir **queue = (ScanDir **)realloc(pool->queue, capacity * sizeof(ScanDir *));
+            if (queue == NULL) {
+                perror("scan_tree: realloc");
+                return -1;
+            }
+            pool->queue = queue;
+            pool->capacity = capacity;
+        }
+        pool->queue[pool->num_queued++] = dir->entries[i].dir;
+    }
+    return 0;
+}
+
+
+/*
+** A scan thread: read queued directories until there are none left to read.
+*/
+static void *_scan_worker(void *arg) {
+    ScanWorker *worker = (ScanWorker *)arg;
+    ScanPool *pool = worker->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->num_queued == 0 && pool->busy > 0 && !pool->failed) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        if (pool->num_queued == 0 || pool->failed) {
+            break;
+        }
+
+        ScanDir *dir = pool->queue[--pool->num_queued];
+        pool->busy++;
+        pthread_mutex_unlock(&pool->lock);
+
+        int result = _read_dir(pool, &worker->arena, dir);
+        if (result == -1 && errno != ENOENT && errno != ENOTDIR) {
+            fprintf(stderr, "scan_tree: %s: %s\n", dir->path, strerror(errno));
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->busy--;
+        if (result == -2 || _queue_subdirs(pool, dir) < 0) {
+            pool->failed = 1;
+        }
+        pthread_cond_broadcast(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+int scan_tree(ScanTree *tree, const char *library_path, const char *dir,
+              int inotify_fd, uint32_t watch_mask, int num_threads) {
+    memset(tree, 0, sizeof(*tree));
+
+    int root_fd = open(library_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        return -1;
+    }
+
+    ScanPool pool = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .changed = PTHREAD_COND_INITIALIZER,
+        .root_fd = root_fd,
+        .library_path = library_path,
+        .inotify_fd = inotify_fd,
+        .watch_mask = watch_mask,
+    };
+    atomic_init(&pool.watch_limit_reached, 0);
+
+    ScanWorker *workers = (ScanWorker *)calloc(num_threads, sizeof(ScanWorker));
+    if (workers == NULL) {
+        perror("scan_tree: calloc");
+        close(root_fd);
+        return -1;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].pool = &pool;
+    }
+
+    // the first directory is read up front, as the scan fails if it cannot be
+    int result = -2;
+    int saved_errno = 0;
+    char *root_path = _arena_join(&workers[0].arena, "", dir);
+    tree->root = root_path != NULL ? _new_dir(&workers[0].arena, root_path) : NULL;
+    if (tree->root != NULL) {
+        result = _read_dir(&pool, &workers[0].arena, tree->root);
+        saved_errno = errno;
+    }
+    if (result == 0 && _queue_subdirs(&pool, tree->root) < 0) {
+        result = -2;
+    }
+
+    if (result == 0) {
+        // a leaf directory needs no more threads (read before any start)
+        int wanted = pool.num_queued > 0 ? num_threads : 1;
+        int started = 1;
+        for (; started < wanted; started++) {
+            if (pthread_create(&workers[started].thread, NULL, _scan_worker, &workers[started]) != 0) {
+                break; // the threads already started will do
+            }
+        }
+        _scan_worker(&workers[0]);
+        for (int i = 1; i < started; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        if (pool.failed) {
+            result = -2;
+        }
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        arena_append(&tree->arena, &workers[i].arena);
+    }
+    tree->watch_limit_reached = atomic_load(&pool.watch_limit_reached);
+    free(workers);
+    free(pool.queue);
+    close(root_fd);
+
+    if (result < 0) {
+        scan_tree_free(tree);
+        errno = result == -1 ? saved_errno : ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+
+static void _free_dir(ScanDir *dir) {
+    for (uint32_t i = 0; i < dir->num_entries; i++) {
+        if (dir->entries[i].dir != NULL) {
+            _free_dir(dir->entries[i].dir);
+        }
+    }
+    free(dir->entries);
+}
+
+
+void scan_tree_free(ScanTree *tree) {
+    if (tree->root != NULL) {
+        _free_dir(tree->root);
+        tree->root = NULL;
+    }
+    arena_free(&tree->arena);
+}
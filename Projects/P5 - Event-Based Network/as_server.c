@@ -1,4 +1,9 @@
 #include "as_server.h"
+#include "as_frame.h"
+#include "as_hash.h"
+#include "as_radio.h"
+#include "as_stats.h"
+#include "as_uring.h"
 
 
 int init_server_addr(int port, struct sockaddr_in *addr){
@@ -17,7 +22,8 @@ int init_server_addr(int port, struct sockaddr_in *addr){
 
 
 int set_up_server_socket(const struct sockaddr_in *server_options, int num_queue) {
-    int soc = socket(AF_INET, SOCK_STREAM, 0);
+    // Non-blocking, so the event loop can accept until the queue is empty
+    int soc = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (soc < 0) {
         perror("socket");
         exit(1);
@@ -35,6 +41,15 @@ int set_up_server_socket(const struct sockaddr_in *server_options, int num_queue
         exit(1);
     }
 
+    // Every worker listens on the port with a socket of its own, and the kernel
+    // balances incoming connections across them
+    status = setsockopt(soc, SOL_SOCKET, SO_REUSEPORT,
+                        (const char *) &on, sizeof(on));
+    if (status < 0) {
+        perror("setsockopt");
+        exit(1);
+    }
+
     // Associate the process with the address and a port
     if (bind(soc, (struct sockaddr *)server_options, sizeof(*server_options)) < 0) {
         // bind failed; could be because port is in use.
@@ -60,11 +75,13 @@ int set_up_server_socket(const struct sockaddr_in *server_options, int num_queue
 ClientSocket accept_connection(int listenfd) {
     ClientSocket client;
     socklen_t addr_size = sizeof(client.addr);
-    client.socket = accept(listenfd, (struct sockaddr *)&client.addr,
-                               &addr_size);
+    client.socket = accept4(listenfd, (struct sockaddr *)&client.addr,
+                            &addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (client.socket < 0) {
-        perror("accept_connection: accept");
-        exit(-1);
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("accept_connection: accept4");
+        }
+        return client;
     }
 
     // print out a message that we got the connection
@@ -74,138 +91,150 @@ ClientSocket accept_connection(int listenfd) {
     return client;
 }
 
-int response_len(char **file_names, int num_files)
-{
-    int response_len = 0;
-    for (int i = 0; i < num_files; i++)
-    {
-        response_len += strlen(file_names[i]);
+// Digits in the decimal form of n
+static int _num_digits(uint32_t n) {
+    int digits = 1;
+    while (n >= 10) {
+        n /= 10;
+        digits++;
     }
+    return digits;
+}
+
 
-    response_len += (2 * num_files); //take into account network newline characters.
-    return response_len;
+// Length of a list entry: "<index>:<name>\r\n", with no name for a removed file
+static size_t _list_entry_len(const Library *library, uint32_t i) {
+    return _num_digits(i) + 1 + (library->files[i] != NULL ? strlen(library->files[i]) : 0) + 2;
 }
-int get_index_strlen(int index)
-{
-    //chatgpt wrote the structure for this helper.
-    int count = 0;
 
-    // Handle the case when number is 0 separately
-    if (index== 0) {
-        return 1;
-    }
 
-    // Count the number of digits
-    while (index != 0) {
-        index /= 10; // Divide the number by 10
-        count++;      // Increment the digit count
+// Write a list entry at out, returning where it ends
+static char *_write_list_entry(char *out, const Library *library, uint32_t i) {
+    int digits = _num_digits(i);
+    uint32_t n = i;
+    for (int d = digits - 1; d >= 0; d--) {
+        out[d] = '0' + n % 10;
+        n /= 10;
     }
+    out += digits;
+    *out++ = ':';
 
-    return count;
+    if (library->files[i] != NULL) {
+        size_t name_len = strlen(library->files[i]);
+        memcpy(out, library->files[i], name_len);
+        out += name_len;
+    }
+    *out++ = '\r';
+    *out++ = '\n';
+    return out;
 }
 
-char *file_index_string(int index)
-{
-    int num_digits = get_index_strlen(index);
-    char *index_str= malloc((num_digits + 2) * sizeof(char));
-    if (index_str == NULL)
-    {
-        perror("malloc");
-        exit(EXIT_FAILURE);
-    }
 
-    // Format a string using sprintf
-    sprintf(index_str, "%d", index);
+/*
+** Serialize the LIST response for a library, in one allocation: the size of
+** every entry is added up first, then the entries are copied in.
+**
+** return the payload, with one reference, or NULL on error
+*/
+static ListPayload *_build_list_payload(const Library *library) {
+    size_t len = 0;
+    for (uint32_t i = 0; i < library->num_files; i++) {
+        len += _list_entry_len(library, i);
+    }
 
-    // Add a colon to the end of the string
-    strcat(index_str, ":");
+    ListPayload *payload = (ListPayload *)malloc(sizeof(ListPayload) + len);
+    if (payload == NULL) {
+        perror("_build_list_payload: malloc");
+        return NULL;
+    }
+    atomic_init(&payload->refs, 1);
+    payload->len = len;
 
-    // Ensure the string is null-terminated after the colon
-    index_str[strlen(index_str)] = '\0';
+    char *out = payload->data;
+    for (uint32_t i = library->num_files; i-- > 0;) {
+        out = _write_list_entry(out, library, i);
+    }
 
-    return index_str;
+    return payload;
 }
 
-char *create_msg_string(char **file_names, int num_files)
-{
-    //allocating memory for the message, and setting msg values
-    char *msg = malloc(sizeof(char));
-    if (msg == NULL)
-    {
-        perror("malloc");
-        exit(EXIT_FAILURE);
+
+void _release_list_payload(ListPayload *payload) {
+    if (atomic_fetch_sub_explicit(&payload->refs, 1, memory_order_acq_rel) == 1) {
+        free(payload);
     }
-    msg[0] = '\0';
+}
 
-    int old_msg_len = 0;
-    int curr_msg_len = 0;
 
-    for (int i = (num_files - 1); i >= 0; i--)
+int list_request_response(Connection *conn, LibrarySnapshot *snapshot) {
+    if (snapshot->library.num_files == 0)
     {
-        char *curr_index_str = file_index_string(i);
-        char *curr_file_name = file_names[i];
+        printf("No files in library\n");
+        return -1;
+    }
 
-        int index_len = strlen(curr_index_str);
-        int file_name_len = strlen(curr_file_name); //strlen does not include null terminator
+    //the connection shares the snapshot's payload, and lets go of it once it has been sent.
+    atomic_fetch_add_explicit(&snapshot->list->refs, 1, memory_order_relaxed);
+    conn->out_payload = snapshot->list;
+    conn->out_buf = (uint8_t *)snapshot->list->data;
+    conn->out_len = snapshot->list->len;
+    conn->out_sent = 0;
+    conn->state = CONN_SENDING;
 
-        curr_msg_len += index_len + file_name_len + 3;
-        msg = realloc(msg, curr_msg_len * sizeof(char));
-        if (msg == NULL)
-        {
-            perror("realloc");
-            exit(EXIT_FAILURE);
-        }
-        msg[old_msg_len] = '\0';
+    return 0;
+}
 
-        strncat(msg, curr_index_str, index_len);
-        free(curr_index_str);
 
-        strncat(msg, curr_file_name, file_name_len);
-        strncat(msg, "\r\n", 3);
+int list_query_request_response(Connection *conn, LibrarySnapshot *snapshot, QueryMode mode,
+                                const char *pattern, size_t len, uint32_t offset, uint32_t limit) {
+    const Library *library = &snapshot->library;
+    limit = MIN(limit, QUERY_MAX_LIMIT);
+    uint32_t page[QUERY_MAX_LIMIT];
+    uint32_t matched = query_run(&snapshot->query, library, mode, pattern, len, offset, limit, page);
+    uint32_t listed = matched > offset ? MIN(matched - offset, limit) : 0;
 
-        //strncat(msg, '\r\n');
-        old_msg_len = curr_msg_len;
+    size_t list_len = 0;
+    for (uint32_t i = 0; i < listed; i++) {
+        list_len += _list_entry_len(library, page[i]);
     }
-
-    return msg;
-}
-
-int list_request_response(const ClientSocket * client, const Library *library) {
-    if (library->num_files == 0)
-    {
-        printf("No files in library");
+    ListPayload *payload = (ListPayload *)malloc(sizeof(ListPayload) + QUERY_RESPONSE_HEADER_SIZE + list_len);
+    if (payload == NULL) {
+        perror("list_query_request_response: malloc");
         return -1;
     }
-
-    char *msg = create_msg_string(library->files, library->num_files);
-
-    ssize_t bytes_sent =  write_precisely(client->socket, msg, strlen(msg));
-    if (bytes_sent < 0) {
-        perror("Error sending data to client");
-        return -1;
+    atomic_init(&payload->refs, 1);
+    payload->len = QUERY_RESPONSE_HEADER_SIZE + list_len;
+
+    uint8_t *header = (uint8_t *)payload->data;
+    uint32_t matched_be = htonl(matched);
+    uint32_t listed_be = htonl(listed);
+    memcpy(header, &matched_be, sizeof(uint32_t));
+    memcpy(header + sizeof(uint32_t), &listed_be, sizeof(uint32_t));
+    convert_uint64_to_uint8(list_len, header + 2 * sizeof(uint32_t));
+    char *out = payload->data + QUERY_RESPONSE_HEADER_SIZE;
+    for (uint32_t i = 0; i < listed; i++) {
+        out = _write_list_entry(out, library, page[i]);
     }
+    #ifdef DEBUG
+    printf("Query \"%.*s\" matched %u files, listing %u\n", (int)len, pattern, matched, listed);
+    #endif
 
-    free(msg);
+    //the connection holds the only reference, so the payload is freed once it is sent.
+    conn->out_payload = payload;
+    conn->out_buf = (uint8_t *)payload->data;
+    conn->out_len = payload->len;
+    conn->out_sent = 0;
+    conn->state = CONN_SENDING;
 
     return 0;
 }
 
 
-static int _load_file_size_into_buffer(FILE *file, uint8_t *buffer) {
-    if (fseek(file, 0, SEEK_END) < 0) {
-        ERR_PRINT("Error seeking to end of file\n");
-        return -1;
-    }
-    uint32_t file_size = ftell(file);
-    if (fseek(file, 0, SEEK_SET) < 0) {
-        ERR_PRINT("Error seeking to start of file\n");
-        return -1;
-    }
+static void _load_file_size_into_buffer(uint32_t file_size, uint8_t *buffer) {
     buffer[0] = (file_size >> 24) & 0xFF;
     buffer[1] = (file_size >> 16) & 0xFF;
     buffer[2] = (file_size >> 8) & 0xFF;
     buffer[3] = file_size & 0xFF;
-    return 0;
 }
 
 //Following helper was written by chatgpt to convert uint8 arrays to uint32 values.
@@ -220,151 +249,287 @@ uint32_t convert_uint8_to_uint32(uint8_t *array) {
     return result;
 }
 
-int get_file_index(const ClientSocket * client, uint8_t *post_req, int num_pr_bytes)
+char *get_filepath_from_index(const Library *library, uint32_t file_index)
 {
-    int num_to_read = 4 - num_pr_bytes;
-
-    //error handling for if num_pr_bytes > 4
-    if (num_to_read < 0)
+    //Handling for bad index.
+    if (file_index >= library->num_files)
     {
-        printf("number bytes recieved for file index is greater than 4, number recieved: %d\n", num_pr_bytes);
-        return -1;
+        printf("ERROR: file index %u is out of range\n", file_index);
+        return NULL;
+    }
+    if (library->files[file_index] == NULL)
+    {
+        printf("ERROR: file %u was removed from the library\n", file_index);
+        return NULL;
     }
 
-    //the following ensures that the last 4 bytes of post_req is populated by 4 bytes containing file index.
-    if (num_to_read != 0)
+    char *rel_path = _join_path(library->path, library->files[file_index]);
+    return rel_path;
+}
+
+int _send_nonblocking(int socket, const uint8_t *buf, size_t len, size_t *sent, int flags)
+{
+    while (*sent < len)
     {
-        int bytes_read = read_precisely(client->socket, post_req + num_pr_bytes, num_to_read);
-        if(bytes_read != num_to_read)
+        // MSG_NOSIGNAL: a client that hangs up is an error for this connection, not a SIGPIPE for the server
+        ssize_t ret = send(socket, buf + *sent, len - *sent, MSG_NOSIGNAL | flags);
+        if (ret < 0)
         {
-            printf("Read Precisely Error in get_file_index");
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("send_response: send");
             return -1;
         }
+        *sent += ret;
     }
 
-    uint32_t index = convert_uint8_to_uint32(post_req);
-    return index;
+    return 1;
 }
 
-char *get_filepath_from_index(const Library *library, int file_index)
+void _reset_response(Connection *conn)
 {
-    //Handling for bad index.
-    if (file_index < 0 || file_index >= library->num_files )
-    {
-        printf("ERROR: file index %d is out of range\n", file_index);
-        return NULL;
+    if (conn->out_payload != NULL) {
+        _release_list_payload(conn->out_payload);
+        conn->out_payload = NULL;
     }
+    conn->out_buf = NULL;
+    conn->out_len = conn->out_sent = 0;
 
-    char *rel_path = _join_path(library->path, library->files[file_index]);
-    return rel_path;
+    transfer_close(&conn->transfer);
+    radio_leave(conn);
+
+    conn->state = CONN_READING_REQUEST;
 }
 
-int send_filesize(int socket, FILE *file_ptr, uint8_t *buffer)
+int send_response(Connection *conn, uint64_t max_bytes)
 {
-    //the following loads the file size into the buffer.
-    if (_load_file_size_into_buffer(file_ptr, buffer) < 0)
+    size_t out_sent = conn->out_sent;
+    uint64_t remaining = conn->transfer.remaining;
+
+    //the size prefix is held back to go out in the same segment as the start of the file.
+    int more = conn->transfer.remaining > 0 ? MSG_MORE : 0;
+    int ret = _send_nonblocking(conn->client.socket, conn->out_buf, conn->out_len, &conn->out_sent, more);
+    if (ret == 1 && conn->transfer.remaining > 0)
     {
-        printf("Error loading file size into buffer");
-        return -1;
+        ret = transfer_send(&conn->transfer, conn->client.socket, max_bytes);
     }
+    stats_add(&conn->stats->bytes_sent, conn->out_sent - out_sent + remaining - conn->transfer.remaining);
+    if (ret != 1) {return ret;}
 
-    if (write_precisely(socket, buffer, 4) < 4)
-    {
-      perror("Error sending data");
-      return -1;
+    stats_request_done(conn->stats, conn->request_kind, conn->request_started);
+    _reset_response(conn);
+    return 1;
+}
+
+
+// Count whether a file opened for a response (transfer_open returned opened) was in the cache
+static void _count_cache_lookup(Connection *conn, const FileCache *cache, int opened) {
+    if (cache != NULL) {
+        stats_add(opened == 1 ? &conn->stats->cache_hits : &conn->stats->cache_misses, 1);
     }
+}
+
+int stream_request_response(Connection *conn, const Library *library, FileCache *cache,
+                            uint32_t file_index) {
+    char *file_path = get_filepath_from_index(library, file_index);
+    if (file_path == NULL) {return -1;}
+
+    uint64_t file_size;
+    uint64_t bitrate;
+    int opened = transfer_open(&conn->transfer, file_path, cache, &file_size, &bitrate);
+    free(file_path);
+    if (opened < 0) {return -1;}
+    _count_cache_lookup(conn, cache, opened);
 
-    if (ferror(file_ptr))
+    if (file_size > UINT32_MAX)
     {
-       perror("Error reading from file");
-       return -1;
+        ERR_PRINT("File %u is too large to stream (%lu bytes)\n", file_index, (unsigned long)file_size);
+        transfer_close(&conn->transfer);
+        return -1;
     }
 
-    //return file size
-    return convert_uint8_to_uint32(buffer);
+    //someone is listening: no faster than they can play it, once their player's buffer is full.
+    bucket_init(&conn->pace, bitrate * PACE_HEADROOM_PERCENT / 100, bitrate * PACE_BURST_SECONDS,
+                monotonic_ns());
+    #ifdef DEBUG
+    printf("Streaming file %u at %lu bytes/s\n", file_index, (unsigned long)bitrate);
+    #endif
+
+    //the size prefix goes out first, followed by the file's data.
+    _load_file_size_into_buffer(file_size, conn->prefix);
+    conn->out_buf = conn->prefix;
+    conn->out_len = sizeof(uint32_t);
+    conn->out_sent = 0;
+    conn->state = CONN_SENDING;
+
+    return 0;
 }
 
-int send_stream(int socket, FILE *file_ptr, uint8_t *response_buffer, uint32_t num_to_write)
-{
-    uint32_t next_write_amt = 0;
-    while (num_to_write != 0)
-    {
-        //setting the next write size.
-        next_write_amt = STREAM_CHUNK_SIZE;
-        if  (num_to_write <= STREAM_CHUNK_SIZE)
-        {
-            next_write_amt = num_to_write;
-        }
+int stream_range_request_response(Connection *conn, const Library *library, FileCache *cache,
+                                  uint32_t file_index, uint64_t offset, uint64_t length) {
+    char *file_path = get_filepath_from_index(library, file_index);
+    if (file_path == NULL) {return -1;}
 
-        if (fread(response_buffer, 1, next_write_amt, file_ptr) != next_write_amt)
-        {
-            if (feof(file_ptr)) {
-                printf("End of file reached.\n");
-            } else {
-                perror("Error reading from file");
-            }
-            return -1;
-        }
+    uint64_t file_size;
+    int opened = transfer_open(&conn->transfer, file_path, cache, &file_size, NULL);
+    free(file_path);
+    if (opened < 0) {return -1;}
+    _count_cache_lookup(conn, cache, opened);
 
-        if (ferror(file_ptr))
-        {
-            perror("Error reading from file");
-        }
+    uint64_t sending = transfer_set_range(&conn->transfer, offset, length);
+    bucket_init(&conn->pace, 0, 0, 0); // bulk: only limited by the uplink
+    #ifdef DEBUG
+    printf("Streaming %lu bytes of file %u from byte %lu\n",
+           (unsigned long)sending, file_index, (unsigned long)conn->transfer.offset);
+    #endif
+
+    //the header goes out first, followed by the range's data.
+    convert_uint64_to_uint8(file_size, conn->prefix);
+    convert_uint64_to_uint8(sending, conn->prefix + sizeof(uint64_t));
+    conn->out_buf = conn->prefix;
+    conn->out_len = STREAM_RANGE_HEADER_SIZE;
+    conn->out_sent = 0;
+    conn->state = CONN_SENDING;
+
+    return 0;
+}
+
+
+int hash_request_response(Connection *conn, LibrarySnapshot *snapshot, uint32_t file_index) {
+    uint64_t size;
+    uint64_t hash;
+    HashStatus status = content_lookup(snapshot->content, &snapshot->library, file_index, &size, &hash);
+    #ifdef DEBUG
+    printf("Hash of file %u: %s\n", file_index,
+           status == HASH_KNOWN ? "known" : status == HASH_PENDING ? "pending" : "no such file");
+    #endif
+
+    conn->prefix[0] = status;
+    convert_uint64_to_uint8(size, conn->prefix + sizeof(uint8_t));
+    convert_uint64_to_uint8(hash, conn->prefix + sizeof(uint8_t) + sizeof(uint64_t));
+    conn->out_buf = conn->prefix;
+    conn->out_len = HASH_RESPONSE_SIZE;
+    conn->out_sent = 0;
+    conn->state = CONN_SENDING;
+
+    return 0;
+}
 
-        if (write_precisely(socket, response_buffer, next_write_amt) != next_write_amt)
-        {
-            perror("Error sending data");
-            return -1;
-        }
 
-        num_to_write -= next_write_amt;
+int stats_request_response(Connection *conn) {
+    ListPayload *payload = (ListPayload *)malloc(sizeof(ListPayload) + sizeof(uint64_t) + STATS_TEXT_MAX);
+    if (payload == NULL) {
+        perror("stats_request_response: malloc");
+        return -1;
     }
+    atomic_init(&payload->refs, 1);
+    size_t len = stats_format(conn->stats->server, payload->data + sizeof(uint64_t), STATS_TEXT_MAX);
+    convert_uint64_to_uint8(len, (uint8_t *)payload->data);
+    payload->len = sizeof(uint64_t) + len;
+
+    //the connection holds the only reference, so the payload is freed once it is sent.
+    conn->out_payload = payload;
+    conn->out_buf = (uint8_t *)payload->data;
+    conn->out_len = payload->len;
+    conn->out_sent = 0;
+    conn->state = CONN_SENDING;
 
     return 0;
 }
 
-int send_response(const ClientSocket * client, FILE *file_ptr)
-{
-        //the following initializes a response buffer of size STREAM_CHUNK_SIZE bytes
-        uint8_t *response_buffer = (uint8_t *)malloc(STREAM_CHUNK_SIZE);
-        if (response_buffer == NULL)
-        {
-            perror("malloc");
-            exit(EXIT_FAILURE);
-        }
 
-        //the following loads the file size into the buffer.
-        uint32_t num_to_write = send_filesize(client->socket, file_ptr, response_buffer);
-        if (num_to_write == 0){return -1;}
+/*
+** The least file data worth sending from a bucket: PACE_MIN_SEND, or the rest
+** of the file (or what a framed connection's windows allow), but no more than
+** the bucket can ever hold.
+*/
+static uint64_t _pace_wanted(const TokenBucket *bucket, const Connection *conn) {
+    uint64_t left = conn->frames != NULL ? frame_data_ready(conn->frames) : conn->transfer.remaining;
+    uint64_t wanted = MIN(left, PACE_MIN_SEND);
+    return bucket->rate != 0 ? MIN(wanted, bucket->burst) : wanted;
+}
+
 
-        if (send_stream(client->socket, file_ptr, response_buffer, num_to_write) != 0){return -1;}
-        fprintf(stdout, "total size: %d\n", num_to_write);
-        free(response_buffer);
-        return 0;
+uint64_t _pace_allowance(EventLoop *loop, Connection *conn, uint64_t now) {
+    uint64_t allowance = bucket_available(&conn->pace, now);
+    uint64_t wanted = _pace_wanted(&conn->pace, conn);
+    if (allowance >= wanted) {
+        return allowance;
+    }
+    wheel_add(&loop->wheel, &conn->pace_timer, conn, now + bucket_delay(&conn->pace, wanted));
+    return 0;
 }
 
-//num_pr_bytes is number of bytes in post_req.
-int stream_request_response(const ClientSocket * client, const Library *library,
-                            uint8_t *post_req, int num_pr_bytes) {
-    //the following gets the file index.
-    int file_index = get_file_index(client, post_req, num_pr_bytes);
-    if (file_index == -1){return -1;}
 
-    char *file_path = get_filepath_from_index(library, file_index);
-    if (file_path == NULL) {return -1;}
+uint64_t _link_allowance(EventLoop *loop, Connection *conn, uint64_t now) {
+    uint64_t allowance = bucket_available(&loop->link, now);
+    uint64_t wanted = _pace_wanted(&loop->link, conn);
+    if (allowance >= wanted) {
+        return allowance;
+    }
+    loop->link_due = now + bucket_delay(&loop->link, wanted);
+    return 0;
+}
 
-    FILE *file_ptr = fopen(file_path, "r");
-    if (file_ptr == NULL)
-    {
-        perror("Error opening file");
-        return -1;
+
+void _schedule(EventLoop *loop, Connection *conn) {
+    if (conn->scheduled) {
+        return;
+    }
+    conn->scheduled = 1;
+    conn->deficit += PACE_QUANTUM;
+    conn->next_active = NULL;
+    if (loop->active_tail != NULL) {
+        loop->active_tail->next_active = conn;
+    } else {
+        loop->active_head = conn;
     }
+    loop->active_tail = conn;
+}
 
-    free(file_path);
-    int send_success = send_response(client, file_ptr);
-    fclose(file_ptr);
 
-    return send_success;
+void _unschedule(EventLoop *loop, Connection *conn) {
+    wheel_remove(&loop->wheel, &conn->pace_timer);
+    conn->deficit = 0;
+    if (!conn->scheduled) {
+        return;
+    }
+
+    Connection **link = &loop->active_head;
+    Connection *prev = NULL;
+    while (*link != conn) {
+        prev = *link;
+        link = &(*link)->next_active;
+    }
+    *link = conn->next_active;
+    if (loop->active_tail == conn) {
+        loop->active_tail = prev;
+    }
+    conn->scheduled = 0;
+}
+
+
+Connection *_next_scheduled(EventLoop *loop) {
+    Connection *conn = loop->active_head;
+    if (conn == NULL) {
+        return NULL;
+    }
+    loop->active_head = conn->next_active;
+    if (loop->active_head == NULL) {
+        loop->active_tail = NULL;
+    }
+    conn->scheduled = 0;
+    return conn;
+}
+
+
+void _pace_charge(EventLoop *loop, Connection *conn, uint64_t bytes) {
+    bucket_take(&conn->pace, bytes);
+    bucket_take(&loop->link, bytes);
 }
 
 
@@ -382,43 +547,16 @@ static Library make_library(const char *path){
 }
 
 
-static void _wait_for_children(pid_t **client_conn_pids, int *num_connected_clients, uint8_t immediate) {
-    int status;
-    for (int i = 0; i < *num_connected_clients; i++) {
-        int options = immediate ? WNOHANG : 0;
-        if (waitpid((*client_conn_pids)[i], &status, options) > 0) {
-            if (WIFEXITED(status)) {
-                printf("Client process %d terminated\n", (*client_conn_pids)[i]);
-                if (WEXITSTATUS(status) != 0) {
-                    fprintf(stderr, "Client process %d exited with status %d\n",
-                            (*client_conn_pids)[i], WEXITSTATUS(status));
-                }
-            } else {
-                fprintf(stderr, "Client process %d terminated abnormally\n",
-                        (*client_conn_pids)[i]);
-            }
-
-            for (int j = i; j < *num_connected_clients - 1; j++) {
-                (*client_conn_pids)[j] = (*client_conn_pids)[j + 1];
-            }
-
-            (*num_connected_clients)--;
-            *client_conn_pids = (pid_t *)realloc(*client_conn_pids,
-                                                 (*num_connected_clients)
-                                                 * sizeof(pid_t));
-        }
-    }
-}
-
 /*
 ** Create a server socket and listen for connections
 **
 ** port: the port number to listen on.
+** backlog: the length of the queue of pending connections.
 ** 
 ** On success, returns the file descriptor of the socket.
 ** On failure, return -1.
 */
-static int initialize_server_socket(int port) {
+static int initialize_server_socket(int port, int backlog) {
 	struct sockaddr_in server_addr;
 
 	//initializing the sockaddr_in struct:
@@ -430,8 +568,8 @@ static int initialize_server_socket(int port) {
 	    return socket_fd;
 	}
 
-	//set up the socket using the sockaddr_in struct with MAX_PENDING num_queue.
-	socket_fd = set_up_server_socket(&server_addr, MAX_PENDING);
+	//set up the socket using the sockaddr_in struct with a backlog-long num_queue.
+	socket_fd = set_up_server_socket(&server_addr, backlog);
 
 	if (socket_fd == -1)
 	{
@@ -441,275 +579,1156 @@ static int initialize_server_socket(int port) {
 	return socket_fd;
 }
 
-int run_server(int port, const char *library_directory){
-    Library library = make_library(library_directory);
-    if (scan_library(&library) < 0) {
-        ERR_PRINT("Error scanning library\n");
+// Tokens stored in epoll_event.data.ptr for the two fds that are not connections
+static int listen_token;
+static int quit_token;
+
+
+static double _monotonic_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+/*
+** Change the events epoll reports for a connection, if they differ.
+**
+** return 0 on success, -1 on error
+*/
+static int _watch_connection(EventLoop *loop, Connection *conn, uint32_t events) {
+    if (conn->epoll_events == events) {
+        return 0;
+    }
+
+    struct epoll_event event = {.events = events, .data.ptr = conn};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->client.socket, &event) < 0) {
+        perror("epoll_ctl");
         return -1;
     }
+    conn->epoll_events = events;
+    return 0;
+}
 
-    int num_connected_clients = 0;
-    pid_t *client_conn_pids = NULL;
 
-	int incoming_connections = initialize_server_socket(port);
-	if (incoming_connections == -1) {
-		return -1;	
-	}
-	
-    int maxfd = incoming_connections;
-    fd_set incoming;
-    SET_SERVER_FD_SET(incoming, incoming_connections);
-    int num_intervals_without_scan = 0;
-
-    while(1) {
-        if (num_intervals_without_scan >= LIBRARY_SCAN_INTERVAL) {
-            if (scan_library(&library) < 0) {
-                fprintf(stderr, "Error scanning library\n");
-                return 1;
-            }
-            num_intervals_without_scan = 0;
-        }
+static void _close_connection(EventLoop *loop, Connection *conn) {
+    printf("Client on %s:%d disconnected\n",
+           inet_ntoa(conn->client.addr.sin_addr),
+           ntohs(conn->client.addr.sin_port));
+
+    _unschedule(loop, conn);
+    _reset_response(conn);
+    frame_end(conn);
+    close(conn->client.socket); // also removes it from the epoll set
+
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    loop->num_connections--;
+    stats_add(&loop->stats->closed, 1);
+    free(conn);
+}
 
-        struct timeval select_timeout = SELECT_TIMEOUT;
-        if(select(maxfd + 1, &incoming, NULL, NULL, &select_timeout) < 0){
-            perror("run_server");
-            exit(1);
-        }
 
-        if (FD_ISSET(incoming_connections, &incoming)) {
-            ClientSocket client_socket = accept_connection(incoming_connections);
+/*
+** Accept every pending connection, and start watching each for requests.
+*/
+static void _accept_connections(EventLoop *loop) {
+    while (1) {
+        ClientSocket client = accept_connection(loop->listen_fd);
+        if (client.socket < 0) {
+            return;
+        }
 
-            pid_t pid = fork();
-            if(pid == -1){
-                perror("run_server");
-                exit(-1);
-            }
-            // child process
-            if(pid == 0){
-                close(incoming_connections);
-                free(client_conn_pids);
-                int result = handle_client(&client_socket, &library);
-                _free_library(&library);
-                close(client_socket.socket);
-                return result;
-            }
-            close(client_socket.socket);
-            num_connected_clients++;
-            client_conn_pids = (pid_t *)realloc(client_conn_pids,
-                                               (num_connected_clients)
-                                               * sizeof(pid_t));
-            client_conn_pids[num_connected_clients - 1] = pid;
+        Connection *conn = (Connection *)calloc(1, sizeof(Connection));
+        if (conn == NULL) {
+            perror("_accept_connections: calloc");
+            close(client.socket);
+            return;
         }
-        if (FD_ISSET(STDIN_FILENO, &incoming)) {
-            if (getchar() == 'q') break;
+        conn->client = client;
+        conn->state = CONN_READING_REQUEST;
+        transfer_init(&conn->transfer);
+        conn->buffer_index = -1;
+        conn->stats = loop->stats;
+        conn->framing = 1;
+        conn->epoll_events = EPOLLIN;
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client.socket, &event) < 0) {
+            perror("_accept_connections: epoll_ctl");
+            close(client.socket);
+            free(conn);
+            return;
         }
 
-        num_intervals_without_scan++;
-        SET_SERVER_FD_SET(incoming, incoming_connections);
-
-        // Immediate return wait for client processes
-        _wait_for_children(&client_conn_pids, &num_connected_clients, 1);
+        conn->next = loop->connections;
+        if (loop->connections != NULL) {
+            loop->connections->prev = conn;
+        }
+        loop->connections = conn;
+        loop->num_connections++;
+        stats_add(&loop->stats->accepted, 1);
     }
-
-    printf("Quitting server\n");
-    close(incoming_connections);
-    _wait_for_children(&client_conn_pids, &num_connected_clients, 0);
-    _free_library(&library);
-    return 0;
 }
 
 
-static uint8_t _is_file_extension_supported(const char *filename){
-    static const char *supported_file_exts[] = SUPPORTED_FILE_EXTS;
-
-    for (int i = 0; i < sizeof(supported_file_exts)/sizeof(char *); i++) {
-        char *files_ext = strrchr(filename, '.');
-        if (files_ext != NULL && strcmp(files_ext, supported_file_exts[i]) == 0) {
-            return 1;
+/*
+** Read what the client sent into the connection's request buffer.
+**
+** return 0 on success, -1 if the connection must be closed
+*/
+static int _read_requests(Connection *conn) {
+    int bytes_read = read(conn->client.socket, conn->request_buffer + conn->bytes_in_buf,
+                          REQUEST_BUFFER_SIZE - conn->bytes_in_buf);
+    if (bytes_read == 0) {
+        return -1; // client disconnected
+    }
+    if (bytes_read < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("_service_connection: read");
+            return -1;
         }
+    } else {
+        #ifdef DEBUG
+        printf("Read %d bytes from client\n", bytes_read);
+        #endif
+        conn->bytes_in_buf += bytes_read;
     }
-
     return 0;
 }
 
 
-static int _depth_scan_library(Library *library, char *current_path){
-
-    char *path_in_lib = _join_path(library->path, current_path);
-    if (path_in_lib == NULL) {
-        return -1;
+/*
+** Watch a framed connection for what it waits on: for frames while there is
+** room to buffer them, and if it has something to send, for room in its
+** socket, or else for its turn to send.
+**
+** return 0 on success, -1 on error
+*/
+static int _watch_frames(EventLoop *loop, Connection *conn) {
+    uint32_t events = conn->bytes_in_buf < REQUEST_BUFFER_SIZE ? EPOLLIN : 0;
+    if (frame_has_output(conn->frames)) {
+        if (conn->frames->blocked) {
+            events |= EPOLLOUT;
+        } else {
+            _schedule(loop, conn);
+        }
     }
+    return _watch_connection(loop, conn, events);
+}
 
-    DIR *dir = opendir(path_in_lib);
-    if (dir == NULL) {
-        perror("scan_library");
-        return -1;
-    }
-    free(path_in_lib);
-
-    struct dirent *entry;
-    while((entry = readdir(dir)) != NULL) {
-        if ((entry->d_type == DT_REG) &&
-            _is_file_extension_supported(entry->d_name)) {
-            library->files = (char **)realloc(library->files,
-                                              (library->num_files + 1)
-                                              * sizeof(char *));
-            if (library->files == NULL) {
-                perror("_depth_scan_library");
-                return -1;
-            }
 
-            library->files[library->num_files] = _join_path(current_path, entry->d_name);
-            if (library->files[library->num_files] == NULL) {
-                perror("scan_library");
+/*
+** Advance a connection's state machine after epoll reported events on it: read
+** any new requests and answer them. A response is sent when the connection
+** takes its turn (see _take_turn).
+**
+** return 0 to keep the connection, -1 to close it
+*/
+static int _service_connection(EventLoop *loop, Connection *conn, uint32_t events) {
+    if (conn->state == CONN_RADIO) {
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            // a listener has nothing more to ask: it is only read from to see it hang up
+            if (_read_requests(conn) < 0) {
                 return -1;
             }
-            #ifdef DEBUG
-            printf("Found file: %s\n", library->files[library->num_files]);
-            #endif
-            library->num_files++;
+            conn->bytes_in_buf = 0;
+        }
+        if (events & EPOLLOUT) {
+            _schedule(loop, conn); // the socket has room again
+            return _watch_connection(loop, conn, EPOLLIN);
+        }
+        return 0;
+    }
 
-        } else if (entry->d_type == DT_DIR) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                continue;
-            }
+    if (conn->state == CONN_SENDING) {
+        if (events & (EPOLLHUP | EPOLLERR)) {
+            return -1; // nobody left to send it to
+        }
+        if (events & EPOLLOUT) {
+            _schedule(loop, conn); // the socket has room again
+        }
+        // requests that come in meanwhile wait for the response to be done
+        return _watch_connection(loop, conn, 0);
+    }
 
-            char *new_path = _join_path(current_path, entry->d_name);
-            if (new_path == NULL) {
+    if (conn->state == CONN_FRAMED) {
+        if (events & EPOLLOUT) {
+            conn->frames->blocked = 0;
+        }
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            if (conn->bytes_in_buf == REQUEST_BUFFER_SIZE || _read_requests(conn) < 0) {
                 return -1;
             }
+        }
+        if (frame_handle_requests(conn, loop->snapshot, loop->cache) < 0) {
+            return -1;
+        }
+        return _watch_frames(loop, conn);
+    }
 
-            #ifdef DEBUG
-            printf("Library scan descending into directory: %s\n", new_path);
-            #endif
-
-            int ret_code = _depth_scan_library(library, new_path);
-            free(new_path);
-            if (ret_code < 0) {
-                return -1;
-            }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        if (_read_requests(conn) < 0) {
+            return -1;
         }
     }
 
-    closedir(dir);
+    if (handle_client_requests(conn, loop->snapshot, loop->cache) < 0) {
+        return -1;
+    }
+    if (conn->state == CONN_SENDING || conn->state == CONN_RADIO) {
+        _schedule(loop, conn);
+    } else if (conn->state == CONN_FRAMED) {
+        return _watch_frames(loop, conn);
+    }
     return 0;
 }
 
 
-// This function is implemented recursively and uses realloc to grow the files array
-// as it finds more files in the library. It ignores MAX_FILES.
-int scan_library(Library *library) {
-    // Maximal flexibility, free the old strings and start again
-    // A hash table leveraging inode number would be a better way to do this
-    #ifdef DEBUG
-    printf("^^^^ ----------------------------------- ^^^^\n");
-    printf("Freeing library\n");
-    #endif
-    _free_library(library);
-
-    #ifdef DEBUG
-    printf("Scanning library\n");
-    #endif
-    int result = _depth_scan_library(library, "");
-    #ifdef DEBUG
-    printf("vvvv ----------------------------------- vvvv\n");
-    #endif
-    return result;
+/*
+** A framed connection's turn to send: its control frames, and DATA frames up
+** to its deficit as the uplink's tokens allow. Requests that were held back
+** for room to answer them are handled as the control frames go out.
+**
+** return as for _take_turn
+*/
+static int _take_frames_turn(EventLoop *loop, Connection *conn, uint64_t now) {
+    FrameSession *session = conn->frames;
+    while (1) {
+        uint64_t max_bytes = 0;
+        if (frame_data_ready(session) > 0) {
+            uint64_t link_allowance = _link_allowance(loop, conn, now);
+            if (link_allowance == 0) {
+                return 1;
+            }
+            max_bytes = MIN(link_allowance, conn->deficit);
+        }
+
+        uint64_t data_sent = session->data_sent;
+        int sent = frame_send(conn, max_bytes);
+        uint64_t bytes = session->data_sent - data_sent;
+        _pace_charge(loop, conn, bytes);
+        conn->deficit -= MIN(bytes, conn->deficit);
+
+        if (sent < 0 || frame_handle_requests(conn, loop->snapshot, loop->cache) < 0) {
+            return -1;
+        }
+        if (sent == 0) {
+            conn->deficit = 0;
+            session->blocked = 1;
+            return _watch_frames(loop, conn);
+        }
+        if (sent == 2 && conn->deficit > 0) {
+            continue; // out of tokens
+        }
+
+        // its turn is over, or it has nothing more it may send
+        conn->deficit = 0;
+        return _watch_frames(loop, conn);
+    }
 }
 
 
-int handle_client(const ClientSocket * client, Library *library) {
-    char *request = NULL;
-    uint8_t *request_buffer = (uint8_t *)malloc(REQUEST_BUFFER_SIZE);
-    if (request_buffer == NULL) {
-        perror("handle_client");
-        return 1;
+/*
+** A radio listener's turn: everything on air it has not been sent. Its station
+** paces it, so it takes no deficit, but it shares the uplink. Once it has
+** caught up, it waits for the station's next chunk on its pace_timer.
+**
+** return 0 to keep the connection, -1 to close it
+*/
+static int _take_radio_turn(EventLoop *loop, Connection *conn) {
+    uint64_t bytes;
+    int sent = radio_send(conn, &bytes);
+    bucket_take(&loop->link, bytes);
+    conn->deficit = 0;
+    if (sent < 0) {
+        return -1;
+    }
+    if (sent == 0) {
+        return _watch_connection(loop, conn, EPOLLIN | EPOLLOUT);
     }
-    uint8_t *buff_end = request_buffer;
+    wheel_add(&loop->wheel, &conn->pace_timer, conn, radio_next_due(conn->station));
+    return _watch_connection(loop, conn, EPOLLIN);
+}
 
-    int bytes_read = 0;
-    int bytes_in_buf = 0;
-    while((bytes_read = read(client->socket, buff_end, REQUEST_BUFFER_SIZE - bytes_in_buf)) > 0){
-        #ifdef DEBUG
-        printf("Read %d bytes from client\n", bytes_read);
-        #endif
 
-        bytes_in_buf += bytes_read;
+/*
+** A connection's turn to send: as much of its deficit (see _schedule) as its
+** tokens allow. If it has more to send, it goes to the back of the line, or
+** waits for its tokens (pace_timer) or for its socket to have room (EPOLLOUT).
+** Once its response is done, a pipelined request is answered right away.
+**
+** return 0 to keep the connection, 1 if the uplink ran out of tokens before
+** its turn was over, -1 to close it
+*/
+static int _take_turn(EventLoop *loop, Connection *conn, uint64_t now) {
+    if (conn->state == CONN_FRAMED) {
+        return _take_frames_turn(loop, conn, now);
+    }
+    if (conn->state == CONN_RADIO) {
+        return _take_radio_turn(loop, conn);
+    }
 
-        request = find_network_newline((char *)request_buffer, &bytes_in_buf);
+    while (1) {
+        uint64_t max_bytes = 0;
+        if (conn->transfer.remaining > 0) {
+            uint64_t allowance = _pace_allowance(loop, conn, now);
+            if (allowance == 0) {
+                conn->deficit = 0;
+                return 0; // waiting for its pace_timer
+            }
+            uint64_t link_allowance = _link_allowance(loop, conn, now);
+            if (link_allowance == 0) {
+                return 1;
+            }
+            max_bytes = MIN(MIN(allowance, link_allowance), conn->deficit);
+        }
 
-        if (request && strcmp(request, REQUEST_LIST) == 0) {
-            if (list_request_response(client, library) < 0) {
-                ERR_PRINT("Error handling LIST request\n");
-                goto client_error;
+        uint64_t remaining = conn->transfer.remaining;
+        int sent = send_response(conn, max_bytes);
+        uint64_t bytes = remaining - conn->transfer.remaining; // all of it, once the response is done
+        _pace_charge(loop, conn, bytes);
+        conn->deficit -= MIN(bytes, conn->deficit);
+
+        if (sent < 0) {
+            return -1;
+        }
+        if (sent == 0) {
+            conn->deficit = 0;
+            return _watch_connection(loop, conn, EPOLLOUT);
+        }
+        if (sent == 2) {
+            if (conn->deficit == 0) {
+                _schedule(loop, conn); // that was its turn
+                return 0;
             }
+            continue; // out of tokens
+        }
 
-        } else if (request && strcmp(request, REQUEST_STREAM) == 0) {
-            int num_pr_bytes = MIN(sizeof(uint32_t), (unsigned long)bytes_in_buf);
-            if (stream_request_response(client, library, request_buffer, num_pr_bytes) < 0) {
-                ERR_PRINT("Error handling STREAM request\n");
-                goto client_error;
+        // response done: the line is a response at a time
+        conn->deficit = 0;
+        if (handle_client_requests(conn, loop->snapshot, loop->cache) < 0) {
+            return -1;
+        }
+        if (conn->state == CONN_SENDING || conn->state == CONN_RADIO) {
+            _schedule(loop, conn);
+            return 0;
+        }
+        if (conn->state == CONN_FRAMED) {
+            return _watch_frames(loop, conn);
+        }
+        return _watch_connection(loop, conn, EPOLLIN);
+    }
+}
+
+
+/*
+** Put the connections whose tokens have come in back in line, then give each
+** connection in line one turn, unless the uplink is out of tokens: then the
+** line waits for them (until link_due), and the connection whose turn it is
+** carries on where it left off.
+*/
+static void _run_scheduler(EventLoop *loop) {
+    uint64_t now = monotonic_ns();
+    for (Timer *timer = wheel_expire(&loop->wheel, now); timer != NULL;) {
+        Timer *next = timer->next;
+        _schedule(loop, (Connection *)timer->owner);
+        timer = next;
+    }
+    if (loop->link_due > now) {
+        return;
+    }
+    loop->link_due = 0;
+
+    // those put back in line on their turn wait for the next round
+    Connection *last = loop->active_tail;
+    int last_turn = last == NULL;
+    while (!last_turn) {
+        Connection *conn = _next_scheduled(loop);
+        last_turn = conn == last;
+
+        int ret = _take_turn(loop, conn, monotonic_ns());
+        if (ret < 0) {
+            _close_connection(loop, conn);
+        } else if (ret == 1) {
+            // first in line again
+            conn->scheduled = 1;
+            conn->next_active = loop->active_head;
+            loop->active_head = conn;
+            if (loop->active_tail == NULL) {
+                loop->active_tail = conn;
             }
-            bytes_in_buf -= num_pr_bytes;
-            memmove(request_buffer, request_buffer + num_pr_bytes, bytes_in_buf);
+            break;
+        }
+    }
+}
 
-        } else if (request) {
-            ERR_PRINT("Unknown request: %s\n", request);
+
+/*
+** Copy the index into a new snapshot, with no references yet.
+**
+** return the snapshot, or NULL on error
+*/
+static LibrarySnapshot *_snapshot_index(const LibraryIndex *index, char *name,
+                                        ContentIndex *content, RadioStations *radio) {
+    LibrarySnapshot *snapshot = (LibrarySnapshot *)calloc(1, sizeof(LibrarySnapshot));
+    if (snapshot == NULL) {
+        perror("_snapshot_index: calloc");
+        return NULL;
+    }
+
+    if (index_copy_library(index, &snapshot->library, &snapshot->paths) < 0) {
+        free(snapshot);
+        return NULL;
+    }
+    snapshot->library.name = name;
+    snapshot->content = content;
+    snapshot->radio = radio;
+
+    snapshot->list = _build_list_payload(&snapshot->library);
+    if (snapshot->list == NULL || query_index_build(&snapshot->query, &snapshot->library) < 0) {
+        if (snapshot->list != NULL) {
+            _release_list_payload(snapshot->list);
         }
+        free(snapshot->library.files);
+        free(snapshot->paths);
+        free(snapshot);
+        return NULL;
+    }
+
+    atomic_init(&snapshot->refs, 0);
+    return snapshot;
+}
 
-        free(request); request = NULL;
-        buff_end = request_buffer + bytes_in_buf;
 
+void _release_snapshot(LibrarySnapshot *snapshot) {
+    if (atomic_fetch_sub_explicit(&snapshot->refs, 1, memory_order_acq_rel) == 1) {
+        _release_list_payload(snapshot->list);
+        query_index_free(&snapshot->query);
+        free(snapshot->library.files);
+        free(snapshot->paths);
+        free(snapshot);
     }
-    if (bytes_read < 0) {
-        perror("handle_client");
-        goto client_error;
+}
+
+
+/*
+** Make snapshot the current one. The previous snapshot lives on until the last
+** worker answering requests from it moves on.
+*/
+static void _publish_snapshot(SharedLibrary *shared, LibrarySnapshot *snapshot) {
+    atomic_fetch_add_explicit(&snapshot->refs, 1, memory_order_relaxed);
+
+    pthread_mutex_lock(&shared->lock);
+    LibrarySnapshot *old = shared->current;
+    shared->current = snapshot;
+    atomic_fetch_add_explicit(&shared->generation, 1, memory_order_release);
+    pthread_mutex_unlock(&shared->lock);
+
+    if (old != NULL) {
+        _release_snapshot(old);
     }
+}
 
-    printf("Client on %s:%d disconnected\n",
-           inet_ntoa(client->addr.sin_addr),
-           ntohs(client->addr.sin_port));
 
-    free(request_buffer);
-    if (request != NULL) {
-        free(request);
+LibrarySnapshot *_acquire_snapshot(SharedLibrary *shared, unsigned int *generation) {
+    pthread_mutex_lock(&shared->lock);
+    LibrarySnapshot *snapshot = shared->current;
+    atomic_fetch_add_explicit(&snapshot->refs, 1, memory_order_relaxed);
+    *generation = atomic_load_explicit(&shared->generation, memory_order_relaxed);
+    pthread_mutex_unlock(&shared->lock);
+    return snapshot;
+}
+
+
+void _refresh_snapshot(EventLoop *loop) {
+    SharedLibrary *shared = loop->shared_library;
+    if (loop->snapshot != NULL &&
+        atomic_load_explicit(&shared->generation, memory_order_acquire) == loop->snapshot_generation) {
+        return;
     }
-    return 0;
-client_error:
-    free(request_buffer);
-    if (request != NULL) {
+
+    LibrarySnapshot *snapshot = _acquire_snapshot(shared, &loop->snapshot_generation);
+    if (loop->snapshot != NULL) {
+        _release_snapshot(loop->snapshot);
+    }
+    loop->snapshot = snapshot;
+}
+
+
+/*
+** Set up a worker's event loop: its own listening socket on the port, and for
+** the epoll engine, an epoll instance watching that socket and the quit eventfd.
+*/
+static void _init_event_loop(EventLoop *loop, const ServerOptions *options,
+                             SharedLibrary *shared, FileCache *cache, WorkerStats *stats, int quit_fd) {
+    loop->listen_fd = initialize_server_socket(options->port, options->backlog);
+    if (loop->listen_fd == -1) {
+        exit(1);
+    }
+    loop->engine = options->engine;
+    loop->quit_fd = quit_fd;
+    loop->shared_library = shared;
+    loop->cache = cache;
+    loop->stats = stats;
+    loop->snapshot = NULL;
+    loop->connections = NULL;
+    loop->num_connections = 0;
+
+    uint64_t now = monotonic_ns();
+    wheel_init(&loop->wheel, now);
+    uint64_t link_rate = options->uplink_rate / options->num_workers;
+    uint64_t link_burst = link_rate * PACE_LINK_BURST_MS / 1000;
+    bucket_init(&loop->link, link_rate, link_burst > PACE_MIN_SEND ? link_burst : PACE_MIN_SEND, now);
+    loop->active_head = loop->active_tail = NULL;
+    loop->link_due = 0;
+
+    loop->epoll_fd = -1;
+    if (loop->engine != ENGINE_EPOLL) {
+        return; // the io_uring engine sets up its ring in the worker thread
+    }
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("run_server: epoll_create1");
+        exit(1);
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = &listen_token};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &event) < 0) {
+        perror("run_server: epoll_ctl");
+        exit(1);
+    }
+    // Never read, so once the server quits it wakes every worker
+    event.data.ptr = &quit_token;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, quit_fd, &event) < 0) {
+        perror("run_server: epoll_ctl");
+        exit(1);
+    }
+}
+
+
+/*
+** A worker thread: serve connections on the loop until the server quits.
+*/
+static void *_run_event_loop(void *arg) {
+    EventLoop *loop = (EventLoop *)arg;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int quit = 0;
+
+    while (!quit) {
+        _refresh_snapshot(loop);
+
+        uint64_t now = monotonic_ns();
+        int timeout = wheel_timeout_ms(&loop->wheel, now, EPOLL_TIMEOUT_MS);
+        if (loop->active_head != NULL) {
+            // connections in line to send only check for new events between rounds,
+            // or while the uplink is out of tokens
+            uint64_t wait_ms = loop->link_due > now ? (loop->link_due - now + NS_PER_MS - 1) / NS_PER_MS : 0;
+            timeout = MIN(timeout, (int)wait_ms);
+        }
+        int num_events = epoll_wait(loop->epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+        if (num_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("run_server");
+            exit(1);
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            if (events[i].data.ptr == &listen_token) {
+                _accept_connections(loop);
+            } else if (events[i].data.ptr == &quit_token) {
+                quit = 1;
+            } else {
+                Connection *conn = (Connection *)events[i].data.ptr;
+                if (_service_connection(loop, conn, events[i].events) < 0) {
+                    _close_connection(loop, conn);
+                }
+            }
+        }
+
+        _run_scheduler(loop);
+    }
+
+    while (loop->connections != NULL) {
+        _close_connection(loop, loop->connections);
+    }
+    close(loop->epoll_fd);
+    close(loop->listen_fd);
+    _release_snapshot(loop->snapshot);
+    return NULL;
+}
+
+
+/*
+** The main thread's share of the work until the user types q: apply the
+** library changes inotify reports to the index, and publish them to the
+** workers as a new snapshot. A burst of changes (e.g. an album being copied in)
+** is published at once, INDEX_PUBLISH_DELAY_MS after its first change. If the
+** library cannot be watched, it is rescanned every LIBRARY_SCAN_INTERVAL
+** seconds instead. The file cache (if there is one) is reported on every
+** interval, and the content index checks for files changed in place. The
+** workers' stats are logged every STATS_LOG_INTERVAL seconds. The index is
+** saved on an interval that follows a publish, and when the user quits, rather
+** than on each publish: a library that keeps changing (e.g. being rsynced
+** into) would otherwise have the whole index rewritten several times a second.
+**
+** return 0 when the user quits, 1 if the index cannot be updated
+*/
+static int _watch_library(SharedLibrary *shared, LibraryIndex *index, char *name,
+                          FileCache *cache, ContentIndex *content, RadioStations *radio,
+                          ServerStats *stats) {
+    struct pollfd fds[2] = {
+        {.fd = STDIN_FILENO, .events = POLLIN},
+        {.fd = index->inotify_fd, .events = POLLIN},
+    };
+    double last_interval = _monotonic_seconds();
+    double publish_at = 0; // when to publish the index's changes, 0 if there are none
+    int unsaved = 0;       // changes were published since the index was last saved
+    double last_stats = last_interval;
+    StatsTotals logged;
+    stats_collect(stats, &logged);
+
+    while (1) {
+        double now = _monotonic_seconds();
+        if (index->changed && publish_at == 0) {
+            // changed since the last round (or before the first)
+            publish_at = now + INDEX_PUBLISH_DELAY_MS / 1000.0;
+        }
+        double wake_at = last_interval + LIBRARY_SCAN_INTERVAL;
+        if (last_stats + STATS_LOG_INTERVAL < wake_at) {
+            wake_at = last_stats + STATS_LOG_INTERVAL;
+        }
+        if (publish_at > 0 && publish_at < wake_at) {
+            wake_at = publish_at;
+        }
+        int timeout_ms = wake_at > now ? (int)((wake_at - now) * 1000) + 1 : 0;
+
+        fds[1].fd = index->inotify_fd; // -1 (ignored) if the index stopped watching
+        int ready = poll(fds, 2, timeout_ms);
+        if (ready < 0 && errno != EINTR) {
+            perror("run_server: poll");
+            exit(1);
+        }
+        if (ready > 0 && fds[0].revents != 0) {
+            int c = (fds[0].revents & POLLNVAL) ? EOF : getchar();
+            if (c == 'q') {
+                if (unsaved || index->changed) {
+                    index_save(index);
+                }
+                return 0;
+            } else if (c == EOF) {
+                // stdin closed (e.g. running in the background): stop watching it
+                fds[0].fd = -1;
+            }
+        }
+        if (ready > 0 && fds[1].fd >= 0 && fds[1].revents != 0) {
+            if (index_process_events(index) < 0) {
+                fprintf(stderr, "Error updating library index\n");
+                return 1;
+            }
+        }
+
+        now = _monotonic_seconds();
+        if (now - last_stats >= STATS_LOG_INTERVAL) {
+            stats_log(stats, &logged, now - last_stats);
+            last_stats = now;
+        }
+        if (now - last_interval >= LIBRARY_SCAN_INTERVAL) {
+            if (index->inotify_fd < 0) {
+                uint64_t started = monotonic_ns();
+                if (index_rescan(index) < 0) {
+                    fprintf(stderr, "Error scanning library\n");
+                    return 1;
+                }
+                stats_scan_done(stats, started);
+            }
+            last_interval = now;
+            if (unsaved) {
+                index_save(index);
+                unsaved = 0;
+            }
+
+            if (cache != NULL) {
+                cache_report(cache);
+            }
+            content_index_wake(content);
+        }
+
+        if (publish_at > 0 && now >= publish_at) {
+            LibrarySnapshot *snapshot = _snapshot_index(index, name, content, radio);
+            if (snapshot == NULL) {
+                fprintf(stderr, "Error updating library\n");
+                return 1;
+            }
+            _publish_snapshot(shared, snapshot);
+            content_index_wake(content);
+            index->changed = 0;
+            publish_at = 0;
+            unsaved = 1;
+            #ifdef DEBUG
+            printf("Published library with %u files\n", snapshot->library.num_files);
+            #endif
+        }
+    }
+}
+
+
+int run_server(const ServerOptions *options){
+    ServerStats stats;
+    if (stats_init(&stats, options->num_workers) < 0) {
+        return -1;
+    }
+
+    // start from the index the last run saved, if there is one, and check it
+    // against the library once the workers are serving it
+    Library library = make_library(options->library_directory);
+    LibraryIndex index;
+    int loaded = index_load(&index, library.path, 1) == 0;
+    uint64_t scan_started = monotonic_ns();
+    if (!loaded) {
+        if (index_init(&index, library.path, 1) < 0) {
+            ERR_PRINT("Error scanning library\n");
+            stats_free(&stats);
+            return -1;
+        }
+        stats_scan_done(&stats, scan_started);
+    }
+
+    SharedLibrary shared = {.lock = PTHREAD_MUTEX_INITIALIZER, .current = NULL};
+    atomic_init(&shared.generation, 0);
+    ContentIndex content;
+    if (content_index_init(&content, &shared, library.path) < 0) {
+        index_free(&index);
+        stats_free(&stats);
+        return -1;
+    }
+
+    RadioStations radio;
+    radio_init(&radio);
+
+    LibrarySnapshot *snapshot = _snapshot_index(&index, library.name, &content, &radio);
+    if (snapshot == NULL) {
+        radio_free(&radio);
+        content_index_free(&content);
+        index_free(&index);
+        stats_free(&stats);
+        return -1;
+    }
+    index.changed = 0;
+    _publish_snapshot(&shared, snapshot);
+    if (content_index_start(&content) < 0) {
+        exit(1);
+    }
+
+    ServerOptions worker_options = *options;
+    if (worker_options.engine == ENGINE_URING && !uring_available()) {
+        printf("io_uring is not available, using epoll\n");
+        worker_options.engine = ENGINE_EPOLL;
+    }
+
+    FileCache file_cache;
+    FileCache *cache = NULL;
+    if (options->cache_budget > 0) {
+        cache_init(&file_cache, options->cache_budget);
+        cache = &file_cache;
+    }
+
+    int quit_fd = eventfd(0, EFD_CLOEXEC);
+    if (quit_fd < 0) {
+        perror("run_server: eventfd");
+        exit(1);
+    }
+
+    int num_workers = options->num_workers;
+    EventLoop *loops = (EventLoop *)calloc(num_workers, sizeof(EventLoop));
+    if (loops == NULL) {
+        perror("run_server: calloc");
+        exit(1);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        _init_event_loop(&loops[i], &worker_options, &shared, cache, &stats.workers[i], quit_fd);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        int error = pthread_create(&loops[i].thread, NULL,
+                                   worker_options.engine == ENGINE_URING ? run_uring_loop : _run_event_loop,
+                                   &loops[i]);
+        if (error != 0) {
+            ERR_PRINT("run_server: pthread_create: %s\n", strerror(error));
+            exit(1);
+        }
+    }
+    printf("Serving with %d worker threads (%s)\n", num_workers,
+           worker_options.engine == ENGINE_URING ? "io_uring" : "epoll");
+
+    int result = 0;
+    if (loaded) {
+        // what changed since the last run is published like any other change
+        scan_started = monotonic_ns();
+        if (index_rescan(&index) < 0) {
+            fprintf(stderr, "Error scanning library\n");
+            result = 1;
+        } else {
+            stats_scan_done(&stats, scan_started);
+            #ifdef DEBUG
+            printf("Checked library index in %.1f ms%s\n", (monotonic_ns() - scan_started) / 1e6,
+                   index.changed ? ", publishing changes" : "");
+            #endif
+        }
+    }
+    if (result == 0) {
+        if (!loaded) {
+            index_save(&index); // a loaded index is saved once its changes are (see _watch_library)
+        }
+        if (index.inotify_fd >= 0) {
+            printf("Watching library for changes\n");
+        }
+        result = _watch_library(&shared, &index, library.name, cache, &content, &radio, &stats);
+    }
+
+    printf("Quitting server\n");
+    uint64_t quit = 1;
+    if (write(quit_fd, &quit, sizeof(quit)) < 0) {
+        perror("run_server: write");
+        exit(1);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(loops[i].thread, NULL);
+    }
+    free(loops);
+    close(quit_fd);
+    if (cache != NULL) {
+        cache_report(cache);
+        cache_free(cache);
+    }
+    content_index_free(&content);
+    radio_free(&radio);
+    _release_snapshot(shared.current);
+    pthread_mutex_destroy(&shared.lock);
+    index_free(&index);
+    stats_free(&stats);
+    return result;
+}
+
+
+int scan_library(Library *library) {
+    _free_library(library);
+
+    LibraryIndex index;
+    if (index_init(&index, library->path, 0) < 0) {
+        return -1;
+    }
+    int result = 0;
+    library->files = (char **)malloc((index.library.num_files > 0 ? index.library.num_files : 1) * sizeof(char *));
+    if (library->files == NULL) {
+        perror("scan_library: malloc");
+        result = -1;
+    }
+    for (uint32_t i = 0; result == 0 && i < index.library.num_files; i++) {
+        library->files[i] = strdup(index.library.files[i]);
+        if (library->files[i] == NULL) {
+            perror("scan_library: strdup");
+            result = -1;
+            break;
+        }
+        library->num_files++;
+    }
+
+    index_free(&index);
+    if (result < 0) {
+        _free_library(library);
+    }
+    return result;
+}
+
+
+/*
+** Count a request of the given kind, complete in the request buffer now, and
+** time it until its response is sent.
+*/
+static void _start_request(Connection *conn, StatKind kind) {
+    stats_add(&conn->stats->requests[kind], 1);
+    conn->request_kind = kind;
+    conn->request_started = monotonic_ns();
+}
+
+
+int handle_client_requests(Connection *conn, LibrarySnapshot *snapshot, FileCache *cache) {
+    while (conn->state != CONN_SENDING && conn->state != CONN_RADIO) {
+        if (conn->state == CONN_FRAMED) {
+            // frames the client sent straight after switching
+            return frame_handle_requests(conn, snapshot, cache);
+        }
+
+        if (conn->state == CONN_READING_INDEX) {
+            //the file index follows the request line.
+            if (conn->bytes_in_buf < sizeof(uint32_t)) {
+                return 0;
+            }
+
+            uint32_t file_index = convert_uint8_to_uint32(conn->request_buffer);
+            conn->bytes_in_buf -= sizeof(uint32_t);
+            memmove(conn->request_buffer, conn->request_buffer + sizeof(uint32_t), conn->bytes_in_buf);
+            conn->state = CONN_READING_REQUEST;
+
+            _start_request(conn, STAT_STREAM);
+            if (stream_request_response(conn, &snapshot->library, cache, file_index) < 0) {
+                ERR_PRINT("Error handling STREAM request\n");
+                stats_add(&conn->stats->errors, 1);
+                return -1;
+            }
+            continue;
+        }
+
+        if (conn->state == CONN_READING_HASH) {
+            //the file index follows the request line.
+            if (conn->bytes_in_buf < sizeof(uint32_t)) {
+                return 0;
+            }
+
+            uint32_t file_index = convert_uint8_to_uint32(conn->request_buffer);
+            conn->bytes_in_buf -= sizeof(uint32_t);
+            memmove(conn->request_buffer, conn->request_buffer + sizeof(uint32_t), conn->bytes_in_buf);
+            conn->state = CONN_READING_REQUEST;
+
+            _start_request(conn, STAT_HASH);
+            if (hash_request_response(conn, snapshot, file_index) < 0) {
+                ERR_PRINT("Error handling HASH request\n");
+                stats_add(&conn->stats->errors, 1);
+                return -1;
+            }
+            continue;
+        }
+
+        if (conn->state == CONN_READING_STATION) {
+            //the file index follows the request line.
+            if (conn->bytes_in_buf < sizeof(uint32_t)) {
+                return 0;
+            }
+
+            uint32_t file_index = convert_uint8_to_uint32(conn->request_buffer);
+            conn->bytes_in_buf -= sizeof(uint32_t);
+            memmove(conn->request_buffer, conn->request_buffer + sizeof(uint32_t), conn->bytes_in_buf);
+            conn->state = CONN_READING_REQUEST;
+
+            _start_request(conn, STAT_RADIO);
+            if (radio_tune(conn, snapshot->radio, &snapshot->library, file_index) < 0) {
+                ERR_PRINT("Error handling RADIO request\n");
+                stats_add(&conn->stats->errors, 1);
+                return -1;
+            }
+            continue;
+        }
+
+        if (conn->state == CONN_READING_QUERY) {
+            //the mode, offset, limit and pattern length follow the request line, then the pattern.
+            if (conn->bytes_in_buf < QUERY_FIELDS_SIZE) {
+                return 0;
+            }
+            size_t pattern_len = conn->request_buffer[QUERY_FIELDS_SIZE - 1];
+            if (pattern_len > QUERY_PATTERN_MAX) {
+                ERR_PRINT("LIST_QUERY pattern of %zu bytes is too long\n", pattern_len);
+                stats_add(&conn->stats->errors, 1);
+                return -1;
+            }
+            if (conn->bytes_in_buf < QUERY_FIELDS_SIZE + pattern_len) {
+                return 0;
+            }
+
+            QueryMode mode = (QueryMode)conn->request_buffer[0];
+            uint32_t offset = convert_uint8_to_uint32(conn->request_buffer + sizeof(uint8_t));
+            uint32_t limit = convert_uint8_to_uint32(conn->request_buffer + sizeof(uint8_t) + sizeof(uint32_t));
+            char pattern[QUERY_PATTERN_MAX];
+            memcpy(pattern, conn->request_buffer + QUERY_FIELDS_SIZE, pattern_len);
+            conn->bytes_in_buf -= QUERY_FIELDS_SIZE + pattern_len;
+            memmove(conn->request_buffer, conn->request_buffer + QUERY_FIELDS_SIZE + pattern_len,
+                    conn->bytes_in_buf);
+            conn->state = CONN_READING_REQUEST;
+
+            _start_request(conn, STAT_QUERY);
+            if ((mode != QUERY_SUBSTRING && mode != QUERY_PREFIX) || memchr(pattern, '\0', pattern_len) != NULL ||
+                list_query_request_response(conn, snapshot, mode, pattern, pattern_len, offset, limit) < 0) {
+                ERR_PRINT("Error handling LIST_QUERY request\n");
+                stats_add(&conn->stats->errors, 1);
+                return -1;
+            }
+            continue;
+        }
+
+        if (conn->state == CONN_READING_RANGE) {
+            //the file index, offset and length follow the request line.
+            if (conn->bytes_in_buf < STREAM_RANGE_FIELDS_SIZE) {
+                return 0;
+            }
+
+            uint32_t file_index = convert_uint8_to_uint32(conn->request_buffer);
+            uint64_t offset = convert_uint8_to_uint64(conn->request_buffer + sizeof(uint32_t));
+            uint64_t length = convert_uint8_to_uint64(conn->request_buffer + sizeof(uint32_t) + sizeof(uint64_t));
+            conn->bytes_in_buf -= STREAM_RANGE_FIELDS_SIZE;
+            memmove(conn->request_buffer, conn->request_buffer + STREAM_RANGE_FIELDS_SIZE, conn->bytes_in_buf);
+            conn->state = CONN_READING_REQUEST;
+
+            _start_request(conn, STAT_RANGE);
+            if (stream_range_request_response(conn, &snapshot->library, cache, file_index, offset, length) < 0) {
+                ERR_PRINT("Error handling STREAM_RANGE request\n");
+                stats_add(&conn->stats->errors, 1);
+                return -1;
+            }
+            continue;
+        }
+
+        char *request = find_network_newline((char *)conn->request_buffer, &conn->bytes_in_buf);
+        if (request == NULL) {
+            if (conn->bytes_in_buf == REQUEST_BUFFER_SIZE) {
+                ERR_PRINT("Request buffer filled without a complete request\n");
+                return -1;
+            }
+            return 0;
+        }
+
+        #ifdef DEBUG
+        printf("Request from client: %s\n", request);
+        #endif
+
+        int result = 0;
+        if (strcmp(request, REQUEST_LIST) == 0) {
+            _start_request(conn, STAT_LIST);
+            result = list_request_response(conn, snapshot);
+            if (result < 0) {
+                ERR_PRINT("Error handling LIST request\n");
+            }
+
+        } else if (strcmp(request, REQUEST_STREAM) == 0) {
+            conn->state = CONN_READING_INDEX;
+
+        } else if (strcmp(request, REQUEST_STREAM_RANGE) == 0) {
+            conn->state = CONN_READING_RANGE;
+
+        } else if (strcmp(request, REQUEST_HASH) == 0) {
+            conn->state = CONN_READING_HASH;
+
+        } else if (strcmp(request, REQUEST_RADIO) == 0) {
+            conn->state = CONN_READING_STATION;
+
+        } else if (strcmp(request, REQUEST_LIST_QUERY) == 0) {
+            conn->state = CONN_READING_QUERY;
+
+        } else if (strcmp(request, REQUEST_FRAMED) == 0) {
+            _start_request(conn, STAT_FRAMED);
+            result = frame_start(conn);
+            if (result < 0) {
+                ERR_PRINT("Error switching to the framed protocol\n");
+            } else if (conn->state == CONN_FRAMED) {
+                stats_request_done(conn->stats, STAT_FRAMED, conn->request_started);
+            }
+
+        } else if (strcmp(request, REQUEST_STATS) == 0) {
+            _start_request(conn, STAT_STATS);
+            result = stats_request_response(conn);
+            if (result < 0) {
+                ERR_PRINT("Error handling STATS request\n");
+            }
+
+        } else {
+            ERR_PRINT("Unknown request: %s\n", request);
+            stats_add(&conn->stats->errors, 1);
+        }
+
         free(request);
+        if (result < 0) {
+            stats_add(&conn->stats->errors, 1);
+            return -1;
+        }
     }
-    return -1;
+
+    return 0;
 }
 
 
 static void print_usage(){
-    printf("Usage: as_server [-h] [-p port] [-l library_directory]\n");
+    printf("Usage: as_server [-h] [-p port] [-l library_directory] [-b backlog] [-w workers] [-e engine] [-c cache_mb] [-r mbit]\n");
     printf("  -h  Print this message\n");
     printf("  -p  Port to listen on (default: " XSTR(DEFAULT_PORT) ")\n");
     printf("  -l  Directory containing the library (default: ./library/)\n");
+    printf("  -b  Length of each worker's queue of pending connections (default: " XSTR(DEFAULT_BACKLOG) ")\n");
+    printf("  -w  Number of worker threads (default: one per online CPU)\n");
+    printf("  -e  I/O engine: epoll or uring (default: epoll)\n");
+    printf("  -c  MiB of popular files to keep in memory, 0 for none (default: " XSTR(DEFAULT_CACHE_MB) ")\n");
+    printf("  -r  Uplink bandwidth in Mbit/s to share between clients, 0 for no limit (default: 0)\n");
 }
 
 
 int main(int argc, char * const *argv){
     int opt;
-    int port = DEFAULT_PORT;
-    const char *library_directory = "library";
+    ServerOptions options = {
+        .port = DEFAULT_PORT,
+        .library_directory = "library",
+        .backlog = DEFAULT_BACKLOG,
+        .num_workers = sysconf(_SC_NPROCESSORS_ONLN),
+        .engine = ENGINE_EPOLL,
+        .cache_budget = (size_t)DEFAULT_CACHE_MB << 20,
+        .uplink_rate = 0,
+    };
 
     // Check out man 3 getopt for how to use this function
     // The short version: it parses command line options
     // Note that optarg is a global variable declared in getopt.h
-    while ((opt = getopt(argc, argv, "hp:l:")) != -1) {
+    while ((opt = getopt(argc, argv, "hp:l:b:w:e:c:r:")) != -1) {
         switch (opt) {
             case 'h':
                 print_usage();
                 return 0;
             case 'p':
-                port = atoi(optarg);
+                options.port = atoi(optarg);
                 break;
             case 'l':
-                library_directory = optarg;
+                options.library_directory = optarg;
+                break;
+            case 'b':
+                options.backlog = atoi(optarg);
+                if (options.backlog <= 0) {
+                    ERR_PRINT("Invalid backlog %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'w':
+                options.num_workers = atoi(optarg);
+                if (options.num_workers <= 0) {
+                    ERR_PRINT("Invalid number of workers %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'e':
+                if (strcmp(optarg, "epoll") == 0) {
+                    options.engine = ENGINE_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    options.engine = ENGINE_URING;
+                } else {
+                    ERR_PRINT("Unknown I/O engine %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                if (atoi(optarg) < 0) {
+                    ERR_PRINT("Invalid cache size %s\n", optarg);
+                    return 1;
+                }
+                options.cache_budget = (size_t)atoi(optarg) << 20;
+                break;
+            case 'r':
+                if (atoi(optarg) < 0) {
+                    ERR_PRINT("Invalid uplink rate %s\n", optarg);
+                    return 1;
+                }
+                options.uplink_rate = (uint64_t)atoi(optarg) * 1000000 / 8;
                 break;
             default:
                 print_usage();
@@ -718,7 +1737,11 @@ int main(int argc, char * const *argv){
     }
 
     printf("Starting server on port %d, serving library in %s\n",
-           port, library_directory);
+           options.port, options.library_directory);
+
+    if (options.num_workers <= 0) {
+        options.num_workers = 1;
+    }
 
-    return run_server(port, library_directory);
+    return run_server(&options);
 }
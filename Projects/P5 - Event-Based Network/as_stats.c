@@ -0,0 +1,197 @@
+#include "as_stats.h"
+
+
+// How each kind of request is named in STATS and the stats lines
+static const char *kind_names[NUM_STAT_KINDS] = {"list", "stream", "stream_range", "hash", "v2", "stats", "radio",
+                                                "list_query"};
+
+
+int stats_init(ServerStats *stats, int num_workers) {
+    size_t size = num_workers * sizeof(WorkerStats);
+    stats->workers = (WorkerStats *)aligned_alloc(STATS_ALIGNMENT, size);
+    if (stats->workers == NULL) {
+        perror("stats_init: aligned_alloc");
+        return -1;
+    }
+    memset(stats->workers, 0, size);
+    for (int i = 0; i < num_workers; i++) {
+        stats->workers[i].server = stats;
+    }
+    stats->num_workers = num_workers;
+    stats->started = monotonic_ns();
+    atomic_init(&stats->scans, 0);
+    atomic_init(&stats->scan_last_ns, 0);
+    atomic_init(&stats->scan_total_ns, 0);
+    return 0;
+}
+
+
+void stats_request_done(WorkerStats *worker, StatKind kind, uint64_t started) {
+    uint64_t us = (monotonic_ns() - started) / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    stats_add(&worker->times[kind][MIN(bucket, STATS_TIME_BUCKETS - 1)], 1);
+}
+
+
+void stats_scan_done(ServerStats *stats, uint64_t started) {
+    // only the main thread scans
+    uint64_t took = monotonic_ns() - started;
+    stats_add(&stats->scans, 1);
+    atomic_store_explicit(&stats->scan_last_ns, took, memory_order_relaxed);
+    stats_add(&stats->scan_total_ns, took);
+}
+
+
+static uint64_t _load(const _Atomic uint64_t *counter) {
+    return atomic_load_explicit((_Atomic uint64_t *)counter, memory_order_relaxed);
+}
+
+
+void stats_collect(const ServerStats *stats, StatsTotals *totals) {
+    memset(totals, 0, sizeof(*totals));
+    for (int i = 0; i < stats->num_workers; i++) {
+        const WorkerStats *worker = &stats->workers[i];
+        totals->accepted += _load(&worker->accepted);
+        totals->closed += _load(&worker->closed);
+        totals->bytes_sent += _load(&worker->bytes_sent);
+        totals->errors += _load(&worker->errors);
+        totals->cache_hits += _load(&worker->cache_hits);
+        totals->cache_misses += _load(&worker->cache_misses);
+        for (int kind = 0; kind < NUM_STAT_KINDS; kind++) {
+            totals->requests[kind] += _load(&worker->requests[kind]);
+            for (int b = 0; b < STATS_TIME_BUCKETS; b++) {
+                totals->times[kind][b] += _load(&worker->times[kind][b]);
+            }
+        }
+    }
+    // a connection closed since its worker's accepted was read
+    totals->closed = MIN(totals->closed, totals->accepted);
+}
+
+
+// The largest service time (in microseconds) bucket b holds
+static uint64_t _bucket_limit(int b) {
+    return b == 0 ? 1 : (uint64_t)1 << b;
+}
+
+
+uint64_t stats_percentile(const StatsTotals *totals, StatKind kind, double percent) {
+    uint64_t count = 0;
+    for (int b = 0; b < STATS_TIME_BUCKETS; b++) {
+        count += totals->times[kind][b];
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(count * percent / 100.0 + 0.5);
+    rank = rank < 1 ? 1 : rank;
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_TIME_BUCKETS; b++) {
+        seen += totals->times[kind][b];
+        if (seen >= rank) {
+            return _bucket_limit(b);
+        }
+    }
+    return _bucket_limit(STATS_TIME_BUCKETS - 1);
+}
+
+
+// Append a "<name> <value>\r\n" line to buf, as snprintf would
+static size_t _add_line(char *buf, size_t size, size_t len, const char *name, const char *suffix,
+                        uint64_t value) {
+    if (len >= size) {
+        return len;
+    }
+    int n = snprintf(buf + len, size - len, "%s%s %lu\r\n", name, suffix, (unsigned long)value);
+    return n < 0 ? len : MIN(len + n, size);
+}
+
+
+size_t stats_format(const ServerStats *stats, char *buf, size_t size) {
+    StatsTotals totals;
+    stats_collect(stats, &totals);
+
+    size_t len = 0;
+    len = _add_line(buf, size, len, "uptime_s", "", (monotonic_ns() - stats->started) / NS_PER_SEC);
+    len = _add_line(buf, size, len, "workers", "", stats->num_workers);
+    len = _add_line(buf, size, len, "connections_active", "", totals.accepted - totals.closed);
+    len = _add_line(buf, size, len, "connections_accepted", "", totals.accepted);
+    len = _add_line(buf, size, len, "bytes_sent", "", totals.bytes_sent);
+    for (int kind = 0; kind < NUM_STAT_KINDS; kind++) {
+        char name[32];
+        snprintf(name, sizeof(name), "requests_%s", kind_names[kind]);
+        len = _add_line(buf, size, len, name, "", totals.requests[kind]);
+    }
+    len = _add_line(buf, size, len, "errors", "", totals.errors);
+    len = _add_line(buf, size, len, "cache_hits", "", totals.cache_hits);
+    len = _add_line(buf, size, len, "cache_misses", "", totals.cache_misses);
+    len = _add_line(buf, size, len, "scans", "", _load(&stats->scans));
+    len = _add_line(buf, size, len, "scan_last_us", "", _load(&stats->scan_last_ns) / 1000);
+    len = _add_line(buf, size, len, "scan_total_us", "", _load(&stats->scan_total_ns) / 1000);
+
+    for (int kind = 0; kind < NUM_STAT_KINDS; kind++) {
+        if (stats_percentile(&totals, kind, 100) == 0) {
+            continue; // none served yet
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "time_%s", kind_names[kind]);
+        len = _add_line(buf, size, len, name, "_p50_us", stats_percentile(&totals, kind, 50));
+        len = _add_line(buf, size, len, name, "_p90_us", stats_percentile(&totals, kind, 90));
+        len = _add_line(buf, size, len, name, "_p99_us", stats_percentile(&totals, kind, 99));
+        len = _add_line(buf, size, len, name, "_max_us", stats_percentile(&totals, kind, 100));
+    }
+    return len;
+}
+
+
+void stats_log(const ServerStats *stats, StatsTotals *last, double elapsed) {
+    StatsTotals now;
+    stats_collect(stats, &now);
+
+    // what happened since the last line
+    StatsTotals delta;
+    uint64_t requests = 0;
+    for (int kind = 0; kind < NUM_STAT_KINDS; kind++) {
+        delta.requests[kind] = now.requests[kind] - last->requests[kind];
+        requests += delta.requests[kind];
+        for (int b = 0; b < STATS_TIME_BUCKETS; b++) {
+            delta.times[kind][b] = now.times[kind][b] - last->times[kind][b];
+        }
+    }
+    uint64_t active = now.accepted - now.closed;
+    uint64_t accepted = now.accepted - last->accepted;
+    uint64_t bytes_sent = now.bytes_sent - last->bytes_sent;
+    uint64_t hits = now.cache_hits - last->cache_hits;
+    uint64_t opened = hits + now.cache_misses - last->cache_misses;
+    uint64_t errors = now.errors - last->errors;
+    *last = now;
+    if (active == 0 && accepted == 0 && requests == 0) {
+        return;
+    }
+
+    char times[256];
+    size_t len = 0;
+    for (int kind = 0; kind < NUM_STAT_KINDS && len < sizeof(times); kind++) {
+        uint64_t p99 = stats_percentile(&delta, kind, 99);
+        if (p99 > 0) {
+            int n = snprintf(times + len, sizeof(times) - len, " %s %.1f", kind_names[kind], p99 / 1000.0);
+            len = n < 0 ? len : len + n;
+        }
+    }
+    if (len == 0) {
+        snprintf(times, sizeof(times), " none");
+    }
+
+    printf("Stats: %lu connections (+%lu), %lu requests, %lu errors, %.1f MiB/s sent, "
+           "%.0f%% cache hits; p99 ms:%s\n",
+           (unsigned long)active, (unsigned long)accepted, (unsigned long)requests, (unsigned long)errors,
+           elapsed > 0 ? bytes_sent / elapsed / 1048576.0 : 0.0,
+           opened > 0 ? 100.0 * hits / opened : 0.0, times);
+}
+
+
+void stats_free(ServerStats *stats) {
+    free(stats->workers);
+    stats->workers = NULL;
+}
@@ -0,0 +1,225 @@
+#include "as_transfer.h"
+
+
+void transfer_init(FileTransfer *transfer) {
+    transfer->fd = -1;
+    transfer->cached = NULL;
+    transfer->offset = 0;
+    transfer->remaining = 0;
+    transfer->chunk = STREAM_CHUNK_MIN;
+    transfer->pipe_fds[0] = transfer->pipe_fds[1] = -1;
+    transfer->in_pipe = 0;
+}
+
+
+int transfer_open(FileTransfer *transfer, const char *path, FileCache *cache, uint64_t *file_size,
+                  uint64_t *bitrate) {
+    transfer_close(transfer);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("transfer_open: open");
+        return -1;
+    }
+
+    struct stat file_info;
+    if (fstat(fd, &file_info) < 0) {
+        perror("transfer_open: fstat");
+        close(fd);
+        return -1;
+    }
+
+    transfer->remaining = file_info.st_size;
+    *file_size = file_info.st_size;
+    if (bitrate != NULL) {
+        *bitrate = pace_probe_bitrate(fd, file_info.st_size);
+    }
+
+    int hit = 0;
+    transfer->cached = cache != NULL ? cache_get(cache, fd, &file_info, &hit) : NULL;
+    if (transfer->cached != NULL) {
+        close(fd); // the mapping keeps the contents
+    } else {
+        transfer->fd = fd;
+    }
+    return hit;
+}
+
+
+uint64_t transfer_set_range(FileTransfer *transfer, uint64_t offset, uint64_t length) {
+    uint64_t file_size = transfer->remaining;
+    if (offset > file_size) {
+        offset = file_size;
+    }
+    transfer->offset = offset;
+    transfer->remaining = MIN(length, file_size - offset);
+    return transfer->remaining;
+}
+
+
+/*
+** Grow the chunk after the socket took all of it, or shrink it towards what
+** the socket took when it filled up.
+*/
+static void _adapt_chunk(FileTransfer *transfer, size_t offered, size_t sent) {
+    if (sent == offered) {
+        transfer->chunk = MIN(transfer->chunk * 2, STREAM_CHUNK_MAX);
+    } else {
+        transfer->chunk = sent < STREAM_CHUNK_MIN ? STREAM_CHUNK_MIN : sent;
+    }
+}
+
+
+/*
+** Move the transfer to the splice fallback.
+**
+** return 0 on success, -1 on error
+*/
+static int _start_splicing(FileTransfer *transfer) {
+    if (pipe2(transfer->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("transfer_send: pipe2");
+        transfer->pipe_fds[0] = transfer->pipe_fds[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** One step of the splice fallback: fill the pipe from the file if it is empty,
+** then drain it into the socket, sending at most max_bytes.
+**
+** return 1 after progress, 0 if the socket is full, -1 on error
+*/
+static int _splice_step(FileTransfer *transfer, int socket, uint64_t max_bytes) {
+    if (transfer->in_pipe == 0) {
+        size_t want = MIN(MIN(transfer->chunk, transfer->remaining), max_bytes);
+        ssize_t in = splice(transfer->fd, &transfer->offset, transfer->pipe_fds[1], NULL,
+                            want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (in < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                return 1;
+            }
+            perror("transfer_send: splice from file");
+            return -1;
+        }
+        if (in == 0) {
+            ERR_PRINT("transfer_send: file ended %lu bytes early\n", (unsigned long)transfer->remaining);
+            return -1;
+        }
+        transfer->in_pipe = in;
+    }
+
+    ssize_t out = splice(transfer->pipe_fds[0], NULL, socket, NULL, MIN(transfer->in_pipe, max_bytes),
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    if (out < 0) {
+        if (errno == EINTR) {
+            return 1;
+        }
+        if (errno == EAGAIN) {
+            return 0;
+        }
+        perror("transfer_send: splice to socket");
+        return -1;
+    }
+    transfer->in_pipe -= out;
+    transfer->remaining -= out;
+    return 1;
+}
+
+
+/*
+** Send the next chunk of a cached file from its mapping, at most max_bytes.
+**
+** return 1 after progress, 0 if the socket is full, -1 on error
+*/
+static int _send_cached(FileTransfer *transfer, int socket, uint64_t max_bytes) {
+    size_t offered = MIN(MIN(transfer->chunk, transfer->remaining), max_bytes);
+    // more follows right away, unless this is all that may be sent for now
+    int more = transfer->remaining > offered && max_bytes > offered ? MSG_MORE : 0;
+    ssize_t sent = send(socket, transfer->cached->data + transfer->offset, offered, MSG_NOSIGNAL | more);
+    if (sent < 0) {
+        if (errno == EINTR) {
+            return 1;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        perror("transfer_send: send");
+        return -1;
+    }
+
+    _adapt_chunk(transfer, offered, sent);
+    transfer->offset += sent;
+    transfer->remaining -= sent;
+    return 1;
+}
+
+
+int transfer_send(FileTransfer *transfer, int socket, uint64_t max_bytes) {
+    uint64_t limit = transfer->remaining > max_bytes ? transfer->remaining - max_bytes : 0;
+    while (transfer->remaining > limit) {
+        // what may still be sent
+        max_bytes = transfer->remaining - limit;
+
+        if (transfer->cached != NULL) {
+            int ret = _send_cached(transfer, socket, max_bytes);
+            if (ret != 1) {
+                return ret;
+            }
+            continue;
+        }
+
+        if (transfer->pipe_fds[0] >= 0) {
+            int ret = _splice_step(transfer, socket, max_bytes);
+            if (ret != 1) {
+                return ret;
+            }
+            continue;
+        }
+
+        size_t offered = MIN(MIN(transfer->chunk, transfer->remaining), max_bytes);
+        ssize_t sent = sendfile(socket, transfer->fd, &transfer->offset, offered);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                // this file cannot be sendfile'd (e.g. some FUSE or network file systems)
+                if (_start_splicing(transfer) < 0) {
+                    return -1;
+                }
+                continue;
+            }
+            perror("transfer_send: sendfile");
+            return -1;
+        }
+        if (sent == 0) {
+            ERR_PRINT("transfer_send: file ended %lu bytes early\n", (unsigned long)transfer->remaining);
+            return -1;
+        }
+
+        _adapt_chunk(transfer, offered, sent);
+        transfer->remaining -= sent;
+    }
+
+    return transfer->remaining > 0 ? 2 : 1;
+}
+
+
+void transfer_close(FileTransfer *transfer) {
+    if (transfer->fd >= 0) {
+        close(transfer->fd);
+    }
+    if (transfer->cached != NULL) {
+        cache_release(transfer->cached);
+    }
+    if (transfer->pipe_fds[0] >= 0) {
+        close(transfer->pipe_fds[0]);
+        close(transfer->pipe_fds[1]);
+    }
+    transfer_init(transfer);
+}
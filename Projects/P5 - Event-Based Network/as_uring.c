@@ -0,0 +1,1008 @@
+#include "as_uring.h"
+#include "as_frame.h"
+#include "as_radio.h"
+#include "as_stats.h"
+
+// user_data of completions that are not for a connection. Connections are
+// heap-allocated, so their addresses are never this small.
+#define UD_IGNORE 0
+#define UD_ACCEPT 1
+#define UD_QUIT 2
+#define UD_WAKEUP 3
+#define UD_PACE 4
+
+// Operations on a connection carry its address, tagged with the operation in
+// the low bits (malloc aligns to at least 8 bytes)
+#define TAG_MASK 7
+#define TAG_RECV 1
+#define TAG_SEND 2        // out_buf, or a framed connection's control frames
+#define TAG_READ 3        // a chunk of the file into the connection's buffer
+#define TAG_SEND_CHUNK 4  // that chunk to the socket (or a DATA frame's payload)
+#define TAG_RADIO 5       // a radio listener's next bytes, from its station's ring
+#define TAG_SEND_HEADER 6 // a framed connection's DATA frame header
+
+
+static int _io_uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+static int _io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+
+static int _io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/*
+** Register a sparse fixed file table of num_files slots for accepted sockets.
+**
+** return 0 on success, -1 on error
+*/
+static int _register_file_table(int ring_fd, unsigned int num_files) {
+    struct io_uring_rsrc_register files;
+    memset(&files, 0, sizeof(files));
+    files.nr = num_files;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    return _io_uring_register(ring_fd, IORING_REGISTER_FILES2, &files, sizeof(files));
+}
+
+
+int uring_available(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = _io_uring_setup(1, &params);
+    if (fd < 0) {
+        return 0;
+    }
+
+    // Accepting into a sparse file table is the newest feature used (Linux 5.19)
+    int available = (params.features & IORING_FEAT_SINGLE_MMAP) && _register_file_table(fd, 1) == 0;
+    close(fd);
+    return available;
+}
+
+
+/*
+** Set up a ring and map its queues.
+**
+** return 0 on success, -1 on error
+*/
+static int _uring_init(Uring *ring) {
+    memset(ring, 0, sizeof(*ring));
+    ring->pace_due = UINT64_MAX;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Only this thread submits, and completions are only needed when it waits for them
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring->fd = _io_uring_setup(URING_ENTRIES, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        // Kernels before 6.1 do not have those flags
+        memset(&params, 0, sizeof(params));
+        ring->fd = _io_uring_setup(URING_ENTRIES, &params);
+    }
+    if (ring->fd < 0) {
+        perror("_uring_init: io_uring_setup");
+        return -1;
+    }
+
+    // Both queues share one mapping (IORING_FEAT_SINGLE_MMAP, checked by uring_available)
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        perror("_uring_init: mmap");
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        perror("_uring_init: mmap");
+        munmap(ring->ring_ptr, ring->ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    uint8_t *base = (uint8_t *)ring->ring_ptr;
+    ring->sq_head = (unsigned int *)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(base + params.sq_off.tail);
+    ring->sq_array = (unsigned int *)(base + params.sq_off.array);
+    ring->sq_mask = *(unsigned int *)(base + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned int *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(base + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+    return 0;
+}
+
+
+/*
+** Register the ring's fixed file table and its buffers. Buffers that cannot be
+** registered (e.g. over RLIMIT_MEMLOCK) are used as plain buffers instead.
+**
+** return 0 on success, -1 on error
+*/
+static int _uring_register(Uring *ring) {
+    unsigned int num_files = URING_MAX_FILES;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < num_files) {
+        num_files = limit.rlim_cur;
+    }
+    if (_register_file_table(ring->fd, num_files) < 0) {
+        perror("_uring_register: io_uring_register");
+        return -1;
+    }
+
+    // mmap rather than malloc: reads still in flight when the ring is torn down
+    // must not land in memory that has been handed out again
+    size_t buffers_size = (size_t)URING_BUFFERS * URING_BUFFER_SIZE;
+    ring->buffers = mmap(NULL, buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED) {
+        perror("_uring_register: mmap");
+        return -1;
+    }
+
+    struct iovec iovecs[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        iovecs[i].iov_base = ring->buffers + (size_t)i * URING_BUFFER_SIZE;
+        iovecs[i].iov_len = URING_BUFFER_SIZE;
+        ring->free_buffers[i] = URING_BUFFERS - 1 - i;
+    }
+    ring->num_free_buffers = URING_BUFFERS;
+
+    ring->buffers_registered = _io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovecs, URING_BUFFERS) == 0;
+    if (!ring->buffers_registered) {
+        perror("_uring_register: registering buffers");
+    }
+    return 0;
+}
+
+
+static void _uring_free(Uring *ring) {
+    close(ring->fd);
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_ptr, ring->ring_size);
+    if (ring->buffers != NULL && ring->buffers != MAP_FAILED) {
+        munmap(ring->buffers, (size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    }
+}
+
+
+/*
+** Submit everything queued, then wait for at least wait_for completions.
+**
+** return 0 on success, -1 on error
+*/
+static int _uring_submit(Uring *ring, unsigned int wait_for) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    while (1) {
+        unsigned int to_submit = ring->sqe_tail - ring->sqe_submitted;
+        int ret = _io_uring_enter(ring->fd, to_submit, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                if (wait_for > 0) {
+                    return 0; // the caller handles what has completed and comes back
+                }
+                continue;
+            }
+            perror("_uring_submit: io_uring_enter");
+            return -1;
+        }
+        ring->sqe_submitted += ret;
+        return 0;
+    }
+}
+
+
+/*
+** Make sure the next count entries fit in the submission queue, submitting what
+** is queued if they do not, so that a chain is never split across submissions.
+**
+** return 0 on success, -1 on error
+*/
+static int _uring_reserve(Uring *ring, unsigned int count) {
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head + count <= ring->sq_entries) {
+        return 0;
+    }
+    if (_uring_submit(ring, 0) < 0) {
+        return -1;
+    }
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return ring->sqe_tail - head + count <= ring->sq_entries ? 0 : -1;
+}
+
+
+/*
+** The next submission queue entry, cleared. _uring_reserve must have made room.
+*/
+static struct io_uring_sqe *_uring_sqe(Uring *ring, uint8_t opcode, uint64_t user_data) {
+    unsigned int index = ring->sqe_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    ring->in_flight++;
+    return sqe;
+}
+
+
+static uint64_t _conn_data(Connection *conn, int tag) {
+    return (uint64_t)(uintptr_t)conn | tag;
+}
+
+
+static void _prepare_accept(EventLoop *loop, Uring *ring) {
+    if (_uring_reserve(ring, 1) < 0) {
+        return;
+    }
+    ring->accept_addrlen = sizeof(ring->accept_addr);
+    struct io_uring_sqe *sqe = _uring_sqe(ring, IORING_OP_ACCEPT, UD_ACCEPT);
+    sqe->fd = loop->listen_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->accept_addr;
+    sqe->addr2 = (uint64_t)(uintptr_t)&ring->accept_addrlen;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+    ring->accept_armed = 1;
+}
+
+
+static void _prepare_wakeup(Uring *ring) {
+    if (_uring_reserve(ring, 1) < 0) {
+        return;
+    }
+    ring->wakeup.tv_sec = EPOLL_TIMEOUT_MS / 1000;
+    ring->wakeup.tv_nsec = (EPOLL_TIMEOUT_MS % 1000) * 1000000L;
+    struct io_uring_sqe *sqe = _uring_sqe(ring, IORING_OP_TIMEOUT, UD_WAKEUP);
+    sqe->addr = (uint64_t)(uintptr_t)&ring->wakeup;
+    sqe->len = 1;
+}
+
+
+/*
+** Wake the loop up when the next connection waiting for tokens may send, unless
+** it is already set to wake up by then.
+*/
+static void _prepare_pace_wakeup(EventLoop *loop, Uring *ring, uint64_t now) {
+    uint64_t due = UINT64_MAX;
+    if (loop->wheel.num_armed > 0) {
+        due = now + (uint64_t)wheel_timeout_ms(&loop->wheel, now, EPOLL_TIMEOUT_MS) * NS_PER_MS;
+    }
+    if (loop->active_head != NULL && loop->link_due < due) {
+        due = loop->link_due;
+    }
+    if (due == UINT64_MAX || due >= ring->pace_due || _uring_reserve(ring, 1) < 0) {
+        return;
+    }
+    ring->pace_due = due;
+    ring->pace_wakeup.tv_sec = due / NS_PER_SEC;
+    ring->pace_wakeup.tv_nsec = due % NS_PER_SEC;
+    struct io_uring_sqe *sqe = _uring_sqe(ring, IORING_OP_TIMEOUT, UD_PACE);
+    sqe->addr = (uint64_t)(uintptr_t)&ring->pace_wakeup;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS; // on CLOCK_MONOTONIC, like the wheel
+}
+
+
+static int _prepare_recv(Uring *ring, Connection *conn) {
+    if (_uring_reserve(ring, 1) < 0) {
+        return -1;
+    }
+    struct io_uring_sqe *sqe = _uring_sqe(ring, IORING_OP_RECV, _conn_data(conn, TAG_RECV));
+    sqe->fd = conn->client.socket;
+    sqe->flags = IOSQE_FIXED_FILE;
+    if (conn->frames != NULL) {
+        // alongside the connection's chains (see _advance_frames)
+        sqe->addr = (uint64_t)(uintptr_t)conn->frames->received;
+        sqe->len = sizeof(conn->frames->received);
+        conn->frames->receiving = 1;
+    } else {
+        sqe->addr = (uint64_t)(uintptr_t)(conn->request_buffer + conn->bytes_in_buf);
+        sqe->len = REQUEST_BUFFER_SIZE - conn->bytes_in_buf;
+    }
+    conn->ops_in_flight++;
+    return 0;
+}
+
+
+// Stop waiting for a framed connection's client to send something
+static void _cancel_recv(Uring *ring, Connection *conn) {
+    if (conn->frames == NULL || !conn->frames->receiving || _uring_reserve(ring, 1) < 0) {
+        return;
+    }
+    struct io_uring_sqe *sqe = _uring_sqe(ring, IORING_OP_ASYNC_CANCEL, UD_IGNORE);
+    sqe->addr = _conn_data(conn, TAG_RECV);
+}
+
+
+// Whether the connection has a chain of operations in flight (a framed connection's recv aside)
+static int _chain_in_flight(const Connection *conn) {
+    return conn->ops_in_flight > (conn->frames != NULL && conn->frames->receiving);
+}
+
+
+static void _prepare_send(Uring *ring, Connection *conn, int tag, const uint8_t *buf, size_t len,
+                          int more, uint8_t sqe_flags) {
+    struct io_uring_sqe *sqe = _uring_sqe(ring, IORING_OP_SEND, _conn_data(conn, tag));
+    sqe->fd = conn->client.socket;
+    sqe->flags = IOSQE_FIXED_FILE | sqe_flags;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    // MSG_WAITALL: the kernel retries short sends itself, so the next link only starts after all of it
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (more ? MSG_MORE : 0);
+    conn->ops_in_flight++;
+}
+
+
+/*
+** Take a buffer for the connection, or queue it to get the next one released.
+**
+** return 1 if the connection holds a buffer, 0 if it must wait
+*/
+static int _take_buffer(Uring *ring, Connection *conn) {
+    if (conn->buffer_index >= 0) {
+        return 1;
+    }
+    if (ring->num_free_buffers > 0) {
+        conn->buffer_index = ring->free_buffers[--ring->num_free_buffers];
+        return 1;
+    }
+
+    if (!conn->waiting) {
+        conn->waiting = 1;
+        conn->next_waiting = NULL;
+        if (ring->waiting_tail != NULL) {
+            ring->waiting_tail->next_waiting = conn;
+        } else {
+            ring->waiting_head = conn;
+        }
+        ring->waiting_tail = conn;
+    }
+    return 0;
+}
+
+
+static int _submit_response(EventLoop *loop, Uring *ring, Connection *conn);
+
+
+/*
+** Give up the connection's buffer (or its place waiting for one), handing the
+** buffer to the first connection waiting.
+*/
+static void _release_buffer(EventLoop *loop, Uring *ring, Connection *conn) {
+    if (conn->waiting) {
+        Connection **link = &ring->waiting_head;
+        Connection *prev = NULL;
+        while (*link != conn) {
+            prev = *link;
+            link = &(*link)->next_waiting;
+        }
+        *link = conn->next_waiting;
+        if (ring->waiting_tail == conn) {
+            ring->waiting_tail = prev;
+        }
+        conn->waiting = 0;
+    }
+    if (conn->buffer_index < 0) {
+        return;
+    }
+
+    int index = conn->buffer_index;
+    conn->buffer_index = -1;
+
+    Connection *next = ring->waiting_head;
+    if (next == NULL) {
+        ring->free_buffers[ring->num_free_buffers++] = index;
+        return;
+    }
+    ring->waiting_head = next->next_waiting;
+    if (ring->waiting_head == NULL) {
+        ring->waiting_tail = NULL;
+    }
+    next->waiting = 0;
+    next->buffer_index = index;
+    if (!_chain_in_flight(next)) {
+        // otherwise it carries on once its chain completes
+        _submit_response(loop, ring, next);
+    }
+}
+
+
+/*
+** Send a radio listener its header, or what is on air that it has not been
+** sent, straight from its station's ring; once it has caught up, it waits for
+** the station's next chunk on its pace_timer.
+**
+** return 0 on success, -1 if the connection must be closed
+*/
+static int _submit_radio(EventLoop *loop, Uring *ring, Connection *conn) {
+    if (_uring_reserve(ring, 1) < 0) {
+        return -1;
+    }
+    if (conn->out_sent < conn->out_len) {
+        _prepare_send(ring, conn, TAG_SEND, conn->out_buf + conn->out_sent, conn->out_len - conn->out_sent, 1, 0);
+        return 0;
+    }
+
+    const uint8_t *data;
+    int64_t len = radio_peek(conn, &data);
+    if (len < 0) {
+        return -1;
+    }
+    if (len == 0) {
+        wheel_add(&loop->wheel, &conn->pace_timer, conn, radio_next_due(conn->station));
+        return 0;
+    }
+    bucket_take(&loop->link, len);
+    _prepare_send(ring, conn, TAG_RADIO, data, len, 0, 0);
+    return 0;
+}
+
+
+/*
+** Whether a framed connection has control frames to send that may go next:
+** between DATA frames, or before any of a started DATA frame's header.
+*/
+static int _control_ready(const FrameSession *session) {
+    return session->control_sent < session->control_len && (session->current < 0 || session->header_sent == 0);
+}
+
+
+/*
+** Queue the next part of a framed connection's output as one chain, in the
+** order frame_send sends it: its control frames (see _control_ready), then the next DATA frame's header and up to allowance bytes of its
+** payload. The payload is sent from the stream's LIST payload or its cached
+** file's mapping, or else read into the connection's buffer first, like any
+** other chunk of a file.
+**
+** return 0 on success, -1 on error
+*/
+static int _submit_frames(EventLoop *loop, Uring *ring, Connection *conn, uint64_t allowance) {
+    FrameSession *session = conn->frames;
+    int sending_control = _control_ready(session);
+    FrameStream *stream = allowance > 0 && frame_next_data(session, allowance) ? &session->streams[session->current]
+                                                                               : NULL;
+
+    const uint8_t *data = NULL;
+    uint64_t len = 0;
+    if (stream != NULL) {
+        len = session->data_left;
+        if (stream->payload != NULL) {
+            data = (const uint8_t *)stream->payload->data + stream->payload->len - stream->remaining - len;
+        } else if (stream->transfer.cached != NULL) {
+            data = stream->transfer.cached->data + stream->transfer.offset;
+        } else if (_take_buffer(ring, conn)) {
+            len = MIN(len, URING_BUFFER_SIZE);
+        } else {
+            stream = NULL; // its DATA frame waits for a buffer
+        }
+    }
+
+    if (_uring_reserve(ring, 4) < 0) {
+        return -1;
+    }
+
+    if (sending_control) {
+        _prepare_send(ring, conn, TAG_SEND, session->control + session->control_sent,
+                      session->control_len - session->control_sent, stream != NULL, stream != NULL ? IOSQE_IO_LINK : 0);
+    }
+    if (stream == NULL) {
+        return 0;
+    }
+
+    _pace_charge(loop, conn, len);
+    if (session->header_sent < FRAME_HEADER_SIZE) {
+        _prepare_send(ring, conn, TAG_SEND_HEADER, session->data_header + session->header_sent,
+                      FRAME_HEADER_SIZE - session->header_sent, 1, IOSQE_IO_LINK);
+    }
+
+    if (data == NULL) {
+        uint8_t *buffer = ring->buffers + (size_t)conn->buffer_index * URING_BUFFER_SIZE;
+        stream->transfer.chunk = len;
+        struct io_uring_sqe *sqe = _uring_sqe(ring, ring->buffers_registered ? IORING_OP_READ_FIXED : IORING_OP_READ,
+                                              _conn_data(conn, TAG_READ));
+        sqe->fd = stream->transfer.fd;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->addr = (uint64_t)(uintptr_t)buffer;
+        sqe->len = len;
+        sqe->off = stream->transfer.offset;
+        sqe->buf_index = ring->buffers_registered ? conn->buffer_index : 0;
+        conn->ops_in_flight++;
+        data = buffer;
+    }
+    _prepare_send(ring, conn, TAG_SEND_CHUNK, data, len, frame_data_ready(session) > len, 0);
+    return 0;
+}
+
+
+/*
+** Queue the next part of the connection's response: whatever is left of
+** out_buf, linked to the next chunk of the file if it holds a buffer for it.
+** The connection must have no operations in flight.
+**
+** A paced connection sends no more than its tokens allow, and without the
+** tokens for a chunk, it lets go of its buffer and waits for its pace_timer.
+** With an uplink rate, a connection sends at most PACE_QUANTUM per chain, and
+** while others wait in line for the uplink's tokens, it waits behind them for
+** its turn (see _run_timers). A framed connection's DATA frames take turns
+** the same way, while its control frames go out regardless (see _submit_frames).
+**
+** return 0 on success, -1 on error
+*/
+static int _submit_response(EventLoop *loop, Uring *ring, Connection *conn) {
+    if (conn->state == CONN_RADIO) {
+        return _submit_radio(loop, ring, conn);
+    }
+    FrameSession *session = conn->frames;
+    FileTransfer *transfer = &conn->transfer;
+    int sending_out = session != NULL ? _control_ready(session) : conn->out_sent < conn->out_len;
+    uint64_t left = session != NULL ? frame_data_ready(session) : transfer->remaining;
+
+    uint64_t allowance = UINT64_MAX;
+    if (left > 0 && (conn->pace.rate != 0 || loop->link.rate != 0)) {
+        uint64_t now = monotonic_ns();
+        allowance = _pace_allowance(loop, conn, now);
+        if (allowance > 0 && loop->link.rate != 0) {
+            int its_turn = !conn->scheduled && (conn->deficit > 0 || loop->active_head == NULL);
+            uint64_t link_allowance = its_turn ? _link_allowance(loop, conn, now) : 0;
+            if (link_allowance == 0) {
+                _schedule(loop, conn);
+            } else {
+                conn->deficit = 0; // one chain a turn
+            }
+            allowance = MIN(MIN(allowance, link_allowance), PACE_QUANTUM);
+        }
+        if (allowance == 0) {
+            _release_buffer(loop, ring, conn);
+            if (!sending_out) {
+                return 0;
+            }
+        }
+    }
+    if (session != NULL) {
+        return _submit_frames(loop, ring, conn, allowance);
+    }
+
+    int sending_cached = transfer->cached != NULL && transfer->remaining > 0 && allowance > 0;
+    int sending_file = transfer->fd >= 0 && transfer->remaining > 0 && allowance > 0 &&
+                       _take_buffer(ring, conn);
+
+    if (_uring_reserve(ring, 3) < 0) {
+        return -1;
+    }
+
+    if (sending_out) {
+        _prepare_send(ring, conn, TAG_SEND, conn->out_buf + conn->out_sent, conn->out_len - conn->out_sent,
+                      transfer->remaining > 0, (sending_file || sending_cached) ? IOSQE_IO_LINK : 0);
+    }
+
+    if (sending_cached) {
+        // straight from the mapping, no buffer needed: the kernel sends the rest in one go
+        size_t len = MIN(transfer->remaining, allowance);
+        _pace_charge(loop, conn, len);
+        _prepare_send(ring, conn, TAG_SEND_CHUNK, transfer->cached->data + transfer->offset,
+                      len, transfer->remaining > len, 0);
+    }
+
+    if (sending_file) {
+        uint8_t *buffer = ring->buffers + (size_t)conn->buffer_index * URING_BUFFER_SIZE;
+        size_t len = MIN(MIN(transfer->remaining, URING_BUFFER_SIZE), allowance);
+        transfer->chunk = len;
+        _pace_charge(loop, conn, len);
+
+        struct io_uring_sqe *sqe = _uring_sqe(ring, ring->buffers_registered ? IORING_OP_READ_FIXED : IORING_OP_READ,
+                                              _conn_data(conn, TAG_READ));
+        sqe->fd = transfer->fd;
+        // a short read (the file shrank) fails the link, so the send is cancelled
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->addr = (uint64_t)(uintptr_t)buffer;
+        sqe->len = len;
+        sqe->off = transfer->offset;
+        sqe->buf_index = ring->buffers_registered ? conn->buffer_index : 0;
+        conn->ops_in_flight++;
+
+        _prepare_send(ring, conn, TAG_SEND_CHUNK, buffer, len, transfer->remaining > len, 0);
+    }
+
+    return 0;
+}
+
+
+static void _close_connection(EventLoop *loop, Uring *ring, Connection *conn) {
+    if (conn->ops_in_flight > 0) {
+        // only ever a framed connection's recv: closed once it is cancelled,
+        // and out of every line meanwhile
+        conn->failed = 1;
+        _release_buffer(loop, ring, conn);
+        _unschedule(loop, conn);
+        _cancel_recv(ring, conn);
+        return;
+    }
+    printf("Client on %s:%d disconnected\n",
+           inet_ntoa(conn->client.addr.sin_addr),
+           ntohs(conn->client.addr.sin_port));
+
+    _release_buffer(loop, ring, conn);
+    _unschedule(loop, conn);
+    _reset_response(conn);
+    frame_end(conn);
+
+    if (_uring_reserve(ring, 1) == 0) {
+        struct io_uring_sqe *sqe = _uring_sqe(ring, IORING_OP_CLOSE, UD_IGNORE);
+        sqe->file_index = conn->client.socket + 1;
+    }
+
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    loop->num_connections--;
+    stats_add(&loop->stats->closed, 1);
+    free(conn);
+
+    if (!ring->accept_armed) {
+        _prepare_accept(loop, ring); // a slot in the file table is free again
+    }
+}
+
+
+static void _open_connection(EventLoop *loop, Uring *ring, int slot) {
+    Connection *conn = (Connection *)calloc(1, sizeof(Connection));
+    if (conn == NULL) {
+        perror("_open_connection: calloc");
+        if (_uring_reserve(ring, 1) == 0) {
+            struct io_uring_sqe *sqe = _uring_sqe(ring, IORING_OP_CLOSE, UD_IGNORE);
+            sqe->file_index = slot + 1;
+        }
+        return;
+    }
+    conn->client.socket = slot;
+    conn->client.addr = ring->accept_addr;
+    conn->state = CONN_READING_REQUEST;
+    transfer_init(&conn->transfer);
+    conn->buffer_index = -1;
+    conn->stats = loop->stats;
+    conn->framing = 1;
+
+    conn->next = loop->connections;
+    if (loop->connections != NULL) {
+        loop->connections->prev = conn;
+    }
+    loop->connections = conn;
+    loop->num_connections++;
+    stats_add(&loop->stats->accepted, 1);
+
+    printf("Server got a connection from %s, port %d\n",
+           inet_ntoa(conn->client.addr.sin_addr), ntohs(conn->client.addr.sin_port));
+
+    if (_prepare_recv(ring, conn) < 0) {
+        _close_connection(loop, ring, conn);
+    }
+}
+
+
+/*
+** Move what a framed connection's recv got into its request buffer, as far as
+** there is room.
+**
+** return the bytes moved
+*/
+static size_t _take_received(Connection *conn) {
+    FrameSession *session = conn->frames;
+    size_t len = MIN(session->received_len, (size_t)(REQUEST_BUFFER_SIZE - conn->bytes_in_buf));
+    memcpy(conn->request_buffer + conn->bytes_in_buf, session->received, len);
+    conn->bytes_in_buf += len;
+    session->received_len -= len;
+    memmove(session->received, session->received + len, session->received_len);
+    return len;
+}
+
+
+/*
+** Carry on with a framed connection that has no chain in flight: handle the
+** frames it got, keep a recv in flight for more while there is room for them,
+** and send what is ready. Frames are only handled between chains, since a
+** chain sends from the session (and the streams' files) that frames change.
+*/
+static void _advance_frames(EventLoop *loop, Uring *ring, Connection *conn) {
+    FrameSession *session = conn->frames;
+    if (session->current < 0) {
+        _release_buffer(loop, ring, conn); // the next DATA frame takes one if it needs it
+    }
+
+    do {
+        if (frame_handle_requests(conn, loop->snapshot, loop->cache) < 0) {
+            _close_connection(loop, ring, conn);
+            return;
+        }
+    } while (!session->receiving && _take_received(conn) > 0);
+
+    if ((!session->receiving && session->received_len == 0 && _prepare_recv(ring, conn) < 0) ||
+        (frame_has_output(session) && _submit_response(loop, ring, conn) < 0)) {
+        _close_connection(loop, ring, conn);
+    }
+}
+
+
+/*
+** Carry on with a connection whose operations have all completed: finish or
+** continue its response, answer the next request, or receive more of one.
+*/
+static void _advance_connection(EventLoop *loop, Uring *ring, Connection *conn) {
+    if (conn->state == CONN_RADIO) {
+        if (_submit_radio(loop, ring, conn) < 0) {
+            _close_connection(loop, ring, conn);
+        }
+        return;
+    }
+
+    if (conn->state == CONN_SENDING) {
+        if (conn->out_sent < conn->out_len ||
+            conn->transfer.remaining > 0) {
+            if (_submit_response(loop, ring, conn) < 0) {
+                _close_connection(loop, ring, conn);
+            }
+            return;
+        }
+        stats_request_done(conn->stats, conn->request_kind, conn->request_started);
+        _release_buffer(loop, ring, conn);
+        _reset_response(conn);
+    }
+
+    if (handle_client_requests(conn, loop->snapshot, loop->cache) < 0) {
+        _close_connection(loop, ring, conn);
+        return;
+    }
+    if (conn->state == CONN_FRAMED) {
+        _advance_frames(loop, ring, conn);
+        return;
+    }
+
+    int ret = conn->state == CONN_SENDING || conn->state == CONN_RADIO ? _submit_response(loop, ring, conn)
+                                                                       : _prepare_recv(ring, conn);
+    if (ret < 0) {
+        _close_connection(loop, ring, conn);
+    }
+}
+
+
+/*
+** The file the connection's chunk is sent from: its response's, or the current
+** DATA frame's stream's (NULL for a LIST payload).
+*/
+static FileTransfer *_chunk_transfer(Connection *conn) {
+    if (conn->frames == NULL) {
+        return &conn->transfer;
+    }
+    FrameStream *stream = &conn->frames->streams[conn->frames->current];
+    return stream->payload == NULL ? &stream->transfer : NULL;
+}
+
+
+static void _complete_connection_op(EventLoop *loop, Uring *ring, Connection *conn, int tag, int res,
+                                    int quitting) {
+    conn->ops_in_flight--;
+    FrameSession *session = conn->frames;
+    if (tag == TAG_RECV && session != NULL) {
+        session->receiving = 0;
+    }
+
+    if (res == -ECANCELED) {
+        // an earlier link fell short; the chain is resubmitted from where it got to
+    } else if (res < 0) {
+        if (res != -ECONNRESET && res != -EPIPE) {
+            fprintf(stderr, "io_uring operation on connection failed: %s\n", strerror(-res));
+        }
+        conn->failed = 1;
+    } else if (tag == TAG_RECV) {
+        if (res == 0) {
+            conn->failed = 1; // client disconnected
+        }
+        #ifdef DEBUG
+        printf("Read %d bytes from client\n", res);
+        #endif
+        if (session != NULL) {
+            session->received_len = res;
+        } else {
+            conn->bytes_in_buf += res;
+        }
+    } else if (tag == TAG_SEND) {
+        if (session != NULL) {
+            frame_control_sent(session, res);
+        } else {
+            conn->out_sent += res;
+            stats_add(&conn->stats->bytes_sent, res);
+        }
+    } else if (tag == TAG_SEND_HEADER) {
+        frame_header_sent(session, res);
+    } else if (tag == TAG_READ) {
+        if ((size_t)res != _chunk_transfer(conn)->chunk) {
+            conn->failed = 1;
+        }
+    } else if (tag == TAG_SEND_CHUNK) {
+        FileTransfer *transfer = _chunk_transfer(conn);
+        if (transfer != NULL) {
+            transfer->offset += res;
+            transfer->remaining -= res;
+        }
+        if (session != NULL) {
+            frame_data_sent(session, res);
+        } else {
+            stats_add(&conn->stats->bytes_sent, res);
+        }
+    } else if (tag == TAG_RADIO) {
+        radio_sent(conn, res);
+        stats_add(&conn->stats->bytes_sent, res);
+    }
+
+    if (_chain_in_flight(conn) || quitting) {
+        return; // a framed connection's recv completing mid-chain waits for it
+    }
+    if (conn->failed) {
+        _close_connection(loop, ring, conn);
+    } else if (conn->state == CONN_FRAMED) {
+        _advance_frames(loop, ring, conn);
+    } else {
+        _advance_connection(loop, ring, conn);
+    }
+}
+
+
+/*
+** Carry on with the connections whose tokens have come in, then with those in
+** line for the uplink, one turn each for as long as it has tokens. Those with
+** operations still in flight carry on once they complete. Then set the loop to
+** wake up for the next.
+*/
+static void _run_timers(EventLoop *loop, Uring *ring) {
+    uint64_t now = monotonic_ns();
+    for (Timer *timer = wheel_expire(&loop->wheel, now); timer != NULL;) {
+        Timer *next = timer->next;
+        Connection *conn = (Connection *)timer->owner;
+        if (!_chain_in_flight(conn) && _submit_response(loop, ring, conn) < 0) {
+            _close_connection(loop, ring, conn);
+        }
+        timer = next;
+    }
+
+    if (loop->link_due <= now) {
+        loop->link_due = 0;
+        while (loop->active_head != NULL && _link_allowance(loop, loop->active_head, now) > 0) {
+            Connection *conn = _next_scheduled(loop);
+            if (!_chain_in_flight(conn) && _submit_response(loop, ring, conn) < 0) {
+                _close_connection(loop, ring, conn);
+            }
+        }
+    }
+    _prepare_pace_wakeup(loop, ring, now);
+}
+
+
+/*
+** Handle every completion in the queue.
+**
+** return 1 once the server is quitting, 0 otherwise
+*/
+static int _handle_completions(EventLoop *loop, Uring *ring, int quitting) {
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        ring->in_flight--;
+
+        if (user_data == UD_IGNORE) {
+            continue;
+        } else if (user_data == UD_QUIT) {
+            quitting = 1;
+        } else if (user_data == UD_PACE) {
+            ring->pace_due = UINT64_MAX; // the next round sets the next one
+        } else if (user_data == UD_WAKEUP) {
+            if (!quitting) {
+                _prepare_wakeup(ring);
+            }
+        } else if (user_data == UD_ACCEPT) {
+            ring->accept_armed = 0;
+            if (quitting) {
+                continue; // the ring closes any socket it accepted
+            }
+            if (res >= 0) {
+                _open_connection(loop, ring, res);
+            } else if (res != -EINTR && res != -ECONNABORTED) {
+                fprintf(stderr, "io_uring accept failed: %s\n", strerror(-res));
+            }
+            // with a full file table, wait for a connection to close first
+            if (res != -ENFILE) {
+                _prepare_accept(loop, ring);
+            }
+        } else {
+            Connection *conn = (Connection *)(uintptr_t)(user_data & ~(uint64_t)TAG_MASK);
+            _complete_connection_op(loop, ring, conn, user_data & TAG_MASK, res, quitting);
+        }
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return quitting;
+}
+
+
+void *run_uring_loop(void *arg) {
+    EventLoop *loop = (EventLoop *)arg;
+    Uring ring;
+    if (_uring_init(&ring) < 0 || _uring_register(&ring) < 0) {
+        exit(1);
+    }
+
+    // The ring waits for connections itself, so the listening socket can block
+    int flags = fcntl(loop->listen_fd, F_GETFL);
+    if (flags < 0 || fcntl(loop->listen_fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        perror("run_uring_loop: fcntl");
+        exit(1);
+    }
+
+    _prepare_accept(loop, &ring);
+    _prepare_wakeup(&ring);
+    if (_uring_reserve(&ring, 1) == 0) {
+        // POLL_ADD leaves the eventfd readable, so it wakes every worker
+        struct io_uring_sqe *sqe = _uring_sqe(&ring, IORING_OP_POLL_ADD, UD_QUIT);
+        sqe->fd = loop->quit_fd;
+        sqe->poll32_events = POLLIN;
+    }
+
+    int quitting = 0;
+    while (!quitting) {
+        _refresh_snapshot(loop);
+        _run_timers(loop, &ring);
+        if (_uring_submit(&ring, 1) < 0) {
+            exit(1);
+        }
+        quitting = _handle_completions(loop, &ring, quitting);
+    }
+
+    // Cancel everything still in flight, and wait for it to complete before
+    // freeing the memory it uses
+    if (_uring_reserve(&ring, 1) == 0) {
+        struct io_uring_sqe *sqe = _uring_sqe(&ring, IORING_OP_ASYNC_CANCEL, UD_IGNORE);
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    }
+    while (ring.in_flight > 0) {
+        if (_uring_submit(&ring, 1) < 0) {
+            break;
+        }
+        _handle_completions(loop, &ring, quitting);
+    }
+
+    while (loop->connections != NULL) {
+        Connection *conn = loop->connections;
+        loop->connections = conn->next;
+        printf("Client on %s:%d disconnected\n",
+               inet_ntoa(conn->client.addr.sin_addr),
+               ntohs(conn->client.addr.sin_port));
+        _reset_response(conn);
+        frame_end(conn);
+        free(conn);
+    }
+    _uring_free(&ring); // also closes the sockets in its file table
+    close(loop->listen_fd);
+    _release_snapshot(loop->snapshot);
+    return NULL;
+}
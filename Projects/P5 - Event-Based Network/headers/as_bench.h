@@ -0,0 +1,270 @@
+#ifndef AS_BENCH_H_
+#define AS_BENCH_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+#include "as_pace.h"
+
+#include <pthread.h>
+#include <sys/epoll.h>
+
+/*
+** Constants
+** ---------
+*/
+#define DEFAULT_CONNECTIONS 100
+#define DEFAULT_DURATION_SEC 10
+// Relative weights of LIST, STREAM and STREAM_RANGE requests (-m)
+#define DEFAULT_MIX "1:4:4"
+// Bytes a STREAM_RANGE request asks for (-R)
+#define DEFAULT_RANGE_BYTES (1024 * 1024)
+
+// A connection that failed is replaced after this long, so a server that is
+// down is not hammered with connects
+#define BENCH_RECONNECT_DELAY_MS 100
+
+#define BENCH_MAX_EVENTS 256
+#define BENCH_EPOLL_TIMEOUT_MS 100
+
+// Bytes of response moved from a socket to /dev/null per splice (the size of
+// a default pipe)
+#define BENCH_SPLICE_SIZE (64 * 1024)
+
+// Latency histograms: values (in microseconds) below 2^HIST_SUB_BITS have a
+// bucket each; above, each power of two is split into 2^HIST_SUB_BITS buckets,
+// so a percentile is within about 6% of the exact value
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+
+/*
+** Design
+** ------
+** as_bench measures the server under load, for comparing builds, options and
+** I/O engines (-e) with each other. It opens a number of connections (-c) at
+** once and keeps each busy for the length of the run (-d): a request, its
+** whole response, the think time (-t), and the next request, on the same
+** connection. Each request is LIST, STREAM or STREAM_RANGE of a random file,
+** in the proportions of the mix (-m).
+**
+** Connections are non-blocking and shared between a few threads (-j), each
+** running an epoll loop. Response data is not looked at: it is spliced from
+** the socket through a pipe to /dev/null, so the benchmark's own cost per
+** byte stays small. Only a LIST's is read, to find where it ends. A connection
+** may be limited to reading a rate (-b), like a player that reads no faster
+** than it plays; the server then sees the back-pressure real clients give it.
+**
+** For each request, the time to its first byte (TTFB) and to its last
+** (completion) are measured from when it was sent, and kept in histograms.
+** Only requests completed within the run are counted. At the end, the
+** throughput and the percentiles of both are reported, for each kind of
+** request and for all of them.
+**
+** Note that the server paces STREAMs at their file's bitrate once their first
+** PACE_BURST_SECONDS of audio are sent (see as_server.h): a STREAM of a long
+** file takes about as long as the file plays. Use STREAM_RANGE for bulk
+** throughput.
+*/
+
+
+typedef enum request_kind {
+    KIND_LIST,
+    KIND_STREAM,
+    KIND_RANGE,
+    NUM_KINDS,
+} RequestKind;
+
+
+/*
+** A latency histogram (see HIST_BUCKETS), in microseconds.
+*/
+typedef struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+
+/*
+** What a thread measured, merged into one at the end.
+**
+** bytes:         bytes of responses received, headers included.
+** errors:        requests the connection failed (or the server hung up) in.
+** connect_fails: connections that could not be made.
+*/
+typedef struct bench_stats {
+    uint64_t requests[NUM_KINDS];
+    uint64_t bytes[NUM_KINDS];
+    Histogram ttfb[NUM_KINDS];
+    Histogram completion[NUM_KINDS];
+    uint64_t errors;
+    uint64_t connect_fails;
+} BenchStats;
+
+
+/*
+** Connection state machine
+** ------------------------
+** CONNECTING: waiting for the non-blocking connect to finish.
+** SENDING:    the request is being written.
+** HEADER:     reading the response's header (a STREAM's size, a
+**             STREAM_RANGE's size and length).
+** BODY:       splicing the response's data away.
+** LIST:       reading a LIST response, until its "0:" line.
+** WAITING:    thinking before the next request, out of rate tokens, or
+**             waiting to reconnect (on its timer).
+*/
+typedef enum bench_state {
+    BENCH_CONNECTING,
+    BENCH_SENDING,
+    BENCH_HEADER,
+    BENCH_BODY,
+    BENCH_LIST,
+    BENCH_WAITING,
+} BenchState;
+
+/*
+** One connection to the server.
+**
+** fd:           its socket, -1 while it waits to reconnect.
+** events:       what epoll watches it for.
+** file:         the file requested, as a position in BenchOptions' files.
+** header_len:   the response header's size, header_got bytes of which are in.
+** body_left:    bytes of the response's data not received yet.
+** list_line:    bytes of the LIST line being read so far, and whether it
+**               starts with "0:" (list_last), the last line of a LIST.
+** sent_at:      when the request was sent (CLOCK_MONOTONIC nanoseconds), and
+**               when its response's first byte came in (first_byte_at, 0 until
+**               it has).
+** rate:         the connection's read rate (-b), unlimited if 0.
+** timer:        armed while it is WAITING.
+** resume:       the state to go on in once the timer expires.
+*/
+typedef struct bench_conn {
+    int fd;
+    BenchState state;
+    uint32_t events;
+    RequestKind kind;
+    uint32_t file;
+
+    uint8_t request[REQUEST_BUFFER_SIZE];
+    size_t request_len;
+    size_t request_sent;
+
+    uint8_t header[STREAM_RANGE_HEADER_SIZE];
+    size_t header_len;
+    size_t header_got;
+    uint64_t body_left;
+    uint64_t received;
+
+    size_t list_line;
+    uint8_t list_last;
+    uint8_t list_cr;
+
+    uint64_t sent_at;
+    uint64_t first_byte_at;
+
+    TokenBucket rate;
+    Timer timer;
+    BenchState resume;
+} BenchConn;
+
+
+/*
+** The benchmark's settings, from the command line, and the library's files
+** (from a LIST made before the run).
+**
+** mix:         the weights of LIST, STREAM and STREAM_RANGE requests.
+** think_ms:    milliseconds a connection waits between a response and its
+**              next request.
+** read_rate:   bytes per second each connection reads, 0 for no limit.
+** files:       indexes of the library's files (not removed ones).
+*/
+typedef struct bench_options {
+    struct sockaddr_in addr;
+    const char *hostname;
+    int port;
+    int connections;
+    int threads;
+    int duration_sec;
+    unsigned int mix[NUM_KINDS];
+    uint64_t range_bytes;
+    int think_ms;
+    uint64_t read_rate;
+    const char *label;
+
+    uint32_t *files;
+    uint32_t num_files;
+} BenchOptions;
+
+
+/*
+** A benchmark thread, with its share of the connections.
+**
+** pipe_fds:   the pipe responses are spliced to /dev/null (null_fd) through.
+**             It is always empty between splices, so all of the thread's
+**             connections share it.
+** file_sizes: the size of each of the library's files, once a STREAM or
+**             STREAM_RANGE response has told it (0 until then); a
+**             STREAM_RANGE starts at a random offset within it.
+** seed:       for rand_r.
+** deadline:   when the run ends (CLOCK_MONOTONIC nanoseconds).
+*/
+typedef struct bench_worker {
+    pthread_t thread;
+    const BenchOptions *options;
+    int epoll_fd;
+    int pipe_fds[2];
+    int null_fd;
+    TimerWheel wheel;
+    BenchConn *conns;
+    int num_conns;
+    uint64_t *file_sizes;
+    unsigned int seed;
+    uint64_t deadline;
+    BenchStats stats;
+} BenchWorker;
+
+
+/*
+** Add a value (in microseconds) to a histogram.
+*/
+void hist_record(Histogram *hist, uint64_t value);
+
+
+/*
+** Add the counts of one histogram to another.
+*/
+void hist_merge(Histogram *into, const Histogram *from);
+
+
+/*
+** return the value (in microseconds) percentile percent of the histogram's
+** values are at or below (the upper end of its bucket), 0 if it has none
+*/
+uint64_t hist_percentile(const Histogram *hist, double percent);
+
+
+/*
+** Get the indexes of the library's files with a LIST request, on a (blocking)
+** connection of its own.
+**
+** return 0 on success, -1 on error
+*/
+int bench_list_files(BenchOptions *options);
+
+
+/*
+** A benchmark thread: keep its connections busy until the deadline.
+*/
+void *bench_run_worker(void *arg);
+
+
+/*
+** Print the results of a run of duration seconds.
+*/
+void bench_report(const BenchOptions *options, const BenchStats *stats, double duration);
+
+#endif // AS_BENCH_H_
@@ -0,0 +1,109 @@
+#ifndef AS_CACHE_H_
+#define AS_CACHE_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+/*
+** Constants
+** ---------
+*/
+// Default memory budget for cached files, in MiB (-c)
+#define DEFAULT_CACHE_MB 256
+
+// Hash table buckets; a power of two
+#define FILE_CACHE_BUCKETS 4096
+
+
+/*
+** File cache
+** ----------
+** Popular tracks are requested by many clients, so the server keeps the most
+** recently streamed files mapped in memory (mmap), and streams them straight
+** from there. The cache is shared by all workers.
+**
+** A file is identified by its device, inode, size and modification time, so a
+** file that is changed (or replaced) is a miss, and its stale entry simply ages
+** out. Files are evicted least recently used first, once the mapped files add up
+** to more than the budget. A file that is evicted while it is being streamed
+** stays mapped until its last stream is done.
+**
+** refs:  held by the cache while the file is cached, and by each transfer
+**        streaming it.
+*/
+typedef struct cached_file {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+    uint8_t *data;
+    atomic_int refs;
+
+    struct cached_file *hash_next;
+    struct cached_file *lru_prev; // towards the most recently used
+    struct cached_file *lru_next;
+} CachedFile;
+
+
+/*
+** lock:     protects everything but the files' refs.
+** budget:   most bytes of files to keep mapped.
+** bytes:    bytes of files currently cached.
+** lru_head: most recently used file; lru_tail is the next to be evicted.
+*/
+typedef struct file_cache {
+    pthread_mutex_t lock;
+    size_t budget;
+    size_t bytes;
+    int num_files;
+    CachedFile *buckets[FILE_CACHE_BUCKETS];
+    CachedFile *lru_head;
+    CachedFile *lru_tail;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} FileCache;
+
+
+/*
+** Initialize an empty cache that keeps at most budget bytes of files.
+*/
+void cache_init(FileCache *cache, size_t budget);
+
+
+/*
+** Find the open file fd (with fstat info file_info) in the cache, mapping and
+** adding it on a miss. The caller gets a reference, to give back with
+** cache_release. *hit is set to whether the file was already in the cache.
+**
+** return the cached file, or NULL if it cannot be cached (it is empty, larger
+** than the budget, or cannot be mapped)
+*/
+CachedFile *cache_get(FileCache *cache, int fd, const struct stat *file_info, int *hit);
+
+
+/*
+** Give back a reference to a cached file.
+*/
+void cache_release(CachedFile *file);
+
+
+/*
+** Print the cache's size and hit rate on one line.
+*/
+void cache_report(FileCache *cache);
+
+
+/*
+** Unmap every file (that nothing else holds) and empty the cache.
+*/
+void cache_free(FileCache *cache);
+
+#endif // AS_CACHE_H_
@@ -6,6 +6,9 @@
 /*****************************************************************************/
 #include "libas.h"
 
+#include <pthread.h>
+#include <signal.h>
+
 /*
 ** The following constants are used to define a separate process that
 ** will be used to playback audio data. The process will be started
@@ -28,13 +31,90 @@
 #define SELECT_TIMEOUT_SEC 1
 #define SELECT_TIMEOUT_USEC 0
 
-// Buffer size to receive network data
-// before the dynamically changing one
-#define NETWORK_PRE_DYNAMIC_BUFF_SIZE 8192
+// Bytes of a stream the client holds (in a pipe, spliced in from the socket)
+// before it stops reading from the server until the player or the disk catch up
+#define STREAM_PIPE_SIZE (1024 * 1024)
 
 // Student's don't need to change this
 #define BUFFER_BLEED_OFF 1
 
+// A get that loses its connection reconnects and resumes this many times,
+// waiting GET_RESUME_DELAY_SEC seconds before each
+#define GET_RESUME_ATTEMPTS 5
+#define GET_RESUME_DELAY_SEC 1
+// A file being downloaded by get has this appended to its name until it is complete
+#define PARTIAL_FILE_SUFFIX ".part"
+
+// Connections a get splits a large file across (-n), and the least a
+// connection is given of it: a file of up to GET_SEGMENT_MIN_SIZE bytes is
+// got on one connection
+#define DEFAULT_GET_CONNECTIONS 4
+#define GET_SEGMENT_MIN_SIZE (8 * 1024 * 1024)
+
+// Files find and browse list at a time
+#define QUERY_PAGE_SIZE 20
+
+// Files sync checks and gets at a time (each one's local copy is open until
+// the server's hash of it is read)
+#define SYNC_BATCH_SIZE 256
+
+
+/*
+** The server the client is connected to, and where to reconnect to it.
+** sockfd is -1 while the client is not connected. connections is the most a
+** get may use at once (-n).
+*/
+typedef struct server_connection {
+    const char *hostname;
+    int port;
+    int sockfd;
+    int connections;
+} ServerConnection;
+
+/*
+** A segment of a file being got by get_file_request on a connection of its
+** own, by a thread of its own.
+**
+** offset:    where the segment starts in the file, and where the next byte
+**            received goes (the file is written at offsets, not appended to).
+** end:       where the segment ends.
+** file_size: the size of the file the segment was got from, which must be
+**            that of the others'.
+*/
+typedef struct get_segment {
+    pthread_t thread;
+    const ServerConnection *server;
+    uint32_t file_index;
+    int fd;
+    loff_t offset;
+    uint64_t end;
+    uint64_t file_size;
+} GetSegment;
+
+/*
+** A file being got by get_files_request, on stream_id of its connection.
+**
+** offset:    the bytes its partial file had when it was requested.
+** length:    the bytes the server is sending, once receiving.
+** unacked:   bytes received since the stream's window was last grown.
+** failed:    the server could not send it.
+*/
+typedef struct framed_get {
+    uint32_t file_index;
+    const char *name;
+    uint32_t stream_id;
+    int fd;
+    char *filepath;
+    char *partial_path;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t received;
+    uint32_t unacked;
+    uint8_t receiving;
+    uint8_t failed;
+} FramedGet;
+
+
 /*
 ** Client shell commands and constants**
 ** -----------------------------------
@@ -43,6 +123,11 @@
 #define CMD_GET "get"
 #define CMD_STREAM "stream"
 #define CMD_STREAM_AND_GET "stream+"
+#define CMD_STATS "stats"
+#define CMD_RADIO "radio"
+#define CMD_FIND "find"
+#define CMD_BROWSE "browse"
+#define CMD_SYNC "sync"
 #define CMD_QUIT "quit"
 #define CMD_HELP "help"
 
@@ -62,17 +147,112 @@
 int list_request(int sockfd, Library *library);
 
 /*
-** Sends a stream request to the server and simply saves the file received
-** from the server to the local library directory. The AUDIO_PLAYER is
+** Downloads a file from the server with a STREAM_RANGE request and saves it
+** to an identical file in the local library directory. The AUDIO_PLAYER is
 ** not started.
 **
-** See send_and_process_stream_request for more information. This function
-** should invoke send_and_process_stream_request such that the file data
-** received is saved to an identical file in the local library_directory.
+** A file larger than GET_SEGMENT_MIN_SIZE (that is not being resumed) is split
+** across up to server->connections connections: its first
+** GET_SEGMENT_MIN_SIZE bytes on the client's connection, and the rest in
+** equal segments on connections of their own, got at once (one connection's
+** TCP window cannot fill a link with a long round trip). The file is sized
+** up front and each segment written at its offset. Once they are all in, the
+** file must have the size every segment was got from, and the throughput is
+** reported. If a segment's connection is lost, the file is cut back to the
+** bytes that are in from its start, and resumed from there as below.
+**
+** The file is written under its name plus PARTIAL_FILE_SUFFIX, and renamed
+** once it is complete. If the connection is lost, the client reconnects to
+** the server and asks for the rest of the file, up to GET_RESUME_ATTEMPTS
+** times; a partial file left by an earlier get (e.g. the client was killed)
+** is resumed the same way. A partial file longer than the server's file is
+** started over. The file must not have changed on the server in between.
+**
+** returns 0 on success, -1 on error
+*/
+int get_file_request(ServerConnection *server, uint32_t file_index, const Library * library);
+
+/*
+** Downloads several files at once, on a connection of its own that uses the
+** framed protocol: each file is a stream of the connection, and the server
+** interleaves their data. The files are saved the same way as by
+** get_file_request, and partial files are resumed; a file the connection is
+** lost before finishing is left partial, for a later get to resume.
+**
+** If the server does not serve the framed protocol, the files are got one
+** after the other with get_file_request.
+**
+** A file the server cannot send (e.g. it was removed) is reported, and the
+** others are still got.
+**
+** returns 0 on success, -1 on error
+*/
+int get_files_request(ServerConnection *server, const uint32_t *file_indexes, int num_files,
+                      const Library *library);
+
+/*
+** Checks the local library's copies of the files at file_indexes against the
+** server's with HASH requests, all sent before any response is read. A copy
+** with the size and XXH64 content hash of the server's file is up to date,
+** and is left out of file_indexes, so get does not transfer it again; a copy
+** that differs (or that the server has not hashed yet) is reported, and left
+** in to be got again. Files with no local copy are left in without asking.
+**
+** If the connection is lost, it is closed (sockfd is -1) for get to reconnect,
+** and the files not checked yet are left in.
+**
+** returns the number of files left in file_indexes
+*/
+int skip_up_to_date_files(ServerConnection *server, uint32_t *file_indexes, int num_files,
+                          const Library *library);
+
+/*
+** Mirrors the server's library, or the files in it whose path starts with
+** prefix (all of them for ""), into the local library directory: lists the
+** library again (into library, without printing it), creates the directories
+** the files need, each once, then gets the files that are not up to date,
+** SYNC_BATCH_SIZE at a time, as get does: each batch is checked with pipelined
+** HASH requests (skip_up_to_date_files) and got with get_files_request, which
+** keeps a request for the next file in flight while the others drain. Prints
+** how many files were got and how many were up to date.
+**
+** returns 0 on success, -1 on error
+*/
+int sync_request(ServerConnection *server, Library *library, const char *prefix);
+
+/*
+** Sends a STATS request to the server and prints the metrics it responds with,
+** a "<name> <value>" line each.
 **
 ** returns 0 on success, -1 on error
 */
-int get_file_request(int sockfd, uint32_t file_index, const Library * library);
+int stats_request(int sockfd);
+
+/*
+** Sends a LIST_QUERY request to the server for a page (counting from 1) of
+** QUERY_PAGE_SIZE of the files whose path contains the pattern (or starts
+** with it, with QUERY_PREFIX), and prints them, with how many match in all.
+**
+** The files listed are added to the library (the others it does not know yet
+** are left empty, as removed ones are), so they can be got and streamed
+** without listing the whole library first.
+**
+** returns 0 on success, -1 on error
+*/
+int list_query_request(int sockfd, Library *library, QueryMode mode, const char *pattern, uint32_t page);
+
+/*
+** Tunes in to the station of the file at file_index with a RADIO request, and
+** plays its broadcast with the audio player (see as_radio.h): the file as it
+** is playing for everyone else tuned in, from a few seconds before now. The
+** broadcast never ends, so it plays until the player quits.
+**
+** The server keeps broadcasting until the connection is closed, so the
+** client hangs up and reconnects for its next command.
+**
+** returns 0 on success, -1 on error
+*/
+int radio_request(ServerConnection *server, uint32_t file_index);
 
 /*
 ** Starts the audio player process and returns the file descriptor of
@@ -117,24 +297,19 @@ int stream_and_get_request(int sockfd, uint32_t file_index, const Library * libr
 ** stream to the audio_out_fd and file_dest_fd file descriptors
 ** -- provided that they are not < 0.
 **
-** The select system call should be used to simultaneously wait for data to be available
-** to read from the server connection/socket, as well as for when audio_out_fd and file_dest_fd
-** (if applicable) are ready to be written to. Differing numbers of bytes may be written to
-** at each time (do no use write_precisely for this purpose -- you will nor receive full marks)
-** audio_out_fd and file_dest_fd, and this must be handled.
+** The select system call is used to simultaneously wait for data to be available
+** to read from the server connection/socket, as well as for when audio_out_fd is ready
+** to be written to. audio_out_fd must be a pipe (the audio player's stdin).
 **
 ** One of audio_out_fd or file_dest_fd can be -1, but not both. File descriptors >= 0
 ** should be closed before the function returns.
 **
-** This function will leverage a dynamic circular buffer with two output streams
-** and one input stream. The input stream is the server connection/socket, and the output
-** streams are audio_out_fd and file_dest_fd. The buffer should be dynamically sized using
-** realloc. See the assignment handout for more information, and notice how realloc is used
-** to manage the library.files in this client and the server.
-**
-** Phrased differently, this uses a FIFO with two independent out streams and one in stream,
-** but because it is as long as needed, we call it circular, and just point to three different
-** parts of it.
+** The stream never passes through the client's memory: it is spliced from the socket
+** into a pipe of STREAM_PIPE_SIZE bytes, and from there out to its destinations. With
+** both, the data at the front of the pipe is tee'd to the audio player and then spliced
+** into the file, so it leaves the pipe once both have it. The pipe is the only buffer:
+** once it is full, the socket is not read until the player (or the disk) takes more,
+** and TCP slows the server down.
 **
 ** returns 0 on success, -1 on error
 */
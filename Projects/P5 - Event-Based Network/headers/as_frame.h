@@ -0,0 +1,185 @@
+#ifndef AS_FRAME_H_
+#define AS_FRAME_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+
+/*
+** Constants
+** ---------
+*/
+// Bytes of HELLO, HEADERS and ERROR frames a connection holds to send between
+// DATA frames. A client that makes requests faster than they are answered is
+// not read from until there is room again.
+#define FRAME_CONTROL_SIZE 512
+
+// Longest ERROR message, and the room in the control buffer a request needs
+#define FRAME_ERROR_MAX 64
+#define FRAME_CONTROL_RESERVE (FRAME_HEADER_SIZE + FRAME_ERROR_MAX)
+
+// Longest payload a client's frame may have: a STREAM's
+#define FRAME_REQUEST_MAX STREAM_RANGE_FIELDS_SIZE
+
+
+/*
+** Framed connections
+** ------------------
+** A connection that switched to the framed protocol (see libas.h) is read from
+** and written to at the same time: new requests, WINDOW and CANCEL frames are
+** handled while responses are being sent.
+**
+** Responses are sent a frame at a time. HELLO, HEADERS and ERROR frames are
+** queued in control and go out between DATA frames; each DATA frame is the
+** next chunk of the next open stream (round robin) that has data and window
+** left, so one large file does not hold up a LIST or a short track. A file's
+** chunk is sent like any other response (see as_transfer.h), from the file or
+** the file cache straight to the socket after its frame header.
+**
+** Framed streams are not paced: their windows are for the client to keep its
+** buffers from overflowing. A framed connection takes turns to send with the
+** others, and shares the uplink, as a whole (see Design in as_server.h).
+**
+** The epoll engine sends with frame_send. The io_uring engine queues the same
+** bytes as chains of operations instead (see as_uring.h): it starts DATA frames
+** with frame_next_data and accounts for what its chains sent with
+** frame_control_sent, frame_header_sent and frame_data_sent.
+**
+** stream (FrameStream):
+**   id:          the client's id for it, 0 if the slot is free.
+**   payload:     the LIST payload being sent, NULL for a file.
+**   transfer:    the file being sent (a LIST's has no file).
+**   remaining:   bytes not yet put in a DATA frame.
+**   window:      bytes it may still be sent before the client grows it.
+**   started:     when its request came in, for its service time (see
+**                as_stats.h).
+**
+** session (FrameSession):
+**   control:     frames to send before the next DATA frame.
+**   current:     the stream the DATA frame being sent belongs to, -1 if none is.
+**   data_header: that frame's header, header_sent bytes of which are sent.
+**   data_left:   bytes of its payload still to send.
+**   next:        the stream slot to look at first for the next DATA frame.
+**   data_sent:   bytes of DATA frame payloads sent on the connection, so far.
+**   blocked:     the socket was full; nothing is sent until it has room.
+**   stats:       the counters of the connection's worker.
+**
+** The io_uring engine receives while a chain sends from the session, so its
+** recv does not go into the request buffer, which handling frames changes:
+**   received:    what the recv got (received_len bytes), waiting for room in
+**                the request buffer.
+**   receiving:   the recv is in flight.
+*/
+typedef struct frame_stream {
+    uint32_t id;
+    ListPayload *payload;
+    FileTransfer transfer;
+    uint64_t remaining;
+    int64_t window;
+    uint64_t started;
+} FrameStream;
+
+typedef struct frame_session {
+    FrameStream streams[FRAME_MAX_STREAMS];
+    int num_open;
+
+    uint8_t control[FRAME_CONTROL_SIZE];
+    size_t control_len;
+    size_t control_sent;
+
+    int current;
+    uint8_t data_header[FRAME_HEADER_SIZE];
+    size_t header_sent;
+    uint64_t data_left;
+    int next;
+
+    uint64_t data_sent;
+    uint8_t blocked;
+    struct worker_stats *stats;
+
+    uint8_t received[REQUEST_BUFFER_SIZE];
+    size_t received_len;
+    uint8_t receiving;
+} FrameSession;
+
+
+/*
+** Answer a REQUEST_FRAMED line. If the connection's engine serves the framed
+** protocol, the connection moves to CONN_FRAMED with a new session and a HELLO
+** queued; otherwise an empty ERROR frame is queued as its response (CONN_SENDING),
+** and the connection goes on with the line protocol.
+**
+** return 0 on success, -1 on error
+*/
+int frame_start(Connection *conn);
+
+
+/*
+** Handle the frames buffered on a framed connection: open a stream for each
+** request (queueing its HEADERS, or an ERROR if it cannot be answered), and
+** apply WINDOW and CANCEL frames. A request is left in the buffer until the
+** control buffer has room for its answer.
+**
+** return 0 on success, -1 if the connection must be closed (a protocol error)
+*/
+int frame_handle_requests(Connection *conn, LibrarySnapshot *snapshot, FileCache *cache);
+
+
+/*
+** Send the connection's control frames and DATA frames, as much as the socket
+** takes without blocking, but no more than max_bytes of DATA payload (besides
+** the rest of a DATA frame that was already started).
+**
+** return 1 once everything that can be sent is (the rest waits for windows or
+** requests), 0 if the socket is full, 2 if max_bytes were sent and more could
+** be, -1 on error
+*/
+int frame_send(Connection *conn, uint64_t max_bytes);
+
+
+/*
+** For an engine that queues its sends rather than making them: start the next
+** DATA frame, of at most max_bytes, unless one is being sent already. Control
+** frames still to send go out before it.
+**
+** return 1 if a DATA frame is being sent (session->current), 0 if none can be
+*/
+int frame_next_data(FrameSession *session, uint64_t max_bytes);
+
+
+/*
+** Account for bytes of the control frames, or of the current DATA frame's
+** header, that were sent.
+*/
+void frame_control_sent(FrameSession *session, size_t bytes);
+void frame_header_sent(FrameSession *session, size_t bytes);
+
+
+/*
+** Account for bytes of the current DATA frame's payload that were sent (a
+** file's must be taken off its stream's transfer too). Once all of it is, the
+** frame is done, and its stream is closed if nothing of it is left.
+*/
+void frame_data_sent(FrameSession *session, uint64_t bytes);
+
+
+/*
+** The bytes of DATA payload the session could send now: the rest of the
+** current DATA frame, and what every open stream's window allows.
+*/
+uint64_t frame_data_ready(const FrameSession *session);
+
+
+/*
+** Whether the session has anything to send now.
+*/
+int frame_has_output(const FrameSession *session);
+
+
+/*
+** Close every stream of a framed connection, and free its session.
+*/
+void frame_end(Connection *conn);
+
+#endif // AS_FRAME_H_
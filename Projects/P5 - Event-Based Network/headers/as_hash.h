@@ -0,0 +1,131 @@
+#ifndef AS_HASH_H_
+#define AS_HASH_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+
+/*
+** Constants
+** ---------
+*/
+// The file in the library directory the content hashes are kept in between
+// runs (not a SUPPORTED_FILE_EXTS file, so never in the library itself)
+#define HASH_INDEX_FILENAME ".as_hashes"
+
+// Bytes of a file the hasher reads at a time
+#define HASH_CHUNK_SIZE (1024 * 1024)
+
+
+/*
+** Content index
+** -------------
+** The XXH64 hash (see libas.h) of every file in the library, by file index, so
+** a client can tell whether its copy of a file is the same as the server's
+** without downloading it (see the HASH request in as_server.h).
+**
+** Files are hashed by a background thread at the lowest CPU and I/O priority,
+** one after the other. It goes through the library when it starts, whenever a
+** new library snapshot is published, and when a lookup finds that a file
+** changed since it was hashed; each pass only hashes the files whose size or
+** modification time changed. A hash is only given out for a file that still
+** has the size and modification time it was hashed with.
+**
+** The hashes are saved to HASH_INDEX_FILENAME after each pass that hashed
+** anything or went through a new snapshot, and loaded from it when the server starts, so unchanged files are
+** not hashed again. The file has a line per file: its hash (in hex), size,
+** modification time (in nanoseconds) and path, separated by spaces. If it
+** cannot be written, the hashes are only kept in memory.
+**
+** hash (ContentHash):
+**   mtime:  modification time (nanoseconds since the epoch) it was hashed at.
+**   known:  whether the entry holds a hash at all.
+**
+** index (ContentIndex):
+**   lock:       held by lookups and while the hasher updates hashes (which
+**               only the hasher changes, so it reads them without the lock).
+**   hashes:     by file index, num_hashes of them.
+**   stale:      a lookup found a file that changed since it was hashed.
+**   generation: of the last snapshot the hasher went through.
+**   saved:      the hashes loaded from the last run, sorted by path, until the
+**               first pass is over. Those of files the pass has not got to
+**               (used is 0) are saved again with the index's own.
+*/
+typedef struct content_hash {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+    uint8_t known;
+} ContentHash;
+
+typedef struct saved_hash {
+    char *path;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+    uint8_t used;
+} SavedHash;
+
+typedef struct content_index {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    ContentHash *hashes;
+    uint32_t num_hashes;
+    uint8_t stale;
+    atomic_int quit;
+
+    pthread_t thread;
+    uint8_t running;
+    SharedLibrary *shared;
+    unsigned int generation;
+    int library_fd;
+
+    char *save_path;
+    uint8_t save_failed;
+    SavedHash *saved;
+    size_t num_saved;
+} ContentIndex;
+
+
+/*
+** Set up the content index of the library at library_path, loading the hashes
+** saved by the last run. The hasher is not started yet.
+**
+** return 0 on success, -1 on error
+*/
+int content_index_init(ContentIndex *index, SharedLibrary *shared, const char *library_path);
+
+
+/*
+** Start hashing the shared library's current snapshot in the background.
+**
+** return 0 on success, -1 on error
+*/
+int content_index_start(ContentIndex *index);
+
+
+/*
+** Have the hasher go through the library again (e.g. after a new snapshot is
+** published), hashing the files that changed.
+*/
+void content_index_wake(ContentIndex *index);
+
+
+/*
+** Look up the hash of the library's file at file_index, for a HASH request.
+** *size is set to the file's size as it is now, and *hash to its hash if it
+** is known. A file that changed since it was hashed wakes the hasher.
+**
+** return HASH_KNOWN, HASH_PENDING, or HASH_MISSING if there is no such file
+*/
+HashStatus content_lookup(ContentIndex *index, const Library *library, uint32_t file_index,
+                          uint64_t *size, uint64_t *hash);
+
+
+/*
+** Stop the hasher (saving the hashes it computed) and free the index.
+*/
+void content_index_free(ContentIndex *index);
+
+#endif // AS_HASH_H_
@@ -0,0 +1,244 @@
+#ifndef AS_INDEX_H_
+#define AS_INDEX_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+#include "as_scan.h"
+
+#include <sys/inotify.h>
+
+/*
+** Constants
+** ---------
+*/
+// Events the index watches every directory of the library for
+#define INDEX_WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                          IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+// Bytes of inotify events read at a time
+#define INOTIFY_BUFFER_SIZE (64 * 1024)
+
+// The file in the library directory the index is saved to between runs (not a
+// SUPPORTED_FILE_EXTS file, so never in the library itself)
+#define INDEX_SAVE_FILENAME ".as_library"
+#define INDEX_SAVE_MAGIC "ASLIBIDX"
+#define INDEX_SAVE_VERSION 1
+
+
+/*
+** Library index
+** -------------
+** The server's view of the library, kept up to date by inotify instead of
+** rescanning the whole directory tree: every directory in the library is
+** watched, and each file added, removed or renamed is applied to the index
+** as it happens, in time proportional to the change.
+**
+** To apply a directory's move (or removal) in time proportional to what is in
+** it rather than to the library, each watch keeps a list of the files directly
+** in its directory and of the watches of its subdirectories. A watch follows
+** its directory (by inode) wherever it is moved to, so a moved directory keeps
+** its watches, lists and all; only their paths change.
+**
+** A file keeps its index for as long as it is in the library, so the indices
+** a client listed stay valid: new files get the next unused index, a renamed
+** file keeps its index, and a removed file leaves a hole (a NULL entry in
+** library.files) that is never reused. A full rescan only happens if the
+** kernel's event queue overflows, and even then the files that are still
+** there keep their indices: files are matched up by path, then by inode (so
+** renames missed in the overflow are recognized).
+**
+** If inotify is not available (e.g. the watch limit is reached), inotify_fd
+** is -1 and the library must be rescanned periodically with index_rescan.
+**
+** Scans read the library's directories in parallel (see as_scan.h). The paths
+** found by the first scan stay in its arena; files added later have paths of
+** their own.
+**
+** The index is saved to INDEX_SAVE_FILENAME (see index_save), so the next run
+** can start from it without waiting for a scan: index_load maps the file, and
+** the index's paths point into the mapping rather than being copied. The
+** loaded index is served as is while a rescan checks it against the library,
+** applying what changed as any other change (so files keep their indices
+** across runs too).
+**
+** The saved file is a SavedIndexHeader, then a SavedFile per index (holes
+** included), then the paths, each NUL-terminated. It is a cache, not an
+** interchange format: it is in the server's byte order, and anything that
+** does not check out (the magic, version, sizes or checksum) is ignored and
+** the library scanned instead.
+**
+** library:     the files, by index; removed files are NULL. num_files counts
+**              the holes too.
+** inodes:      the inode of each file in library.files.
+** capacity:    allocated length of library.files and inodes; doubled as needed.
+** paths:       the first scan's arena, holding most of library.files' strings.
+** path_map,
+** inode_map:   hash tables (open addressing) of index + 1 (0 for an empty
+**              bucket), keyed by the file's path and inode.
+** watches:     each inotify watch, by descriptor (see IndexWatch).
+** links:       where each file is in its directory's watch's list, by index.
+** pending_move: a file or directory moved away, waiting to see whether the
+**              next event moves it back into the library (move_cookie); it
+**              was in the directory of the watch pending_wd.
+** changed:     whether the files changed since the flag was last cleared.
+** saved:       the mapping of the saved index it was loaded from (saved_size
+**              bytes, NULL if it was scanned), which loaded paths point into.
+** save_path:   where the index is saved; save_failed if the last save failed.
+*/
+/*
+** watch (IndexWatch):
+**   dir:          the directory watched, relative to the library ("" for its
+**                 root); NULL if the descriptor is not in use.
+**   parent:       the watch of the directory it is in, -1 for the root.
+**   first_child,
+**   next_sibling,
+**   prev_sibling: the watches of its subdirectories (-1 ends the list).
+**   first_file:   index + 1 of the first file directly in it, 0 if none.
+**
+** link (IndexLink):
+**   watch:        the watch of the file's directory, -1 if it is in none (the
+**                 library is not watched, or not yet: a loaded index).
+**   next, prev:   index + 1 of the next and previous file in its list, 0 at
+**                 either end.
+*/
+typedef struct index_watch {
+    char *dir;
+    int parent;
+    int first_child;
+    int next_sibling;
+    int prev_sibling;
+    uint32_t first_file;
+} IndexWatch;
+
+typedef struct index_link {
+    int watch;
+    uint32_t next;
+    uint32_t prev;
+} IndexLink;
+
+typedef struct slot_map {
+    uint32_t *buckets;
+    size_t capacity;
+    size_t count;
+} SlotMap;
+
+typedef struct library_index {
+    Library library;
+    ino_t *inodes;
+    uint32_t capacity;
+    PathArena paths;
+    SlotMap path_map;
+    SlotMap inode_map;
+
+    int inotify_fd;
+    IndexWatch *watches;
+    int num_watches;
+    IndexLink *links;
+
+    char *pending_move;
+    int pending_is_dir;
+    int pending_wd;
+    uint32_t move_cookie;
+
+    int changed;
+
+    const char *saved;
+    size_t saved_size;
+    char *save_path;
+    uint8_t save_failed;
+} LibraryIndex;
+
+
+/*
+** The saved index file.
+**
+** header (SavedIndexHeader):
+**   num_files:    SavedFiles that follow.
+**   paths_size:   bytes of paths after them.
+**   checksum:     XXH64 of the SavedFiles and paths.
+**
+** file (SavedFile):
+**   inode:        the file's inode.
+**   path:         offset of its path in the paths, INDEX_SAVED_HOLE for a
+**                 removed file.
+*/
+#define INDEX_SAVED_HOLE UINT64_MAX
+
+typedef struct saved_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_files;
+    uint64_t paths_size;
+    uint64_t checksum;
+} SavedIndexHeader;
+
+typedef struct saved_file {
+    uint64_t inode;
+    uint64_t path;
+} SavedFile;
+
+
+/*
+** Scan the library at path (which must outlive the index) into an empty
+** index. If watch is set, also watch the library for changes with inotify.
+**
+** return 0 on success, -1 on error
+*/
+int index_init(LibraryIndex *index, const char *path, int watch);
+
+
+/*
+** Load the index of the library at path (which must outlive the index) saved
+** by the last run, into an empty index. If watch is set, an inotify instance
+** is set up, but nothing is watched until index_rescan: the loaded index must
+** be checked against the library with it.
+**
+** return 0 on success, -1 if there is no saved index that can be used (the
+** index is then freed)
+*/
+int index_load(LibraryIndex *index, const char *path, int watch);
+
+
+/*
+** Save the index to INDEX_SAVE_FILENAME in the library: to a temporary file
+** first, renamed over it, so a crash never leaves half of one. If it cannot be
+** saved, the next run scans the library.
+*/
+void index_save(LibraryIndex *index);
+
+
+/*
+** Read and apply the changes inotify has reported, without blocking. An
+** overflowed event queue is recovered from with a full rescan.
+**
+** return 0 on success, -1 on error
+*/
+int index_process_events(LibraryIndex *index);
+
+
+/*
+** Rescan the whole library, keeping the indices of the files still there.
+**
+** return 0 on success, -1 on error
+*/
+int index_rescan(LibraryIndex *index);
+
+
+/*
+** Copy the index's files into an empty library, with NULL for the holes. The
+** strings are packed into one allocation, returned in *paths: free it and
+** library->files (not with _free_library) once the copy is no longer needed.
+**
+** return 0 on success, -1 on error
+*/
+int index_copy_library(const LibraryIndex *index, Library *library, char **paths);
+
+
+/*
+** Free the index, and stop watching the library.
+*/
+void index_free(LibraryIndex *index);
+
+#endif // AS_INDEX_H_
@@ -0,0 +1,168 @@
+#ifndef AS_PACE_H_
+#define AS_PACE_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <time.h>
+
+/*
+** Constants
+** ---------
+*/
+// A realtime stream is paced at its audio's bitrate times this (in percent),
+// so a player that fell behind can still catch up
+#define PACE_HEADROOM_PERCENT 125
+
+// Seconds of audio a realtime stream may send at once: the player's buffer is
+// filled as fast as the network allows at the start of a stream
+#define PACE_BURST_SECONDS 10
+
+// Bytes a connection may send per turn, when connections take turns sending
+// (deficit round robin)
+#define PACE_QUANTUM (256 * 1024)
+
+// A connection waiting for tokens is woken once it can send this much (or the
+// rest of its response), rather than trickling out a packet at a time
+#define PACE_MIN_SEND (64 * 1024)
+
+// Milliseconds of the uplink rate (-r) a worker may send at once
+#define PACE_LINK_BURST_MS 50
+
+// Timer wheel: WHEEL_SLOTS slots of WHEEL_TICK_MS each
+#define WHEEL_SLOTS 256
+#define WHEEL_TICK_MS 1
+
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_MS 1000000ULL
+
+
+/*
+** Token bucket
+** ------------
+** Limits a sender to rate bytes per second on average, in bursts of at most
+** burst bytes: the bucket fills with rate tokens per second up to burst, and
+** each byte sent takes a token. A rate of 0 is not limited at all.
+**
+** updated: when tokens were last topped up (CLOCK_MONOTONIC nanoseconds).
+*/
+typedef struct token_bucket {
+    uint64_t rate;
+    uint64_t burst;
+    double tokens;
+    uint64_t updated;
+} TokenBucket;
+
+
+/*
+** Timer wheel
+** -----------
+** Timers hashed by their expiry tick into WHEEL_SLOTS slots, so arming,
+** cancelling and expiring a timer take constant time however many are armed.
+** A timer further than one turn of the wheel away waits in its slot for as
+** many turns as it takes.
+**
+** Timers are embedded in what they time (owner), and each slot is a circular
+** list through a sentinel timer.
+**
+** expires: the tick it expires on.
+** armed:   whether it is on the wheel.
+** tick:    the next tick to expire; ticks are WHEEL_TICK_MS of CLOCK_MONOTONIC.
+*/
+typedef struct timer {
+    struct timer *prev;
+    struct timer *next;
+    uint64_t expires;
+    int armed;
+    void *owner;
+} Timer;
+
+typedef struct timer_wheel {
+    Timer slots[WHEEL_SLOTS];
+    uint64_t tick;
+    int num_armed;
+} TimerWheel;
+
+
+/*
+** Nanoseconds of CLOCK_MONOTONIC.
+*/
+uint64_t monotonic_ns(void);
+
+
+/*
+** Set up a bucket for rate bytes per second (0 for no limit), starting full.
+*/
+void bucket_init(TokenBucket *bucket, uint64_t rate, uint64_t burst, uint64_t now);
+
+
+/*
+** Top the bucket up for the time since it was last.
+**
+** return the bytes that may be sent now, UINT64_MAX if it has no limit
+*/
+uint64_t bucket_available(TokenBucket *bucket, uint64_t now);
+
+
+/*
+** Take the tokens for bytes sent. The bucket may go into debt, if the bytes
+** were sent before the tokens came in.
+*/
+void bucket_take(TokenBucket *bucket, uint64_t bytes);
+
+
+/*
+** return the nanoseconds until the bucket (topped up) holds bytes tokens
+*/
+uint64_t bucket_delay(const TokenBucket *bucket, uint64_t bytes);
+
+
+/*
+** Set up an empty wheel, starting at now.
+*/
+void wheel_init(TimerWheel *wheel, uint64_t now);
+
+
+/*
+** Arm a timer (first cancelling it if it is armed) to expire at the first tick
+** at or after the time expires (CLOCK_MONOTONIC nanoseconds), and no earlier
+** than the wheel's next tick.
+*/
+void wheel_add(TimerWheel *wheel, Timer *timer, void *owner, uint64_t expires);
+
+
+/*
+** Cancel a timer, if it is armed.
+*/
+void wheel_remove(TimerWheel *wheel, Timer *timer);
+
+
+/*
+** Take every timer that has expired by now off the wheel, oldest tick first.
+**
+** return the expired timers, chained through next (NULL if there are none)
+*/
+Timer *wheel_expire(TimerWheel *wheel, uint64_t now);
+
+
+/*
+** return the milliseconds from now until the next timer expires, at most
+** max_ms (max_ms if none is armed)
+*/
+int wheel_timeout_ms(const TimerWheel *wheel, uint64_t now, int max_ms);
+
+
+/*
+** The average bitrate of an audio file, in bytes per second, from its header:
+** a WAV's byte rate, a FLAC's length over its duration, or an MP3's frame
+** bitrate (its average, for a VBR file with a Xing header). The file is read
+** from fd with pread, never from a mapping of it: a mapped file truncated in
+** place faults (SIGBUS) where pread only comes up short.
+**
+** return the bitrate, 0 if it cannot be told (an unknown format)
+*/
+uint64_t pace_probe_bitrate(int fd, uint64_t file_size);
+
+#endif // AS_PACE_H_
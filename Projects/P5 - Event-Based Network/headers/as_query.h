@@ -0,0 +1,72 @@
+#ifndef AS_QUERY_H_
+#define AS_QUERY_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+/*
+** Constants
+** ---------
+*/
+// Trigrams are hashed into 2^QUERY_TRIGRAM_BITS posting lists
+#define QUERY_TRIGRAM_BITS 16
+#define QUERY_BUCKETS ((uint32_t)1 << QUERY_TRIGRAM_BITS)
+
+// Most files a LIST_QUERY response lists
+#define QUERY_MAX_LIMIT 1000
+
+
+/*
+** Path queries
+** ------------
+** A LIST_QUERY finds the library's files whose path contains a pattern, or
+** starts with it (see QueryMode in libas.h), ignoring ASCII case. Rather than
+** comparing the pattern with every path, it only looks at the paths that have
+** every three-character sequence (trigram) of the pattern: each library
+** snapshot has a trigram index, the files (by index, in order) each trigram of
+** their path appears in. The shortest of the pattern's lists is the candidates,
+** and each candidate's path is then compared with the pattern. A pattern
+** shorter than a trigram is compared with every path.
+**
+** Trigrams are folded to lower case and hashed into QUERY_BUCKETS lists, so a
+** list may hold files that only have a trigram with the same hash; comparing
+** the candidates drops them. The lists are built in one allocation per
+** snapshot: the files in each bucket are counted first, then filled in.
+**
+** index (QueryIndex):
+**   starts:   where each bucket's files start in postings; the bucket's files
+**             end where the next bucket's start (starts has QUERY_BUCKETS + 1
+**             entries).
+**   postings: the buckets' files, by index, in ascending order, each at most
+**             once per bucket.
+*/
+typedef struct query_index {
+    uint32_t *starts;
+    uint32_t *postings;
+} QueryIndex;
+
+
+/*
+** Build the trigram index of a library's paths (removed files have none).
+**
+** return 0 on success, -1 on error
+*/
+int query_index_build(QueryIndex *index, const Library *library);
+
+
+/*
+** Find the library's files that match the pattern (len bytes, not
+** NUL-terminated), in ascending order of index. The indices of the limit
+** matches from offset on are written to page.
+**
+** return the number of files that match in all
+*/
+uint32_t query_run(const QueryIndex *index, const Library *library, QueryMode mode,
+                   const char *pattern, size_t len, uint32_t offset, uint32_t limit, uint32_t *page);
+
+
+void query_index_free(QueryIndex *index);
+
+#endif // AS_QUERY_H_
@@ -0,0 +1,163 @@
+#ifndef AS_RADIO_H_
+#define AS_RADIO_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+
+/*
+** Constants
+** ---------
+*/
+// A station's ring holds RADIO_RING_CHUNKS chunks of RADIO_CHUNK_SIZE bytes
+// of its file; a chunk is read in at a time
+#define RADIO_CHUNK_SIZE (16 * 1024)
+#define RADIO_RING_CHUNKS 64
+#define RADIO_RING_SIZE ((uint64_t)RADIO_CHUNK_SIZE * RADIO_RING_CHUNKS)
+
+// The bitrate (bytes per second) of a file pace_probe_bitrate cannot tell:
+// 320 kbit/s, the most an MP3 has
+#define RADIO_DEFAULT_BITRATE (320 * 1000 / 8)
+
+// Most bytes of a station's ring a listener is sent at once
+#define RADIO_MAX_SEND (64 * 1024)
+
+// A listener's socket send buffer (SO_SNDBUF), so a listener that reads
+// slower than the bitrate falls behind the ring, rather than the kernel
+// queueing seconds of the broadcast for it
+#define RADIO_SOCKET_BUFFER (64 * 1024)
+
+
+/*
+** Radio stations
+** --------------
+** A RADIO request tunes in to a file's station rather than streaming the file
+** from its start: everyone listening to the same file hears the same moment
+** of it, like a radio broadcast. The first listener starts the station, and it
+** is shut down once its last listener hangs up. A station plays its file in a
+** loop, in real time (at its bitrate, see pace_probe_bitrate).
+**
+** A station reads its file once, a chunk at a time as it goes on air, into a
+** ring of RADIO_RING_CHUNKS chunks; its listeners (on any worker) are sent the
+** ring's data, and only keep their position in the broadcast (their cursor).
+** So however many listen, a station costs one ring and one file read at its
+** bitrate. No thread of its own reads the file: whichever listener's turn
+** finds that a new chunk is due reads it in, under the station's produce
+** lock (other listeners carry on with what is in the ring meanwhile).
+**
+** A station is ahead of real time by lead bytes (PACE_BURST_SECONDS of audio,
+** or half the ring if less): a new listener is sent those first, to fill its
+** player's buffer, then the rest as it goes on air. A listener that falls
+** behind by more than the ring holds (a client that reads slower than the
+** bitrate) skips ahead to where a new listener would start, rather than being
+** buffered for: with the epoll engine, its socket's send buffer is only
+** RADIO_SOCKET_BUFFER (a socket in an io_uring's file table keeps the kernel's
+** default). Joining or skipping lands at the start of a chunk rather than of
+** an audio frame, which players resync from.
+**
+** station (RadioStation):
+**   file_index: the library file it plays; fd is open on it.
+**   bitrate:    bytes per second it goes on air at.
+**   started:    when it went on air (CLOCK_MONOTONIC nanoseconds).
+**   head:       bytes of the broadcast read into the ring so far. The ring
+**               holds the last RADIO_RING_SIZE of them, but the oldest chunk
+**               is the next to be overwritten, so listeners are only sent
+**               from the others; the producer does not wait for listeners,
+**               so each send is checked afterwards (see radio_sent).
+**   failed:     reading the file failed; its listeners are hung up on.
+**   listeners:  connections tuned in, under the stations' lock.
+**
+** stations (RadioStations):
+**   lock:       held while a station is looked up, started or shut down.
+*/
+typedef struct radio_station {
+    uint32_t file_index;
+    int fd;
+    uint64_t file_size;
+    uint64_t bitrate;
+    uint64_t lead;
+    uint64_t started;
+
+    pthread_mutex_t produce_lock;
+    _Atomic uint64_t head;
+    atomic_int failed;
+
+    int listeners;
+    struct radio_stations *owner;
+    struct radio_station *next;
+    uint8_t ring[RADIO_RING_SIZE];
+} RadioStation;
+
+typedef struct radio_stations {
+    pthread_mutex_t lock;
+    RadioStation *stations;
+} RadioStations;
+
+
+void radio_init(RadioStations *stations);
+
+
+/*
+** Tune a connection in to the station of the library's file at file_index,
+** starting it if it is not on air, and queue the response header: the file's
+** size and the station's bitrate (64 bits each, network byte order). The
+** connection moves to CONN_RADIO, at the start of the station's lead.
+**
+** return 0 on success, -1 if there is no such file (or on error)
+*/
+int radio_tune(Connection *conn, RadioStations *stations, const Library *library, uint32_t file_index);
+
+
+/*
+** Send a listener the header (first shrinking its socket's send buffer to
+** RADIO_SOCKET_BUFFER), then what is on air past its cursor, as much as the
+** socket takes without blocking. *bytes is set to the bytes sent.
+**
+** return 1 once it has caught up with the station, 0 if the socket is full,
+** -1 on error
+*/
+int radio_send(Connection *conn, uint64_t *bytes);
+
+
+/*
+** The listener's next bytes of the broadcast (skipping it ahead if it fell
+** behind the ring), from the ring: at most RADIO_MAX_SEND of them, as many as
+** are on air and contiguous in the ring. Reads in the chunks that are due.
+**
+** return the number of bytes at *data, 0 if it has caught up, -1 if the
+** station failed
+*/
+int64_t radio_peek(Connection *conn, const uint8_t **data);
+
+
+/*
+** Move a listener's cursor past the sent bytes of what radio_peek gave it,
+** once the socket has taken them. If the station overwrote them meanwhile (a
+** chunk of the ring is overwritten as soon as it is the oldest, while a
+** listener that far behind may still be sent from it), what went out may mix
+** two passes of the broadcast: the listener skips ahead instead, as if it had
+** fallen behind.
+*/
+void radio_sent(Connection *conn, size_t sent);
+
+
+/*
+** When the station's next chunk goes on air (CLOCK_MONOTONIC nanoseconds), for
+** a listener that caught up to wait for.
+*/
+uint64_t radio_next_due(const RadioStation *station);
+
+
+/*
+** Untune a connection, shutting its station down if it was the last listener.
+*/
+void radio_leave(Connection *conn);
+
+
+/*
+** Free the stations. Every listener must have left.
+*/
+void radio_free(RadioStations *stations);
+
+#endif // AS_RADIO_H_
@@ -0,0 +1,142 @@
+#ifndef AS_SCAN_H_
+#define AS_SCAN_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/inotify.h>
+
+/*
+** Constants
+** ---------
+*/
+// Threads reading directories in a full scan of the library. Reading a
+// directory mostly waits on the disk (or the network, for a NAS), so this
+// is more than there are cores.
+#define SCAN_THREADS 8
+
+// Bytes of directory entries read per getdents64 call
+#define SCAN_BUFFER_SIZE (32 * 1024)
+
+// The first chunk of a path arena; each chunk is twice the last, up to the max
+#define ARENA_CHUNK_MIN (64 * 1024)
+#define ARENA_CHUNK_MAX (4 * 1024 * 1024)
+
+
+/*
+** Path arena
+** ----------
+** Path strings allocated in large chunks, and freed all at once: a scan of a
+** large library makes hundreds of thousands of small strings, which would
+** otherwise each be a malloc.
+*/
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+typedef struct path_arena {
+    ArenaChunk *chunks; // the newest first
+    size_t next_size;
+} PathArena;
+
+
+/*
+** Directory scans
+** ---------------
+** A scan reads a directory tree on a pool of threads, each opening
+** directories (openat, relative to the library) and reading them with
+** getdents64, and queueing the subdirectories it finds for any thread to read.
+** Each directory's entries are kept in the order the kernel returned them, so
+** walking the tree depth first gives the files in the same order as a
+** recursive readdir would.
+**
+** path:    relative to the library ("" for its root), in the scan's arena.
+** inode:   the file's inode.
+** dir:     the subdirectory's listing, or NULL for a file.
+** wd:      the inotify watch on the directory, -1 if it is not watched.
+**
+** watch_limit_reached: a directory could not be watched, as there are too
+**          many watches.
+*/
+typedef struct scan_entry {
+    const char *path;
+    ino_t inode;
+    struct scan_dir *dir;
+} ScanEntry;
+
+typedef struct scan_dir {
+    const char *path;
+    int wd;
+    ScanEntry *entries;
+    uint32_t num_entries;
+    uint32_t capacity;
+} ScanDir;
+
+typedef struct scan_tree {
+    ScanDir *root;
+    PathArena arena;
+    int watch_limit_reached;
+} ScanTree;
+
+
+/*
+** Whether filename has one of the SUPPORTED_FILE_EXTS.
+*/
+uint8_t _is_file_extension_supported(const char *filename);
+
+
+/*
+** Allocate size bytes (8-byte aligned) from the arena.
+**
+** return the memory, or NULL on error
+*/
+void *arena_alloc(PathArena *arena, size_t size);
+
+
+/*
+** Whether ptr was allocated from the arena.
+*/
+int arena_owns(const PathArena *arena, const void *ptr);
+
+
+/*
+** Move the chunks of from into to, leaving from empty.
+*/
+void arena_append(PathArena *to, PathArena *from);
+
+
+/*
+** Free everything allocated from the arena.
+*/
+void arena_free(PathArena *arena);
+
+
+/*
+** Scan the directory dir (relative to the library at library_path, "" for its
+** root) and everything below it into tree, reading directories on num_threads
+** threads (1 reads them on the caller's thread alone). Only regular files with
+** a supported extension are listed.
+**
+** If inotify_fd is not -1, each directory is watched for watch_mask before it
+** is read, so nothing added meanwhile is missed. A subdirectory that cannot be
+** read (e.g. it was removed during the scan) is left empty.
+**
+** return 0 on success, -1 if dir itself cannot be read (with errno set)
+*/
+int scan_tree(ScanTree *tree, const char *library_path, const char *dir,
+              int inotify_fd, uint32_t watch_mask, int num_threads);
+
+
+/*
+** Free a scan's listings, and its arena unless it was moved elsewhere.
+*/
+void scan_tree_free(ScanTree *tree);
+
+#endif // AS_SCAN_H_
@@ -5,33 +5,84 @@
 /*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
 /*****************************************************************************/
 #include "libas.h"
+#include "as_transfer.h"
+#include "as_index.h"
+#include "as_pace.h"
+#include "as_query.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
 
 /*
 ** Constants
 ** ---------
 */
-#define MAX_PENDING 10
-#define STREAM_CHUNK_SIZE 1024
+// Default length of the kernel's queue of connections waiting to be accepted (-b)
+#define DEFAULT_BACKLOG 128
 
-#define SELECT_TIMEOUT_SEC 1
-#define SELECT_TIMEOUT_USEC 0
-#define SELECT_TIMEOUT {SELECT_TIMEOUT_SEC, SELECT_TIMEOUT_USEC}
+// Each event loop wakes up at least this often to pick up an updated library
+#define EPOLL_TIMEOUT_MS 1000
+#define MAX_EPOLL_EVENTS 64
 
 #define LIBRARY_FILENAME_MAX 256
+// Seconds between library rescans, when the library cannot be watched with inotify
 #define LIBRARY_SCAN_INTERVAL 60
+// Changes to the library are published to the workers this long after the first
+#define INDEX_PUBLISH_DELAY_MS 100
+
+// The longest response header a connection sends from its prefix
+#define RESPONSE_PREFIX_SIZE \
+    (HASH_RESPONSE_SIZE > STREAM_RANGE_HEADER_SIZE ? HASH_RESPONSE_SIZE : STREAM_RANGE_HEADER_SIZE)
 
 
 /*
 ** Design
 ** ------
 ** The server will be a simple command-line program that listens for incoming
-** connections on a specified port. When a connection is made, the server will
-** fork a child process to handle the client. The child process will exist solely
-** to handle this client, and will terminate when the client disconnects.
+** connections on a specified port. Clients are served by a number of worker
+** threads, each running its own epoll event loop on its own listening socket.
+** The sockets share the port with SO_REUSEPORT, so the kernel spreads new
+** connections over the workers, and a connection stays with the worker that
+** accepted it. Each connection is a small state machine (see Connection below)
+** that is advanced whenever its socket is ready, so one slow client never holds
+** up the others.
+**
+** Workers run one of two I/O engines (-e): by default every socket is
+** non-blocking and watched with epoll, or with -e uring the worker submits its
+** accepts, reads and sends to an io_uring in batches (see as_uring.h).
+**
+** Connections share the uplink fairly. A STREAM is someone listening, so once
+** it has sent PACE_BURST_SECONDS of audio to fill the player's buffer, it is
+** paced at the file's bitrate (plus PACE_HEADROOM_PERCENT) with a token bucket:
+** a client streaming one track no longer takes the bandwidth of a whole album.
+** STREAM_RANGE (get, seeking) is bulk, and not paced. The connections with
+** file data to send take turns by deficit round robin, up to PACE_QUANTUM bytes
+** a turn, and with an uplink rate (-r) each worker has a token bucket for its
+** share of it: a few clients downloading large files cannot starve the
+** streams. Connections waiting for tokens are woken by a timer wheel (see
+** as_pace.h).
 **
 ** The server will maintain a library of audio files. The library will be a
-** directory on the server's file system. The server will scan the library
-** directory at regular intervals to keep the library up to date.
+** directory on the server's file system. The main thread scans it once (or
+** loads the index the last run saved, serving it while a rescan checks it),
+** then keeps its index up to date as files are added, removed and renamed (see
+** as_index.h), and shares it with the workers as a read-only snapshot (see
+** LibrarySnapshot below), with a trigram index of its paths for LIST_QUERY
+** (see as_query.h). A background thread keeps a content hash of each
+** file (see as_hash.h).
+**
+** A file many clients listen to at once can be broadcast instead: RADIO tunes
+** in to the file's station, which reads it once into a ring that all of its
+** listeners are sent from (see as_radio.h).
+**
+** Each worker counts its connections, requests, bytes sent and how long
+** requests take to serve, without locks (see as_stats.h). The main thread
+** prints a line of them every STATS_LOG_INTERVAL seconds the server is busy,
+** and a client can ask for them all with a STATS request.
 **
 ** Once a client connects, it can make requests.
 ** The server will respond to the following requests:
@@ -50,6 +101,58 @@
 **     - the file's size followed by the file's data.
 **       - see stream_request_response for more information
 **
+** 3) "STREAM_RANGE" to stream part of a file, e.g. to seek or to resume
+**   - The string REQUEST_STREAM_RANGE will be sent to the server, followed by
+**     the network newline "\r\n" (2 chars).
+**   - This will be followed by the file's index (32 bits), then the offset of
+**     the first byte wanted and how many bytes are wanted (64 bits each), all
+**     in network byte order.
+**   - The server will respond with the file's size and the length of the data
+**     that follows (64 bits each), followed by that data.
+**       - see stream_range_request_response for more information
+**
+** 4) "V2" to switch the connection to the framed protocol (see libas.h)
+**   - The string REQUEST_FRAMED will be sent to the server, followed by the
+**     network newline "\r\n" (2 chars).
+**   - The server will respond with a HELLO frame, and from then on the client
+**     can have several LIST and STREAM requests answered at once.
+**       - see as_frame.h for more information
+**
+** 5) "HASH" to get the content hash of a file, e.g. to check a local copy
+**   - The string REQUEST_HASH will be sent to the server, followed by the
+**     network newline "\r\n" (2 chars).
+**   - This will be followed by the file's index (32 bits, network byte order).
+**   - The server will respond with HASH_RESPONSE_SIZE bytes: whether the hash
+**     is known, then the file's size and hash.
+**       - see hash_request_response for more information
+**
+** 6) "STATS" to get the server's metrics, e.g. for monitoring
+**   - The string REQUEST_STATS will be sent to the server, followed by the
+**     network newline "\r\n" (2 chars).
+**   - The server will respond with the length of the text that follows (64
+**     bits, network byte order), then a "<name> <value>" line per metric.
+**       - see stats_request_response for more information
+**
+** 7) "RADIO" to tune in to a file's station, listening along with everyone
+**    else tuned in to it
+**   - The string REQUEST_RADIO will be sent to the server, followed by the
+**     network newline "\r\n" (2 chars).
+**   - This will be followed by the file's index (32 bits, network byte order).
+**   - The server will respond with the file's size and the station's bitrate
+**     (64 bits each), followed by the broadcast, until the client hangs up.
+**       - see as_radio.h for more information
+**
+** 8) "LIST_QUERY" to list a page of the files whose path contains (or starts
+**    with) a pattern, rather than the whole library
+**   - The string REQUEST_LIST_QUERY will be sent to the server, followed by
+**     the network newline "\r\n" (2 chars).
+**   - This will be followed by the QueryMode (8 bits), the offset and limit of
+**     the page (32 bits each, network byte order), the pattern's length (8
+**     bits) and the pattern.
+**   - The server will respond with the number of files that match, how many
+**     are listed, and the list's length, followed by the list.
+**       - see list_query_request_response for more information
+**
 ** The client-server connection code is nearly identical to T10, so be sure to take a crack
 ** at that lab before starting this assignment.
 */
@@ -62,11 +165,230 @@ typedef struct client_socket {
 } ClientSocket;
 
 
-#define SET_SERVER_FD_SET(fd, conn_soc) do { \
-    FD_ZERO(&fd); \
-    FD_SET(conn_soc, &fd); \
-    FD_SET(STDIN_FILENO, &fd); \
-} while (0)
+/*
+** A serialized LIST response (see list_request_response). It is built once per
+** library scan, and shared by every connection it is sent to.
+**
+** refs: held by the library snapshots it was built for (a rescan that finds the
+**       same files keeps the payload), and by each connection sending it.
+*/
+typedef struct list_payload {
+    atomic_int refs;
+    size_t len;
+    char data[];
+} ListPayload;
+
+
+/*
+** Connection state machine
+** ------------------------
+** READING_REQUEST: waiting for a request line ending in a network newline.
+** READING_INDEX:   got REQUEST_STREAM, waiting for the 4-byte file index.
+** READING_RANGE:   got REQUEST_STREAM_RANGE, waiting for its index, offset and
+**                  length.
+** READING_HASH:    got REQUEST_HASH, waiting for the 4-byte file index.
+** READING_STATION: got REQUEST_RADIO, waiting for the 4-byte file index.
+** READING_QUERY:   got REQUEST_LIST_QUERY, waiting for its fields and pattern.
+** SENDING:         a response is being written. The socket is only watched for
+**                  writability, and further (pipelined) requests wait in the
+**                  request buffer until the response is done.
+** FRAMED:          the client switched to the framed protocol; requests are
+**                  read and responses sent at the same time (see as_frame.h).
+** RADIO:           the client tuned in to a station, and is sent its broadcast
+**                  until it hangs up (see as_radio.h).
+*/
+typedef enum conn_state {
+    CONN_READING_REQUEST,
+    CONN_READING_INDEX,
+    CONN_READING_RANGE,
+    CONN_READING_HASH,
+    CONN_READING_STATION,
+    CONN_READING_QUERY,
+    CONN_SENDING,
+    CONN_FRAMED,
+    CONN_RADIO,
+} ConnState;
+
+
+/*
+** Everything the server keeps for one client between events. Idle clients only
+** cost this struct; buffers for a response are allocated while it is being sent.
+**
+** out_buf:        bytes to send before any file data (a LIST payload, or a
+**                 STREAM's size prefix, STREAM_RANGE's header or a HASH
+**                 response, in prefix).
+** out_payload:    the LIST payload out_buf points into, if it does.
+** transfer:       file being streamed after out_buf (see as_transfer.h).
+**
+** Pacing (see as_pace.h):
+** pace:           the response's token bucket, with a rate of 0 if it is not
+**                 paced.
+** deficit:        bytes the connection may still send on its turn.
+** pace_timer:     armed while it waits for tokens.
+** scheduled:      in line (through next_active) for its turn to send.
+**
+** stats:          the counters of the worker the connection belongs to.
+** request_kind:   the kind of request being answered (a StatKind), and when
+**                 it was complete (request_started), for its service time.
+**
+** framing:        whether the connection's engine serves the framed protocol.
+** frames:         the framed protocol's streams, NULL until the client
+**                 switches to it.
+**
+** station:        the radio station the connection is tuned in to, and its
+**                 position in the broadcast (radio_cursor).
+**
+** With the io_uring engine, client.socket is the connection's slot in the
+** ring's fixed file table rather than a file descriptor, and:
+** buffer_index:   the registered buffer file data is read into while a file
+**                 is streamed, -1 if the connection holds none.
+** ops_in_flight:  operations submitted for the connection and not completed.
+** failed:         an operation failed; the connection is closed once none are
+**                 in flight.
+** waiting:        queued (through next_waiting) for a buffer to be released.
+*/
+typedef struct connection {
+    ClientSocket client;
+    ConnState state;
+
+    uint8_t request_buffer[REQUEST_BUFFER_SIZE];
+    int bytes_in_buf;
+
+    uint8_t *out_buf;
+    size_t out_len;
+    size_t out_sent;
+    ListPayload *out_payload;
+    uint8_t prefix[RESPONSE_PREFIX_SIZE];
+
+    FileTransfer transfer;
+
+    TokenBucket pace;
+    uint64_t deficit;
+    Timer pace_timer;
+    uint8_t scheduled;
+    struct connection *next_active;
+
+    struct worker_stats *stats;
+    uint8_t request_kind;
+    uint64_t request_started;
+
+    uint8_t framing;
+    struct frame_session *frames;
+
+    struct radio_station *station;
+    uint64_t radio_cursor;
+
+    uint32_t epoll_events;
+    struct connection *prev;
+    struct connection *next;
+
+    int buffer_index;
+    int ops_in_flight;
+    uint8_t failed;
+    uint8_t waiting;
+    struct connection *next_waiting;
+} Connection;
+
+
+/*
+** Library snapshots
+** -----------------
+** The workers share one copy of the library index, which none of them modify.
+** Changes to the library build a new snapshot, published in place of the current one;
+** each worker moves to it between events, and the old snapshot is freed once
+** the last worker has let go of it. A request is always answered from a single
+** consistent snapshot.
+**
+** refs:       references held by workers, plus one while it is current.
+** paths:      the strings library.files points to, in one allocation.
+** list:       the LIST response for this library.
+** query:      the trigram index of its paths, for LIST_QUERY.
+** content:    the content hashes of the library's files (the same index for
+**             every snapshot).
+** radio:      the stations on air (the same for every snapshot).
+**
+** lock:       held only while taking a reference to current, or replacing it.
+** generation: incremented whenever a snapshot is published, so workers can
+**             check for a new one without taking the lock.
+*/
+typedef struct library_snapshot {
+    Library library;
+    char *paths;
+    ListPayload *list;
+    QueryIndex query;
+    struct content_index *content;
+    struct radio_stations *radio;
+    atomic_int refs;
+} LibrarySnapshot;
+
+typedef struct shared_library {
+    pthread_mutex_t lock;
+    LibrarySnapshot *current;
+    atomic_uint generation;
+} SharedLibrary;
+
+
+typedef enum io_engine {
+    ENGINE_EPOLL,
+    ENGINE_URING,
+} IoEngine;
+
+
+/*
+** The server's settings, from the command line.
+**
+** cache_budget: bytes of files to keep in the file cache, 0 to disable it.
+** uplink_rate:  bytes per second all workers may send together, 0 for no limit.
+*/
+typedef struct server_options {
+    int port;
+    const char *library_directory;
+    int backlog;
+    int num_workers;
+    IoEngine engine;
+    size_t cache_budget;
+    uint64_t uplink_rate;
+} ServerOptions;
+
+
+/*
+** A worker's event loop. With the epoll engine, one epoll instance watches the
+** worker's listening socket, the server's quit eventfd and every connection the
+** worker accepted (epoll_fd is -1 with the io_uring engine).
+**
+** quit_fd:             eventfd that becomes readable when the server quits.
+** cache:               the file cache shared by all workers, NULL if disabled.
+** stats:               the worker's counters (see as_stats.h).
+** snapshot:            the library snapshot this worker answers requests from.
+** snapshot_generation: the generation it was published as.
+** wheel:               timers of the connections waiting for tokens.
+** link:                the worker's share of the uplink rate.
+** active_head:         connections in line to send, from the next to take a
+**                      turn to the last (active_tail). With the io_uring
+**                      engine, only those waiting for the uplink wait in line.
+** link_due:            when the uplink has tokens for the first in line again,
+**                      0 if it is not out of them.
+*/
+typedef struct event_loop {
+    pthread_t thread;
+    IoEngine engine;
+    int epoll_fd;
+    int listen_fd;
+    int quit_fd;
+    SharedLibrary *shared_library;
+    FileCache *cache;
+    struct worker_stats *stats;
+    LibrarySnapshot *snapshot;
+    unsigned int snapshot_generation;
+    Connection *connections;
+    int num_connections;
+
+    TimerWheel wheel;
+    TokenBucket link;
+    Connection *active_head;
+    Connection *active_tail;
+    uint64_t link_due;
+} EventLoop;
 
 
 // Network Connection functions
@@ -85,7 +407,9 @@ int init_server_addr(int port, struct sockaddr_in *server_options);
 **
 ** The server will listen on all network interfaces on the specified port. This
 ** function will use provided sockaddr_in structure to set up the socket, then call
-** bind and listen on the socket. If any of these steps fail, the program will
+** bind and listen on the socket, with a queue of num_queue pending connections.
+** The socket is non-blocking, and set SO_REUSEPORT so that every worker can
+** listen on the same port. If any of these steps fail, the program will
 ** terminate with an error message.
 **
 ** Return the socket file descriptor, -1 on error
@@ -94,10 +418,11 @@ int set_up_server_socket(const struct sockaddr_in *self, int num_queue);
 
 
 /*
-** Wait for and accept a new connection. Return the socket file descriptor for
-** the new connection.
+** Accept a pending connection on the non-blocking listenfd. The new socket is
+** non-blocking too.
 **
-** If the accept call fails, return -1.
+** If there is no pending connection or the accept call fails, the returned
+** socket is -1 (with errno set by accept4).
 */
 ClientSocket accept_connection(int listenfd);
 
@@ -115,34 +440,203 @@ ClientSocket accept_connection(int listenfd);
 ** the data sent to the client will be the following characters:
 ** "2:artist/album/file3.wav\r\n1:artist/file2.wav\r\n0:file1.wav\r\n"
 **
+** A file keeps its index while the server runs, so a file that was removed
+** leaves an entry with no name: if "artist/file2.wav" is deleted, the list
+** becomes "2:artist/album/file3.wav\r\n1:\r\n0:file1.wav\r\n".
+**
 ** Notes:
 **   -- the null character is not included in the message sent to the client.
 **
+** The response is serialized once per library snapshot, when it is published.
+** It is queued on the connection by reference, and the connection moves to
+** CONN_SENDING; the event loop writes it as the socket accepts more data.
+**
 ** return 0 on success, -1 on error
 */
-int list_request_response(const ClientSocket * client, const Library *library);
+int list_request_response(Connection *conn, LibrarySnapshot *snapshot);
 
 
 /*
-** Stream a file from the library to the client. The file is streamed in chunks
-** of a maximum of STREAM_CHUNK_SIZE bytes. The client will be able to request
-** a specific file by its index in the library.
+** List a page of the library's files that match a pattern (see as_query.h):
+** the limit (at most QUERY_MAX_LIMIT) matches from offset on, counting from 0,
+** in ascending order of index. Removed files never match, and an empty
+** pattern matches every file.
 **
-** The 32-bit unsigned network byte-order integer file_index will be read
-** from the client_socket, but will consider num_pr_bytes (must be <= uint32_t)
-** from post_req first, then:
-**   The stream will be sent in the following format:
-**     - the first 4 bytes (32-bits) will be the file size in network byte-order
-**     - the rest of the stream will be the file's data written in chunks of
-**       STREAM_CHUNK_SIZE bytes, or less if write returns less than STREAM_CHUNK_SIZE,
-**       the file is less than STREAM_CHUNK_SIZE bytes, or the last remaining chunk is
-**       less than STREAM_CHUNK_SIZE bytes.
+** The response is:
+**   - 4 bytes (32-bits): the number of files that match in all
+**   - 4 bytes (32-bits): the number of them listed
+**   - 8 bytes (64-bits): the length of the list
+**   - the list: a "<index>:<name>\r\n" line per file listed, as for LIST
+** all in network byte order. It is built on the heap and queued on the
+** connection, which moves to CONN_SENDING.
 **
-** If the file is successfully transported to the client over the client_socket,
-** return 0. Otherwise, return -1.
+** return 0 on success, -1 on error
+*/
+int list_query_request_response(Connection *conn, LibrarySnapshot *snapshot, QueryMode mode,
+                                const char *pattern, size_t len, uint32_t offset, uint32_t limit);
+
+
+/*
+** Stream a file from the library to the client. The client requests a
+** specific file by its index in the library.
+**
+** The stream will be sent in the following format:
+**   - the first 4 bytes (32-bits) will be the file size in network byte-order
+**   - the rest of the stream will be the file's data, sent straight from the
+**     file to the socket (with sendfile) as the socket accepts it, or from the
+**     file cache if cache is not NULL.
+**
+** The file is opened and the response queued on the connection, which moves
+** to CONN_SENDING; the event loop writes it out with send_response, paced at
+** the file's bitrate (see Design). Files of 4 GiB or more cannot be streamed,
+** as their size does not fit the prefix.
+**
+** If the file exists and the response is queued, return 0. Otherwise, return -1.
  */
-int stream_request_response(const ClientSocket * client, const Library *library,
-                            uint8_t *post_req, int num_pr_bytes);
+int stream_request_response(Connection *conn, const Library *library, FileCache *cache,
+                            uint32_t file_index);
+
+
+/*
+** Stream part of a file from the library to the client: length bytes from
+** offset. The range is clamped to the file, so a client can ask for the rest
+** of a file with a length of UINT64_MAX, and an offset at or past the end of
+** the file gets no data.
+**
+** The stream will be sent in the following format:
+**   - 8 bytes (64-bits): the whole file's size in network byte-order
+**   - 8 bytes (64-bits): the number of bytes of data that follow
+**   - the data, sent the same way as for stream_request_response
+**
+** Unlike STREAM, this serves files of any size.
+**
+** If the file exists and the response is queued, return 0. Otherwise, return -1.
+*/
+int stream_range_request_response(Connection *conn, const Library *library, FileCache *cache,
+                                  uint32_t file_index, uint64_t offset, uint64_t length);
+
+
+/*
+** Tell the client whether its copy of a file is the same as the library's.
+**
+** The response is HASH_RESPONSE_SIZE bytes:
+**   - 1 byte: a HashStatus. HASH_PENDING means the file has not been hashed
+**     since it last changed (the hash is 0; the client may ask again later).
+**   - 8 bytes (64-bits): the file's size in network byte-order, 0 if it is
+**     HASH_MISSING
+**   - 8 bytes (64-bits): the XXH64 hash of its contents (see as_hash.h)
+**
+** Unlike STREAM, a file that is not in the library is answered (HASH_MISSING)
+** rather than closing the connection. The response is queued on the
+** connection, which moves to CONN_SENDING.
+**
+** return 0 on success, -1 on error
+*/
+int hash_request_response(Connection *conn, LibrarySnapshot *snapshot, uint32_t file_index);
+
+
+/*
+** Report the server's metrics: the counters of every worker added up, and the
+** service time percentiles of each kind of request (see stats_format).
+**
+** The response is the length of the text (64 bits, network byte order),
+** followed by the text: a "<name> <value>\r\n" line per metric, e.g.
+** "connections_active 3\r\n" or "time_stream_range_p99_us 2048\r\n". Times
+** are in microseconds, and percentiles are the upper end of a power-of-two
+** bucket. The response is built on the heap and queued on the connection,
+** which moves to CONN_SENDING.
+**
+** return 0 on success, -1 on error
+*/
+int stats_request_response(Connection *conn);
+
+
+/*
+** Send bytes from buf[*sent] up to buf[len] without blocking, advancing *sent.
+** flags are added to send's (e.g. MSG_MORE when more data follows).
+**
+** return 1 once everything is sent, 0 if the socket is full, -1 on error
+*/
+int _send_nonblocking(int socket, const uint8_t *buf, size_t len, size_t *sent, int flags);
+
+
+/*
+** The path of the library's file at file_index, heap-allocated.
+**
+** return the path, NULL if there is no such file (or on error)
+*/
+char *get_filepath_from_index(const Library *library, uint32_t file_index);
+
+
+/*
+** Drop a reference to a LIST payload, freeing it if it was the last.
+*/
+void _release_list_payload(ListPayload *payload);
+
+
+/*
+** Write as much of the connection's queued response as the socket accepts
+** without blocking, but no more than max_bytes of file data (out_buf is
+** always sent whole).
+**
+** return 1 once the whole response is sent, 0 if the socket is full and the
+** rest must wait for it to become writable, 2 if max_bytes of the file were
+** sent and more remain, -1 on error
+*/
+int send_response(Connection *conn, uint64_t max_bytes);
+
+
+/*
+** The bytes of file data the connection's own token bucket allows it to send
+** now (UINT64_MAX if it is not paced). If that is too little to be worth a send
+** (less than PACE_MIN_SEND, or the rest of the file), its pace_timer is armed
+** for when it will be, and 0 is returned.
+*/
+uint64_t _pace_allowance(EventLoop *loop, Connection *conn, uint64_t now);
+
+
+/*
+** The bytes of file data the worker's share of the uplink allows now, for the
+** connection. If that is too little to be worth a send, 0 is returned, and
+** link_due is set to when it will be: connections wait for the uplink in line
+** (see _schedule), rather than on the timer wheel, to keep their turns.
+*/
+uint64_t _link_allowance(EventLoop *loop, Connection *conn, uint64_t now);
+
+
+/*
+** Take the tokens for bytes of file data sent on the connection.
+*/
+void _pace_charge(EventLoop *loop, Connection *conn, uint64_t bytes);
+
+
+/*
+** Put a connection at the back of the loop's line to send file data, adding
+** PACE_QUANTUM to its deficit: that is its turn, once it reaches the front.
+*/
+void _schedule(EventLoop *loop, Connection *conn);
+
+
+/*
+** Take a connection out of line and off the timer wheel, with no deficit.
+*/
+void _unschedule(EventLoop *loop, Connection *conn);
+
+
+/*
+** Take the connection at the front of the line out of it.
+**
+** return the connection, NULL if the line is empty
+*/
+Connection *_next_scheduled(EventLoop *loop);
+
+
+/*
+** Release everything held for the connection's current response (closing the
+** file being streamed, or leaving its radio station), and go back to reading
+** requests.
+*/
+void _reset_response(Connection *conn);
 
 
 // Library functions
@@ -151,39 +645,63 @@ int stream_request_response(const ClientSocket * client, const Library *library,
 ** structure will be populated with the name of the library, the path to the library,
 ** and a list of files in the library.
 **
-** Only SUPPORTED_FILE_EXTS files will be added to the library.
+** Only SUPPORTED_FILE_EXTS files will be added to the library. The files are in
+** the order the library index gives them on its first scan.
 **
 ** If the library is successfully populated, return 0. Otherwise, return -1.
 */
 int scan_library(Library *library);
 
 
+/*
+** Take a reference to the current library snapshot, and the generation it was
+** published as.
+*/
+LibrarySnapshot *_acquire_snapshot(SharedLibrary *shared, unsigned int *generation);
+
+
+/*
+** Move the loop to the current library snapshot, if a newer one has been
+** published since it last looked.
+*/
+void _refresh_snapshot(EventLoop *loop);
+
+
+/*
+** Drop a reference to a snapshot, freeing it if it was the last.
+*/
+void _release_snapshot(LibrarySnapshot *snapshot);
+
+
 // Server operation functions
 // These leverage all above functions
 /*
-** Handle a client connection. This function will only be used by child processes
-** of the server. It will continue to manage a connected client, for the duration
-** that it is connected.
+** Handle the requests buffered on a connection: parse each complete request and
+** queue its response, until the buffer holds no complete request or a response
+** is being sent (requests are answered one at a time, in order).
 **
-** When the client's socket is closed/receives EOF, this process must exit with a
-** value of 0. If any errors occur, the process must exit with a non-zero status.
+** return 0 on success, -1 if the connection must be closed
 */
-int handle_client(const ClientSocket * client, Library *library);
+int handle_client_requests(Connection *conn, LibrarySnapshot *snapshot, FileCache *cache);
 
 
 /*
-** Run the server using the specified port and library directory. The server
+** Run the server with the given options (port, library directory, ...). The server
 ** will listen for incoming connections and respond to requests from clients in
 ** an infinite loop. The loop will terminate if an error occurs or the user types
 ** q + enter in the server's terminal.
 **
-** All new connections will be accepted and handled in a child process that will
-** exclusively run the handle_client function. The server will continue to listen
-** for new connections in the parent process.
+** Connections are accepted and served by num_workers event loops, one per
+** thread, using the given I/O engine (epoll if io_uring is not available);
+** backlog is the length of each worker's queue of pending connections. The
+** calling thread rescans the library, reports on the file cache and the
+** workers' stats and watches the terminal, and a background thread hashes the
+** library's files.
 **
-** If the server is successfully set up and running, this function will never
-** return. If any errors occur, the server will terminate with an error message.
+** If the server is successfully set up and running, this function will only
+** return when the user quits. If any errors occur, the server will terminate
+** with an error message.
 */
-int run_server(int port, const char *library_directory);
+int run_server(const ServerOptions *options);
 
 #endif // AS_SERVER_H_
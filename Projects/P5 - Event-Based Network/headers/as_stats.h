@@ -0,0 +1,171 @@
+#ifndef AS_STATS_H_
+#define AS_STATS_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+#include "as_pace.h"
+
+#include <stdatomic.h>
+
+/*
+** Constants
+** ---------
+*/
+// Seconds between the server's stats lines, printed only if it was busy
+#define STATS_LOG_INTERVAL 10
+
+// Service times (in microseconds) are kept in power-of-two buckets: bucket 0
+// for under 1 us, bucket b for [2^(b-1), 2^b) us, the last for anything longer
+#define STATS_TIME_BUCKETS 40
+
+// The longest STATS response text
+#define STATS_TEXT_MAX 4096
+
+// Keeps each worker's counters on cache lines of their own
+#define STATS_ALIGNMENT 64
+
+
+/*
+** Server metrics
+** --------------
+** Each worker counts what it does in a WorkerStats of its own, which only it
+** writes: a counter is bumped with a relaxed load and store, as cheap as a
+** plain increment, with no lock and no shared cache line. Anyone may read the
+** counters at any time (relaxed loads) and add them up; a total is only ever
+** a moment behind.
+**
+** The request kinds are the line protocol's requests; framed LIST and STREAM
+** requests count as LIST and STREAM_RANGE. A request's service time runs from
+** when it is complete in the request buffer until the last byte of its
+** response is handed to the socket (or, framed, until its stream is done). A
+** RADIO broadcast is never done, so it has none.
+**
+** worker (WorkerStats):
+**   accepted, closed: connections; those open are the difference.
+**   bytes_sent:       everything written to clients, headers included.
+**   requests:         by kind, counted once the request is complete.
+**   errors:           requests that could not be answered (bad index,
+**                     unknown request, ...).
+**   cache_hits:       files opened from the file cache, cache_misses from
+**                     disk while there is a cache.
+**   times:            the service time histogram of each kind of request.
+**
+** server (ServerStats):
+**   started:            when the server started (CLOCK_MONOTONIC nanoseconds).
+**   scans:              full scans of the library directory, and how long the
+**                       last took and all of them did (scan_last_ns,
+**                       scan_total_ns). Written by the main thread.
+*/
+typedef enum stat_kind {
+    STAT_LIST,
+    STAT_STREAM,
+    STAT_RANGE,
+    STAT_HASH,
+    STAT_FRAMED,
+    STAT_STATS,
+    STAT_RADIO,
+    STAT_QUERY,
+    NUM_STAT_KINDS,
+} StatKind;
+
+typedef struct worker_stats {
+    _Atomic uint64_t accepted;
+    _Atomic uint64_t closed;
+    _Atomic uint64_t bytes_sent;
+    _Atomic uint64_t requests[NUM_STAT_KINDS];
+    _Atomic uint64_t errors;
+    _Atomic uint64_t cache_hits;
+    _Atomic uint64_t cache_misses;
+    _Atomic uint64_t times[NUM_STAT_KINDS][STATS_TIME_BUCKETS];
+    struct server_stats *server;
+} __attribute__((aligned(STATS_ALIGNMENT))) WorkerStats;
+
+typedef struct server_stats {
+    WorkerStats *workers;
+    int num_workers;
+    uint64_t started;
+    _Atomic uint64_t scans;
+    _Atomic uint64_t scan_last_ns;
+    _Atomic uint64_t scan_total_ns;
+} ServerStats;
+
+
+/*
+** The workers' counters added up, at a moment.
+*/
+typedef struct stats_totals {
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t bytes_sent;
+    uint64_t requests[NUM_STAT_KINDS];
+    uint64_t errors;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t times[NUM_STAT_KINDS][STATS_TIME_BUCKETS];
+} StatsTotals;
+
+
+/*
+** Set up the counters of num_workers workers, all at 0.
+**
+** return 0 on success, -1 on error
+*/
+int stats_init(ServerStats *stats, int num_workers);
+
+
+/*
+** Add n to one of a worker's counters. Only the worker may call this.
+*/
+static inline void stats_add(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+
+/*
+** Count a request of the given kind that started (was complete) at started
+** (CLOCK_MONOTONIC nanoseconds) as served now.
+*/
+void stats_request_done(WorkerStats *worker, StatKind kind, uint64_t started);
+
+
+/*
+** Count a full scan of the library that took from started until now.
+*/
+void stats_scan_done(ServerStats *stats, uint64_t started);
+
+
+/*
+** Add up every worker's counters.
+*/
+void stats_collect(const ServerStats *stats, StatsTotals *totals);
+
+
+/*
+** return the service time (in microseconds) percentile percent of a kind's
+** requests took at most (the upper end of its bucket), 0 if there were none
+*/
+uint64_t stats_percentile(const StatsTotals *totals, StatKind kind, double percent);
+
+
+/*
+** Write the STATS response text into buf (of size bytes, at least
+** STATS_TEXT_MAX): a "<name> <value>\r\n" line per metric.
+**
+** return the length of the text
+*/
+size_t stats_format(const ServerStats *stats, char *buf, size_t size);
+
+
+/*
+** Print a compact line of what the server did since last (the totals of the
+** last line, updated to now), elapsed seconds ago, unless it was idle.
+*/
+void stats_log(const ServerStats *stats, StatsTotals *last, double elapsed);
+
+
+void stats_free(ServerStats *stats);
+
+#endif // AS_STATS_H_
@@ -0,0 +1,98 @@
+#ifndef AS_TRANSFER_H_
+#define AS_TRANSFER_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+#include "as_cache.h"
+#include "as_pace.h"
+
+#include <sys/sendfile.h>
+
+/*
+** Constants
+** ---------
+** A transfer offers the kernel STREAM_CHUNK_MIN bytes per call to begin with,
+** doubling (up to STREAM_CHUNK_MAX) while the socket keeps taking whole chunks
+** and shrinking back when it fills up.
+*/
+#define STREAM_CHUNK_MIN (64 * 1024)
+#define STREAM_CHUNK_MAX (1024 * 1024)
+
+
+/*
+** File transfer
+** -------------
+** Sends (part of) a file to a non-blocking socket without copying it through
+** user space: with sendfile(2), or where that is not supported for the file,
+** by splice(2)-ing it into a pipe and from the pipe into the socket. A file
+** that is in the file cache is sent from its mapping instead. A transfer can be
+** resumed whenever the socket is writable again.
+**
+** fd:        the open file, -1 if there is no transfer (or it is cached).
+** cached:    the file's contents in the file cache, NULL if sent from fd.
+** offset:    the next byte of the file to send.
+** remaining: bytes left to send.
+** chunk:     bytes offered to the kernel per call.
+** pipe_fds:  the splice fallback's pipe, -1 until it is needed.
+** in_pipe:   bytes spliced into the pipe but not yet out to the socket.
+*/
+typedef struct file_transfer {
+    int fd;
+    CachedFile *cached;
+    off_t offset;
+    uint64_t remaining;
+    size_t chunk;
+    int pipe_fds[2];
+    size_t in_pipe;
+} FileTransfer;
+
+
+/*
+** Initialize an empty transfer (with no file).
+*/
+void transfer_init(FileTransfer *transfer);
+
+
+/*
+** Open the file at path and set up a transfer of all of it. Its size (from
+** fstat) is stored in *file_size. If cache is not NULL, the file is sent from
+** the cache (and added to it on a miss) where possible. If bitrate is not
+** NULL, the file's bitrate (see pace_probe_bitrate) is stored in it, probed
+** from the file before a cached transfer closes it.
+**
+** return 1 if the file was found in the cache, 0 on success otherwise, -1 on
+** error
+*/
+int transfer_open(FileTransfer *transfer, const char *path, FileCache *cache, uint64_t *file_size,
+                  uint64_t *bitrate);
+
+
+/*
+** Narrow a transfer that has just been opened to length bytes starting at
+** offset, both clamped to the file: an offset past the end sends nothing.
+**
+** return the bytes the transfer will send
+*/
+uint64_t transfer_set_range(FileTransfer *transfer, uint64_t offset, uint64_t length);
+
+
+/*
+** Send as much of the rest of the transfer to socket as it takes without
+** blocking, but no more than max_bytes (UINT64_MAX for no limit).
+**
+** return 1 once the transfer is complete, 0 if the socket is full and the
+** rest must wait for it to become writable, 2 if max_bytes were sent and
+** more remain, -1 on error
+*/
+int transfer_send(FileTransfer *transfer, int socket, uint64_t max_bytes);
+
+
+/*
+** Close the transfer's file (and pipe), or let go of its cached file, leaving
+** an empty transfer.
+*/
+void transfer_close(FileTransfer *transfer);
+
+#endif // AS_TRANSFER_H_
@@ -0,0 +1,115 @@
+#ifndef AS_URING_H_
+#define AS_URING_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/*
+** Constants
+** ---------
+*/
+// Submission queue entries per ring (the completion queue is twice as long)
+#define URING_ENTRIES 256
+
+// Registered buffers per ring that streamed files are read into. A connection
+// holds one while it streams a file; when all are in use, streams wait their turn.
+#define URING_BUFFERS 16
+#define URING_BUFFER_SIZE (256 * 1024)
+
+// Most connections one worker can have open: the size of its fixed file table
+// (or RLIMIT_NOFILE, if that is lower)
+#define URING_MAX_FILES 4096
+
+
+/*
+** io_uring engine
+** ---------------
+** Each worker owns a ring, talking to the kernel with the raw io_uring_setup,
+** io_uring_enter and io_uring_register system calls. Instead of waiting for
+** sockets to become ready and then calling accept, read and send, the worker
+** queues those operations in the ring, and hands the kernel everything it queued
+** while handling the last batch of completions in one io_uring_enter call.
+**
+** - Connections are accepted straight into the ring's fixed file table, so
+**   their operations skip the file descriptor lookup.
+** - Requests are received into the connection's request buffer, and answered
+**   by the same handlers as the epoll engine.
+** - A file is streamed in URING_BUFFER_SIZE chunks: each chunk is a read into
+**   one of the ring's registered buffers, linked to a send of that buffer, so
+**   the pair is a single submission. The size prefix (or LIST payload) is linked
+**   in front of the first chunk. A file in the file cache needs no buffer: the
+**   rest of it is sent from its mapping with a single send.
+**
+** A connection only ever has one chain of operations in flight (besides a
+** framed connection's recv), and is advanced once all of them complete. Chains of a paced connection are cut to
+** the tokens it has (see Design in as_server.h); once it runs out, it waits on
+** the loop's timer wheel, which wakes the ring with an absolute timeout.
+**
+** A framed connection (see as_frame.h) is read from while it is sent to: it
+** keeps a recv in flight alongside its chains, into its session rather than
+** its request buffer. Each chain is its control frames, then a DATA frame's
+** header linked to its payload (read into a buffer first, like a chunk of any
+** other file). The frames it receives are handled between chains, since a
+** chain sends from the session that they change.
+*/
+typedef struct uring {
+    int fd;
+
+    // Submission queue, shared with the kernel
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned int sqe_tail;      // next entry to fill in
+    unsigned int sqe_submitted; // entries before this one have been submitted
+
+    // Completion queue, shared with the kernel
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+
+    // Registered buffers (plain buffers if they could not be registered)
+    uint8_t *buffers;
+    int buffers_registered;
+    int free_buffers[URING_BUFFERS];
+    int num_free_buffers;
+    Connection *waiting_head;
+    Connection *waiting_tail;
+
+    int in_flight;    // operations submitted and not completed
+    int accept_armed; // whether an accept is in flight
+    struct sockaddr_in accept_addr;
+    socklen_t accept_addrlen;
+    struct __kernel_timespec wakeup;
+    struct __kernel_timespec pace_wakeup;
+    uint64_t pace_due; // when the loop is set to wake up for the timer wheel, UINT64_MAX if it is not
+} Uring;
+
+
+/*
+** Whether this kernel supports everything the io_uring engine needs.
+*/
+int uring_available(void);
+
+
+/*
+** A worker thread running the io_uring engine: serve connections on the loop
+** (an EventLoop *) until the server quits.
+*/
+void *run_uring_loop(void *arg);
+
+#endif // AS_URING_H_
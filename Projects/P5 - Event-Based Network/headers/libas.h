@@ -4,6 +4,10 @@
 /*                       CSC209-24s A4 Audio Stream                          */
 /*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
 /*****************************************************************************/
+// accept4, sendfile, splice and friends are Linux extensions
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <unistd.h>
 
 // General stuff
@@ -57,9 +61,103 @@
 #define REQUEST_BUFFER_SIZE 128
 #define REQUEST_LIST "LIST"
 #define REQUEST_STREAM "STREAM"
+#define REQUEST_STREAM_RANGE "STREAM_RANGE"
+
+// What follows a STREAM_RANGE request line: the file index, offset and length
+#define STREAM_RANGE_FIELDS_SIZE (sizeof(uint32_t) + 2 * sizeof(uint64_t))
+// What precedes a STREAM_RANGE response's data: the file size and data length
+#define STREAM_RANGE_HEADER_SIZE (2 * sizeof(uint64_t))
 
 #define RESPONSE_BUFFER_SIZE 4 * MAX_FILE_NAME
 
+// The request line that switches a connection to the framed protocol
+#define REQUEST_FRAMED "V2"
+
+// A HASH request line is followed by the file index (32 bits); its response is
+// a HashStatus (8 bits), then the file's size and content hash (64 bits each)
+#define REQUEST_HASH "HASH"
+#define HASH_RESPONSE_SIZE (sizeof(uint8_t) + 2 * sizeof(uint64_t))
+
+// A STATS request line is answered with the length of the text that follows
+// (64 bits), then the server's metrics as "<name> <value>\r\n" lines
+#define REQUEST_STATS "STATS"
+
+// A RADIO request line is followed by the file index (32 bits); its response
+// is the file's size and the station's bitrate (64 bits each), then the
+// broadcast, for as long as the client listens
+#define REQUEST_RADIO "RADIO"
+
+// A LIST_QUERY request line is followed by a QueryMode (8 bits), the offset
+// and limit of the page of matches wanted (32 bits each), the pattern's length
+// (8 bits, at most QUERY_PATTERN_MAX) and the pattern. Its response is the
+// number of files that match and how many of them are listed (32 bits each),
+// and the length of the list (64 bits), then the list, as for LIST
+#define REQUEST_LIST_QUERY "LIST_QUERY"
+#define QUERY_FIELDS_SIZE (2 * sizeof(uint8_t) + 2 * sizeof(uint32_t))
+#define QUERY_PATTERN_MAX 100
+#define QUERY_RESPONSE_HEADER_SIZE (2 * sizeof(uint32_t) + sizeof(uint64_t))
+
+typedef enum query_mode {
+    // files whose path contains the pattern
+    QUERY_SUBSTRING = 0,
+    // files whose path starts with it (e.g. a directory's)
+    QUERY_PREFIX = 1,
+} QueryMode;
+
+typedef enum hash_status {
+    // the file has not been hashed since it last changed; ask again later
+    HASH_PENDING = 0,
+    // the hash is the file's, as it is now
+    HASH_KNOWN = 1,
+    // there is no such file
+    HASH_MISSING = 2,
+} HashStatus;
+
+
+/*
+** Framed protocol
+** ---------------
+** Once a client sends REQUEST_FRAMED, everything either way is a frame: a
+** FRAME_HEADER_SIZE header of the payload's length, the stream it belongs to
+** (both 32 bits) and its type (8 bits), all in network byte order, followed
+** by the payload. Each request the client makes opens a stream, with an id of
+** its choosing (not 0, and not one it used before on the connection), and the
+** server interleaves the responses of the open streams in DATA frames of at
+** most FRAME_DATA_MAX bytes.
+**
+** A stream's data is flow controlled: the server sends no more than the
+** stream's window, which starts at FRAME_INITIAL_WINDOW bytes and grows by
+** each WINDOW the client sends for it, as it consumes the data.
+*/
+#define FRAME_HEADER_SIZE (2 * sizeof(uint32_t) + sizeof(uint8_t))
+#define FRAME_DATA_MAX (64 * 1024)
+#define FRAME_INITIAL_WINDOW (256 * 1024)
+#define FRAME_MAX_WINDOW 0x7FFFFFFF
+// Streams one connection may have open at once
+#define FRAME_MAX_STREAMS 16
+
+typedef enum frame_type {
+    // server: the connection is framed from here on. Payload: the initial window
+    // and the most streams that may be open (32 bits each). A HELLO's stream is 0.
+    FRAME_HELLO = 0,
+    // client: list the library. No payload.
+    FRAME_LIST = 1,
+    // client: part of a file. Payload: as for STREAM_RANGE (STREAM_RANGE_FIELDS_SIZE).
+    FRAME_STREAM = 2,
+    // client: the stream's window grows by the payload (32 bits).
+    FRAME_WINDOW = 3,
+    // client: send no more of the stream. No payload.
+    FRAME_CANCEL = 4,
+    // server: the response's first frame. Payload: as for STREAM_RANGE
+    // (STREAM_RANGE_HEADER_SIZE); for a LIST both are the list's length.
+    FRAME_HEADERS = 5,
+    // server: the next bytes of the response.
+    FRAME_DATA = 6,
+    // server: the stream is over, without (all) its data. Payload: why, as text.
+    // An empty ERROR on stream 0 answers REQUEST_FRAMED when it is not served.
+    FRAME_ERROR = 7,
+} FrameType;
+
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 #define END_OF_MESSAGE_TOKEN "\r\n"
@@ -122,4 +220,41 @@ int read_precisely(int fd, void *buf, size_t count);
 */
 int write_precisely(int fd, const void *buf, size_t count);
 
+/*
+** Convert between a 64-bit integer and its 8 bytes in network byte order.
+*/
+uint64_t convert_uint8_to_uint64(const uint8_t *array);
+void convert_uint64_to_uint8(uint64_t value, uint8_t *array);
+
+/*
+** Write a frame header into buf (FRAME_HEADER_SIZE bytes), or read one from it.
+*/
+void frame_pack_header(uint8_t *buf, uint32_t length, uint32_t stream_id, uint8_t type);
+void frame_unpack_header(const uint8_t *buf, uint32_t *length, uint32_t *stream_id, uint8_t *type);
+
+
+/*
+** Content hashes
+** --------------
+** Files are compared by their XXH64 hash (xxHash's 64-bit hash, with a seed of
+** 0), which the server and the client both compute, a chunk at a time.
+*/
+typedef struct xxh64_state {
+    uint64_t total_len;
+    uint64_t acc[4];
+    uint8_t buf[32];
+    uint32_t buf_len;
+} Xxh64State;
+
+void xxh64_init(Xxh64State *state);
+void xxh64_update(Xxh64State *state, const void *data, size_t len);
+uint64_t xxh64_digest(const Xxh64State *state);
+
+/*
+** Hash the whole of an open file, reading it from the start.
+**
+** Returns 0 on success, -1 on error.
+*/
+int xxh64_file(int fd, uint64_t *hash);
+
 #endif // LIBAS_H_
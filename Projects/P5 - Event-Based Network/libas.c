@@ -94,3 +94,190 @@ int write_precisely(int fd, const void *buf, size_t count) {
     #endif
     return bytes_written;
 }
+
+
+uint64_t convert_uint8_to_uint64(const uint8_t *array) {
+    uint64_t result = 0;
+    for (int i = 0; i < sizeof(uint64_t); i++) {
+        result = (result << 8) | array[i];
+    }
+    return result;
+}
+
+
+void convert_uint64_to_uint8(uint64_t value, uint8_t *array) {
+    for (int i = sizeof(uint64_t) - 1; i >= 0; i--) {
+        array[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+
+void frame_pack_header(uint8_t *buf, uint32_t length, uint32_t stream_id, uint8_t type) {
+    for (int i = 0; i < sizeof(uint32_t); i++) {
+        buf[i] = length >> (8 * (sizeof(uint32_t) - 1 - i));
+        buf[sizeof(uint32_t) + i] = stream_id >> (8 * (sizeof(uint32_t) - 1 - i));
+    }
+    buf[2 * sizeof(uint32_t)] = type;
+}
+
+
+void frame_unpack_header(const uint8_t *buf, uint32_t *length, uint32_t *stream_id, uint8_t *type) {
+    *length = 0;
+    *stream_id = 0;
+    for (int i = 0; i < sizeof(uint32_t); i++) {
+        *length = (*length << 8) | buf[i];
+        *stream_id = (*stream_id << 8) | buf[sizeof(uint32_t) + i];
+    }
+    *type = buf[2 * sizeof(uint32_t)];
+}
+
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+// xxHash reads its input as little-endian words, whatever the machine's order
+static uint64_t _read_le64(const uint8_t *p) {
+    uint64_t value = 0;
+    for (int i = sizeof(uint64_t) - 1; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+
+static uint32_t _read_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+static uint64_t _rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+
+static uint64_t _xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return _rotl64(acc, 31) * XXH_PRIME64_1;
+}
+
+
+static uint64_t _xxh64_merge_round(uint64_t acc, uint64_t value) {
+    acc ^= _xxh64_round(0, value);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+
+void xxh64_init(Xxh64State *state) {
+    memset(state, 0, sizeof(*state));
+    state->acc[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->acc[1] = XXH_PRIME64_2;
+    state->acc[2] = 0;
+    state->acc[3] = -XXH_PRIME64_1;
+}
+
+
+// One 32-byte stripe into the four accumulators
+static void _xxh64_stripe(Xxh64State *state, const uint8_t *p) {
+    for (int i = 0; i < 4; i++) {
+        state->acc[i] = _xxh64_round(state->acc[i], _read_le64(p + 8 * i));
+    }
+}
+
+
+void xxh64_update(Xxh64State *state, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    state->total_len += len;
+
+    if (state->buf_len > 0) {
+        size_t fill = MIN(len, sizeof(state->buf) - state->buf_len);
+        memcpy(state->buf + state->buf_len, p, fill);
+        state->buf_len += fill;
+        p += fill;
+        len -= fill;
+        if (state->buf_len < sizeof(state->buf)) {
+            return;
+        }
+        _xxh64_stripe(state, state->buf);
+        state->buf_len = 0;
+    }
+
+    for (; len >= sizeof(state->buf); p += sizeof(state->buf), len -= sizeof(state->buf)) {
+        _xxh64_stripe(state, p);
+    }
+    memcpy(state->buf, p, len);
+    state->buf_len = len;
+}
+
+
+uint64_t xxh64_digest(const Xxh64State *state) {
+    uint64_t h;
+    if (state->total_len >= sizeof(state->buf)) {
+        h = _rotl64(state->acc[0], 1) + _rotl64(state->acc[1], 7) +
+            _rotl64(state->acc[2], 12) + _rotl64(state->acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = _xxh64_merge_round(h, state->acc[i]);
+        }
+    } else {
+        h = state->acc[2] + XXH_PRIME64_5; // the seed
+    }
+    h += state->total_len;
+
+    const uint8_t *p = state->buf;
+    uint32_t left = state->buf_len;
+    for (; left >= 8; p += 8, left -= 8) {
+        h ^= _xxh64_round(0, _read_le64(p));
+        h = _rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (left >= 4) {
+        h ^= (uint64_t)_read_le32(p) * XXH_PRIME64_1;
+        h = _rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--) {
+        h ^= *p * XXH_PRIME64_5;
+        h = _rotl64(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+int xxh64_file(int fd, uint64_t *hash) {
+    size_t buf_size = 1024 * 1024;
+    uint8_t *buf = (uint8_t *)malloc(buf_size);
+    if (buf == NULL) {
+        perror("xxh64_file: malloc");
+        return -1;
+    }
+
+    Xxh64State state;
+    xxh64_init(&state);
+    off_t offset = 0;
+    ssize_t len;
+    while ((len = pread(fd, buf, buf_size, offset)) != 0) {
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("xxh64_file: pread");
+            free(buf);
+            return -1;
+        }
+        xxh64_update(&state, buf, len);
+        offset += len;
+    }
+
+    free(buf);
+    *hash = xxh64_digest(&state);
+    return 0;
+}
@@ -0,0 +1,814 @@
+#!/usr/bin/env python3
+"""Protocol check for as_server.
+
+Starts the server on a free port with each I/O engine given (epoll, uring) on
+a library generated in a temporary directory, then runs every check against
+it: single requests, pipelined requests, and many clients at once, for LIST,
+STREAM, STREAM_RANGE, HASH, STATS, RADIO and LIST_QUERY, and the framed
+protocol (V2). Every byte the server sends is compared with the library's
+files.
+
+    python3 tests/protocol_check.py ./as_server epoll uring
+
+Exits 0 if every check passes under every engine, 1 otherwise.
+"""
+import os
+import random
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+CONCURRENT_CLIENTS = 60
+HASH_TIMEOUT = 10
+SERVER_START_TIMEOUT = 10
+
+
+# Library
+# -------
+# Files of assorted sizes (empty, smaller than a packet, larger than the
+# server's buffers) in nested directories; paths are relative to the library.
+LIBRARY_FILES = {
+    "a.mp3": 0,
+    "b.wav": 1,
+    "short.ogg": 1000,
+    "rock/one.mp3": 64 * 1024 + 7,
+    "rock/two.mp3": 300 * 1024,
+    "rock/deep/three.flac": 1024 * 1024 + 3,
+    "jazz/Take Five.m4a": 2 * 1024 * 1024 + 11,
+    "jazz/four.mp3": 4096,
+}
+
+
+def make_library(path):
+    rng = random.Random(209)
+    for name, size in LIBRARY_FILES.items():
+        full = os.path.join(path, name)
+        os.makedirs(os.path.dirname(full), exist_ok=True)
+        with open(full, "wb") as f:
+            f.write(bytes(rng.getrandbits(8) for _ in range(min(size, 4096))) * (size // 4096 + 1))
+            f.truncate(size)
+
+
+def read_file(library, name):
+    with open(os.path.join(library, name), "rb") as f:
+        return f.read()
+
+
+# Protocol helpers
+# ----------------
+class CheckFailed(Exception):
+    pass
+
+
+def expect(condition, what):
+    if not condition:
+        raise CheckFailed(what)
+
+
+class Client:
+    """A connection to the server, with what was read past the last response."""
+
+    def __init__(self, port):
+        self.sock = socket.create_connection(("127.0.0.1", port), timeout=30)
+        self.buf = bytearray()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.sock.close()
+
+    def send(self, data):
+        self.sock.sendall(data)
+
+    def _fill(self):
+        chunk = self.sock.recv(1 << 20)
+        if not chunk:
+            raise CheckFailed("connection closed with %d bytes unread" % len(self.buf))
+        self.buf += chunk
+
+    def recv_exactly(self, n):
+        while len(self.buf) < n:
+            self._fill()
+        data = bytes(self.buf[:n])
+        del self.buf[:n]
+        return data
+
+    def recv_line(self):
+        while b"\r\n" not in self.buf:
+            self._fill()
+        end = self.buf.index(b"\r\n")
+        line = bytes(self.buf[:end]).decode()
+        del self.buf[:end + 2]
+        return line
+
+    def expect_drained(self, what):
+        expect(not self.buf, "%d unexpected bytes after %s" % (len(self.buf), what))
+
+    def expect_idle(self, seconds, what):
+        """Nothing more arrives within the given time."""
+        self.sock.settimeout(seconds)
+        try:
+            self._fill()
+        except socket.timeout:
+            pass
+        finally:
+            self.sock.settimeout(30)
+        self.expect_drained(what)
+
+
+def read_list(client):
+    """A LIST response: the files by index ('' for a removed one), ending with index 0."""
+    files = {}
+    while True:
+        index, _, name = client.recv_line().partition(":")
+        files[int(index)] = name
+        if int(index) == 0:
+            return files
+
+
+def request_list(client):
+    client.send(b"LIST\r\n")
+    files = read_list(client)
+    client.expect_drained("LIST")
+    return files
+
+
+def stream_request(index):
+    return b"STREAM\r\n" + struct.pack("!I", index)
+
+
+def read_stream(client):
+    size = struct.unpack("!I", client.recv_exactly(4))[0]
+    return client.recv_exactly(size)
+
+
+def request_stream(client, index):
+    client.send(stream_request(index))
+    return read_stream(client)
+
+
+TO_END = (1 << 64) - 1
+
+
+def range_request(index, offset, length):
+    return b"STREAM_RANGE\r\n" + struct.pack("!IQQ", index, offset, length)
+
+
+def read_range(client):
+    """A STREAM_RANGE response: the file's size and the range's data."""
+    size, length = struct.unpack("!QQ", client.recv_exactly(16))
+    return size, client.recv_exactly(length)
+
+
+def request_range(client, index, offset, length):
+    client.send(range_request(index, offset, length))
+    return read_range(client)
+
+
+def request_stats(client):
+    """A STATS response, as a dict of its counters."""
+    client.send(b"STATS\r\n")
+    length = struct.unpack("!Q", client.recv_exactly(8))[0]
+    text = client.recv_exactly(length).decode()
+    client.expect_drained("STATS")
+    expect(text.endswith("\r\n"), "STATS text does not end with a line break")
+    stats = {}
+    for line in text.split("\r\n")[:-1]:
+        name, value = line.split(" ")
+        expect(name not in stats, "STATS has %s twice" % name)
+        stats[name] = int(value)
+    return stats
+
+
+QUERY_SUBSTRING, QUERY_PREFIX = range(2)
+QUERY_MAX_LIMIT = 1000
+
+
+def query_request(mode, pattern, offset, limit):
+    return b"LIST_QUERY\r\n" + struct.pack("!BIIB", mode, offset, limit, len(pattern)) + pattern
+
+
+def read_query(client):
+    """A LIST_QUERY response: the number of matches, and the page listed as [(index, name)]."""
+    matched, listed, length = struct.unpack("!IIQ", client.recv_exactly(16))
+    lines = client.recv_exactly(length).decode().split("\r\n")
+    expect(lines.pop() == "", "LIST_QUERY's list does not end with a line break")
+    expect(len(lines) == listed, "LIST_QUERY says %d listed, and lists %d" % (listed, len(lines)))
+    return matched, [(int(index), name) for index, _, name in (line.partition(":") for line in lines)]
+
+
+def expected_query(files, mode, pattern, offset, limit):
+    """What LIST_QUERY should answer, by comparing the pattern with every path."""
+    pattern = pattern.decode().lower()
+    matches = [(index, name) for index, name in sorted(files.items())
+               if name and (name.lower().startswith(pattern) if mode == QUERY_PREFIX else pattern in name.lower())]
+    return len(matches), matches[offset:offset + min(limit, QUERY_MAX_LIMIT)]
+
+
+RADIO_CHUNK_SIZE = 16 * 1024
+RADIO_DEFAULT_BITRATE = 320 * 1000 // 8
+
+
+def tune_in(client, index):
+    """Send a RADIO request; the station's file size and bitrate."""
+    client.send(b"RADIO\r\n" + struct.pack("!I", index))
+    return struct.unpack("!QQ", client.recv_exactly(16))
+
+
+def looped(data, offset, length):
+    """length bytes of data played in a loop, from offset."""
+    offset %= len(data)
+    return (data[offset:] + data * (length // len(data) + 1))[:length]
+
+
+def expect_broadcast(heard, data, what):
+    # a listener joins at the start of a chunk of the broadcast, which may be
+    # anywhere in the file after it looped
+    offset = next((k * RADIO_CHUNK_SIZE % len(data) for k in range(len(data))
+                   if looped(data, k * RADIO_CHUNK_SIZE, len(heard)) == heard), None)
+    expect(offset is not None, "%s is not its file in a loop from a chunk" % what)
+    return offset
+
+
+HASH_PENDING, HASH_KNOWN, HASH_MISSING = range(3)
+
+
+def hash_request(index):
+    return b"HASH\r\n" + struct.pack("!I", index)
+
+
+def read_hash(client):
+    """A HASH response: (status, size, hash)."""
+    return struct.unpack("!BQQ", client.recv_exactly(17))
+
+
+# XXH64 with a seed of 0, as the server hashes files, so the check needs
+# nothing beyond the standard library.
+XXH_PRIME64 = (0x9E3779B185EBCA87, 0xC2B2AE3D27D4EB4F, 0x165667B19E3779F9, 0x85EBCA77C2B2AE63,
+               0x27D4EB2F165667C5)
+MASK64 = (1 << 64) - 1
+
+
+def _rotl64(x, r):
+    return ((x << r) | (x >> (64 - r))) & MASK64
+
+
+def _xxh64_round(acc, lane):
+    acc = (acc + lane * XXH_PRIME64[1]) & MASK64
+    return (_rotl64(acc, 31) * XXH_PRIME64[0]) & MASK64
+
+
+def xxh64(data):
+    p1, p2, p3, p4, p5 = XXH_PRIME64
+    n = len(data)
+    pos = 0
+    if n >= 32:
+        acc = [(p1 + p2) & MASK64, p2, 0, (-p1) & MASK64]
+        lanes = struct.unpack_from("<%dQ" % (n // 32 * 4), data)
+        for i in range(0, len(lanes), 4):
+            acc = [_xxh64_round(acc[k], lanes[i + k]) for k in range(4)]
+        h = (_rotl64(acc[0], 1) + _rotl64(acc[1], 7) + _rotl64(acc[2], 12) + _rotl64(acc[3], 18)) & MASK64
+        for a in acc:
+            h = ((h ^ _xxh64_round(0, a)) * p1 + p4) & MASK64
+        pos = n // 32 * 32
+    else:
+        h = p5
+    h = (h + n) & MASK64
+    while pos + 8 <= n:
+        h ^= _xxh64_round(0, struct.unpack_from("<Q", data, pos)[0])
+        h = (_rotl64(h, 27) * p1 + p4) & MASK64
+        pos += 8
+    if pos + 4 <= n:
+        h ^= struct.unpack_from("<I", data, pos)[0] * p1 & MASK64
+        h = (_rotl64(h, 23) * p2 + p3) & MASK64
+        pos += 4
+    for byte in data[pos:]:
+        h ^= byte * p5 & MASK64
+        h = _rotl64(h, 11) * p1 & MASK64
+    h = (h ^ (h >> 33)) * p2 & MASK64
+    h = (h ^ (h >> 29)) * p3 & MASK64
+    return h ^ (h >> 32)
+
+
+# Framed protocol (V2)
+FRAME_HEADER = struct.Struct("!IIB")
+FRAME_HELLO, FRAME_LIST, FRAME_STREAM, FRAME_WINDOW, FRAME_CANCEL, FRAME_HEADERS, FRAME_DATA, FRAME_ERROR = range(8)
+FRAME_DATA_MAX = 64 * 1024
+FRAME_INITIAL_WINDOW = 256 * 1024
+FRAME_MAX_STREAMS = 16
+
+
+def frame(stream_id, type, payload=b""):
+    return FRAME_HEADER.pack(len(payload), stream_id, type) + payload
+
+
+def read_frame(client):
+    """The next frame: (stream id, type, payload)."""
+    length, stream_id, type = FRAME_HEADER.unpack(client.recv_exactly(FRAME_HEADER.size))
+    return stream_id, type, client.recv_exactly(length)
+
+
+def start_framed(client):
+    client.send(b"V2\r\n")
+    stream_id, type, payload = read_frame(client)
+    expect((stream_id, type) == (0, FRAME_HELLO), "V2 answered with type %d on stream %d" % (type, stream_id))
+    expect(struct.unpack("!II", payload) == (FRAME_INITIAL_WINDOW, FRAME_MAX_STREAMS),
+           "HELLO offers %s" % (struct.unpack("!II", payload),))
+
+
+class FramedResponses:
+    """The responses of a framed connection's streams, as they arrive.
+
+    Checks each stream's frames against the protocol: HEADERS first, DATA no
+    larger than FRAME_DATA_MAX nor past the stream's window or its length,
+    nothing after an ERROR. When auto_window is set, every DATA frame is
+    acknowledged with a WINDOW of its size, as a player would consume it.
+    """
+
+    def __init__(self, client, auto_window=True):
+        self.client = client
+        self.auto_window = auto_window
+        self.headers = {}
+        self.data = {}
+        self.errors = {}
+        self.windows = {}
+        self.order = []
+
+    def open(self, stream_id, type, payload=b""):
+        self.windows[stream_id] = FRAME_INITIAL_WINDOW
+        self.client.send(frame(stream_id, type, payload))
+
+    def grow(self, stream_id, increment):
+        self.windows[stream_id] += increment
+        self.client.send(frame(stream_id, FRAME_WINDOW, struct.pack("!I", increment)))
+
+    def done(self, stream_id):
+        if stream_id in self.errors:
+            return True
+        return stream_id in self.headers and len(self.data[stream_id]) == self.headers[stream_id][1]
+
+    def read(self):
+        stream_id, type, payload = read_frame(self.client)
+        expect(stream_id in self.windows, "frame of type %d on unopened stream %d" % (type, stream_id))
+        expect(stream_id not in self.errors, "frame of type %d after stream %d's ERROR" % (type, stream_id))
+        if type == FRAME_HEADERS:
+            expect(stream_id not in self.headers, "second HEADERS on stream %d" % stream_id)
+            self.headers[stream_id] = struct.unpack("!QQ", payload)
+            self.data[stream_id] = bytearray()
+        elif type == FRAME_DATA:
+            expect(stream_id in self.headers, "DATA before HEADERS on stream %d" % stream_id)
+            expect(0 < len(payload) <= FRAME_DATA_MAX, "DATA of %d bytes" % len(payload))
+            self.data[stream_id] += payload
+            expect(len(self.data[stream_id]) <= self.windows[stream_id], "stream %d overran its window" % stream_id)
+            expect(len(self.data[stream_id]) <= self.headers[stream_id][1], "stream %d overran its length" % stream_id)
+            self.order.append(stream_id)
+            if self.auto_window:
+                self.grow(stream_id, len(payload))
+        elif type == FRAME_ERROR:
+            self.errors[stream_id] = payload.decode()
+        else:
+            raise CheckFailed("frame of type %d from the server" % type)
+        return stream_id
+
+    def read_until_done(self, stream_ids):
+        while not all(self.done(i) for i in stream_ids):
+            self.read()
+
+
+def framed_list(responses, stream_id):
+    """The library as listed on a framed stream."""
+    responses.read_until_done([stream_id])
+    expect(stream_id not in responses.errors, "framed LIST failed: %s" % responses.errors.get(stream_id))
+    length, listed = responses.headers[stream_id]
+    expect(length == listed, "framed LIST's HEADERS are %d and %d" % (length, listed))
+    files = {}
+    for line in bytes(responses.data[stream_id]).decode().split("\r\n")[:-1]:
+        index, _, name = line.partition(":")
+        files[int(index)] = name
+    return files
+
+
+# Checks
+# ------
+# Each check gets the server's port (to connect to as it needs) and the
+# library: its files by index, as listed, and its directory. A mismatch raises
+# CheckFailed.
+CHECKS = []
+
+
+def check(function):
+    CHECKS.append(function)
+    return function
+
+
+@check
+def stats_count_cache_lookups(port, files, library):
+    # the first check, while no file has been opened: only repeats are cache hits
+    index = next(i for i, name in files.items() if name == "rock/two.mp3")
+    with Client(port) as client:
+        before = request_stats(client)
+        request_stream(client, index)
+        request_stream(client, index)
+        request_range(client, index, 5, 10)
+        after = request_stats(client)
+    counted = (after["cache_misses"] - before["cache_misses"], after["cache_hits"] - before["cache_hits"])
+    expect(counted == (1, 2), "3 lookups of a new file counted as %d misses and %d hits" % counted)
+
+
+@check
+def list_matches_library(port, files, library):
+    listed = sorted(name for name in files.values() if name)
+    expect(listed == sorted(LIBRARY_FILES), "LIST has %s, library has %s" % (listed, sorted(LIBRARY_FILES)))
+    expect(sorted(files) == list(range(len(files))), "LIST indexes are not 0..n-1")
+
+
+@check
+def stream_every_file(port, files, library):
+    with Client(port) as client:
+        for index, name in files.items():
+            expect(request_stream(client, index) == read_file(library, name), "STREAM of %s differs" % name)
+
+
+@check
+def pipelined_requests(port, files, library):
+    # every request in one send, then the responses in order
+    with Client(port) as client:
+        order = list(files) + list(reversed(list(files)))
+        client.send(b"LIST\r\n" + b"".join(stream_request(i) for i in order) + b"LIST\r\n")
+        expect(read_list(client) == files, "pipelined LIST differs")
+        for index in order:
+            expect(read_stream(client) == read_file(library, files[index]),
+                   "pipelined STREAM of %s differs" % files[index])
+        expect(read_list(client) == files, "second pipelined LIST differs")
+        client.expect_drained("the pipelined responses")
+
+
+@check
+def requests_split_across_sends(port, files, library):
+    # a request that arrives a byte at a time is still one request
+    with Client(port) as client:
+        client.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        index = max(files, key=lambda i: LIBRARY_FILES.get(files[i], 0))
+        for byte in stream_request(index):
+            client.send(bytes([byte]))
+            time.sleep(0.002)
+        expect(read_stream(client) == read_file(library, files[index]), "byte-at-a-time STREAM differs")
+
+
+def expected_ranges(size):
+    """(offset, length) pairs around a file's edges and the server's buffers."""
+    ranges = [(0, TO_END), (0, 0), (0, 1), (size, TO_END), (size, 10), (size + 1, TO_END),
+              (size + 1000, 5), (TO_END, TO_END)]
+    for offset in (1, size // 3, size - 1, 64 * 1024 - 1, 64 * 1024 + 1):
+        if 0 <= offset < size:
+            ranges += [(offset, TO_END), (offset, 1), (offset, 64 * 1024 + 5), (offset, size)]
+    return ranges
+
+
+@check
+def stream_range_of_every_file(port, files, library):
+    with Client(port) as client:
+        for index, name in files.items():
+            data = read_file(library, name)
+            for offset, length in expected_ranges(len(data)):
+                size, got = request_range(client, index, offset, length)
+                expect(size == len(data), "STREAM_RANGE of %s says size %d, not %d" % (name, size, len(data)))
+                want = data[offset:offset + length] if offset < len(data) else b""
+                expect(got == want, "STREAM_RANGE of %s at %d+%d: %d bytes, expected %d"
+                       % (name, offset, length, len(got), len(want)))
+        client.expect_drained("STREAM_RANGE")
+
+
+@check
+def pipelined_stream_ranges(port, files, library):
+    # ranges interleaved with the other requests, in one send
+    with Client(port) as client:
+        requests = []
+        for index, name in files.items():
+            size = LIBRARY_FILES[name]
+            requests += [(index, size // 2, TO_END), (index, 0, size // 2 + 1), (index, size + 3, 1)]
+        client.send(b"".join(range_request(*r) + stream_request(r[0]) for r in requests) + b"LIST\r\n")
+        for index, offset, length in requests:
+            data = read_file(library, files[index])
+            expect(read_range(client) == (len(data), data[offset:offset + length]),
+                   "pipelined STREAM_RANGE of %s at %d+%d differs" % (files[index], offset, length))
+            expect(read_stream(client) == data, "STREAM after STREAM_RANGE of %s differs" % files[index])
+        expect(read_list(client) == files, "LIST after the ranges differs")
+        client.expect_drained("the pipelined ranges")
+
+
+@check
+def many_clients_at_once(port, files, library):
+    errors = []
+
+    def client(k):
+        try:
+            with Client(port) as client:
+                expect(request_list(client) == files, "client %d: LIST differs" % k)
+                for index in random.Random(k).sample(list(files), len(files)):
+                    expect(request_stream(client, index) == read_file(library, files[index]),
+                           "client %d: STREAM of %s differs" % (k, files[index]))
+        except Exception as e:
+            errors.append("client %d: %r" % (k, e))
+
+    threads = [threading.Thread(target=client, args=(k,)) for k in range(CONCURRENT_CLIENTS)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    expect(not errors, "%d of %d clients failed, e.g. %s" % (len(errors), CONCURRENT_CLIENTS, errors[:3]))
+
+
+STATS_COUNTERS = ("uptime_s", "workers", "connections_active", "connections_accepted", "bytes_sent",
+                  "errors", "cache_hits", "cache_misses", "scans")
+
+
+@check
+def stats_count_requests(port, files, library):
+    index = max(files, key=lambda i: LIBRARY_FILES.get(files[i], 0))
+    with Client(port) as client:
+        before = request_stats(client)
+        for name in STATS_COUNTERS + ("requests_list", "requests_stream", "requests_stream_range",
+                                      "requests_hash", "requests_stats"):
+            expect(name in before, "STATS has no %s" % name)
+        expect(before["workers"] == 4, "STATS says %d workers, not 4" % before["workers"])
+        expect(before["connections_active"] >= 1, "STATS does not count its own connection")
+
+        with Client(port) as other:
+            request_list(other)
+            sent = len(request_stream(other, index))
+            request_range(other, index, 0, 1)
+            other.send(hash_request(index))
+            read_hash(other)
+            other.send(b"BOGUS\r\n") # an error, and the connection carries on
+            expect(request_list(other) == files, "LIST after an unknown request differs")
+        time.sleep(0.1) # for the server to count the connection closed
+        after = request_stats(client)
+
+    def counted(name):
+        return after[name] - before[name]
+    for name, expected in (("requests_list", 2), ("requests_stream", 1), ("requests_stream_range", 1),
+                           ("requests_hash", 1), ("requests_stats", 1), ("connections_accepted", 1),
+                           ("connections_active", 0), ("errors", 1)):
+        expect(counted(name) == expected, "STATS counted %d %s, not %d" % (counted(name), name, expected))
+    expect(counted("bytes_sent") >= sent, "STATS counted %d bytes sent for a %d byte STREAM" % (counted("bytes_sent"), sent))
+
+
+@check
+def hash_of_every_file(port, files, library):
+    # pending until the background hasher gets to a file, then its XXH64;
+    # asked for all at once, pipelined, with an index past the library's
+    indexes = list(files) + [len(files), len(files) + 1000]
+    deadline = time.monotonic() + HASH_TIMEOUT
+    with Client(port) as client:
+        while True:
+            client.send(b"".join(hash_request(i) for i in indexes))
+            responses = {i: read_hash(client) for i in indexes}
+            client.expect_drained("HASH")
+            for index, (status, size, digest) in responses.items():
+                if index not in files:
+                    expect((status, size, digest) == (HASH_MISSING, 0, 0), "HASH of missing file %d: %s"
+                           % (index, (status, size, digest)))
+                    continue
+                data = read_file(library, files[index])
+                expect(status in (HASH_PENDING, HASH_KNOWN), "HASH of %s has status %d" % (files[index], status))
+                expect(size == len(data), "HASH of %s says size %d, not %d" % (files[index], size, len(data)))
+                if status == HASH_KNOWN:
+                    expect(digest == xxh64(data), "HASH of %s is %016x, not %016x" % (files[index], digest, xxh64(data)))
+            if all(responses[i][0] == HASH_KNOWN for i in files):
+                return
+            expect(time.monotonic() < deadline, "files still pending after %d s" % HASH_TIMEOUT)
+            time.sleep(0.1)
+
+
+@check
+def radio_stations(port, files, library):
+    # no bitrate can be probed from the library's random bytes, so each
+    # station plays at the default one, ahead of real time by a chunk-aligned
+    # lead and the chunk going on air
+    chunk_time = RADIO_CHUNK_SIZE / RADIO_DEFAULT_BITRATE
+    lead = min(RADIO_DEFAULT_BITRATE * 10, 512 * 1024) // RADIO_CHUNK_SIZE * RADIO_CHUNK_SIZE
+    for name in ("rock/two.mp3", "short.ogg", "b.wav"):
+        index = next(i for i, n in files.items() if n == name)
+        data = read_file(library, name)
+        with Client(port) as first, Client(port) as second:
+            tuned = time.monotonic()
+            expect(tune_in(first, index) == (len(data), RADIO_DEFAULT_BITRATE), "RADIO header of %s" % name)
+            heard = first.recv_exactly(lead + RADIO_CHUNK_SIZE)
+            expect_broadcast(heard, data, "the lead of %s" % name)
+
+            # a listener tuning in later hears the same broadcast
+            expect(tune_in(second, index) == (len(data), RADIO_DEFAULT_BITRATE), "second RADIO header of %s" % name)
+            expect_broadcast(second.recv_exactly(lead), data, "the second listener's lead of %s" % name)
+
+            # then the station goes on in real time, a chunk at a time
+            heard += first.recv_exactly(RADIO_CHUNK_SIZE)
+            took = time.monotonic() - tuned
+            expect(chunk_time * 0.9 < took < chunk_time * 2, "the second chunk of %s went on air after %.2f s, not %.2f s"
+                   % (name, took, chunk_time))
+            expect_broadcast(heard, data, "the broadcast of %s" % name)
+
+    for index in (next(i for i, n in files.items() if n == "a.mp3"), len(files) + 1000):
+        # an empty or missing file has no station: the connection is closed
+        with Client(port) as client:
+            client.send(b"RADIO\r\n" + struct.pack("!I", index))
+            expect(not client.sock.recv(16), "RADIO of file %d was answered" % index)
+
+
+@check
+def list_query_pages(port, files, library):
+    # patterns shorter than, as long as and longer than a trigram, in any case,
+    # in pages, all pipelined
+    patterns = [b"", b"o", b"MP", b"mp3", b".M4A", b"rock/", b"ROCK/DEEP/", b"take five", b"ck/",
+                b"e F", b"zzz", b"jazz/Take Five.m4a", b"jazz/Take Five.m4a!"]
+    pages = [(0, 100), (0, 1), (1, 2), (3, 100), (100, 5), (0, 0), (0, 5000)]
+    queries = [(mode, pattern, offset, limit) for mode in (QUERY_SUBSTRING, QUERY_PREFIX)
+               for pattern in patterns for offset, limit in pages]
+    with Client(port) as client:
+        client.send(b"".join(query_request(*query) for query in queries))
+        for mode, pattern, offset, limit in queries:
+            expected = expected_query(files, mode, pattern, offset, limit)
+            expect(read_query(client) == expected, "LIST_QUERY %s for %r at %d+%d differs from %s"
+                   % ("prefix" if mode else "substring", pattern, offset, limit, expected))
+        client.expect_drained("LIST_QUERY")
+
+    for bad in (query_request(QUERY_SUBSTRING, b"x" * 101, 0, 10), query_request(2, b"mp3", 0, 10)):
+        # a pattern longer than QUERY_PATTERN_MAX, or an unknown mode, closes the connection
+        with Client(port) as client:
+            client.send(bad)
+            expect(not client.sock.recv(16), "bad LIST_QUERY was answered")
+
+
+@check
+def framed_list_and_streams(port, files, library):
+    # every file at once, then ranges, on streams interleaved by the server
+    with Client(port) as client:
+        start_framed(client)
+        responses = FramedResponses(client)
+        responses.open(1, FRAME_LIST)
+        expect(framed_list(responses, 1) == files, "framed LIST differs")
+
+        streams = {}
+        for index, name in files.items():
+            size = LIBRARY_FILES[name]
+            for offset, length in ((0, TO_END), (size // 3, size // 2 + 1)):
+                stream_id = 3 + 2 * len(streams)
+                streams[stream_id] = (index, offset, length)
+                responses.open(stream_id, FRAME_STREAM, struct.pack("!IQQ", index, offset, length))
+                if len(streams) % FRAME_MAX_STREAMS == 0:
+                    responses.read_until_done(streams)
+        responses.read_until_done(streams)
+
+        for stream_id, (index, offset, length) in streams.items():
+            data = read_file(library, files[index])
+            expect(stream_id not in responses.errors, "framed STREAM of %s failed: %s"
+                   % (files[index], responses.errors.get(stream_id)))
+            expect(responses.headers[stream_id][0] == len(data), "framed STREAM of %s has the wrong size" % files[index])
+            expect(responses.data[stream_id] == data[offset:offset + length],
+                   "framed STREAM of %s at %d+%d differs" % (files[index], offset, length))
+        # the DATA of the streams longer than a frame alternate, rather than coming one stream after another
+        long = [i for i in responses.order if len(responses.data[i]) > FRAME_DATA_MAX]
+        runs = 1 + sum(a != b for a, b in zip(long, long[1:]))
+        expect(runs > len(set(long)), "the server did not interleave the streams")
+        client.expect_drained("the framed streams")
+
+
+@check
+def framed_flow_control(port, files, library):
+    # the server stops at the window, and carries on as it grows
+    index = max(files, key=lambda i: LIBRARY_FILES.get(files[i], 0))
+    data = read_file(library, files[index])
+    with Client(port) as client:
+        start_framed(client)
+        responses = FramedResponses(client, auto_window=False)
+        responses.open(1, FRAME_STREAM, struct.pack("!IQQ", index, 0, TO_END))
+        while len(responses.data.get(1, b"")) < FRAME_INITIAL_WINDOW:
+            responses.read()
+        client.expect_idle(0.3, "the stream's window was used up")
+        responses.grow(1, len(data) - FRAME_INITIAL_WINDOW)
+        responses.read_until_done([1])
+        expect(responses.data[1] == data, "flow controlled STREAM of %s differs" % files[index])
+
+
+@check
+def framed_errors(port, files, library):
+    index = max(files, key=lambda i: LIBRARY_FILES.get(files[i], 0))
+    with Client(port) as client:
+        start_framed(client)
+        responses = FramedResponses(client, auto_window=False)
+
+        responses.open(1, FRAME_STREAM, struct.pack("!IQQ", len(files) + 1000, 0, TO_END))
+        responses.read_until_done([1])
+        expect(1 in responses.errors and responses.errors[1], "STREAM of a missing file did not fail")
+
+        # every stream the server allows, stalled on its window, then one more
+        stalled = list(range(3, 3 + 2 * FRAME_MAX_STREAMS, 2))
+        for stream_id in stalled:
+            responses.open(stream_id, FRAME_STREAM, struct.pack("!IQQ", index, 0, TO_END))
+        responses.open(101, FRAME_STREAM, struct.pack("!IQQ", index, 0, TO_END))
+        responses.read_until_done([101])
+        expect(101 in responses.errors, "stream %d past FRAME_MAX_STREAMS was served" % FRAME_MAX_STREAMS)
+
+        for stream_id in stalled:
+            client.send(frame(stream_id, FRAME_CANCEL))
+        responses.read_until_done(stalled)
+        expect(all(responses.errors.get(i) == "cancelled" for i in stalled),
+               "cancelled streams ended with %s" % set(responses.errors.get(i) for i in stalled))
+
+        # the connection carries on, with the streams free again
+        responses.open(103, FRAME_LIST)
+        expect(framed_list(responses, 103) == files, "framed LIST after the errors differs")
+        client.expect_idle(0.1, "the errors")
+
+
+# Running the server
+# ------------------
+def free_port():
+    with socket.socket() as sock:
+        sock.bind(("127.0.0.1", 0))
+        return sock.getsockname()[1]
+
+
+def start_server(server, engine, library, port, log):
+    process = subprocess.Popen([server, "-p", str(port), "-l", library, "-e", engine, "-w", "4"],
+                               stdin=subprocess.PIPE, stdout=log, stderr=subprocess.STDOUT)
+    deadline = time.monotonic() + SERVER_START_TIMEOUT
+    while time.monotonic() < deadline:
+        if process.poll() is not None:
+            raise CheckFailed("server exited with %d on startup" % process.returncode)
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=1).close()
+            return process
+        except OSError:
+            time.sleep(0.05)
+    process.kill()
+    raise CheckFailed("server did not accept connections within %d s" % SERVER_START_TIMEOUT)
+
+
+def stop_server(process):
+    try:
+        process.communicate(b"q\n", timeout=10)
+    except subprocess.TimeoutExpired:
+        process.kill()
+        process.wait()
+        raise CheckFailed("server did not quit")
+    if process.returncode != 0:
+        raise CheckFailed("server exited with %d" % process.returncode)
+
+
+def run_engine(server, engine, workdir):
+    library = os.path.join(workdir, "library-" + engine)
+    make_library(library)
+    log_path = os.path.join(workdir, engine + ".log")
+    failures = 0
+    with open(log_path, "wb") as log:
+        port = free_port()
+        try:
+            process = start_server(server, engine, library, port, log)
+        except CheckFailed as e:
+            print("FAIL %s: %s (log: %s)" % (engine, e, log_path))
+            return 1
+        try:
+            with Client(port) as client:
+                files = request_list(client)
+            for function in CHECKS:
+                started = time.monotonic()
+                try:
+                    function(port, files, library)
+                    print("ok   %-5s %-30s %.2f s" % (engine, function.__name__, time.monotonic() - started))
+                except Exception as e:
+                    failures += 1
+                    print("FAIL %-5s %-30s %s" % (engine, function.__name__, e))
+        finally:
+            try:
+                stop_server(process)
+            except CheckFailed as e:
+                failures += 1
+                print("FAIL %-5s server: %s" % (engine, e))
+    if failures:
+        print("server log for %s: %s" % (engine, log_path))
+    return failures
+
+
+def main(argv):
+    if len(argv) < 3:
+        print("usage: %s SERVER ENGINE [ENGINE ...]" % argv[0], file=sys.stderr)
+        return 2
+    workdir = tempfile.mkdtemp(prefix="as_check_")
+    failures = sum(run_engine(os.path.abspath(argv[1]), engine, workdir) for engine in argv[2:])
+    if failures:
+        print("%d check(s) failed; left %s for inspection" % (failures, workdir))
+        return 1
+    shutil.rmtree(workdir)
+    print("all checks passed under %s" % ", ".join(argv[2:]))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -34,6 +34,9 @@ ttest(net_interface_test_hidden_6)
 ttest(net_interface_test_hidden_7)
 ttest(net_interface_test_hidden_8)
 
+ttest(net_interface_test_qdisc)
+ttest(net_interface_test_refresh)
+
 ttest(router_2hosts_1)
 ttest(router_2hosts_2)
 ttest(router_internet)
@@ -44,6 +47,12 @@ ttest(router_noroute)
 ttest(router_same_dest)
 ttest(router_test_lpm)
 ttest(router_route_many)
+ttest(router_test_aggregation)
+ttest(router_test_acl)
+
+ttest(util_test_logger)
+
+ttest(qdisc_speed_test)
 
 add_custom_target (pa1 COMMAND ${CMAKE_CTEST_COMMAND} --output-on-failure --continue-on-failure --timeout 180 -R '^net_interface')
 
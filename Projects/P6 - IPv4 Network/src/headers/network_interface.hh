@@ -4,15 +4,26 @@
 #include "ethernet_frame.hh"
 #include "ipv4_datagram.hh"
 #include "arp_message.hh"
+#include "queue_discipline.hh"
 
 #include <iostream>
 #include <list>
+#include <memory>
 #include <optional>
 #include <queue>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 
+// A learned IP -> Ethernet address mapping, as exported from or imported into an interface's ARP table.
+struct ArpNeighbor
+{
+  uint32_t ip_address;               // IP address (host byte order) of the neighbor
+  EthernetAddress ethernet_address;  // its Ethernet address
+  size_t age_ms;                     // how long ago the mapping was learned
+};
+
 // A "network interface" that connects IP (the internet layer, or network layer)
 // with Ethernet (the network access layer, or link layer).
 
@@ -36,7 +47,21 @@
 // and learns or replies as necessary.
 class NetworkInterface
 {
+public:
+  static constexpr size_t ARP_ENTRY_TTL_MS = 30000;    // learned mappings are forgotten after this long
+  static constexpr size_t ARP_REQUEST_TIMEOUT_MS = 5000; // a request is not repeated (and its datagrams are kept) for this long
+  static constexpr size_t ARP_REFRESH_LEAD_MS = 3000;  // mappings in use are re-requested this long before they expire
+
 private:
+  //An entry in the ARP table.
+  struct ArpEntry
+  {
+    EthernetAddress ethernet_address {};
+    size_t age_ms = 0;         //time since the mapping was learned.
+    bool in_use = false;       //a datagram was sent to this neighbor since the mapping was learned.
+    bool refresh_sent = false; //a unicast ARP request has already been sent to refresh this mapping.
+  };
+
   // Ethernet (known as hardware, network-access, or link-layer) address of the interface
   EthernetAddress ethernet_address_;
 
@@ -45,14 +70,17 @@ private:
 
   //new state information:
   //TODO: SHOULD I MAKE THESE 3 FIELDS PUBLIC OR PRIVATE?
-  //The maps ip addresses -> pointer (MAC, Time since entry was found).
-  std::unordered_map<uint32_t, std::pair<EthernetAddress, size_t>> arp_table_;
+  //The maps ip addresses -> (MAC, Time since entry was found, refresh state).
+  std::unordered_map<uint32_t, ArpEntry> arp_table_;
 
   //This maps ip addresses -> pointer (queue(packets waiting for ARP response with corresponding MAC address), time since ARP request sent)
   std::unordered_map<uint32_t, std::pair<std::queue<InternetDatagram>, size_t>> arp_reqs_;
 
-  //This is a queue of packets that are waiting to be sent. 
-  std::queue<EthernetFrame> rtosend_q_; //TODO: MAY NEED TO CHANGE THIS TO ALLOW MORE DATATYPES. 
+  //This is the egress queue discipline holding frames that are waiting to be sent (FIFO unless replaced).
+  QueueDisciplinePtr rtosend_q_;
+
+  //Milliseconds of interface time (advanced by tick), used to timestamp queued frames.
+  uint64_t now_ms_ = 0;
 
 
   //helpers:
@@ -67,10 +95,16 @@ private:
     const EthernetAddress& target_ethernet_address,
     const Address& target_ip_address );
 
+  void queue_frame( EthernetFrame frame, uint8_t tos );
+
   void queue_ip_packet( const InternetDatagram& dgram, const EthernetAddress& target_mac_addr );
 
   void queue_arp_req( const Address& target_addr );
 
+  void queue_arp_refresh( uint32_t target_addr_bin, const EthernetAddress& target_mac_addr );
+
+  void learn_mapping( uint32_t ip_addr_bin, const EthernetAddress& mac_addr, size_t age_ms );
+
   void queue_arp_reply( const Address& target_addr, const EthernetAddress& target_mac_addr );
 
   std::optional<InternetDatagram> recieve_ipdgram( const EthernetFrame& frame );
@@ -79,8 +113,6 @@ private:
 
   void recieve_arp( const EthernetFrame& frame );
 
-  void reply_arp( const EthernetFrame& frame );
-
 public:
 
   // Construct a network interface with given Ethernet (network-access-layer) and IP (internet-layer)
@@ -106,4 +138,19 @@ public:
   // Called periodically when time elapses
   void tick( size_t ms_since_last_tick );
 
+  // Export the ARP table (e.g. to save it before a restart)
+  std::vector<ArpNeighbor> neighbor_snapshot() const;
+
+  // Import mappings learned elsewhere (e.g. a snapshot saved before a restart), so datagrams to these
+  // neighbors are sent immediately instead of waiting on ARP. Mappings older than ARP_ENTRY_TTL_MS are
+  // ignored, and a mapping is only replaced by a fresher one.
+  void preload_neighbors( const std::vector<ArpNeighbor>& neighbors );
+
+  // Replace the egress queue discipline. Frames already waiting are moved to the new one, in order and
+  // with the times they were queued, without the old one dropping any (the new one may tail-drop).
+  void set_queue_discipline( std::unique_ptr<QueueDiscipline> qdisc );
+
+  // Access the egress queue discipline (e.g. for its statistics)
+  const QueueDiscipline& queue_discipline() const { return *rtosend_q_; }
+
 };
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "ipv4_header.hh"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+// What an access-control rule does with the datagrams it matches
+enum class AclAction : uint8_t
+{
+  Permit, // forward the datagram
+  Deny,   // drop it
+  Mark,   // forward it with its TOS byte rewritten to the rule's `mark_tos`
+};
+
+// An access-control rule. A datagram matches if every field matches: the prefixes on their
+// first `*_prefix_length` bits, and the protocol and TOS on the bits set in their masks
+// (so a zero mask or prefix length matches anything).
+struct AclRule
+{
+  uint32_t src_prefix = 0;
+  uint8_t src_prefix_length = 0;
+  uint32_t dst_prefix = 0;
+  uint8_t dst_prefix_length = 0;
+  uint8_t proto = 0;
+  uint8_t proto_mask = 0;
+  uint8_t tos = 0;
+  uint8_t tos_mask = 0;
+
+  AclAction action = AclAction::Permit;
+  uint8_t mark_tos = 0; // TOS byte given to matching datagrams, for AclAction::Mark
+
+  bool matches( const IPv4Header& header ) const;
+};
+
+// An ingress packet classifier for an ordered list of ACL rules, where the first rule that
+// matches a datagram decides what happens to it.
+//
+// The rules are compiled for tuple space search (Srinivasan, Suri and Varghese, SIGCOMM 1999):
+// rules are grouped by their tuple of masks, and each group is a hash table of masked header
+// fields. Classification probes one hash table per distinct tuple, rather than testing every rule,
+// and stops once no remaining tuple holds a rule earlier than the best match so far.
+//
+// Rule sets are replaced atomically: a datagram being classified during set_rules() sees
+// either the old rules or the new ones. Each rule set counts the hits on each of its rules.
+class PacketClassifier
+{
+public:
+  // Replace the rules, which are tried in order. Datagrams no rule matches get `default_action`.
+  void set_rules( std::vector<AclRule> rules, AclAction default_action = AclAction::Permit );
+
+  // Index of the first rule matching this header, if any
+  std::optional<size_t> classify( const IPv4Header& header ) const;
+
+  // Classify a header, count the hit, and apply any mark to it. Returns Permit or Deny.
+  AclAction apply( IPv4Header& header );
+
+  // Current rules, and the number of datagrams each one has decided since they were set
+  std::vector<AclRule> rules() const;
+  std::vector<uint64_t> hit_counts() const;
+
+private:
+  // Header fields under one tuple of masks
+  struct TupleKey
+  {
+    uint32_t src = 0;
+    uint32_t dst = 0;
+    uint8_t proto = 0;
+    uint8_t tos = 0;
+
+    bool operator==( const TupleKey& other ) const = default;
+  };
+
+  struct TupleKeyHash
+  {
+    size_t operator()( const TupleKey& key ) const;
+  };
+
+  // All rules with the same masks, by their masked fields. Where several rules have the same
+  // fields, only the first can ever match, so only its index is kept.
+  struct Tuple
+  {
+    TupleKey masks {};
+    size_t first_rule = 0; // smallest rule index in this tuple
+    std::unordered_map<TupleKey, size_t, TupleKeyHash> rules {};
+
+    TupleKey key_for( const IPv4Header& header ) const;
+  };
+
+  struct CompiledRuleSet
+  {
+    std::vector<AclRule> rules {};
+    AclAction default_action = AclAction::Permit;
+    std::vector<Tuple> tuples {}; // in order of first_rule
+    std::unique_ptr<std::atomic<uint64_t>[]> hits {};
+  };
+
+  std::atomic<std::shared_ptr<const CompiledRuleSet>> rule_set_ { std::make_shared<const CompiledRuleSet>() };
+
+  static std::optional<size_t> classify( const CompiledRuleSet& rule_set, const IPv4Header& header );
+};
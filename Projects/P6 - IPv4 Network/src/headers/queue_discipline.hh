@@ -0,0 +1,179 @@
+#pragma once
+
+#include "ethernet_frame.hh"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+// A frame waiting in an egress queue, stamped (in milliseconds of interface time)
+// when it entered and when it left the queue.
+struct QueuedFrame
+{
+  EthernetFrame frame {};
+  uint8_t tos = 0;         // IPv4 type-of-service byte the frame was classified with
+  uint64_t enqueue_ms = 0; // time the frame was offered to the queue
+  uint64_t dequeue_ms = 0; // time the frame was released for transmission
+
+  uint64_t sojourn_ms() const { return dequeue_ms - enqueue_ms; }
+};
+
+// Counters kept by every queue discipline
+struct QueueStats
+{
+  uint64_t enqueued = 0; // frames accepted into the queue
+  uint64_t dequeued = 0; // frames released for transmission
+  uint64_t dropped = 0;  // frames dropped, at enqueue (queue full) or by active queue management
+};
+
+// An egress queue discipline ("qdisc"): decides which of the frames waiting on an
+// interface is transmitted next, and which (if any) are dropped.
+class QueueDiscipline
+{
+public:
+  // TOS byte given to frames the interface originates itself (ARP): DSCP CS6, "network control"
+  static constexpr uint8_t TOS_NETWORK_CONTROL = 0xC0;
+
+  // Offer a frame at time `now_ms`. Returns false if the frame was dropped instead.
+  virtual bool enqueue( EthernetFrame frame, uint8_t tos, uint64_t now_ms ) = 0;
+
+  // Release the next frame to transmit at time `now_ms`, if there is one
+  virtual std::optional<QueuedFrame> dequeue( uint64_t now_ms ) = 0;
+
+  // Remove every queued frame, in the order they would be released, without dropping any or
+  // restamping them (e.g. to move them to another queue discipline)
+  virtual std::vector<QueuedFrame> drain() = 0;
+
+  // Number of frames currently queued
+  virtual size_t size() const = 0;
+
+  // A copy of this queue discipline, including its queued frames and state
+  virtual std::unique_ptr<QueueDiscipline> clone() const = 0;
+
+  bool empty() const { return size() == 0; }
+  const QueueStats& stats() const { return stats_; }
+
+  QueueDiscipline() = default;
+  QueueDiscipline( const QueueDiscipline& other ) = default;
+  QueueDiscipline( QueueDiscipline&& other ) noexcept = default;
+  QueueDiscipline& operator=( const QueueDiscipline& other ) = default;
+  QueueDiscipline& operator=( QueueDiscipline&& other ) noexcept = default;
+  virtual ~QueueDiscipline() = default;
+
+protected:
+  QueueStats stats_ {};
+};
+
+// First-in first-out with tail drop once `limit` frames are queued (0 means unbounded).
+class FifoQueue : public QueueDiscipline
+{
+  std::queue<QueuedFrame> queue_ {};
+  size_t limit_;
+
+public:
+  explicit FifoQueue( size_t limit = 0 ) : limit_( limit ) {}
+
+  bool enqueue( EthernetFrame frame, uint8_t tos, uint64_t now_ms ) override;
+  std::optional<QueuedFrame> dequeue( uint64_t now_ms ) override;
+  std::vector<QueuedFrame> drain() override;
+  size_t size() const override { return queue_.size(); }
+  std::unique_ptr<QueueDiscipline> clone() const override { return std::make_unique<FifoQueue>( *this ); }
+};
+
+// Strict priority between DSCP classes: a band is only served when every higher-priority
+// band is empty. Each band is a tail-drop FIFO of at most `band_limit` frames (0 means unbounded).
+//   band 0: network control and realtime (CS5 and above, including EF and CS6/CS7)
+//   band 1: assured forwarding and the remaining class selectors
+//   band 2: best effort (DSCP 0) and lower effort (CS1)
+class StrictPriorityQueue : public QueueDiscipline
+{
+public:
+  static constexpr size_t NUM_BANDS = 3;
+
+  explicit StrictPriorityQueue( size_t band_limit = 0 ) : band_limit_( band_limit ) {}
+
+  // Which band a frame with this TOS byte is queued in
+  static size_t band_for( uint8_t tos );
+
+  bool enqueue( EthernetFrame frame, uint8_t tos, uint64_t now_ms ) override;
+  std::optional<QueuedFrame> dequeue( uint64_t now_ms ) override;
+  std::vector<QueuedFrame> drain() override;
+  size_t size() const override { return size_; }
+  std::unique_ptr<QueueDiscipline> clone() const override { return std::make_unique<StrictPriorityQueue>( *this ); }
+
+private:
+  std::array<std::queue<QueuedFrame>, NUM_BANDS> bands_ {};
+  size_t band_limit_;
+  size_t size_ = 0;
+};
+
+// CoDel active queue management ([RFC 8289](\ref rfc::rfc8289)). Frames are dropped at dequeue
+// once the time they spent queued has stayed above `target_ms` for at least `interval_ms`, at a
+// rate that rises with the square root of the number of drops until the standing queue is gone.
+// `limit` bounds the queue length with tail drop as a last resort (0 means unbounded).
+class CoDelQueue : public QueueDiscipline
+{
+public:
+  static constexpr uint64_t DEFAULT_TARGET_MS = 5;
+  static constexpr uint64_t DEFAULT_INTERVAL_MS = 100;
+
+  explicit CoDelQueue( uint64_t target_ms = DEFAULT_TARGET_MS,
+                       uint64_t interval_ms = DEFAULT_INTERVAL_MS,
+                       size_t limit = 0 )
+    : target_ms_( target_ms ), interval_ms_( interval_ms ), limit_( limit )
+  {}
+
+  bool enqueue( EthernetFrame frame, uint8_t tos, uint64_t now_ms ) override;
+  std::optional<QueuedFrame> dequeue( uint64_t now_ms ) override;
+  std::vector<QueuedFrame> drain() override;
+  size_t size() const override { return queue_.size(); }
+  std::unique_ptr<QueueDiscipline> clone() const override { return std::make_unique<CoDelQueue>( *this ); }
+
+private:
+  std::queue<QueuedFrame> queue_ {};
+  uint64_t target_ms_;
+  uint64_t interval_ms_;
+  size_t limit_;
+
+  uint64_t first_above_time_ = 0; // when the sojourn time will have been above target for an interval (0: not above)
+  uint64_t drop_next_ = 0;        // time of the next drop while in the dropping state
+  uint32_t count_ = 0;            // drops since entering the dropping state
+  uint32_t last_count_ = 0;       // count_ when the dropping state was last entered
+  bool dropping_ = false;
+
+  // Pop the head of the queue, and report whether CoDel considers it droppable
+  std::optional<QueuedFrame> pop_head( uint64_t now_ms, bool& ok_to_drop );
+
+  // Time of the next drop: `from` plus interval / sqrt(count)
+  uint64_t control_law( uint64_t from ) const;
+};
+
+// An owning pointer to a queue discipline that copies by cloning it, so that whatever holds one
+// (e.g. a NetworkInterface) keeps value semantics.
+class QueueDisciplinePtr
+{
+  std::unique_ptr<QueueDiscipline> qdisc_;
+
+public:
+  explicit QueueDisciplinePtr( std::unique_ptr<QueueDiscipline> qdisc ) : qdisc_( std::move( qdisc ) ) {}
+
+  QueueDisciplinePtr( const QueueDisciplinePtr& other ) : qdisc_( other.qdisc_->clone() ) {}
+  QueueDisciplinePtr& operator=( const QueueDisciplinePtr& other )
+  {
+    if ( this != &other ) {
+      qdisc_ = other.qdisc_->clone();
+    }
+    return *this;
+  }
+  QueueDisciplinePtr( QueueDisciplinePtr&& other ) noexcept = default;
+  QueueDisciplinePtr& operator=( QueueDisciplinePtr&& other ) noexcept = default;
+  ~QueueDisciplinePtr() = default;
+
+  QueueDiscipline& operator*() const { return *qdisc_; }
+  QueueDiscipline* operator->() const { return qdisc_.get(); }
+};
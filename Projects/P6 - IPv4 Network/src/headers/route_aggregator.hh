@@ -0,0 +1,110 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Where a route sends the datagrams it matches
+struct RouteTarget
+{
+  size_t interface_num = 0;
+  std::optional<uint32_t> next_hop {}; // empty if the network is directly attached
+
+  bool operator==( const RouteTarget& other ) const = default;
+};
+
+// A route in an aggregated table. A route without a target is a "blackhole": it carves
+// addresses that had no route back out of a shorter prefix that was aggregated over them.
+struct AggregatedRoute
+{
+  uint32_t prefix = 0;
+  uint8_t prefix_length = 0;
+  std::optional<RouteTarget> target {};
+};
+
+// One change to an aggregated table: `route` was added or replaced, or (if `removed`) taken out.
+struct FibChange
+{
+  AggregatedRoute route {};
+  bool removed = false;
+};
+
+// Route aggregation with ORTC, the "optimal routing table constructor" of Draves, King,
+// Venkatachary and Zill (INFOCOM 1999). Maintains the smallest set of prefixes that forwards every
+// address exactly as the input routes do under longest-prefix match. Each update re-aggregates only
+// the prefixes it can affect, and returns what changed in the aggregated table.
+class RouteAggregator
+{
+public:
+  // Add a route, or replace the target of an existing one
+  std::vector<FibChange> add_route( uint32_t prefix, uint8_t prefix_length, const RouteTarget& target );
+
+  // Remove a route (if there is one for this prefix)
+  std::vector<FibChange> remove_route( uint32_t prefix, uint8_t prefix_length );
+
+  // The aggregated table, in prefix order
+  std::vector<AggregatedRoute> routes() const;
+
+  size_t input_size() const { return num_input_routes_; }
+  size_t output_size() const { return num_output_routes_; }
+
+  // Size of the aggregated table relative to the input table (1 when there are no routes)
+  double compression_ratio() const;
+
+private:
+  // A RouteTarget is interned as a small id. NO_ROUTE stands for "no route", and NOT_EMITTED
+  // marks a prefix that has no entry in the aggregated table.
+  using TargetId = uint32_t;
+  static constexpr TargetId NO_ROUTE = 0;
+  static constexpr TargetId NOT_EMITTED = std::numeric_limits<TargetId>::max();
+
+  // The root (node 0) is never a child, so 0 also means "no children"
+  static constexpr uint32_t NO_CHILD = 0;
+
+  // A node of the binary trie of prefixes. As in ORTC's first pass, every node has either no
+  // children or both, so each leaf stands for a block of addresses with a single next hop.
+  struct Node
+  {
+    std::array<uint32_t, 2> children { NO_CHILD, NO_CHILD };
+    TargetId original = NO_ROUTE;        // input route for exactly this prefix
+    std::vector<TargetId> candidates {}; // second pass: targets that could cover this subtree, sorted
+    TargetId emitted = NOT_EMITTED;      // third pass: this prefix's entry in the aggregated table
+    TargetId last_inherited = NOT_EMITTED; // the covering target the third pass last saw here
+    bool dirty = true;                     // candidates changed somewhere in this subtree since the third pass
+
+    bool is_leaf() const { return children[0] == NO_CHILD; }
+  };
+
+  std::vector<Node> nodes_ { 1 };
+  std::vector<RouteTarget> targets_ { RouteTarget {} }; // indexed by TargetId; 0 is NO_ROUTE
+  std::map<std::pair<size_t, std::optional<uint32_t>>, TargetId> target_ids_ {};
+  size_t num_input_routes_ = 0;
+  size_t num_output_routes_ = 0;
+
+  TargetId intern( const RouteTarget& target );
+
+  // Indices of the nodes from the root down to this prefix, creating (pairs of) nodes as needed
+  std::vector<uint32_t> path_to( uint32_t prefix, uint8_t prefix_length );
+
+  // Set a prefix's input route and re-aggregate
+  std::vector<FibChange> update( uint32_t prefix, uint8_t prefix_length, TargetId target );
+
+  // Second pass over a subtree whose covering input route is `inherited`. Returns whether any
+  // candidate set in the subtree changed.
+  bool compute_candidates( uint32_t index, TargetId inherited );
+
+  // Second pass at one node, from its children's (already computed) candidates
+  bool combine_children( uint32_t index, TargetId inherited );
+
+  // Third pass over a subtree covered by `inherited` in the aggregated table
+  void select( uint32_t index, uint32_t prefix, uint8_t prefix_length, TargetId inherited, std::vector<FibChange>& changes );
+
+  void collect( uint32_t index, uint32_t prefix, uint8_t prefix_length, std::vector<AggregatedRoute>& out ) const;
+
+  std::optional<RouteTarget> target_of( TargetId id ) const;
+};
@@ -1,9 +1,13 @@
 #pragma once
 
 #include "network_interface.hh"
+#include "packet_classifier.hh"
+#include "route_aggregator.hh"
 
+#include <limits>
 #include <optional>
 #include <queue>
+#include <vector>
 
 // A wrapper for NetworkInterface that makes the host-side
 // interface asynchronous: instead of returning received datagrams
@@ -18,7 +22,7 @@ public:
   using NetworkInterface::NetworkInterface;
 
   // Construct from a NetworkInterface
-  explicit AsyncNetworkInterface( NetworkInterface&& interface ) : NetworkInterface( interface ) {}
+  explicit AsyncNetworkInterface( NetworkInterface&& interface ) : NetworkInterface( std::move( interface ) ) {}
 
   // \brief Receives and Ethernet frame and responds appropriately.
 
@@ -57,6 +61,15 @@ class Router
   //List of 33 entries of maps from prefix_max -> <interface_num, next_hop_addr> tuples, Indexed by length of prefix match required. 
   std::unordered_map<uint32_t, std::pair<size_t, std::optional<uint32_t>>> routing_table_[33];
 
+  //Interface number of a "blackhole" entry in the table: datagrams that match it are dropped.
+  static constexpr size_t DROP_INTERFACE = std::numeric_limits<size_t>::max();
+
+  //When route aggregation is enabled, the routes that were added, from which routing_table_ is computed.
+  std::optional<RouteAggregator> aggregator_ {};
+
+  //Ingress ACL, applied to every datagram before it is routed.
+  PacketClassifier acl_ {};
+
   //Helpers:
 
   uint32_t get_prefmask(uint8_t prefix_length, const uint32_t route); //This makes a mask from a route, consisting of the first prefix_length bits, shifted to the rightmost bits.
@@ -67,6 +80,8 @@ class Router
 
   std::optional<std::pair<size_t, uint32_t>> find_match(uint32_t dst_ip); //Uses longest prefix matching to find next hop IP and interface num to route packet, if a match is found in the table.
 
+  void apply_fib_changes(const std::vector<FibChange>& changes); //Updates the table with the entries the aggregator added, replaced or removed.
+
 public:
   // Add an interface to the router
   // interface: an already-constructed network interface
@@ -86,6 +101,26 @@ public:
                   std::optional<Address> next_hop,
                   size_t interface_num );
 
+  // Remove the route for exactly this prefix, if there is one
+  void remove_route( uint32_t route_prefix, uint8_t prefix_length );
+
+  // Aggregate the routing table: replace the routes with the smallest set of prefixes that
+  // forwards every datagram the same way, and keep it minimal as routes are added and removed.
+  void enable_route_aggregation();
+
+  // Number of entries in the routing table, and that as a fraction of the routes added
+  // (less than 1 when aggregation merged routes)
+  size_t table_size() const;
+  double route_compression_ratio() const;
+
+  // Ingress access control: datagrams are checked against these rules before they are routed
+  // (the first matching rule decides), and those with no matching rule get `default_action`
+  void set_acl( std::vector<AclRule> rules, AclAction default_action = AclAction::Permit )
+  {
+    acl_.set_rules( std::move( rules ), default_action );
+  }
+  const PacketClassifier& acl() const { return acl_; }
+
   // Route packets between the interfaces. For each interface, use the
   // maybe_receive() method to consume every incoming datagram and
   // send it on one of interfaces to the correct next hop. The router
@@ -1,6 +1,7 @@
 #include "network_interface.hh"
 #include "arp_message.hh"
 #include "ethernet_frame.hh"
+#include "logger.hh"
 
 using namespace std;
 
@@ -15,12 +16,10 @@ NetworkInterface::NetworkInterface(const EthernetAddress& ethernet_address,
     ip_address_(ip_address),
     arp_table_({}),
     arp_reqs_({}),
-    rtosend_q_() {
+    rtosend_q_(make_unique<FifoQueue>()) {
 
-    cerr << "DEBUG: Network interface has Ethernet address ";
-    cerr << to_string(ethernet_address_);
-    cerr << " and IP address ";
-    cerr << ip_address.ip() << "\n";
+    LOG_DEBUG("Network interface has Ethernet address {} and IP address {}",
+              ethernet_address_, LogIPv4 {ip_address.ipv4_numeric()});
 }
 
 //The following two functions were copied from the test files.  (modified make_arp)
@@ -52,9 +51,13 @@ ARPMessage NetworkInterface::construct_arp( const uint16_t opcode,
   return arp;
 }
 
+void NetworkInterface::queue_frame(EthernetFrame frame, uint8_t tos){
+    rtosend_q_->enqueue(std::move(frame), tos, now_ms_); //the queue discipline may drop the frame if it is full.
+}
+
 void NetworkInterface::queue_ip_packet(const InternetDatagram& dgram, const EthernetAddress& target_mac_addr){
     EthernetFrame new_frame = construct_frame(ethernet_address_, target_mac_addr, EthernetHeader::TYPE_IPv4, serialize(dgram)); //create the eth frame.
-    rtosend_q_.push(new_frame);
+    queue_frame(std::move(new_frame), dgram.header.tos); //classified by the datagram's type of service.
 }
 
 void NetworkInterface::queue_arp_req(const Address& target_addr) {
@@ -68,7 +71,15 @@ void NetworkInterface::queue_arp_req(const Address& target_addr) {
     ARPMessage arp_req = construct_arp(ARPMessage::OPCODE_REQUEST, ethernet_address_, ip_address_, {}, target_addr); //create the request.
     EthernetFrame new_frame = construct_frame(ethernet_address_, ETHERNET_BROADCAST, EthernetHeader::TYPE_ARP, serialize(arp_req)); //create the eth frame.
     //this eth frame will be broadcasted.
-    rtosend_q_.push(new_frame); //push it onto the send queue. 
+    queue_frame(std::move(new_frame), QueueDiscipline::TOS_NETWORK_CONTROL); //push it onto the send queue. 
+}
+
+void NetworkInterface::queue_arp_refresh(uint32_t target_addr_bin, const EthernetAddress& target_mac_addr) {
+    //We ask the neighbor directly (rather than broadcasting) to confirm the mapping we already have.
+    ARPMessage arp_req = construct_arp(ARPMessage::OPCODE_REQUEST, ethernet_address_, ip_address_, target_mac_addr, Address::from_ipv4_numeric(target_addr_bin)); //create the request.
+    EthernetFrame new_frame = construct_frame(ethernet_address_, target_mac_addr, EthernetHeader::TYPE_ARP, serialize(arp_req)); //create the eth frame.
+
+    queue_frame(std::move(new_frame), QueueDiscipline::TOS_NETWORK_CONTROL); //push it onto the send queue. 
 }
 
 void NetworkInterface::queue_arp_reply(const Address& target_addr, const EthernetAddress& target_mac_addr) {
@@ -76,7 +87,7 @@ void NetworkInterface::queue_arp_reply(const Address& target_addr, const Etherne
     ARPMessage arp_reply = construct_arp(ARPMessage::OPCODE_REPLY, ethernet_address_, ip_address_, target_mac_addr, target_addr); //create the reply.
     EthernetFrame new_frame = construct_frame(ethernet_address_, target_mac_addr, EthernetHeader::TYPE_ARP, serialize(arp_reply)); //create the eth frame.
 
-    rtosend_q_.push(new_frame); //push it onto the send queue. 
+    queue_frame(std::move(new_frame), QueueDiscipline::TOS_NETWORK_CONTROL); //push it onto the send queue. 
 }
 
 
@@ -91,8 +102,10 @@ void NetworkInterface::send_datagram(const InternetDatagram& dgram,
     EthernetAddress mac_addr;
 
     //First we check if we know the MAC address of the next hop:
-    if (arp_table_.find(next_hop.ipv4_numeric()) != arp_table_.end()){
-        mac_addr = arp_table_[next_hop.ipv4_numeric()].first; //we have the MAC_addr.
+    auto entry = arp_table_.find(next_hop.ipv4_numeric());
+    if (entry != arp_table_.end()){
+        mac_addr = entry->second.ethernet_address; //we have the MAC_addr.
+        entry->second.in_use = true; //this mapping is worth refreshing before it expires.
         queue_ip_packet(dgram, mac_addr); //create the ethernet frame for the packet, and queue it to be sent.
 
     } else {
@@ -125,32 +138,26 @@ void NetworkInterface::release_reqs_q(uint32_t target_addr_bin, EthernetAddress
     arp_reqs_.erase(target_addr_bin); //remove this entry in the map.
 }
 
-void NetworkInterface::recieve_arp(const EthernetFrame& frame){
-    ARPMessage arp_reply = {};
-
-    //update the table, and queue all packets that were waiting for this reply.
-    if (parse(arp_reply, frame.payload)){ //The payload is an ARP Reply
-        arp_table_[arp_reply.sender_ip_address].first = arp_reply.sender_ethernet_address; //add or replace an entry in the table. 
-        arp_table_[arp_reply.sender_ip_address].second = 0;
-
-        release_reqs_q(arp_reply.sender_ip_address, arp_reply.sender_ethernet_address); //Queue all packets that were waiting for this MAC address to be sent.
-    }
+void NetworkInterface::learn_mapping(uint32_t ip_addr_bin, const EthernetAddress& mac_addr, size_t age_ms){
+    ArpEntry& entry = arp_table_[ip_addr_bin]; //add or replace an entry in the table. 
+    entry.ethernet_address = mac_addr;
+    entry.age_ms = age_ms;
+    entry.in_use = false;
+    entry.refresh_sent = false;
 
+    release_reqs_q(ip_addr_bin, mac_addr); //Queue all packets that were waiting for this MAC address to be sent.
 }
 
-void NetworkInterface::reply_arp(const EthernetFrame& frame){
-    ARPMessage arp_req = {};
+void NetworkInterface::recieve_arp(const EthernetFrame& frame){
+    ARPMessage arp_msg = {};
 
-    //update the table, and respond to the request if needed
-    if (parse(arp_req, frame.payload)){ //The payload is an ARP Req
-        arp_table_[arp_req.sender_ip_address].first = arp_req.sender_ethernet_address; //add or replace an entry in the table. 
-        arp_table_[arp_req.sender_ip_address].second = 0;
+    //update the table, and respond to the request if needed (whether it was broadcast or, as a refresh, sent to us directly)
+    if (parse(arp_msg, frame.payload)){
+        learn_mapping(arp_msg.sender_ip_address, arp_msg.sender_ethernet_address, 0); //add or replace an entry, and release waiting packets.
 
-        release_reqs_q(arp_req.sender_ip_address, arp_req.sender_ethernet_address); //Queue all packets that were waiting for this MAC address to be sent.
-        
         //Now create a reply for this ARP request, in the case that the ARP requested for this interface's mac:
-        if (arp_req.target_ip_address == ip_address_.ipv4_numeric()){
-            queue_arp_reply(Address::from_ipv4_numeric(arp_req.sender_ip_address), arp_req.sender_ethernet_address);
+        if (arp_msg.opcode == ARPMessage::OPCODE_REQUEST && arp_msg.target_ip_address == ip_address_.ipv4_numeric()){
+            queue_arp_reply(Address::from_ipv4_numeric(arp_msg.sender_ip_address), arp_msg.sender_ethernet_address);
         }
     }
 
@@ -160,21 +167,14 @@ void NetworkInterface::reply_arp(const EthernetFrame& frame){
 optional<InternetDatagram> NetworkInterface::recv_frame(const EthernetFrame& frame) {
 
     //First we check if the frame was destined for this interface specifically.
-    if (frame.header.dst == ethernet_address_){
-
-        if (frame.header.type == EthernetHeader::TYPE_IPv4){ //This is an ipv4 datagram destined for the interface
-
-            return recieve_ipdgram(frame);
-
-        } else { //handle the frame if it is an ARP reply.
-            recieve_arp(frame);
-        }
+    if (frame.header.dst == ethernet_address_ && frame.header.type == EthernetHeader::TYPE_IPv4){
+        return recieve_ipdgram(frame); //This is an ipv4 datagram destined for the interface
     }
 
-    //Next we check if the frame was broadcast (possibly ARP)
-    if (frame.header.dst == ETHERNET_BROADCAST){
-        //Handle the frame if it is an ARP request.
-        reply_arp(frame);
+    //ARP is handled the same whether it was sent to us or broadcast (requests, replies and refreshes).
+    if ((frame.header.dst == ethernet_address_ || frame.header.dst == ETHERNET_BROADCAST) &&
+        frame.header.type == EthernetHeader::TYPE_ARP){
+        recieve_arp(frame);
     }
 
 
@@ -183,17 +183,24 @@ optional<InternetDatagram> NetworkInterface::recv_frame(const EthernetFrame& fra
 
 // ms_since_last_tick: the number of milliseconds since the last call to this method
 void NetworkInterface::tick(const size_t ms_since_last_tick){
+    now_ms_ += ms_since_last_tick;
 
     //iterate through all entries in the arp_table, incrementing the timers, and removing expired entries:
     for (auto it = arp_table_.begin(); it != arp_table_.end(); ) {
-        auto& key_val = it->second;
-        key_val.second += ms_since_last_tick; // Add time since last tick
+        auto& entry = it->second;
+        entry.age_ms += ms_since_last_tick; // Add time since last tick
     
-        if (key_val.second >= 30000) { // check for 30-second limit
+        if (entry.age_ms >= ARP_ENTRY_TTL_MS) { // check for 30-second limit
             it = arp_table_.erase(it);  
-        } else {
-            ++it; 
+            continue;
+        }
+
+        //Mappings that are in use are confirmed shortly before they expire, so traffic to them never stalls on ARP.
+        if (entry.in_use && !entry.refresh_sent && entry.age_ms >= ARP_ENTRY_TTL_MS - ARP_REFRESH_LEAD_MS) {
+            queue_arp_refresh(it->first, entry.ethernet_address);
+            entry.refresh_sent = true;
         }
+        ++it; 
     }
 
     //Doing the same for packets waiting for ARP reply:
@@ -201,7 +208,7 @@ void NetworkInterface::tick(const size_t ms_since_last_tick){
         auto& key_val = it->second;
         key_val.second += ms_since_last_tick; // Add time since last tick
     
-        if (key_val.second >= 5000) { // check for 5-second limit
+        if (key_val.second >= ARP_REQUEST_TIMEOUT_MS) { // check for 5-second limit
             it = arp_reqs_.erase(it);  
         } else {
             ++it; 
@@ -213,12 +220,50 @@ void NetworkInterface::tick(const size_t ms_since_last_tick){
 
 optional<EthernetFrame> NetworkInterface::maybe_send()
 {   
-    //Check for a frame on the queue. If there is one, pop it off, and send it. 
-    if (!rtosend_q_.empty()){
-        EthernetFrame nextframe = rtosend_q_.front();
-        rtosend_q_.pop();
-        return nextframe;
+    //Ask the queue discipline for the next frame. If there is one, send it. 
+    optional<QueuedFrame> next = rtosend_q_->dequeue(now_ms_);
+    if (next.has_value()){
+        return std::move(next->frame);
     }
 
     return {}; 
 }
+
+vector<ArpNeighbor> NetworkInterface::neighbor_snapshot() const
+{
+    vector<ArpNeighbor> neighbors;
+    neighbors.reserve(arp_table_.size());
+
+    for (const auto& [ip_addr_bin, entry] : arp_table_){
+        neighbors.push_back({ip_addr_bin, entry.ethernet_address, entry.age_ms});
+    }
+
+    return neighbors;
+}
+
+void NetworkInterface::preload_neighbors(const vector<ArpNeighbor>& neighbors)
+{
+    for (const ArpNeighbor& neighbor : neighbors){
+        if (neighbor.age_ms >= ARP_ENTRY_TTL_MS){
+            continue; //this mapping would already have expired.
+        }
+
+        auto known = arp_table_.find(neighbor.ip_address);
+        if (known != arp_table_.end() && known->second.age_ms <= neighbor.age_ms){
+            continue; //what we learned ourselves is at least as fresh.
+        }
+
+        learn_mapping(neighbor.ip_address, neighbor.ethernet_address, neighbor.age_ms);
+    }
+}
+
+void NetworkInterface::set_queue_discipline(unique_ptr<QueueDiscipline> qdisc)
+{
+    //move the frames that are already waiting over to the new queue discipline, keeping their order
+    //and when they were queued. draining rather than dequeuing, so the old one (e.g. CoDel) drops none.
+    for (QueuedFrame& waiting : rtosend_q_->drain()){
+        qdisc->enqueue(std::move(waiting.frame), waiting.tos, waiting.enqueue_ms);
+    }
+
+    rtosend_q_ = QueueDisciplinePtr(std::move(qdisc));
+}
@@ -0,0 +1,128 @@
+#include "packet_classifier.hh"
+
+#include <algorithm>
+#include <functional>
+#include <utility>
+
+using namespace std;
+
+namespace {
+
+uint32_t prefix_mask( const uint8_t prefix_length )
+{
+  return prefix_length == 0 ? 0 : ~0U << ( 32U - min<unsigned>( prefix_length, 32 ) );
+}
+
+} // namespace
+
+bool AclRule::matches( const IPv4Header& header ) const
+{
+  const uint32_t src_mask = prefix_mask( src_prefix_length );
+  const uint32_t dst_mask = prefix_mask( dst_prefix_length );
+  return ( header.src & src_mask ) == ( src_prefix & src_mask ) and ( header.dst & dst_mask ) == ( dst_prefix & dst_mask )
+         and ( header.proto & proto_mask ) == ( proto & proto_mask ) and ( header.tos & tos_mask ) == ( tos & tos_mask );
+}
+
+size_t PacketClassifier::TupleKeyHash::operator()( const TupleKey& key ) const
+{
+  const uint64_t addresses = ( static_cast<uint64_t>( key.src ) << 32U ) | key.dst;
+  const uint64_t rest = ( static_cast<uint64_t>( key.proto ) << 8U ) | key.tos;
+  return hash<uint64_t> {}( addresses ) ^ ( hash<uint64_t> {}( rest ) * 0x9E3779B97F4A7C15ULL );
+}
+
+PacketClassifier::TupleKey PacketClassifier::Tuple::key_for( const IPv4Header& header ) const
+{
+  return { header.src & masks.src,
+           header.dst & masks.dst,
+           static_cast<uint8_t>( header.proto & masks.proto ),
+           static_cast<uint8_t>( header.tos & masks.tos ) };
+}
+
+void PacketClassifier::set_rules( vector<AclRule> rules, const AclAction default_action )
+{
+  auto rule_set = make_shared<CompiledRuleSet>();
+  rule_set->default_action = default_action;
+  rule_set->hits = make_unique<atomic<uint64_t>[]>( rules.size() );
+
+  unordered_map<TupleKey, size_t, TupleKeyHash> tuple_index;
+  for ( size_t i = 0; i < rules.size(); i++ ) {
+    const AclRule& rule = rules[i];
+    const TupleKey masks {
+      prefix_mask( rule.src_prefix_length ), prefix_mask( rule.dst_prefix_length ), rule.proto_mask, rule.tos_mask };
+
+    const auto [it, new_tuple] = tuple_index.try_emplace( masks, rule_set->tuples.size() );
+    if ( new_tuple ) {
+      rule_set->tuples.push_back( { masks, i, {} } );
+    }
+
+    // Rules are visited in order, so the first rule with these fields is the one kept
+    Tuple& tuple = rule_set->tuples.at( it->second );
+    IPv4Header fields;
+    fields.src = rule.src_prefix;
+    fields.dst = rule.dst_prefix;
+    fields.proto = rule.proto;
+    fields.tos = rule.tos;
+    tuple.rules.try_emplace( tuple.key_for( fields ), i );
+  }
+
+  // Tuples were created in order of their first rule, so they are already sorted by first_rule
+  rule_set->rules = std::move( rules );
+  rule_set_.store( std::move( rule_set ) );
+}
+
+optional<size_t> PacketClassifier::classify( const CompiledRuleSet& rule_set, const IPv4Header& header )
+{
+  optional<size_t> best;
+  for ( const Tuple& tuple : rule_set.tuples ) {
+    if ( best.has_value() and tuple.first_rule >= *best ) {
+      break; // no rule in this or any later tuple comes before the best match
+    }
+
+    const auto it = tuple.rules.find( tuple.key_for( header ) );
+    if ( it != tuple.rules.end() and ( not best.has_value() or it->second < *best ) ) {
+      best = it->second;
+    }
+  }
+  return best;
+}
+
+optional<size_t> PacketClassifier::classify( const IPv4Header& header ) const
+{
+  return classify( *rule_set_.load(), header );
+}
+
+AclAction PacketClassifier::apply( IPv4Header& header )
+{
+  const shared_ptr<const CompiledRuleSet> rule_set = rule_set_.load();
+  if ( rule_set->rules.empty() ) {
+    return rule_set->default_action;
+  }
+
+  const optional<size_t> match = classify( *rule_set, header );
+  if ( not match.has_value() ) {
+    return rule_set->default_action;
+  }
+
+  rule_set->hits[*match].fetch_add( 1, memory_order_relaxed );
+  const AclRule& rule = rule_set->rules[*match];
+  if ( rule.action == AclAction::Mark ) {
+    header.tos = rule.mark_tos;
+    return AclAction::Permit;
+  }
+  return rule.action;
+}
+
+vector<AclRule> PacketClassifier::rules() const
+{
+  return rule_set_.load()->rules;
+}
+
+vector<uint64_t> PacketClassifier::hit_counts() const
+{
+  const shared_ptr<const CompiledRuleSet> rule_set = rule_set_.load();
+  vector<uint64_t> hits( rule_set->rules.size() );
+  for ( size_t i = 0; i < hits.size(); i++ ) {
+    hits[i] = rule_set->hits[i].load( memory_order_relaxed );
+  }
+  return hits;
+}
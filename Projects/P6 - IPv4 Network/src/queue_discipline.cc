@@ -0,0 +1,197 @@
+#include "queue_discipline.hh"
+
+#include <cmath>
+#include <utility>
+
+using namespace std;
+
+bool FifoQueue::enqueue( EthernetFrame frame, const uint8_t tos, const uint64_t now_ms )
+{
+  if ( limit_ != 0 and queue_.size() >= limit_ ) {
+    stats_.dropped++;
+    return false;
+  }
+
+  queue_.push( { std::move( frame ), tos, now_ms, 0 } );
+  stats_.enqueued++;
+  return true;
+}
+
+optional<QueuedFrame> FifoQueue::dequeue( const uint64_t now_ms )
+{
+  if ( queue_.empty() ) {
+    return {};
+  }
+
+  QueuedFrame next = std::move( queue_.front() );
+  queue_.pop();
+  next.dequeue_ms = now_ms;
+  stats_.dequeued++;
+  return next;
+}
+
+vector<QueuedFrame> FifoQueue::drain()
+{
+  vector<QueuedFrame> frames;
+  while ( not queue_.empty() ) {
+    frames.push_back( std::move( queue_.front() ) );
+    queue_.pop();
+  }
+  return frames;
+}
+
+size_t StrictPriorityQueue::band_for( const uint8_t tos )
+{
+  const uint8_t dscp = tos >> 2U;
+
+  if ( dscp >= 40 ) { // CS5, VOICE-ADMIT, EF, CS6, CS7
+    return 0;
+  }
+  if ( dscp == 0 or dscp == 8 ) { // best effort, CS1
+    return 2;
+  }
+  return 1;
+}
+
+bool StrictPriorityQueue::enqueue( EthernetFrame frame, const uint8_t tos, const uint64_t now_ms )
+{
+  auto& band = bands_.at( band_for( tos ) );
+  if ( band_limit_ != 0 and band.size() >= band_limit_ ) {
+    stats_.dropped++;
+    return false;
+  }
+
+  band.push( { std::move( frame ), tos, now_ms, 0 } );
+  size_++;
+  stats_.enqueued++;
+  return true;
+}
+
+optional<QueuedFrame> StrictPriorityQueue::dequeue( const uint64_t now_ms )
+{
+  for ( auto& band : bands_ ) {
+    if ( band.empty() ) {
+      continue;
+    }
+
+    QueuedFrame next = std::move( band.front() );
+    band.pop();
+    size_--;
+    next.dequeue_ms = now_ms;
+    stats_.dequeued++;
+    return next;
+  }
+
+  return {};
+}
+
+vector<QueuedFrame> StrictPriorityQueue::drain()
+{
+  vector<QueuedFrame> frames;
+  for ( auto& band : bands_ ) {
+    while ( not band.empty() ) {
+      frames.push_back( std::move( band.front() ) );
+      band.pop();
+    }
+  }
+  size_ = 0;
+  return frames;
+}
+
+bool CoDelQueue::enqueue( EthernetFrame frame, const uint8_t tos, const uint64_t now_ms )
+{
+  if ( limit_ != 0 and queue_.size() >= limit_ ) {
+    stats_.dropped++;
+    return false;
+  }
+
+  queue_.push( { std::move( frame ), tos, now_ms, 0 } );
+  stats_.enqueued++;
+  return true;
+}
+
+optional<QueuedFrame> CoDelQueue::pop_head( const uint64_t now_ms, bool& ok_to_drop )
+{
+  ok_to_drop = false;
+  if ( queue_.empty() ) {
+    first_above_time_ = 0;
+    return {};
+  }
+
+  QueuedFrame head = std::move( queue_.front() );
+  queue_.pop();
+  head.dequeue_ms = now_ms;
+
+  // Below target, or nothing left behind this frame: there is no standing queue
+  if ( head.sojourn_ms() < target_ms_ or queue_.empty() ) {
+    first_above_time_ = 0;
+  } else if ( first_above_time_ == 0 ) {
+    first_above_time_ = now_ms + interval_ms_;
+  } else if ( now_ms >= first_above_time_ ) {
+    ok_to_drop = true;
+  }
+
+  return head;
+}
+
+uint64_t CoDelQueue::control_law( const uint64_t from ) const
+{
+  return from + static_cast<uint64_t>( static_cast<double>( interval_ms_ ) / sqrt( static_cast<double>( count_ ) ) );
+}
+
+optional<QueuedFrame> CoDelQueue::dequeue( const uint64_t now_ms )
+{
+  bool ok_to_drop = false;
+  optional<QueuedFrame> head = pop_head( now_ms, ok_to_drop );
+
+  if ( not head.has_value() ) {
+    dropping_ = false;
+    return {};
+  }
+
+  if ( dropping_ ) {
+    if ( not ok_to_drop ) {
+      dropping_ = false; // sojourn time fell below target
+    }
+
+    // Drop once per control-law period while the standing queue persists
+    while ( dropping_ and now_ms >= drop_next_ ) {
+      stats_.dropped++;
+      count_++;
+      head = pop_head( now_ms, ok_to_drop );
+      if ( not head.has_value() or not ok_to_drop ) {
+        dropping_ = false;
+      } else {
+        drop_next_ = control_law( drop_next_ );
+      }
+    }
+  } else if ( ok_to_drop ) {
+    // Enter the dropping state, dropping this frame
+    stats_.dropped++;
+    head = pop_head( now_ms, ok_to_drop );
+    dropping_ = true;
+
+    // If we were dropping recently, resume near the previous drop rate rather than starting over
+    const uint32_t delta = count_ - last_count_;
+    count_ = ( delta > 1 and now_ms < drop_next_ + 16 * interval_ms_ ) ? delta : 1;
+    drop_next_ = control_law( now_ms );
+    last_count_ = count_;
+  }
+
+  if ( head.has_value() ) {
+    stats_.dequeued++;
+  }
+  return head;
+}
+
+vector<QueuedFrame> CoDelQueue::drain()
+{
+  vector<QueuedFrame> frames;
+  while ( not queue_.empty() ) {
+    frames.push_back( std::move( queue_.front() ) );
+    queue_.pop();
+  }
+  first_above_time_ = 0;
+  dropping_ = false;
+  return frames;
+}
@@ -0,0 +1,233 @@
+#include "route_aggregator.hh"
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+
+// The address bit that decides which child a prefix of length `depth` continues into
+uint32_t branch_bit( const uint8_t depth )
+{
+  return 1U << ( 31U - depth );
+}
+
+} // namespace
+
+vector<FibChange> RouteAggregator::add_route( const uint32_t prefix,
+                                              const uint8_t prefix_length,
+                                              const RouteTarget& target )
+{
+  return update( prefix, prefix_length, intern( target ) );
+}
+
+vector<FibChange> RouteAggregator::remove_route( const uint32_t prefix, const uint8_t prefix_length )
+{
+  return update( prefix, prefix_length, NO_ROUTE );
+}
+
+double RouteAggregator::compression_ratio() const
+{
+  if ( num_input_routes_ == 0 ) {
+    return 1;
+  }
+  return static_cast<double>( num_output_routes_ ) / static_cast<double>( num_input_routes_ );
+}
+
+RouteAggregator::TargetId RouteAggregator::intern( const RouteTarget& target )
+{
+  const auto [it, inserted]
+    = target_ids_.try_emplace( { target.interface_num, target.next_hop }, static_cast<TargetId>( targets_.size() ) );
+  if ( inserted ) {
+    targets_.push_back( target );
+  }
+  return it->second;
+}
+
+optional<RouteTarget> RouteAggregator::target_of( const TargetId id ) const
+{
+  if ( id == NO_ROUTE ) {
+    return {};
+  }
+  return targets_.at( id );
+}
+
+vector<uint32_t> RouteAggregator::path_to( const uint32_t prefix, const uint8_t prefix_length )
+{
+  if ( prefix_length > 32 ) {
+    throw invalid_argument( "prefix length must be at most 32" );
+  }
+
+  vector<uint32_t> path { 0 };
+  path.reserve( prefix_length + 1U );
+
+  for ( uint8_t depth = 0; depth < prefix_length; depth++ ) {
+    const uint32_t index = path.back();
+    if ( nodes_.at( index ).is_leaf() ) {
+      const auto first_child = static_cast<uint32_t>( nodes_.size() );
+      nodes_.resize( nodes_.size() + 2 );
+      nodes_.at( index ).children = { first_child, first_child + 1 };
+    }
+    path.push_back( nodes_.at( index ).children.at( ( prefix & branch_bit( depth ) ) ? 1 : 0 ) );
+  }
+
+  return path;
+}
+
+bool RouteAggregator::combine_children( const uint32_t index, const TargetId inherited )
+{
+  Node& node = nodes_.at( index );
+  const TargetId covering = node.original != NO_ROUTE ? node.original : inherited;
+
+  vector<TargetId> candidates;
+  if ( node.is_leaf() ) {
+    candidates.push_back( covering );
+  } else {
+    // Targets both halves could share if they are aggregated here, or else any target of either
+    const auto& left = nodes_.at( node.children[0] ).candidates;
+    const auto& right = nodes_.at( node.children[1] ).candidates;
+    set_intersection( left.begin(), left.end(), right.begin(), right.end(), back_inserter( candidates ) );
+    if ( candidates.empty() ) {
+      set_union( left.begin(), left.end(), right.begin(), right.end(), back_inserter( candidates ) );
+    }
+  }
+
+  if ( candidates == node.candidates ) {
+    return false;
+  }
+  node.candidates = std::move( candidates );
+  node.dirty = true;
+  return true;
+}
+
+bool RouteAggregator::compute_candidates( const uint32_t index, const TargetId inherited )
+{
+  const Node& node = nodes_.at( index );
+  const TargetId covering = node.original != NO_ROUTE ? node.original : inherited;
+
+  bool changed = false;
+  if ( not node.is_leaf() ) {
+    for ( const uint32_t child : node.children ) {
+      const Node& child_node = nodes_.at( child );
+      // A computed child with its own route does not depend on what covers it
+      if ( child_node.original != NO_ROUTE and not child_node.candidates.empty() ) {
+        continue;
+      }
+      changed |= compute_candidates( child, covering );
+    }
+  }
+
+  changed |= combine_children( index, inherited );
+  if ( changed ) {
+    nodes_.at( index ).dirty = true;
+  }
+  return changed;
+}
+
+void RouteAggregator::select( const uint32_t index,
+                              const uint32_t prefix,
+                              const uint8_t prefix_length,
+                              const TargetId inherited,
+                              vector<FibChange>& changes )
+{
+  Node& node = nodes_.at( index );
+  if ( not node.dirty and node.last_inherited == inherited ) {
+    return; // nothing below here can have changed
+  }
+
+  // Only prefixes that cannot simply inherit what covers them need an entry of their own
+  TargetId chosen = inherited;
+  TargetId emitted = NOT_EMITTED;
+  if ( not binary_search( node.candidates.begin(), node.candidates.end(), inherited ) ) {
+    chosen = node.candidates.front();
+    emitted = chosen;
+  }
+
+  if ( emitted != node.emitted ) {
+    if ( node.emitted == NOT_EMITTED ) {
+      num_output_routes_++;
+    } else if ( emitted == NOT_EMITTED ) {
+      num_output_routes_--;
+    }
+    changes.push_back( { { prefix, prefix_length, target_of( emitted == NOT_EMITTED ? node.emitted : emitted ) },
+                         emitted == NOT_EMITTED } );
+    node.emitted = emitted;
+  }
+  node.last_inherited = inherited;
+  node.dirty = false;
+
+  if ( not node.is_leaf() ) {
+    select( node.children[0], prefix, prefix_length + 1, chosen, changes );
+    select( node.children[1], prefix | branch_bit( prefix_length ), prefix_length + 1, chosen, changes );
+  }
+}
+
+vector<FibChange> RouteAggregator::update( const uint32_t prefix, const uint8_t prefix_length, const TargetId target )
+{
+  const size_t old_num_nodes = nodes_.size();
+  const vector<uint32_t> path = path_to( prefix, prefix_length );
+  Node& changed = nodes_.at( path.back() );
+  if ( changed.original == target and nodes_.size() == old_num_nodes ) {
+    return {};
+  }
+
+  if ( changed.original == NO_ROUTE and target != NO_ROUTE ) {
+    num_input_routes_++;
+  } else if ( changed.original != NO_ROUTE and target == NO_ROUTE ) {
+    num_input_routes_--;
+  }
+  changed.original = target;
+
+  // The input routes covering each node on the path
+  vector<TargetId> inherited( path.size(), NO_ROUTE );
+  for ( size_t i = 1; i < path.size(); i++ ) {
+    const TargetId parent_route = nodes_.at( path.at( i - 1 ) ).original;
+    inherited.at( i ) = parent_route != NO_ROUTE ? parent_route : inherited.at( i - 1 );
+  }
+
+  // Second pass: the changed subtree, then back up the path. Nodes created off the path are
+  // computed on the way, and everything on the path is marked for the third pass to revisit.
+  compute_candidates( path.back(), inherited.back() );
+  nodes_.at( path.back() ).dirty = true;
+  for ( size_t i = path.size() - 1; i-- > 0; ) {
+    const Node& node = nodes_.at( path.at( i ) );
+    const TargetId covering = node.original != NO_ROUTE ? node.original : inherited.at( i );
+    for ( const uint32_t child : node.children ) {
+      if ( nodes_.at( child ).candidates.empty() ) {
+        compute_candidates( child, covering );
+      }
+    }
+    combine_children( path.at( i ), inherited.at( i ) );
+    nodes_.at( path.at( i ) ).dirty = true;
+  }
+
+  // Third pass, from the root: outside the table, addresses have no route
+  vector<FibChange> changes;
+  select( 0, 0, 0, NO_ROUTE, changes );
+  return changes;
+}
+
+void RouteAggregator::collect( const uint32_t index,
+                               const uint32_t prefix,
+                               const uint8_t prefix_length,
+                               vector<AggregatedRoute>& out ) const
+{
+  const Node& node = nodes_.at( index );
+  if ( node.emitted != NOT_EMITTED ) {
+    out.push_back( { prefix, prefix_length, target_of( node.emitted ) } );
+  }
+  if ( not node.is_leaf() ) {
+    collect( node.children[0], prefix, prefix_length + 1, out );
+    collect( node.children[1], prefix | branch_bit( prefix_length ), prefix_length + 1, out );
+  }
+}
+
+vector<AggregatedRoute> RouteAggregator::routes() const
+{
+  vector<AggregatedRoute> out;
+  out.reserve( num_output_routes_ );
+  collect( 0, 0, 0, out );
+  return out;
+}
@@ -1,10 +1,30 @@
 #include "router.hh"
+#include "logger.hh"
 
 #include <iostream>
 #include <limits>
 
 using namespace std;
 
+namespace {
+
+// A route's next hop as it appears in the log: an IP address, or "(direct)" for attached networks
+struct LogNextHop
+{
+  optional<uint32_t> ip;
+
+  friend void log_print( ostream& out, const LogNextHop& hop )
+  {
+    if ( hop.ip.has_value() ) {
+      log_print( out, LogIPv4 { *hop.ip } );
+    } else {
+      out << "(direct)";
+    }
+  }
+};
+
+} // namespace
+
 // route_prefix: The "up-to-32-bit" IPv4 address prefix to match the datagram's destination address against
 // prefix_length: For this route to be applicable, how many high-order (most-significant) bits of
 //    the route_prefix will need to match the corresponding bits of the datagram's destination address?
@@ -16,9 +36,20 @@ void Router::add_route( const uint32_t route_prefix,
                         const optional<Address> next_hop,
                         const size_t interface_num )
 {
-  cerr << "DEBUG: adding route " << Address::from_ipv4_numeric( route_prefix ).ip() << "/"
-       << static_cast<int>( prefix_length ) << " => " << ( next_hop.has_value() ? next_hop->ip() : "(direct)" )
-       << " on interface " << interface_num << "\n";
+  LOG_DEBUG( "adding route {}/{} => {} on interface {}",
+             LogIPv4 { route_prefix },
+             static_cast<int>( prefix_length ),
+             LogNextHop { next_hop.has_value() ? optional<uint32_t> { next_hop->ipv4_numeric() } : nullopt },
+             interface_num );
+
+  if (aggregator_.has_value()){ //the aggregator decides which entries the table needs.
+    RouteTarget target {interface_num, {}};
+    if (next_hop.has_value()){
+      target.next_hop = next_hop->ipv4_numeric();
+    }
+    apply_fib_changes(aggregator_->add_route(route_prefix, prefix_length, target));
+    return;
+  }
 
   //prefix mask will only have nonzero values in first prefix_length bits.
   uint32_t prefix_mask = get_prefmask(prefix_length, route_prefix); //This is the mask for the prefix. If the prefix has bits 1001...., and prefix length is 4, the mask would be 0000...1001
@@ -34,6 +65,74 @@ void Router::add_route( const uint32_t route_prefix,
 
 }
 
+void Router::remove_route(const uint32_t route_prefix, const uint8_t prefix_length)
+{
+  LOG_DEBUG( "removing route {}/{}", LogIPv4 { route_prefix }, static_cast<int>( prefix_length ) );
+
+  if (aggregator_.has_value()){
+    apply_fib_changes(aggregator_->remove_route(route_prefix, prefix_length));
+    return;
+  }
+
+  routing_table_[prefix_length].erase(get_prefmask(prefix_length, route_prefix));
+}
+
+void Router::enable_route_aggregation()
+{
+  if (aggregator_.has_value()){
+    return; //already enabled.
+  }
+  aggregator_.emplace();
+
+  //Hand every route in the table to the aggregator, then rebuild the table from what it computes.
+  for (uint8_t prefix_length = 0; prefix_length <= 32; prefix_length++){
+    for (const auto& [prefix_mask, entry] : routing_table_[prefix_length]){
+      const uint32_t route_prefix = prefix_length == 0 ? 0 : prefix_mask << (32 - prefix_length);
+      aggregator_->add_route(route_prefix, prefix_length, {entry.first, entry.second});
+    }
+    routing_table_[prefix_length].clear();
+  }
+
+  for (const AggregatedRoute& route : aggregator_->routes()){
+    apply_fib_changes({{route, false}});
+  }
+
+  LOG_INFO( "route aggregation: {} routes in {} table entries (ratio {})",
+            aggregator_->input_size(),
+            aggregator_->output_size(),
+            aggregator_->compression_ratio() );
+}
+
+void Router::apply_fib_changes(const vector<FibChange>& changes)
+{
+  for (const FibChange& change : changes){
+    const uint8_t prefix_length = change.route.prefix_length;
+    const uint32_t prefix_mask = get_prefmask(prefix_length, change.route.prefix);
+
+    if (change.removed){
+      routing_table_[prefix_length].erase(prefix_mask);
+    } else if (change.route.target.has_value()){
+      routing_table_[prefix_length][prefix_mask] = {change.route.target->interface_num, change.route.target->next_hop};
+    } else { //a blackhole: no route for these addresses, even though a shorter prefix covers them.
+      routing_table_[prefix_length][prefix_mask] = {DROP_INTERFACE, {}};
+    }
+  }
+}
+
+size_t Router::table_size() const
+{
+  size_t size = 0;
+  for (const auto& table : routing_table_){
+    size += table.size();
+  }
+  return size;
+}
+
+double Router::route_compression_ratio() const
+{
+  return aggregator_.has_value() ? aggregator_->compression_ratio() : 1.0;
+}
+
 uint32_t Router::get_prefmask(uint8_t prefix_length, const uint32_t route){
 
   //I assume that there is always a default available if no matches happen.
@@ -55,6 +154,10 @@ optional<pair<size_t, uint32_t>> Router::find_match(uint32_t dst_ip){
 
     //check if there is a match at this prefix length in the table:
     if (routing_table_[prefix_length].find(ip_mask) != routing_table_[prefix_length].end()){
+      if (routing_table_[prefix_length][ip_mask].first == DROP_INTERFACE){
+        return {}; //the longest match is a blackhole, so there is no route.
+      }
+
       res.first = routing_table_[prefix_length][ip_mask].first; //we've found a match (this is the longest prefix match, as we iterate through prefix lengths backward)
 
       if (routing_table_[prefix_length][ip_mask].second == nullopt){ //No next hop was filled in the table, so we know that the next hop is simply the destination IP.
@@ -99,7 +202,9 @@ void Router::process_interface(size_t interface_num){
   optional<InternetDatagram> dgram = targ_intf.maybe_receive(); //get a packet from the queue. 
 
   while (dgram.has_value()){//Keep iterating through queue until it is empty. 
-    process_dgram(dgram.value());
+    if (acl_.apply(dgram->header) != AclAction::Deny){ //denied datagrams are dropped; marked ones have their TOS rewritten.
+      process_dgram(dgram.value());
+    }
     dgram = targ_intf.maybe_receive();
   }
 
@@ -245,6 +245,8 @@ public:
     }
   }
 
+  Router& router() { return _router; }
+
   Host& host( const string& name )
   {
     auto it = _hosts.find( name );
@@ -0,0 +1,251 @@
+#include "arp_message.hh"
+#include "ethernet_header.hh"
+#include "ipv4_datagram.hh"
+#include "network_interface_test_harness.hh"
+#include "queue_discipline.hh"
+
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+EthernetAddress random_private_ethernet_address()
+{
+  EthernetAddress addr;
+  for ( auto& byte : addr ) {
+    byte = random_device()(); // use a random local Ethernet address
+  }
+  addr.at( 0 ) |= 0x02; // "10" in last two binary digits marks a private Ethernet address
+  addr.at( 0 ) &= 0xfe;
+
+  return addr;
+}
+
+InternetDatagram make_datagram( const string& src_ip, const string& dst_ip, uint8_t tos = 0 ) // NOLINT(*-swappable-*)
+{
+  InternetDatagram dgram;
+  dgram.header.src = Address( src_ip, 0 ).ipv4_numeric();
+  dgram.header.dst = Address( dst_ip, 0 ).ipv4_numeric();
+  dgram.header.tos = tos;
+  dgram.payload.emplace_back( "hello" );
+  dgram.header.len = static_cast<uint64_t>( dgram.header.hlen ) * 4 + dgram.payload.size();
+  dgram.header.compute_checksum();
+  return dgram;
+}
+
+ARPMessage make_arp( const uint16_t opcode,
+                     const EthernetAddress sender_ethernet_address,
+                     const string& sender_ip_address,
+                     const EthernetAddress target_ethernet_address,
+                     const string& target_ip_address )
+{
+  ARPMessage arp;
+  arp.opcode = opcode;
+  arp.sender_ethernet_address = sender_ethernet_address;
+  arp.sender_ip_address = Address( sender_ip_address, 0 ).ipv4_numeric();
+  arp.target_ethernet_address = target_ethernet_address;
+  arp.target_ip_address = Address( target_ip_address, 0 ).ipv4_numeric();
+  return arp;
+}
+
+EthernetFrame make_frame( const EthernetAddress& src,
+                          const EthernetAddress& dst,
+                          const uint16_t type,
+                          vector<Buffer> payload )
+{
+  EthernetFrame frame;
+  frame.header.src = src;
+  frame.header.dst = dst;
+  frame.header.type = type;
+  frame.payload = std::move( payload );
+  return frame;
+}
+
+struct SetQueueDiscipline : public Action<NetworkInterface>
+{
+  string name;
+  function<unique_ptr<QueueDiscipline>()> make;
+
+  string description() const override { return "queue discipline set to " + name; }
+  void execute( NetworkInterface& interface ) const override { interface.set_queue_discipline( make() ); }
+
+  SetQueueDiscipline( string n, function<unique_ptr<QueueDiscipline>()> m ) : name( std::move( n ) ), make( std::move( m ) ) {}
+};
+
+struct ExpectDropped : public ExpectNumber<NetworkInterface, uint64_t>
+{
+  using ExpectNumber::ExpectNumber;
+  string name() const override { return "frames dropped by the queue discipline"; }
+  uint64_t value( NetworkInterface& interface ) const override { return interface.queue_discipline().stats().dropped; }
+};
+
+struct ExpectQueuedSince : public ExpectNumber<NetworkInterface, uint64_t>
+{
+  using ExpectNumber::ExpectNumber;
+  string name() const override { return "time the frame at the head of the queue was queued"; }
+  uint64_t value( NetworkInterface& interface ) const override
+  {
+    const vector<QueuedFrame> queued = interface.queue_discipline().clone()->drain();
+    return queued.empty() ? UINT64_MAX : queued.front().enqueue_ms;
+  }
+};
+
+int main()
+{
+  try {
+    {
+      const EthernetAddress local_eth = random_private_ethernet_address();
+      const EthernetAddress remote_eth = random_private_ethernet_address();
+      NetworkInterfaceTestHarness test { "strict priority serves EF before best effort", local_eth, Address( "4.3.2.1", 0 ) };
+
+      test.execute( SetQueueDiscipline { "strict priority", [] { return make_unique<StrictPriorityQueue>(); } } );
+
+      const auto bulk1 = make_datagram( "5.6.7.8", "13.12.11.10" );
+      const auto bulk2 = make_datagram( "5.6.7.8", "13.12.11.11" );
+      const auto voice = make_datagram( "5.6.7.8", "13.12.11.12", 0xB8 ); // DSCP EF
+
+      test.execute( SendDatagram { bulk1, Address( "192.168.0.1", 0 ) } );
+      test.execute( ExpectFrame { make_frame(
+        local_eth,
+        ETHERNET_BROADCAST,
+        EthernetHeader::TYPE_ARP,
+        serialize( make_arp( ARPMessage::OPCODE_REQUEST, local_eth, "4.3.2.1", {}, "192.168.0.1" ) ) ) } );
+      test.execute( ReceiveFrame {
+        make_frame(
+          remote_eth,
+          local_eth,
+          EthernetHeader::TYPE_ARP, // NOLINTNEXTLINE(*-suspicious-*)
+          serialize( make_arp( ARPMessage::OPCODE_REPLY, remote_eth, "192.168.0.1", local_eth, "4.3.2.1" ) ) ),
+        {} } );
+
+      // bulk1 is already waiting; bulk2 and the EF datagram arrive behind it
+      test.execute( SendDatagram { bulk2, Address( "192.168.0.1", 0 ) } );
+      test.execute( SendDatagram { voice, Address( "192.168.0.1", 0 ) } );
+      test.execute(
+        ExpectFrame { make_frame( local_eth, remote_eth, EthernetHeader::TYPE_IPv4, serialize( voice ) ) } );
+      test.execute(
+        ExpectFrame { make_frame( local_eth, remote_eth, EthernetHeader::TYPE_IPv4, serialize( bulk1 ) ) } );
+      test.execute(
+        ExpectFrame { make_frame( local_eth, remote_eth, EthernetHeader::TYPE_IPv4, serialize( bulk2 ) ) } );
+      test.execute( ExpectNoFrame {} );
+      test.execute( ExpectDropped { 0 } );
+    }
+
+    {
+      const EthernetAddress local_eth = random_private_ethernet_address();
+      const EthernetAddress remote_eth = random_private_ethernet_address();
+      NetworkInterfaceTestHarness test { "CoDel drops from a standing queue", local_eth, Address( "4.3.2.1", 0 ) };
+
+      test.execute( SetQueueDiscipline { "CoDel", [] { return make_unique<CoDelQueue>(); } } );
+
+      // learn the neighbour's address from its ARP request, and reply
+      test.execute( ReceiveFrame {
+        make_frame( remote_eth,
+                    ETHERNET_BROADCAST,
+                    EthernetHeader::TYPE_ARP,
+                    serialize( make_arp( ARPMessage::OPCODE_REQUEST, remote_eth, "192.168.0.1", {}, "4.3.2.1" ) ) ),
+        {} } );
+      test.execute( ExpectFrame { make_frame(
+        local_eth,
+        remote_eth,
+        EthernetHeader::TYPE_ARP,
+        serialize( make_arp( ARPMessage::OPCODE_REPLY, local_eth, "4.3.2.1", remote_eth, "192.168.0.1" ) ) ) } );
+
+      vector<InternetDatagram> dgrams;
+      for ( int i = 0; i < 10; i++ ) {
+        dgrams.push_back( make_datagram( "5.6.7.8", "13.12.11." + to_string( i ) ) );
+        test.execute( SendDatagram { dgrams.back(), Address( "192.168.0.1", 0 ) } );
+      }
+
+      // above target, but not yet for a whole interval: nothing is dropped
+      test.execute( Tick { 10 } );
+      test.execute(
+        ExpectFrame { make_frame( local_eth, remote_eth, EthernetHeader::TYPE_IPv4, serialize( dgrams.at( 0 ) ) ) } );
+      test.execute( ExpectDropped { 0 } );
+
+      // the queue has stood above target for an interval: one frame is dropped
+      test.execute( Tick { 101 } );
+      test.execute(
+        ExpectFrame { make_frame( local_eth, remote_eth, EthernetHeader::TYPE_IPv4, serialize( dgrams.at( 2 ) ) ) } );
+      test.execute( ExpectDropped { 1 } );
+
+      // the next drop is not due until interval / sqrt(1) later
+      test.execute(
+        ExpectFrame { make_frame( local_eth, remote_eth, EthernetHeader::TYPE_IPv4, serialize( dgrams.at( 3 ) ) ) } );
+      test.execute( ExpectDropped { 1 } );
+    }
+
+    {
+      const EthernetAddress local_eth = random_private_ethernet_address();
+      const EthernetAddress remote_eth = random_private_ethernet_address();
+      NetworkInterfaceTestHarness test { "swapping out CoDel moves its standing queue intact", local_eth, Address( "4.3.2.1", 0 ) };
+
+      test.execute( SetQueueDiscipline { "CoDel", [] { return make_unique<CoDelQueue>(); } } );
+      test.execute( ReceiveFrame {
+        make_frame( remote_eth,
+                    ETHERNET_BROADCAST,
+                    EthernetHeader::TYPE_ARP,
+                    serialize( make_arp( ARPMessage::OPCODE_REQUEST, remote_eth, "192.168.0.1", {}, "4.3.2.1" ) ) ),
+        {} } );
+      test.execute( ExpectFrame { make_frame(
+        local_eth,
+        remote_eth,
+        EthernetHeader::TYPE_ARP,
+        serialize( make_arp( ARPMessage::OPCODE_REPLY, local_eth, "4.3.2.1", remote_eth, "192.168.0.1" ) ) ) } );
+
+      vector<InternetDatagram> dgrams;
+      for ( int i = 0; i < 10; i++ ) {
+        dgrams.push_back( make_datagram( "5.6.7.8", "13.12.11." + to_string( i ) ) );
+        test.execute( SendDatagram { dgrams.back(), Address( "192.168.0.1", 0 ) } );
+      }
+      test.execute( Tick { 10 } );
+      test.execute(
+        ExpectFrame { make_frame( local_eth, remote_eth, EthernetHeader::TYPE_IPv4, serialize( dgrams.at( 0 ) ) ) } );
+
+      // CoDel's next dequeue would drop; the swap must not, nor restamp the frames it moves
+      test.execute( Tick { 101 } );
+      test.execute( SetQueueDiscipline { "FIFO", [] { return make_unique<FifoQueue>(); } } );
+      test.execute( ExpectQueuedSince { 0 } );
+      for ( size_t i = 1; i < dgrams.size(); i++ ) {
+        test.execute(
+          ExpectFrame { make_frame( local_eth, remote_eth, EthernetHeader::TYPE_IPv4, serialize( dgrams.at( i ) ) ) } );
+      }
+      test.execute( ExpectNoFrame {} );
+      test.execute( ExpectDropped { 0 } );
+    }
+
+    {
+      const EthernetAddress local_eth = random_private_ethernet_address();
+      NetworkInterfaceTestHarness test { "bounded FIFO tail-drops", local_eth, Address( "4.3.2.1", 0 ) };
+
+      test.execute( SetQueueDiscipline { "FIFO of 2 frames", [] { return make_unique<FifoQueue>( 2 ); } } );
+
+      // three different next hops: three ARP requests, and only the first two fit
+      test.execute( SendDatagram { make_datagram( "5.6.7.8", "13.12.11.10" ), Address( "192.168.0.1", 0 ) } );
+      test.execute( SendDatagram { make_datagram( "5.6.7.8", "13.12.11.10" ), Address( "192.168.0.2", 0 ) } );
+      test.execute( SendDatagram { make_datagram( "5.6.7.8", "13.12.11.10" ), Address( "192.168.0.3", 0 ) } );
+      test.execute( ExpectDropped { 1 } );
+      test.execute( ExpectFrame { make_frame(
+        local_eth,
+        ETHERNET_BROADCAST,
+        EthernetHeader::TYPE_ARP,
+        serialize( make_arp( ARPMessage::OPCODE_REQUEST, local_eth, "4.3.2.1", {}, "192.168.0.1" ) ) ) } );
+      test.execute( ExpectFrame { make_frame(
+        local_eth,
+        ETHERNET_BROADCAST,
+        EthernetHeader::TYPE_ARP,
+        serialize( make_arp( ARPMessage::OPCODE_REQUEST, local_eth, "4.3.2.1", {}, "192.168.0.2" ) ) ) } );
+      test.execute( ExpectNoFrame {} );
+    }
+  } catch ( const exception& e ) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
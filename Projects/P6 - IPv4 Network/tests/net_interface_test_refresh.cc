@@ -0,0 +1,248 @@
+#include "arp_message.hh"
+#include "ethernet_header.hh"
+#include "ipv4_datagram.hh"
+#include "network_interface.hh"
+#include "network_interface_test_harness.hh"
+
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+EthernetAddress random_private_ethernet_address()
+{
+  EthernetAddress addr;
+  for ( auto& byte : addr ) {
+    byte = random_device()(); // use a random local Ethernet address
+  }
+  addr.at( 0 ) |= 0x02; // "10" in last two binary digits marks a private Ethernet address
+  addr.at( 0 ) &= 0xfe;
+
+  return addr;
+}
+
+InternetDatagram make_datagram( const string& src_ip, const string& dst_ip, uint8_t tos = 0 ) // NOLINT(*-swappable-*)
+{
+  InternetDatagram dgram;
+  dgram.header.src = Address( src_ip, 0 ).ipv4_numeric();
+  dgram.header.dst = Address( dst_ip, 0 ).ipv4_numeric();
+  dgram.header.tos = tos;
+  dgram.payload.emplace_back( "hello" );
+  dgram.header.len = static_cast<uint64_t>( dgram.header.hlen ) * 4 + dgram.payload.size();
+  dgram.header.compute_checksum();
+  return dgram;
+}
+
+ARPMessage make_arp( const uint16_t opcode,
+                     const EthernetAddress sender_ethernet_address,
+                     const string& sender_ip_address,
+                     const EthernetAddress target_ethernet_address,
+                     const string& target_ip_address )
+{
+  ARPMessage arp;
+  arp.opcode = opcode;
+  arp.sender_ethernet_address = sender_ethernet_address;
+  arp.sender_ip_address = Address( sender_ip_address, 0 ).ipv4_numeric();
+  arp.target_ethernet_address = target_ethernet_address;
+  arp.target_ip_address = Address( target_ip_address, 0 ).ipv4_numeric();
+  return arp;
+}
+
+EthernetFrame make_frame( const EthernetAddress& src,
+                          const EthernetAddress& dst,
+                          const uint16_t type,
+                          vector<Buffer> payload )
+{
+  EthernetFrame frame;
+  frame.header.src = src;
+  frame.header.dst = dst;
+  frame.header.type = type;
+  frame.payload = std::move( payload );
+  return frame;
+}
+
+void expect( bool condition, const string& what )
+{
+  if ( not condition ) {
+    throw runtime_error( "expectation failed: " + what );
+  }
+}
+
+// Delivers every frame `from` has waiting to `to`, returning how many of them were broadcast;
+// the datagrams `to` receives are counted in `delivered`.
+size_t deliver( NetworkInterface& from, NetworkInterface& to, size_t& delivered )
+{
+  size_t broadcasts = 0;
+  while ( optional<EthernetFrame> frame = from.maybe_send() ) {
+    broadcasts += frame->header.dst == ETHERNET_BROADCAST;
+    delivered += to.recv_frame( *frame ).has_value();
+  }
+  return broadcasts;
+}
+
+struct PreloadNeighbors : public Action<NetworkInterface>
+{
+  vector<ArpNeighbor> neighbors;
+
+  string description() const override { return "preload " + to_string( neighbors.size() ) + " ARP neighbor(s)"; }
+  void execute( NetworkInterface& interface ) const override { interface.preload_neighbors( neighbors ); }
+
+  explicit PreloadNeighbors( vector<ArpNeighbor> n ) : neighbors( std::move( n ) ) {}
+};
+
+struct ExpectNeighbors : public ExpectNumber<NetworkInterface, size_t>
+{
+  using ExpectNumber::ExpectNumber;
+  string name() const override { return "ARP neighbors known"; }
+  size_t value( NetworkInterface& interface ) const override { return interface.neighbor_snapshot().size(); }
+};
+
+int main()
+{
+  try {
+    {
+      const EthernetAddress local_eth = random_private_ethernet_address();
+      const EthernetAddress remote_eth = random_private_ethernet_address();
+      NetworkInterfaceTestHarness test { "a neighbor in use is refreshed before it expires", local_eth, Address( "4.3.2.1", 0 ) };
+
+      // learn the neighbour's address from its ARP request, and reply
+      test.execute( ReceiveFrame {
+        make_frame( remote_eth,
+                    ETHERNET_BROADCAST,
+                    EthernetHeader::TYPE_ARP,
+                    serialize( make_arp( ARPMessage::OPCODE_REQUEST, remote_eth, "192.168.0.1", {}, "4.3.2.1" ) ) ),
+        {} } );
+      test.execute( ExpectFrame { make_frame(
+        local_eth,
+        remote_eth,
+        EthernetHeader::TYPE_ARP,
+        serialize( make_arp( ARPMessage::OPCODE_REPLY, local_eth, "4.3.2.1", remote_eth, "192.168.0.1" ) ) ) } );
+
+      const auto dgram1 = make_datagram( "5.6.7.8", "13.12.11.10" );
+      test.execute( SendDatagram { dgram1, Address( "192.168.0.1", 0 ) } );
+      test.execute(
+        ExpectFrame { make_frame( local_eth, remote_eth, EthernetHeader::TYPE_IPv4, serialize( dgram1 ) ) } );
+
+      // not yet within the refresh window
+      test.execute( Tick { 26000 } );
+      test.execute( ExpectNoFrame {} );
+
+      // within the refresh window: the neighbor is asked directly, once
+      test.execute( Tick { 1500 } );
+      test.execute( ExpectFrame { make_frame(
+        local_eth,
+        remote_eth,
+        EthernetHeader::TYPE_ARP,
+        serialize( make_arp( ARPMessage::OPCODE_REQUEST, local_eth, "4.3.2.1", remote_eth, "192.168.0.1" ) ) ) } );
+      test.execute( Tick { 1000 } );
+      test.execute( ExpectNoFrame {} );
+
+      // its reply renews the mapping, so traffic keeps flowing without a broadcast
+      test.execute( ReceiveFrame {
+        make_frame(
+          remote_eth,
+          local_eth,
+          EthernetHeader::TYPE_ARP, // NOLINTNEXTLINE(*-suspicious-*)
+          serialize( make_arp( ARPMessage::OPCODE_REPLY, remote_eth, "192.168.0.1", local_eth, "4.3.2.1" ) ) ),
+        {} } );
+      test.execute( Tick { 2000 } );
+      const auto dgram2 = make_datagram( "5.6.7.8", "13.12.11.11" );
+      test.execute( SendDatagram { dgram2, Address( "192.168.0.1", 0 ) } );
+      test.execute(
+        ExpectFrame { make_frame( local_eth, remote_eth, EthernetHeader::TYPE_IPv4, serialize( dgram2 ) ) } );
+      test.execute( ExpectNoFrame {} );
+    }
+
+    {
+      const EthernetAddress local_eth = random_private_ethernet_address();
+      const EthernetAddress remote_eth = random_private_ethernet_address();
+      NetworkInterfaceTestHarness test { "an idle neighbor expires without a refresh", local_eth, Address( "4.3.2.1", 0 ) };
+
+      test.execute( ReceiveFrame {
+        make_frame( remote_eth,
+                    ETHERNET_BROADCAST,
+                    EthernetHeader::TYPE_ARP,
+                    serialize( make_arp( ARPMessage::OPCODE_REQUEST, remote_eth, "192.168.0.1", {}, "4.3.2.1" ) ) ),
+        {} } );
+      test.execute( ExpectFrame { make_frame(
+        local_eth,
+        remote_eth,
+        EthernetHeader::TYPE_ARP,
+        serialize( make_arp( ARPMessage::OPCODE_REPLY, local_eth, "4.3.2.1", remote_eth, "192.168.0.1" ) ) ) } );
+      test.execute( ExpectNeighbors { 1 } );
+
+      test.execute( Tick { 29999 } );
+      test.execute( ExpectNoFrame {} );
+      test.execute( Tick { 1 } );
+      test.execute( ExpectNoFrame {} );
+      test.execute( ExpectNeighbors { 0 } );
+    }
+
+    {
+      const EthernetAddress local_eth = random_private_ethernet_address();
+      const EthernetAddress remote_eth = random_private_ethernet_address();
+
+      // an interface that already knows the neighbor, e.g. the one being replaced on a restart
+      NetworkInterface previous { local_eth, Address( "4.3.2.1", 0 ) };
+      previous.recv_frame(
+        make_frame( remote_eth,
+                    ETHERNET_BROADCAST,
+                    EthernetHeader::TYPE_ARP,
+                    serialize( make_arp( ARPMessage::OPCODE_REQUEST, remote_eth, "192.168.0.1", {}, "4.3.2.1" ) ) ) );
+      previous.tick( 10000 );
+
+      NetworkInterfaceTestHarness test { "preloaded neighbors are used immediately", local_eth, Address( "4.3.2.1", 0 ) };
+      vector<ArpNeighbor> snapshot = previous.neighbor_snapshot();
+      snapshot.push_back( { Address( "192.168.0.2", 0 ).ipv4_numeric(), remote_eth, 30000 } ); // already stale
+      test.execute( PreloadNeighbors { snapshot } );
+      test.execute( ExpectNeighbors { 1 } );
+
+      const auto dgram = make_datagram( "5.6.7.8", "13.12.11.10" );
+      test.execute( SendDatagram { dgram, Address( "192.168.0.1", 0 ) } );
+      test.execute(
+        ExpectFrame { make_frame( local_eth, remote_eth, EthernetHeader::TYPE_IPv4, serialize( dgram ) ) } );
+      test.execute( ExpectNoFrame {} );
+
+      // the preloaded mapping keeps its age: it expires 20 s later, not 30
+      test.execute( Tick { 20000 } );
+      test.execute( ExpectNeighbors { 0 } );
+    }
+
+    {
+      // two interfaces running this code, with traffic one way only: a's mapping of b stays valid past
+      // several TTLs only if b answers the refreshes a sends it directly, so a never broadcasts again or
+      // holds back a datagram
+      NetworkInterface a { random_private_ethernet_address(), Address( "4.3.2.1", 0 ) };
+      NetworkInterface b { random_private_ethernet_address(), Address( "192.168.0.1", 0 ) };
+      size_t to_a = 0;
+      size_t to_b = 0;
+
+      a.send_datagram( make_datagram( "4.3.2.1", "192.168.0.1" ), Address( "192.168.0.1", 0 ) );
+      for ( size_t round = 0; round < 2; round++ ) { // the request and its reply, then the datagram it released
+        deliver( a, b, to_b );
+        deliver( b, a, to_a );
+      }
+      expect( to_b == 1, "the first datagram arrives once b is resolved" );
+
+      for ( size_t second = 1; second <= 100; second++ ) {
+        a.tick( 1000 );
+        b.tick( 1000 );
+        a.send_datagram( make_datagram( "4.3.2.1", "192.168.0.1" ), Address( "192.168.0.1", 0 ) );
+
+        size_t broadcasts = deliver( a, b, to_b );
+        broadcasts += deliver( b, a, to_a ); // b's reply to a refresh
+        expect( broadcasts == 0, "no broadcast ARP request at " + to_string( second ) + " s" );
+        expect( to_b == second + 1, "each datagram is sent at once at " + to_string( second ) + " s" );
+      }
+      expect( to_a == 0, "b sends a no datagrams" );
+    }
+  } catch ( const exception& e ) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
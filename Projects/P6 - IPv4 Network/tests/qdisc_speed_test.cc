@@ -0,0 +1,117 @@
+#include "queue_discipline.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// A link that transmits LINK_RATE frames per millisecond, shared by a thin unresponsive stream
+// of EF (voice) frames and an aggregate of bulk senders. The bulk senders behave like TCP: every
+// RTT they add BULK_INCREASE frames/ms to their rate, or cut it by BULK_DECREASE if the queue
+// dropped anything, up to the BULK_MAX_RATE their access links allow -- so they keep the link
+// overloaded and fill whatever buffer the queue discipline lets them.
+namespace {
+
+constexpr uint64_t DURATION_MS = 20000;
+constexpr unsigned LINK_RATE = 10;
+constexpr double VOICE_RATE = 0.5;
+constexpr uint64_t RTT_MS = 40;
+constexpr double BULK_INCREASE = 0.5;
+constexpr double BULK_DECREASE = 0.7;
+constexpr double BULK_MAX_RATE = 15.0;
+constexpr uint8_t TOS_BULK = 0x00;
+constexpr uint8_t TOS_VOICE = 0xB8; // DSCP EF
+
+struct ClassResult
+{
+  vector<uint64_t> sojourns_ms {};
+  uint64_t offered = 0;
+
+  uint64_t percentile( double p )
+  {
+    if ( sojourns_ms.empty() ) {
+      return 0;
+    }
+    const auto rank = static_cast<size_t>( p * static_cast<double>( sojourns_ms.size() - 1 ) );
+    nth_element( sojourns_ms.begin(), sojourns_ms.begin() + static_cast<ptrdiff_t>( rank ), sojourns_ms.end() );
+    return sojourns_ms.at( rank );
+  }
+};
+
+void print_class( const string& name, ClassResult& result )
+{
+  const double delivered
+    = result.offered == 0 ? 0 : 100.0 * static_cast<double>( result.sojourns_ms.size() ) / result.offered;
+  cout << "    " << left << setw( 6 ) << name << right << " p50 " << setw( 6 ) << result.percentile( 0.50 )
+       << " ms   p99 " << setw( 6 ) << result.percentile( 0.99 ) << " ms   delivered " << fixed << setprecision( 1 )
+       << setw( 5 ) << delivered << "%\n";
+}
+
+void run( const string& name, unique_ptr<QueueDiscipline> qdisc )
+{
+  mt19937 rng { 458 }; // NOLINT(*-msc51-cpp)
+  poisson_distribution<unsigned> voice_arrivals { VOICE_RATE };
+  double bulk_rate = LINK_RATE;
+  uint64_t drops_at_last_rtt = 0;
+
+  ClassResult bulk;
+  ClassResult voice;
+  EthernetFrame frame;
+  frame.payload.emplace_back( string( 1000, 'x' ) );
+
+  for ( uint64_t now = 0; now < DURATION_MS; now++ ) {
+    if ( now % RTT_MS == 0 ) {
+      const bool saw_loss = qdisc->stats().dropped != drops_at_last_rtt;
+      drops_at_last_rtt = qdisc->stats().dropped;
+      bulk_rate = saw_loss ? max( 1.0, bulk_rate * BULK_DECREASE ) : min( BULK_MAX_RATE, bulk_rate + BULK_INCREASE );
+    }
+
+    for ( unsigned i = poisson_distribution<unsigned> { bulk_rate }( rng ); i > 0; i-- ) {
+      qdisc->enqueue( frame, TOS_BULK, now );
+      bulk.offered++;
+    }
+    for ( unsigned i = voice_arrivals( rng ); i > 0; i-- ) {
+      qdisc->enqueue( frame, TOS_VOICE, now );
+      voice.offered++;
+    }
+
+    for ( unsigned sent = 0; sent < LINK_RATE; sent++ ) {
+      const optional<QueuedFrame> next = qdisc->dequeue( now );
+      if ( not next.has_value() ) {
+        break;
+      }
+      ( next->tos == TOS_VOICE ? voice : bulk ).sojourns_ms.push_back( next->sojourn_ms() );
+    }
+  }
+
+  cout << "  " << name << " (" << qdisc->stats().dropped << " dropped, " << qdisc->size() << " still queued)\n";
+  print_class( "voice", voice );
+  print_class( "bulk", bulk );
+}
+
+} // namespace
+
+int main()
+{
+  try {
+    cout << "Queueing delay over " << DURATION_MS / 1000 << " s of bulk senders competing with voice for a "
+         << LINK_RATE << " frames/ms link:\n";
+    run( "FIFO (unbounded)", make_unique<FifoQueue>() );
+    run( "FIFO (1000 frames)", make_unique<FifoQueue>( 1000 ) );
+    run( "strict priority", make_unique<StrictPriorityQueue>() );
+    run( "CoDel", make_unique<CoDelQueue>() );
+  } catch ( const exception& e ) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
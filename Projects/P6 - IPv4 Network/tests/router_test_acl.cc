@@ -0,0 +1,213 @@
+#include "packet_classifier.hh"
+#include "router.hh"
+#include "router_common_2.hh"
+
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+void expect( bool condition, const string& what )
+{
+  if ( not condition ) {
+    throw runtime_error( "expectation failed: " + what );
+  }
+}
+
+// First match by testing every rule in order
+optional<size_t> linear_classify( const vector<AclRule>& rules, const IPv4Header& header )
+{
+  for ( size_t i = 0; i < rules.size(); i++ ) {
+    if ( rules[i].matches( header ) ) {
+      return i;
+    }
+  }
+  return {};
+}
+
+// Random rules and headers drawn from a small address space, so that rules overlap and headers
+// often match several of them
+class RuleGenerator
+{
+  mt19937 rng_ { 30 }; // NOLINT(*-msc51-cpp)
+
+  uint32_t address() { return 0x0A000000 | ( rng_() & 0x0003FFFF ); }
+
+public:
+  AclRule rule()
+  {
+    static constexpr array<uint8_t, 5> prefix_lengths { 18, 20, 24, 28, 32 };
+    static constexpr array<uint8_t, 3> proto_masks { 0, 0, 0xFF };
+    static constexpr array<uint8_t, 3> tos_masks { 0, 0xFC, 0xE0 };
+    static constexpr array<uint8_t, 3> protos { 1, 6, 17 };
+
+    AclRule rule;
+    rule.src_prefix = address();
+    rule.src_prefix_length = prefix_lengths.at( rng_() % prefix_lengths.size() );
+    rule.dst_prefix = address();
+    rule.dst_prefix_length = prefix_lengths.at( rng_() % prefix_lengths.size() );
+    rule.proto = protos.at( rng_() % protos.size() );
+    rule.proto_mask = proto_masks.at( rng_() % proto_masks.size() );
+    rule.tos = static_cast<uint8_t>( rng_() );
+    rule.tos_mask = tos_masks.at( rng_() % tos_masks.size() );
+    rule.action = static_cast<AclAction>( rng_() % 3 );
+    rule.mark_tos = static_cast<uint8_t>( rng_() );
+    return rule;
+  }
+
+  IPv4Header header()
+  {
+    static constexpr array<uint8_t, 3> protos { 1, 6, 17 };
+    IPv4Header header;
+    header.src = address();
+    header.dst = address();
+    header.proto = protos.at( rng_() % protos.size() );
+    header.tos = static_cast<uint8_t>( rng_() );
+    return header;
+  }
+};
+
+void test_against_linear()
+{
+  RuleGenerator gen;
+  vector<AclRule> rules;
+  for ( int i = 0; i < 2000; i++ ) {
+    rules.push_back( gen.rule() );
+  }
+
+  PacketClassifier classifier;
+  classifier.set_rules( rules, AclAction::Deny );
+
+  size_t matched = 0;
+  for ( int i = 0; i < 50000; i++ ) {
+    IPv4Header header = gen.header();
+    const optional<size_t> expected = linear_classify( rules, header );
+    expect( classifier.classify( header ) == expected,
+            "tuple space search finds the first matching rule for " + header.to_string() );
+    matched += expected.has_value();
+
+    const IPv4Header original = header;
+    const AclAction action = classifier.apply( header );
+    if ( not expected.has_value() ) {
+      expect( action == AclAction::Deny and header.tos == original.tos, "unmatched datagrams get the default" );
+    } else if ( rules[*expected].action == AclAction::Mark ) {
+      expect( action == AclAction::Permit and header.tos == rules[*expected].mark_tos, "marked and forwarded" );
+    } else {
+      expect( action == rules[*expected].action and header.tos == original.tos, "permitted or denied unchanged" );
+    }
+  }
+
+  uint64_t hits = 0;
+  for ( const uint64_t count : classifier.hit_counts() ) {
+    hits += count;
+  }
+  expect( hits == matched, "every match is counted against its rule" );
+  cout << "  " << matched << " of 50000 headers matched one of " << rules.size() << " rules\n";
+}
+
+void test_concurrent_swap()
+{
+  RuleGenerator gen;
+  const IPv4Header header = gen.header();
+
+  // Two rule sets that each decide this header, differently
+  AclRule permit;
+  permit.src_prefix = header.src;
+  permit.src_prefix_length = 32;
+  AclRule deny = permit;
+  deny.action = AclAction::Deny;
+
+  PacketClassifier classifier;
+  classifier.set_rules( { permit } );
+
+  atomic<bool> done = false;
+  atomic<uint64_t> decided = 0;
+  thread classifying { [&] {
+    while ( not done.load() ) {
+      IPv4Header copy = header;
+      const AclAction action = classifier.apply( copy );
+      expect( action == AclAction::Permit or action == AclAction::Deny, "each datagram sees a whole rule set" );
+      decided++;
+    }
+  } };
+
+  for ( int i = 0; i < 1000; i++ ) {
+    while ( decided.load() < static_cast<uint64_t>( i ) / 10 ) {
+      this_thread::yield(); // let the classifying thread keep up
+    }
+    classifier.set_rules( { i % 2 == 0 ? deny : permit } );
+  }
+  done = true;
+  classifying.join();
+
+  expect( decided.load() >= 99, "classification ran during the swaps" );
+  expect( classifier.rules().at( 0 ).action == AclAction::Permit, "the last rule set is in effect" );
+}
+
+void test_router()
+{
+  Network network;
+
+  AclRule block_hs;
+  block_hs.src_prefix = ip( "10.0.0.0" );
+  block_hs.src_prefix_length = 8;
+  block_hs.dst_prefix = ip( "143.195.0.0" );
+  block_hs.dst_prefix_length = 16;
+  block_hs.action = AclAction::Deny;
+
+  AclRule mark_voice;
+  mark_voice.dst_prefix = ip( "100.70.1.0" );
+  mark_voice.dst_prefix_length = 24;
+  mark_voice.action = AclAction::Mark;
+  mark_voice.mark_tos = 0xB8;
+
+  network.router().set_acl( { block_hs, mark_voice } );
+
+  // denied: must not reach hs_router
+  network.host( "applesauce" ).send_to( Address { "143.195.131.17" } );
+
+  // permitted by default
+  auto dgram_sent = network.host( "cherrypie" ).send_to( Address { "143.195.131.17" } );
+  dgram_sent.header.ttl--;
+  dgram_sent.header.compute_checksum();
+  network.host( "hs_router" ).expect( dgram_sent );
+
+  // marked
+  dgram_sent = network.host( "cherrypie" ).send_to( network.host( "doughnut" ).address() );
+  dgram_sent.header.ttl--;
+  dgram_sent.header.tos = 0xB8;
+  dgram_sent.header.compute_checksum();
+  network.host( "doughnut" ).expect( dgram_sent );
+
+  network.simulate();
+
+  expect( network.router().acl().hit_counts() == vector<uint64_t> { 1, 1 }, "each rule was hit once" );
+}
+
+} // namespace
+
+int main()
+{
+  try {
+    cout << "Random rules against linear search:\n";
+    test_against_linear();
+    test_concurrent_swap();
+    cout << "Router with an ingress ACL:\n";
+    test_router();
+  } catch ( const exception& e ) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,204 @@
+#include "route_aggregator.hh"
+#include "router.hh"
+#include "router_common_2.hh"
+
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+using Prefix = pair<uint8_t, uint32_t>; // (length, masked prefix), so longer prefixes sort last
+
+uint32_t mask( uint8_t prefix_length )
+{
+  return prefix_length == 0 ? 0 : ~0U << ( 32U - prefix_length );
+}
+
+// Longest-prefix match by brute force: a blackhole (no target) means no route
+optional<RouteTarget> lookup( const map<Prefix, optional<RouteTarget>>& table, uint32_t address )
+{
+  for ( int prefix_length = 32; prefix_length >= 0; prefix_length-- ) {
+    const auto len = static_cast<uint8_t>( prefix_length );
+    const auto it = table.find( { len, address & mask( len ) } );
+    if ( it != table.end() ) {
+      return it->second;
+    }
+  }
+  return {};
+}
+
+map<Prefix, optional<RouteTarget>> as_table( const vector<AggregatedRoute>& routes )
+{
+  map<Prefix, optional<RouteTarget>> table;
+  for ( const auto& route : routes ) {
+    table[{ route.prefix_length, route.prefix }] = route.target;
+  }
+  return table;
+}
+
+void expect( bool condition, const string& what )
+{
+  if ( not condition ) {
+    throw runtime_error( "expectation failed: " + what );
+  }
+}
+
+// Random routes in a few clustered regions, where neighbouring prefixes mostly share a next hop
+// (as they do in feeds learned from a handful of upstream routers)
+class RouteGenerator
+{
+  mt19937 rng_ { 29 }; // NOLINT(*-msc51-cpp)
+  vector<RouteTarget> targets_ {
+    { 0, {} }, { 1, {} }, { 1, 0x0A000001 }, { 2, 0x0A000002 }, { 3, 0x0A000003 } };
+
+public:
+  uint32_t address()
+  {
+    static constexpr array<uint32_t, 4> regions { 0x0A000000, 0x0A010000, 0xAC100000, 0xC0A80000 };
+    return regions.at( rng_() % regions.size() ) | ( rng_() & 0x0003FFFF );
+  }
+
+  uint8_t prefix_length() { return static_cast<uint8_t>( 12 + rng_() % 17 ); }
+
+  RouteTarget target( uint32_t prefix )
+  {
+    if ( rng_() % 5 == 0 ) {
+      return targets_.at( rng_() % targets_.size() );
+    }
+    return targets_.at( ( prefix >> 16U ) % targets_.size() );
+  }
+
+  unsigned next( unsigned bound ) { return rng_() % bound; }
+};
+
+void check_lookups( const map<Prefix, optional<RouteTarget>>& input,
+                    const RouteAggregator& aggregator,
+                    RouteGenerator& gen )
+{
+  const auto aggregated = as_table( aggregator.routes() );
+  expect( aggregated.size() == aggregator.output_size(), "output_size() counts the aggregated routes" );
+
+  for ( int i = 0; i < 20000; i++ ) {
+    const uint32_t address = i % 2 == 0 ? gen.address() : static_cast<uint32_t>( gen.next( ~0U ) );
+    expect( lookup( input, address ) == lookup( aggregated, address ),
+            "aggregated table forwards " + Address::from_ipv4_numeric( address ).ip() + " like the input" );
+  }
+}
+
+void test_random_tables()
+{
+  RouteGenerator gen;
+  map<Prefix, optional<RouteTarget>> input;
+  RouteAggregator aggregator;
+
+  for ( int i = 0; i < 3000; i++ ) {
+    const uint8_t len = gen.prefix_length();
+    const uint32_t prefix = gen.address() & mask( len );
+    const RouteTarget target = gen.target( prefix );
+    input[{ len, prefix }] = target;
+    aggregator.add_route( prefix, len, target );
+  }
+
+  expect( aggregator.input_size() == input.size(), "input_size() counts distinct prefixes" );
+  check_lookups( input, aggregator, gen );
+  expect( aggregator.compression_ratio() < 1, "aggregation merges routes" );
+  cout << "  " << input.size() << " routes aggregated to " << aggregator.output_size() << " (ratio "
+       << aggregator.compression_ratio() << ")\n";
+
+  // Incremental updates, mirrored into a table through the reported changes
+  auto mirror = as_table( aggregator.routes() );
+  for ( int i = 0; i < 2000; i++ ) {
+    vector<FibChange> changes;
+    if ( gen.next( 3 ) == 0 and not input.empty() ) {
+      auto victim = input.begin();
+      advance( victim, gen.next( input.size() ) );
+      changes = aggregator.remove_route( victim->first.second, victim->first.first );
+      input.erase( victim );
+    } else {
+      const uint8_t len = gen.prefix_length();
+      const uint32_t prefix = gen.address() & mask( len );
+      const RouteTarget target = gen.target( prefix ^ gen.next( 4 ) << 16U );
+      input[{ len, prefix }] = target;
+      changes = aggregator.add_route( prefix, len, target );
+    }
+
+    for ( const auto& change : changes ) {
+      const Prefix key { change.route.prefix_length, change.route.prefix };
+      if ( change.removed ) {
+        expect( mirror.erase( key ) == 1, "only routes in the table are removed" );
+      } else {
+        mirror[key] = change.route.target;
+      }
+    }
+  }
+
+  expect( mirror == as_table( aggregator.routes() ), "reported changes reproduce the aggregated table" );
+  check_lookups( input, aggregator, gen );
+
+  // ORTC is optimal, so aggregating from scratch cannot do better than the incremental updates
+  RouteAggregator from_scratch;
+  for ( const auto& [prefix, target] : input ) {
+    from_scratch.add_route( prefix.second, prefix.first, *target );
+  }
+  expect( from_scratch.output_size() == aggregator.output_size(),
+          "incremental aggregation is as small as aggregating from scratch" );
+  cout << "  after updates: " << input.size() << " routes aggregated to " << aggregator.output_size() << "\n";
+}
+
+void test_router()
+{
+  Network network;
+  network.router().enable_route_aggregation();
+
+  // 143.195.0.0/17, 143.195.128.0/18 and 143.195.192.0/19 become 143.195.0.0/16 and a blackhole at 143.195.224.0/19
+  expect( network.router().table_size() == 9, "the HS routes are merged" );
+  cout << "  router table compression ratio " << network.router().route_compression_ratio() << "\n";
+
+  for ( const char* address : { "143.195.131.17", "143.195.193.52", "143.195.223.255", "143.195.0.3" } ) {
+    auto dgram_sent = network.host( "applesauce" ).send_to( Address { address } );
+    dgram_sent.header.ttl--;
+    dgram_sent.header.compute_checksum();
+    network.host( "hs_router" ).expect( dgram_sent );
+  }
+
+  // no route: this must not reach hs_router
+  network.host( "applesauce" ).send_to( Address { "143.195.224.1" } );
+
+  auto dgram_sent = network.host( "cherrypie" ).send_to( network.host( "doughnut" ).address() );
+  dgram_sent.header.ttl--;
+  dgram_sent.header.compute_checksum();
+  network.host( "doughnut" ).expect( dgram_sent );
+
+  network.simulate();
+
+  // routes can still be changed once aggregated
+  network.router().remove_route( ip( "143.195.192.0" ), 19 );
+  expect( network.router().table_size() == 9, "the blackhole widens to 143.195.192.0/18" );
+  network.host( "applesauce" ).send_to( Address { "143.195.193.52" } );
+  network.simulate();
+}
+
+} // namespace
+
+int main()
+{
+  try {
+    cout << "Random routing tables:\n";
+    test_random_tables();
+    cout << "Router with aggregation enabled:\n";
+    test_router();
+  } catch ( const exception& e ) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,89 @@
+#include "logger.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+void expect( bool condition, const string& what )
+{
+  if ( not condition ) {
+    throw runtime_error( "expectation failed: " + what );
+  }
+}
+
+} // namespace
+
+int main()
+{
+  try {
+    {
+      ostringstream sink;
+      Logger logger { sink };
+
+      const EthernetAddress eth = { 0x02, 0x00, 0x00, 0x12, 0x34, 0x56 };
+      logger.log( LogLevel::Debug, "interface {} has address {}", eth, LogIPv4 { 0x0A000001 } );
+      logger.log( LogLevel::Warn, "{} routes, {} dropped", 3, 0 );
+      logger.log( LogLevel::Info, "no arguments" );
+      logger.flush();
+
+      expect( sink.str()
+                == "DEBUG: interface 02:00:00:12:34:56 has address 10.0.0.1\n"
+                   "WARN: 3 routes, 0 dropped\n"
+                   "INFO: no arguments\n",
+              "messages are formatted in order by the writer thread, got:\n" + sink.str() );
+    }
+
+    {
+      constexpr int num_threads = 4;
+      constexpr int per_thread = 200; // fits in the ring, so nothing should be dropped
+
+      ostringstream sink;
+      Logger logger { sink };
+
+      vector<thread> producers;
+      producers.reserve( num_threads );
+      for ( int t = 0; t < num_threads; t++ ) {
+        producers.emplace_back( [&logger, t] {
+          for ( int i = 0; i < per_thread; i++ ) {
+            logger.log( LogLevel::Info, "producer {} message {}", t, i );
+          }
+        } );
+      }
+      for ( auto& producer : producers ) {
+        producer.join();
+      }
+      logger.flush();
+
+      expect( logger.dropped() == 0, "no messages dropped" );
+
+      vector<int> next_expected( num_threads, 0 );
+      istringstream lines { sink.str() };
+      string line;
+      int total = 0;
+      while ( getline( lines, line ) ) {
+        int t = 0;
+        int i = 0;
+        expect( sscanf( line.c_str(), "INFO: producer %d message %d", &t, &i ) == 2, "well-formed line: " + line );
+        expect( t >= 0 and t < num_threads, "valid producer in: " + line );
+        expect( next_expected.at( t ) == i, "each producer's messages arrive in order: " + line );
+        next_expected.at( t )++;
+        total++;
+      }
+      expect( total == num_threads * per_thread, "every message was written" );
+    }
+  } catch ( const exception& e ) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "ethernet_header.hh"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Severity of a log message, in increasing order
+enum class LogLevel : uint8_t
+{
+  Debug = 0,
+  Info = 1,
+  Warn = 2,
+  Error = 3,
+  Off = 4
+};
+
+// Messages below this level are compiled out entirely (the LOG_* macros expand to nothing
+// and their arguments are never evaluated). Override with -DMINNOW_LOG_LEVEL=<0..4>.
+#ifndef MINNOW_LOG_LEVEL
+#ifdef NDEBUG
+#define MINNOW_LOG_LEVEL 1
+#else
+#define MINNOW_LOG_LEVEL 0
+#endif
+#endif
+
+constexpr LogLevel COMPILED_LOG_LEVEL = static_cast<LogLevel>( MINNOW_LOG_LEVEL );
+
+// An IPv4 address (host byte order), printed in dotted-quad form by the log writer
+struct LogIPv4
+{
+  uint32_t ip;
+};
+
+// How the log writer prints a captured argument. Overload (or provide a hidden friend
+// found by ADL) to teach the writer about new argument types.
+template<typename T>
+void log_print( std::ostream& out, const T& value )
+{
+  out << value;
+}
+void log_print( std::ostream& out, LogIPv4 address );
+void log_print( std::ostream& out, const EthernetAddress& address );
+
+// An asynchronous logger. Callers on the data path only copy their (trivially copyable)
+// arguments into a slot of a bounded lock-free ring; formatting and the actual write to the
+// sink happen later on a background writer thread. If the ring is full, the message is
+// dropped and counted rather than blocking the caller.
+class Logger
+{
+public:
+  static constexpr size_t CAPACITY = 1024;  // number of slots in the ring (power of two)
+  static constexpr size_t ARG_BYTES = 64;   // space for captured arguments in each slot
+
+  // Construct a logger that writes to `sink` from its own writer thread
+  explicit Logger( std::ostream& sink );
+
+  // Drains any pending messages and stops the writer thread
+  ~Logger();
+
+  // The process-wide logger, writing to std::cerr
+  static Logger& global();
+
+  // Queue a message. `format` must outlive the logger (use a string literal); each "{}" in it
+  // is replaced by the next argument when the message is written.
+  template<typename... Args>
+  void log( LogLevel level, const char* format, Args&&... args );
+
+  // Block until every message queued before this call has been written to (and flushed from) the sink
+  void flush();
+
+  // Number of messages dropped because the ring was full
+  uint64_t dropped() const { return dropped_.load( std::memory_order_relaxed ); }
+
+  Logger( const Logger& other ) = delete;
+  Logger& operator=( const Logger& other ) = delete;
+  Logger( Logger&& other ) = delete;
+  Logger& operator=( Logger&& other ) = delete;
+
+private:
+  using Renderer = void ( * )( std::ostream&, const char*, const std::byte* );
+
+  struct Slot
+  {
+    std::atomic<size_t> sequence { 0 };
+    LogLevel level { LogLevel::Debug };
+    const char* format { nullptr };
+    Renderer render { nullptr };
+    alignas( std::max_align_t ) std::array<std::byte, ARG_BYTES> args {};
+  };
+
+  std::ostream& sink_;
+  std::unique_ptr<Slot[]> ring_; // NOLINT(*-avoid-c-arrays)
+
+  alignas( 64 ) std::atomic<size_t> enqueue_pos_ { 0 };
+  alignas( 64 ) std::atomic<size_t> dequeue_pos_ { 0 };
+  std::atomic<size_t> flushed_pos_ { 0 }; // messages before this position have reached the sink
+  std::atomic<uint64_t> dropped_ { 0 };
+  std::atomic<bool> stopping_ { false };
+
+  std::thread writer_ {};
+
+  // Claim a free slot for a producer, or nullptr if the ring is full
+  Slot* claim();
+
+  // Make a claimed slot visible to the writer
+  static void publish( Slot& slot, size_t position );
+
+  // Write out at most one pending message; returns false if the ring was empty
+  bool write_one();
+
+  void writer_loop();
+
+  // Copy `format` up to the next "{}" placeholder, then print `value` in its place
+  template<typename T>
+  static void render_field( std::ostream& out, const char*& format, const T& value );
+
+  template<typename Stored>
+  static void render( std::ostream& out, const char* format, const std::byte* args );
+};
+
+template<typename T>
+void Logger::render_field( std::ostream& out, const char*& format, const T& value )
+{
+  const char* placeholder = std::strstr( format, "{}" );
+  if ( placeholder == nullptr ) {
+    return; // more arguments than placeholders: the extras are ignored
+  }
+  out.write( format, placeholder - format );
+  log_print( out, value );
+  format = placeholder + 2;
+}
+
+template<typename Stored>
+void Logger::render( std::ostream& out, const char* format, const std::byte* args )
+{
+  const Stored& values = *std::launder( reinterpret_cast<const Stored*>( args ) ); // NOLINT(*-reinterpret-cast)
+  std::apply( [&]( const auto&... value ) { ( render_field( out, format, value ), ... ); }, values );
+  out << format;
+}
+
+template<typename... Args>
+void Logger::log( const LogLevel level, const char* format, Args&&... args )
+{
+  using Stored = std::tuple<std::decay_t<Args>...>;
+  static_assert( ( std::is_trivially_copyable_v<std::decay_t<Args>> and ... ),
+                 "log arguments are formatted later on another thread and must be trivially copyable" );
+  static_assert( sizeof( Stored ) <= ARG_BYTES, "too many log arguments for one slot" );
+  static_assert( alignof( Stored ) <= alignof( std::max_align_t ) );
+
+  Slot* slot = claim();
+  if ( slot == nullptr ) {
+    dropped_.fetch_add( 1, std::memory_order_relaxed );
+    return;
+  }
+
+  const size_t position = slot->sequence.load( std::memory_order_relaxed );
+  slot->level = level;
+  slot->format = format;
+  slot->render = &render<Stored>;
+  ::new ( static_cast<void*>( slot->args.data() ) ) Stored( std::forward<Args>( args )... );
+  publish( *slot, position );
+}
+
+#define LOG_AT( level, ... )                                                                                       \
+  do {                                                                                                             \
+    if constexpr ( ( level ) >= COMPILED_LOG_LEVEL ) {                                                             \
+      Logger::global().log( ( level ), __VA_ARGS__ );                                                              \
+    }                                                                                                              \
+  } while ( false )
+
+#define LOG_DEBUG( ... ) LOG_AT( LogLevel::Debug, __VA_ARGS__ )
+#define LOG_INFO( ... ) LOG_AT( LogLevel::Info, __VA_ARGS__ )
+#define LOG_WARN( ... ) LOG_AT( LogLevel::Warn, __VA_ARGS__ )
+#define LOG_ERROR( ... ) LOG_AT( LogLevel::Error, __VA_ARGS__ )
@@ -0,0 +1,135 @@
+#include "logger.hh"
+
+#include <chrono>
+#include <iostream>
+
+using namespace std;
+
+namespace {
+
+const char* level_name( const LogLevel level )
+{
+  switch ( level ) {
+    case LogLevel::Debug:
+      return "DEBUG";
+    case LogLevel::Info:
+      return "INFO";
+    case LogLevel::Warn:
+      return "WARN";
+    case LogLevel::Error:
+      return "ERROR";
+    case LogLevel::Off:
+      break;
+  }
+  return "LOG";
+}
+
+} // namespace
+
+void log_print( ostream& out, const LogIPv4 address )
+{
+  out << ( address.ip >> 24U ) << "." << ( ( address.ip >> 16U ) & 0xFFU ) << "." << ( ( address.ip >> 8U ) & 0xFFU )
+      << "." << ( address.ip & 0xFFU );
+}
+
+void log_print( ostream& out, const EthernetAddress& address )
+{
+  out << to_string( address );
+}
+
+Logger::Logger( ostream& sink ) : sink_( sink ), ring_( make_unique<Slot[]>( CAPACITY ) ) // NOLINT(*-avoid-c-arrays)
+{
+  static_assert( ( CAPACITY & ( CAPACITY - 1 ) ) == 0, "Logger::CAPACITY must be a power of two" );
+
+  // A slot is free for the producer at position p when its sequence number equals p
+  for ( size_t i = 0; i < CAPACITY; i++ ) {
+    ring_[i].sequence.store( i, memory_order_relaxed );
+  }
+
+  writer_ = thread( [this] { writer_loop(); } );
+}
+
+Logger::~Logger()
+{
+  stopping_.store( true, memory_order_release );
+  writer_.join();
+}
+
+Logger& Logger::global()
+{
+  static Logger logger { cerr };
+  return logger;
+}
+
+Logger::Slot* Logger::claim()
+{
+  size_t position = enqueue_pos_.load( memory_order_relaxed );
+  while ( true ) {
+    Slot& slot = ring_[position & ( CAPACITY - 1 )];
+    const size_t sequence = slot.sequence.load( memory_order_acquire );
+    const auto lag = static_cast<intptr_t>( sequence ) - static_cast<intptr_t>( position );
+
+    if ( lag == 0 ) {
+      if ( enqueue_pos_.compare_exchange_weak( position, position + 1, memory_order_relaxed ) ) {
+        return &slot;
+      }
+    } else if ( lag < 0 ) {
+      return nullptr; // the writer has not yet freed this slot: the ring is full
+    } else {
+      position = enqueue_pos_.load( memory_order_relaxed );
+    }
+  }
+}
+
+void Logger::publish( Slot& slot, const size_t position )
+{
+  slot.sequence.store( position + 1, memory_order_release );
+}
+
+bool Logger::write_one()
+{
+  const size_t position = dequeue_pos_.load( memory_order_relaxed );
+  Slot& slot = ring_[position & ( CAPACITY - 1 )];
+  if ( slot.sequence.load( memory_order_acquire ) != position + 1 ) {
+    return false;
+  }
+
+  sink_ << level_name( slot.level ) << ": ";
+  slot.render( sink_, slot.format, slot.args.data() );
+  sink_ << "\n";
+
+  slot.sequence.store( position + CAPACITY, memory_order_release );
+  dequeue_pos_.store( position + 1, memory_order_release );
+  return true;
+}
+
+void Logger::writer_loop()
+{
+  bool unflushed = false;
+  while ( not stopping_.load( memory_order_acquire ) ) {
+    if ( write_one() ) {
+      unflushed = true;
+      continue;
+    }
+
+    // The ring is empty: push what we have to the sink, then back off
+    if ( unflushed ) {
+      sink_.flush();
+      flushed_pos_.store( dequeue_pos_.load( memory_order_relaxed ), memory_order_release );
+      unflushed = false;
+    }
+    this_thread::sleep_for( chrono::milliseconds( 1 ) );
+  }
+
+  // Drain whatever was queued before shutdown
+  while ( write_one() ) {}
+  sink_.flush();
+}
+
+void Logger::flush()
+{
+  const size_t target = enqueue_pos_.load( memory_order_acquire );
+  while ( flushed_pos_.load( memory_order_acquire ) < target ) {
+    this_thread::yield();
+  }
+}